@@ -0,0 +1,103 @@
+/*
+ * allocstats.c
+ *
+ * Allocation counters for lcd-mp3.
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are wrapped (the
+ * program's own definitions win over the C library's) and counted on the way
+ * through to glibc's __libc_* versions.  That covers mpg123, libao and ALSA as well as our own
+ * code.  The counters are relaxed atomics so it's a few cycles a call, cheap
+ * enough to leave in.
+ */
+
+#include <stddef.h>
+#include <errno.h>
+
+#include "allocstats.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long allocs = 0;
+static unsigned long frees = 0;
+static unsigned long long bytes = 0;
+
+static void count_alloc(size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count_alloc(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+static void count_free(void)
+{
+    __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+}
+
+// realloc(NULL, n) is a malloc, realloc(p, 0) is a free and anything else
+// gives up one block for another
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+        count_free();
+    if (ptr == NULL || size != 0)
+        count_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+        count_free();
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    p = memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void alloc_stats(struct alloc_stats *s)
+{
+    s->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+    s->frees = __atomic_load_n(&frees, __ATOMIC_RELAXED);
+    s->bytes = __atomic_load_n(&bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,18 @@
+/*
+ * header file for allocstats.c
+ *
+ * Counting calls to malloc/calloc/realloc/free
+ */
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+struct alloc_stats {
+	unsigned long allocs;          // malloc, calloc, realloc
+	unsigned long frees;
+	unsigned long long bytes;      // asked for
+};
+
+// Totals since the program started (take two and subtract for a stretch of it)
+void alloc_stats(struct alloc_stats *stats);
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * bench.c
+ *
+ * Microbenchmarks for lcd-mp3.  None of these need the LCD/button board, a
+ * sound card or any music, so they can be run on the Pi or on a PC.
+ *
+ * make bench            (builds and runs all of them)
+ * ./lcd-mp3-bench gain  (just the one)
+ *
+ * The input benchmark decodes a real song; give it one on the command line:
+ * ./lcd-mp3-bench input song.mp3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mpg123.h>
+
+#include "gain.h"
+#include "eq.h"
+#include "dsp.h"
+#include "crossfade.h"
+#include "tempo.h"
+#include "resample.h"
+#include "readahead.h"
+
+// One mpg123_outblock worth of 16 bit stereo (1152 frames)
+#define BLOCK_SAMPLES 2304
+// Roughly how long each test runs for
+#define BENCH_SECONDS 0.5
+// What the player normally has to keep up with
+#define CD_SAMPLES_PER_SEC (44100.0 * 2)
+// Typical speaker correction for the EQ tests
+#define EQ_SETTINGS "ls:100:6,pk:300:-3:1.0,pk:1200:-2:2.0,pk:3500:3:1.4,hs:10000:4"
+
+// An MP3 for the benchmarks that need one
+static const char *bench_clip = NULL;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time used by this thread (wall clock would count other processes too)
+static double cpu_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time used by all threads (the read-ahead thread does the reading)
+static double process_cpu_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU cost of processing 'samples' (44.1kHz stereo) in 'secs' seconds of CPU
+static void report_cpu(const char *name, double samples, double secs)
+{
+    double audio_secs = samples / CD_SAMPLES_PER_SEC;
+
+    printf("%-24s %10.3f ms CPU per second of audio (%.2f%% of one core)\n", name, secs * 1000.0 / audio_secs, secs * 100.0 / audio_secs);
+}
+
+static void report(const char *name, double samples, double secs)
+{
+    printf("%-24s %10.2f Msamples/s  %8.1fx realtime\n", name, samples / secs / 1e6, samples / secs / CD_SAMPLES_PER_SEC);
+}
+
+/*
+ * Gain stage
+ */
+static void bench_gain()
+{
+    struct gain_stage g;
+    int16_t *s16 = malloc(BLOCK_SAMPLES * sizeof(int16_t));
+    float *f32 = malloc(BLOCK_SAMPLES * sizeof(float));
+    double start, samples;
+    int i;
+
+    if (s16 == NULL || f32 == NULL)
+    {
+        perror("malloc: bench_gain");
+        exit(EXIT_FAILURE);
+    }
+    gain_init(&g);
+    gain_set_volume(&g, 0.8);
+    gain_set_replaygain(&g, -6.5, 0.98);
+    printf("gain kernel: %s\n", gain_kernel_name());
+
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        s16[i] = (int16_t)(rand() - RAND_MAX / 2);
+    samples = 0;
+    start = now();
+    do
+    {
+        gain_apply_s16(&g, s16, BLOCK_SAMPLES);
+        samples += BLOCK_SAMPLES;
+    } while (now() - start < BENCH_SECONDS);
+    report("gain s16 (in place)", samples, now() - start);
+
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        f32[i] = (float)rand() / RAND_MAX - 0.5f;
+    samples = 0;
+    start = now();
+    do
+    {
+        gain_apply_f32(&g, f32, BLOCK_SAMPLES);
+        gain_set_volume(&g, 0.8); // keep the data from decaying to denormals
+        samples += BLOCK_SAMPLES;
+    } while (now() - start < BENCH_SECONDS);
+    report("gain f32 (in place)", samples, now() - start);
+
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        f32[i] = (float)rand() / RAND_MAX - 0.5f;
+    samples = 0;
+    start = now();
+    do
+    {
+        gain_f32_to_s16(&g, f32, s16, BLOCK_SAMPLES);
+        samples += BLOCK_SAMPLES;
+    } while (now() - start < BENCH_SECONDS);
+    report("gain f32 -> s16", samples, now() - start);
+
+    free(s16);
+    free(f32);
+}
+
+/*
+ * Equalizer, and the whole DSP chain with the EQ turned on
+ */
+static void bench_eq()
+{
+    struct eq e;
+    struct gain_stage g;
+    struct dsp_chain d;
+    float *f32 = malloc(BLOCK_SAMPLES * sizeof(float));
+    int16_t *s16 = malloc(BLOCK_SAMPLES * sizeof(int16_t));
+    unsigned char *out;
+    double start, samples;
+    int i;
+
+    if (f32 == NULL || s16 == NULL)
+    {
+        perror("malloc: bench_eq");
+        exit(EXIT_FAILURE);
+    }
+    eq_init(&e);
+    if (eq_parse(&e, EQ_SETTINGS) != 0)
+    {
+        fprintf(stderr, "Bad EQ settings\n");
+        exit(EXIT_FAILURE);
+    }
+    eq_prepare(&e, 44100, 2);
+    printf("eq kernel: %s, %d bands, %d samples latency\n", eq_kernel_name(), e.num_bands, eq_latency(&e));
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        f32[i] = (float)rand() / RAND_MAX - 0.5f;
+    samples = 0;
+    start = cpu_now();
+    do
+    {
+        eq_process_f32(&e, f32, BLOCK_SAMPLES / 2);
+        samples += BLOCK_SAMPLES;
+    } while (cpu_now() - start < BENCH_SECONDS);
+    report_cpu("eq (float, in place)", samples, cpu_now() - start);
+
+    gain_init(&g);
+    gain_set_volume(&g, 0.8);
+    if (dsp_open(&d, 44100, 2, MPG123_ENC_SIGNED_16, BLOCK_SAMPLES * sizeof(int16_t), &g, &e, 0.0, 0.0) != 0)
+        exit(EXIT_FAILURE);
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        s16[i] = (int16_t)(rand() - RAND_MAX / 2);
+    samples = 0;
+    start = cpu_now();
+    do
+    {
+        dsp_run(&d, (unsigned char *)s16, BLOCK_SAMPLES * sizeof(int16_t), &out);
+        samples += BLOCK_SAMPLES;
+    } while (cpu_now() - start < BENCH_SECONDS);
+    report_cpu("dsp chain s16->eq->s16", samples, cpu_now() - start);
+    dsp_close(&d);
+
+    free(f32);
+    free(s16);
+}
+
+/*
+ * Crossfade mixer (on top of running two DSP chains)
+ */
+static void bench_xfade()
+{
+    float *a = malloc(BLOCK_SAMPLES * sizeof(float));
+    float *b = malloc(BLOCK_SAMPLES * sizeof(float));
+    double start, samples;
+    long pos = 0, total = 44100 * XFADE_MAX_SECS;
+    int i;
+
+    if (a == NULL || b == NULL)
+    {
+        perror("malloc: bench_xfade");
+        exit(EXIT_FAILURE);
+    }
+    printf("xfade kernel: %s\n", xfade_kernel_name());
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+    {
+        a[i] = (float)rand() / RAND_MAX - 0.5f;
+        b[i] = (float)rand() / RAND_MAX - 0.5f;
+    }
+    samples = 0;
+    start = cpu_now();
+    do
+    {
+        xfade_mix_f32(a, b, BLOCK_SAMPLES, 2, (double)pos / total, (double)(pos + BLOCK_SAMPLES / 2) / total);
+        pos = (pos + BLOCK_SAMPLES / 2) % (total - BLOCK_SAMPLES / 2);
+        samples += BLOCK_SAMPLES;
+    } while (cpu_now() - start < BENCH_SECONDS);
+    report_cpu("xfade equal power mix", samples, cpu_now() - start);
+
+    free(a);
+    free(b);
+}
+
+/*
+ * Speed (time stretch), on one core; anything under 100% keeps up
+ */
+static void bench_tempo()
+{
+    static const double speeds[] = { 0.75, 1.25, 1.5, 2.0 };
+    struct tempo t;
+    float *f32 = malloc(BLOCK_SAMPLES * sizeof(float));
+    float *out;
+    double start, samples;
+    char name[32];
+    int i, s;
+
+    if (f32 == NULL)
+    {
+        perror("malloc: bench_tempo");
+        exit(EXIT_FAILURE);
+    }
+    if (tempo_open(&t, 44100, 2, BLOCK_SAMPLES / 2) != 0)
+        exit(EXIT_FAILURE);
+    printf("tempo kernel: %s, %.1f ms latency\n", tempo_kernel_name(), tempo_latency(&t) * 1000.0 / 44100);
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        f32[i] = (float)rand() / RAND_MAX - 0.5f;
+    for (s = 0; s < (int)(sizeof(speeds) / sizeof(speeds[0])); s++)
+    {
+        tempo_set_speed(&t, speeds[s]);
+        samples = 0;
+        start = cpu_now();
+        do
+        {
+            // Count what comes out; that's what has to keep up with the sound card
+            samples += tempo_process(&t, f32, BLOCK_SAMPLES / 2, &out) * 2;
+        } while (cpu_now() - start < BENCH_SECONDS);
+        snprintf(name, sizeof(name), "tempo %.2fx", speeds[s]);
+        report_cpu(name, samples, cpu_now() - start);
+    }
+    tempo_close(&t);
+    free(f32);
+}
+
+/*
+ * Output rate: what the whole chain costs when the card can do the song's
+ * rate (the bit exact path) and when we have to convert
+ */
+static void bench_resample()
+{
+    static const long paths[][2] = { { 44100, 44100 }, { 48000, 48000 }, { 44100, 48000 }, { 48000, 44100 }, { 22050, 48000 } };
+    struct gain_stage g;
+    struct dsp_chain d;
+    int16_t *s16 = malloc(BLOCK_SAMPLES * sizeof(int16_t));
+    unsigned char *out;
+    double start, samples;
+    char name[32];
+    int i, p;
+
+    if (s16 == NULL)
+    {
+        perror("malloc: bench_resample");
+        exit(EXIT_FAILURE);
+    }
+    printf("resample kernel: %s, %d taps\n", resample_kernel_name(), RESAMPLE_TAPS);
+    for (i = 0; i < BLOCK_SAMPLES; i++)
+        s16[i] = (int16_t)(rand() - RAND_MAX / 2);
+    gain_init(&g);
+    gain_set_volume(&g, 0.8);
+    for (p = 0; p < (int)(sizeof(paths) / sizeof(paths[0])); p++)
+    {
+        if (dsp_open(&d, paths[p][0], 2, MPG123_ENC_SIGNED_16, BLOCK_SAMPLES * sizeof(int16_t), &g, NULL, 0.0, 0.0) != 0
+            || dsp_set_out_rate(&d, paths[p][1]) != 0)
+            exit(EXIT_FAILURE);
+        samples = 0;
+        start = cpu_now();
+        do
+        {
+            dsp_run(&d, (unsigned char *)s16, BLOCK_SAMPLES * sizeof(int16_t), &out);
+            samples += BLOCK_SAMPLES;
+        } while (cpu_now() - start < BENCH_SECONDS);
+        if (paths[p][0] == paths[p][1])
+            snprintf(name, sizeof(name), "%ld as is", paths[p][0]);
+        else
+            snprintf(name, sizeof(name), "%ld -> %ld", paths[p][0], paths[p][1]);
+        // report_cpu counts in 44.1kHz stereo samples
+        report_cpu(name, samples * 44100.0 / paths[p][0], cpu_now() - start);
+        dsp_close(&d);
+    }
+    free(s16);
+}
+
+/*
+ * Input: decoding a whole song with mpg123 reading the file itself, through
+ * the read-ahead thread, and from a mapping.  The file is in the page cache
+ * after the first pass, so this is the cost of the reads and copies
+ * themselves, not of the disk.
+ */
+static void bench_input()
+{
+    static const struct { const char *name; int mode; } modes[] = {
+        { "decode, mpg123 read()", RA_MODE_READ },
+        { "decode, read-ahead", RA_MODE_READAHEAD },
+        { "decode, mmap", RA_MODE_MMAP },
+    };
+    mpg123_handle *mh;
+    unsigned char *buffer;
+    size_t buffer_size, done;
+    double start, cpu_start, samples;
+    long rate;
+    int channels, encoding, err, m, pass;
+
+    if (bench_clip == NULL)
+    {
+        printf("input: skipped (./lcd-mp3-bench input song.mp3)\n");
+        return;
+    }
+    mpg123_init();
+    if (ra_init(RA_MODE_READ) != 0)
+        exit(EXIT_FAILURE);
+    mh = mpg123_new(NULL, &err);
+    if (mh == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: mpg123_new: %s\n", __FILE__, __LINE__, mpg123_plain_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+    buffer_size = mpg123_outblock(mh);
+    buffer = malloc(buffer_size);
+    if (buffer == NULL)
+    {
+        perror("malloc: bench_input");
+        exit(EXIT_FAILURE);
+    }
+    printf("input: %s\n", bench_clip);
+    // Pass 0 only gets the file into the page cache
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++)
+        {
+            ra_set_mode(modes[m].mode);
+            samples = 0;
+            start = now();
+            cpu_start = process_cpu_now();
+            do
+            {
+                if (ra_open(mh, bench_clip) != MPG123_OK || mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK)
+                {
+                    fprintf(stderr, "[%s - %d]: Cannot decode %s\n", __FILE__, __LINE__, bench_clip);
+                    exit(EXIT_FAILURE);
+                }
+                while ((err = mpg123_read(mh, buffer, buffer_size, &done)) == MPG123_OK || err == MPG123_NEW_FORMAT)
+                    samples += (double)done / mpg123_encsize(encoding) / channels * 2 * 44100.0 / rate;
+                mpg123_close(mh);
+            } while (now() - start < BENCH_SECONDS);
+            if (pass == 0)
+                continue;
+            // report / report_cpu count in 44.1kHz stereo samples
+            report(modes[m].name, samples, now() - start);
+            report_cpu(modes[m].name, samples, process_cpu_now() - cpu_start);
+        }
+    }
+    ra_report(stdout);
+    free(buffer);
+    mpg123_delete(mh);
+    ra_shutdown();
+    mpg123_exit();
+}
+
+struct benchmark {
+    const char *name;
+    void (*run)();
+};
+
+static const struct benchmark benchmarks[] = {
+    { "gain", bench_gain },
+    { "eq", bench_eq },
+    { "xfade", bench_xfade },
+    { "tempo", bench_tempo },
+    { "resample", bench_resample },
+    { "input", bench_input },
+};
+
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv)
+{
+    int i, j;
+
+    // A file (rather than the name of a benchmark) is the song for the input benchmark
+    for (j = 1; j < argc; j++)
+    {
+        for (i = 0; i < NUM_BENCHMARKS && strcmp(argv[j], benchmarks[i].name) != 0; i++)
+            ;
+        if (i == NUM_BENCHMARKS && access(argv[j], R_OK) == 0)
+            bench_clip = argv[j];
+    }
+    if (argc == 1 || (argc == 2 && bench_clip != NULL))
+    {
+        for (i = 0; i < NUM_BENCHMARKS; i++)
+            benchmarks[i].run();
+        return 0;
+    }
+    for (j = 1; j < argc; j++)
+    {
+        for (i = 0; i < NUM_BENCHMARKS; i++)
+        {
+            if (strcmp(argv[j], benchmarks[i].name) == 0)
+            {
+                benchmarks[i].run();
+                break;
+            }
+        }
+        if (i == NUM_BENCHMARKS && argv[j] != bench_clip)
+        {
+            fprintf(stderr, "Unknown benchmark '%s'\n", argv[j]);
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,540 @@
+/*
+ * bitmap.c
+ *
+ * Sets of song ids.
+ *
+ * The library's indexes (which songs are by an artist, on an album, in a
+ * genre) and the playlist's filters are sets of ids, and a filter is what's
+ * in one set and another (or either).  They're kept the way Roaring bitmaps
+ * are: the ids are split up by their top 16 bits, and each lot is either a
+ * sorted array of the bottom 16 bits, while there are up to BM_ARRAY_MAX
+ * of them, or a bitmap of all 65536 (8 KB) when there are more.  An artist
+ * with a dozen songs takes a couple of dozen bytes, a genre with half the
+ * library takes a bitmap, and "and"ing two of them is a merge of two short
+ * arrays, a lookup of each id of an array in a bitmap, or 1024 word ands.
+ *
+ * A bitmap that's emptied (or written over by bitmap_and and friends)
+ * keeps its containers' buffers, so filtering again and again into the same
+ * one only allocates the first few times.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+void bitmap_init(struct bitmap *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+// The container for 'key', or -1 - where it would go
+static int find(const struct bitmap *b, uint16_t key)
+{
+    int lo = 0, hi = b->count - 1, mid;
+
+    while (lo <= hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (b->c[mid].key == key)
+            return mid;
+        if (b->c[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1 - lo;
+}
+
+// The same for a bottom 16 bits in an array container
+static int find_low(const struct bm_container *c, uint16_t low)
+{
+    int lo = 0, hi = c->count - 1, mid;
+
+    while (lo <= hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (c->array[mid] == low)
+            return mid;
+        if (c->array[mid] < low)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1 - lo;
+}
+
+/*
+  An empty container for 'key' at 'pos', moving the ones after it up; it's
+  the emptied one that was past the end, buffers and all.  NULL if out of memory
+*/
+static struct bm_container *insert_container(struct bitmap *b, int pos, uint16_t key)
+{
+    int n = (b->max > 0 ? b->max * 2 : 1);
+    struct bm_container spare, *more;
+
+    if (b->count == b->max)
+    {
+        more = realloc(b->c, n * sizeof(struct bm_container));
+        if (more == NULL)
+        {
+            perror("realloc: bitmap");
+            return NULL;
+        }
+        memset(more + b->max, 0, (n - b->max) * sizeof(struct bm_container));
+        b->c = more;
+        b->max = n;
+    }
+    spare = b->c[b->count];
+    memmove(&b->c[pos + 1], &b->c[pos], (b->count - pos) * sizeof(struct bm_container));
+    b->c[pos] = spare;
+    b->c[pos].key = key;
+    b->c[pos].bitset = 0;
+    b->c[pos].count = 0;
+    b->count++;
+    return &b->c[pos];
+}
+
+// Take the container at 'pos' out (its buffers go past the end, for later)
+static void remove_container(struct bitmap *b, int pos)
+{
+    struct bm_container spare = b->c[pos];
+
+    memmove(&b->c[pos], &b->c[pos + 1], (b->count - pos - 1) * sizeof(struct bm_container));
+    b->count--;
+    b->c[b->count] = spare;
+}
+
+static int ensure_array(struct bm_container *c, int need)
+{
+    int n = (c->size > 0 ? c->size : 16);
+    uint16_t *more;
+
+    if (need <= c->size)
+        return 0;
+    while (n < need)
+        n *= 2;
+    more = realloc(c->array, n * sizeof(uint16_t));
+    if (more == NULL)
+    {
+        perror("realloc: bitmap");
+        return -1;
+    }
+    c->array = more;
+    c->size = n;
+    return 0;
+}
+
+// Not cleared
+static int ensure_bits(struct bm_container *c)
+{
+    if (c->bits == NULL && (c->bits = malloc(BM_WORDS * sizeof(uint64_t))) == NULL)
+    {
+        perror("malloc: bitmap");
+        return -1;
+    }
+    return 0;
+}
+
+// An array container's ids into its bitmap
+static int to_bitset(struct bm_container *c)
+{
+    int i;
+
+    if (ensure_bits(c) != 0)
+        return -1;
+    memset(c->bits, 0, BM_WORDS * sizeof(uint64_t));
+    for (i = 0; i < c->count; i++)
+        c->bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+    c->bitset = 1;
+    return 0;
+}
+
+static int count_bits(const uint64_t *bits)
+{
+    int i, n = 0;
+
+    for (i = 0; i < BM_WORDS; i++)
+        n += __builtin_popcountll(bits[i]);
+    return n;
+}
+
+int bitmap_add(struct bitmap *b, int id)
+{
+    uint16_t key = id >> 16, low = id & 0xffff;
+    struct bm_container *c;
+    int pos = find(b, key), at;
+
+    if (pos < 0)
+    {
+        pos = -1 - pos;
+        if ((c = insert_container(b, pos, key)) == NULL)
+            return -1;
+    }
+    else
+        c = &b->c[pos];
+    if (!c->bitset)
+    {
+        if ((at = find_low(c, low)) >= 0)
+            return 0;
+        if (c->count < BM_ARRAY_MAX)
+        {
+            if (ensure_array(c, c->count + 1) != 0)
+            {
+                if (c->count == 0)
+                    remove_container(b, pos);
+                return -1;
+            }
+            at = -1 - at;
+            memmove(c->array + at + 1, c->array + at, (c->count - at) * sizeof(uint16_t));
+            c->array[at] = low;
+            c->count++;
+            return 0;
+        }
+        if (to_bitset(c) != 0)
+            return -1;
+    }
+    if (!(c->bits[low >> 6] & (1ULL << (low & 63))))
+    {
+        c->bits[low >> 6] |= 1ULL << (low & 63);
+        c->count++;
+    }
+    return 0;
+}
+
+void bitmap_remove(struct bitmap *b, int id)
+{
+    uint16_t low = id & 0xffff;
+    struct bm_container *c;
+    int pos = find(b, id >> 16), at;
+
+    if (pos < 0)
+        return;
+    c = &b->c[pos];
+    if (c->bitset)
+    {
+        if (!(c->bits[low >> 6] & (1ULL << (low & 63))))
+            return;
+        c->bits[low >> 6] &= ~(1ULL << (low & 63));
+    }
+    else
+    {
+        if ((at = find_low(c, low)) < 0)
+            return;
+        memmove(c->array + at, c->array + at + 1, (c->count - at - 1) * sizeof(uint16_t));
+    }
+    // A bitmap that's got small again stays a bitmap; they don't shrink
+    if (--c->count == 0)
+        remove_container(b, pos);
+}
+
+int bitmap_contains(const struct bitmap *b, int id)
+{
+    uint16_t low = id & 0xffff;
+    const struct bm_container *c;
+    int pos = find(b, id >> 16);
+
+    if (pos < 0)
+        return 0;
+    c = &b->c[pos];
+    if (c->bitset)
+        return (c->bits[low >> 6] >> (low & 63)) & 1;
+    return (find_low(c, low) >= 0);
+}
+
+int bitmap_count(const struct bitmap *b)
+{
+    int i, n = 0;
+
+    for (i = 0; i < b->count; i++)
+        n += b->c[i].count;
+    return n;
+}
+
+void bitmap_clear(struct bitmap *b)
+{
+    b->count = 0;
+}
+
+// A copy of 's' on the end of dst; 0, or -1 if out of memory
+static int append_copy(struct bitmap *dst, const struct bm_container *s)
+{
+    struct bm_container *d = insert_container(dst, dst->count, s->key);
+
+    if (d == NULL)
+        return -1;
+    if (s->bitset)
+    {
+        if (ensure_bits(d) != 0)
+            return -1;
+        memcpy(d->bits, s->bits, BM_WORDS * sizeof(uint64_t));
+        d->bitset = 1;
+    }
+    else
+    {
+        if (ensure_array(d, s->count) != 0)
+            return -1;
+        memcpy(d->array, s->array, s->count * sizeof(uint16_t));
+    }
+    d->count = s->count;
+    return 0;
+}
+
+int bitmap_copy(struct bitmap *dst, const struct bitmap *a)
+{
+    int i;
+
+    bitmap_clear(dst);
+    for (i = 0; i < a->count; i++)
+    {
+        if (append_copy(dst, &a->c[i]) != 0)
+        {
+            bitmap_clear(dst);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bitmap_copy_bits(struct bitmap *dst, const struct bitmap *a)
+{
+    const struct bm_container *s;
+    struct bm_container *d;
+    int i, j;
+
+    bitmap_clear(dst);
+    for (i = 0; i < a->count; i++)
+    {
+        s = &a->c[i];
+        if (s->bitset)
+        {
+            if (append_copy(dst, s) != 0)
+                goto fail;
+            continue;
+        }
+        if ((d = insert_container(dst, dst->count, s->key)) == NULL || ensure_bits(d) != 0)
+            goto fail;
+        memset(d->bits, 0, BM_WORDS * sizeof(uint64_t));
+        for (j = 0; j < s->count; j++)
+            d->bits[s->array[j] >> 6] |= 1ULL << (s->array[j] & 63);
+        d->bitset = 1;
+        d->count = s->count;
+    }
+    return 0;
+fail:
+    bitmap_clear(dst);
+    return -1;
+}
+
+// d = x & y, for two containers with the same key
+static int and_containers(struct bm_container *d, const struct bm_container *x, const struct bm_container *y)
+{
+    const struct bm_container *t;
+    int i, j, n = 0;
+
+    // An array and a bitmap: the array's the one to go along
+    if (x->bitset && !y->bitset)
+    {
+        t = x;
+        x = y;
+        y = t;
+    }
+    if (!x->bitset && !y->bitset)
+    {
+        if (ensure_array(d, (x->count < y->count ? x->count : y->count)) != 0)
+            return -1;
+        for (i = j = 0; i < x->count && j < y->count;)
+        {
+            if (x->array[i] < y->array[j])
+                i++;
+            else if (x->array[i] > y->array[j])
+                j++;
+            else
+            {
+                d->array[n++] = x->array[i++];
+                j++;
+            }
+        }
+    }
+    else if (!x->bitset)
+    {
+        if (ensure_array(d, x->count) != 0)
+            return -1;
+        for (i = 0; i < x->count; i++)
+        {
+            if ((y->bits[x->array[i] >> 6] >> (x->array[i] & 63)) & 1)
+                d->array[n++] = x->array[i];
+        }
+    }
+    else
+    {
+        if (ensure_bits(d) != 0)
+            return -1;
+        for (i = 0; i < BM_WORDS; i++)
+            d->bits[i] = x->bits[i] & y->bits[i];
+        n = count_bits(d->bits);
+        d->bitset = 1;
+    }
+    d->count = n;
+    return 0;
+}
+
+int bitmap_and(struct bitmap *dst, const struct bitmap *a, const struct bitmap *b)
+{
+    struct bm_container *d;
+    int i, j;
+
+    bitmap_clear(dst);
+    for (i = j = 0; i < a->count && j < b->count;)
+    {
+        if (a->c[i].key < b->c[j].key)
+            i++;
+        else if (a->c[i].key > b->c[j].key)
+            j++;
+        else
+        {
+            if ((d = insert_container(dst, dst->count, a->c[i].key)) == NULL
+                || and_containers(d, &a->c[i], &b->c[j]) != 0)
+            {
+                bitmap_clear(dst);
+                return -1;
+            }
+            // Nothing in common; the container's left past the end for next time
+            if (d->count == 0)
+                dst->count--;
+            i++;
+            j++;
+        }
+    }
+    return 0;
+}
+
+// d = x | y, for two containers with the same key
+static int or_containers(struct bm_container *d, const struct bm_container *x, const struct bm_container *y)
+{
+    int i, j, n = 0;
+
+    if (!x->bitset && !y->bitset && x->count + y->count <= BM_ARRAY_MAX)
+    {
+        if (ensure_array(d, x->count + y->count) != 0)
+            return -1;
+        for (i = j = 0; i < x->count || j < y->count;)
+        {
+            if (j == y->count || (i < x->count && x->array[i] < y->array[j]))
+                d->array[n++] = x->array[i++];
+            else if (i == x->count || y->array[j] < x->array[i])
+                d->array[n++] = y->array[j++];
+            else
+            {
+                d->array[n++] = x->array[i++];
+                j++;
+            }
+        }
+        d->count = n;
+        return 0;
+    }
+    if (ensure_bits(d) != 0)
+        return -1;
+    if (x->bitset)
+        memcpy(d->bits, x->bits, BM_WORDS * sizeof(uint64_t));
+    else
+    {
+        memset(d->bits, 0, BM_WORDS * sizeof(uint64_t));
+        for (i = 0; i < x->count; i++)
+            d->bits[x->array[i] >> 6] |= 1ULL << (x->array[i] & 63);
+    }
+    if (y->bitset)
+    {
+        for (i = 0; i < BM_WORDS; i++)
+            d->bits[i] |= y->bits[i];
+    }
+    else
+    {
+        for (i = 0; i < y->count; i++)
+            d->bits[y->array[i] >> 6] |= 1ULL << (y->array[i] & 63);
+    }
+    d->count = count_bits(d->bits);
+    d->bitset = 1;
+    return 0;
+}
+
+int bitmap_or(struct bitmap *dst, const struct bitmap *a, const struct bitmap *b)
+{
+    struct bm_container *d;
+    int i, j, ret = 0;
+
+    bitmap_clear(dst);
+    for (i = j = 0; ret == 0 && (i < a->count || j < b->count);)
+    {
+        if (j == b->count || (i < a->count && a->c[i].key < b->c[j].key))
+            ret = append_copy(dst, &a->c[i++]);
+        else if (i == a->count || b->c[j].key < a->c[i].key)
+            ret = append_copy(dst, &b->c[j++]);
+        else
+        {
+            if ((d = insert_container(dst, dst->count, a->c[i].key)) == NULL
+                || or_containers(d, &a->c[i], &b->c[j]) != 0)
+                ret = -1;
+            i++;
+            j++;
+        }
+    }
+    if (ret != 0)
+        bitmap_clear(dst);
+    return ret;
+}
+
+int bitmap_ids(const struct bitmap *b, int *ids, int max)
+{
+    const struct bm_container *c;
+    uint64_t word;
+    int i, j, n = 0, base;
+
+    for (i = 0; i < b->count; i++)
+    {
+        c = &b->c[i];
+        base = (int)c->key << 16;
+        if (!c->bitset)
+        {
+            for (j = 0; j < c->count; j++, n++)
+            {
+                if (n < max)
+                    ids[n] = base | c->array[j];
+            }
+            continue;
+        }
+        for (j = 0; j < BM_WORDS; j++)
+        {
+            for (word = c->bits[j]; word != 0; word &= word - 1, n++)
+            {
+                if (n < max)
+                    ids[n] = base | (j << 6) | __builtin_ctzll(word);
+            }
+        }
+    }
+    return n;
+}
+
+size_t bitmap_bytes(const struct bitmap *b)
+{
+    size_t n = b->max * sizeof(struct bm_container);
+    int i;
+
+    for (i = 0; i < b->max; i++)
+        n += b->c[i].size * sizeof(uint16_t) + (b->c[i].bits != NULL ? BM_WORDS * sizeof(uint64_t) : 0);
+    return n;
+}
+
+void bitmap_free(struct bitmap *b)
+{
+    int i;
+
+    for (i = 0; i < b->max; i++)
+    {
+        free(b->c[i].array);
+        free(b->c[i].bits);
+    }
+    free(b->c);
+    bitmap_init(b);
+}
@@ -0,0 +1,58 @@
+/*
+ * header file for bitmap.c
+ *
+ * Compressed sets of song ids (roaring style: a sorted array or a bitmap
+ * for each 65536 ids) for the library's indexes and the playlist filters
+ */
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Past this many ids a container's a bitmap (8 KB) rather than an array of 16 bit ones
+#define BM_ARRAY_MAX 4096
+#define BM_WORDS     1024
+
+// The ids that have the same top 16 bits
+struct bm_container {
+	uint16_t key;       // the top 16 bits
+	uint8_t bitset;     // 'bits' has them, not 'array'
+	int count;
+	int size;           // room in 'array'
+	uint16_t *array;    // the bottom 16 bits, sorted
+	uint64_t *bits;     // BM_WORDS words
+};
+
+/*
+  Containers past 'count' are ones that have been emptied; their buffers
+  are kept for the next time, so a bitmap that's used over and over (the
+  result of bitmap_and, say) stops allocating once it's been as big as it
+  gets.
+*/
+struct bitmap {
+	struct bm_container *c;     // by key
+	int count;
+	int max;
+};
+
+void bitmap_init(struct bitmap *b);
+// 0, or -1 if out of memory
+int bitmap_add(struct bitmap *b, int id);
+void bitmap_remove(struct bitmap *b, int id);
+int bitmap_contains(const struct bitmap *b, int id);
+int bitmap_count(const struct bitmap *b);
+void bitmap_clear(struct bitmap *b);
+// dst = a, a & b, a | b (dst can't be a or b); 0, or -1 if out of memory (dst is then empty)
+int bitmap_copy(struct bitmap *dst, const struct bitmap *a);
+int bitmap_and(struct bitmap *dst, const struct bitmap *a, const struct bitmap *b);
+int bitmap_or(struct bitmap *dst, const struct bitmap *a, const struct bitmap *b);
+// dst = a, with every container a bitmap, for a lot of bitmap_contains (a bit each rather than a search)
+int bitmap_copy_bits(struct bitmap *dst, const struct bitmap *a);
+// The ids, smallest first, into ids (up to max of them); returns how many there are
+int bitmap_ids(const struct bitmap *b, int *ids, int max);
+// Allocated, buffers kept for later included
+size_t bitmap_bytes(const struct bitmap *b);
+void bitmap_free(struct bitmap *b);
+
+#endif
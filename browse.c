@@ -0,0 +1,186 @@
+/*
+ * browse.c
+ *
+ * Picking a song by artist, album and track with the knob.
+ *
+ * The only way to a song used to be pressing next until it came round.  A
+ * list of artists, albums or tracks is never made here, however big the
+ * library: the library's artist view (views.c) already has every song in
+ * artist, album, disc and track order, so an artist is a run of the view,
+ * its albums are runs within that, and its tracks the positions within
+ * those.  Moving the cursor on an artist is finding where its run ends,
+ * which is a gallop (1, 2, 4, ... on, then a binary search back) costing the
+ * log of the run's length, and nothing's looked up for what isn't on one of
+ * the LCD's two rows.  Turning the knob as fast as it goes is then a few
+ * string compares a click, on the main thread, with the player's threads
+ * none the wiser.
+ *
+ * The view has to stay as it is while it's being browsed, so the main loop
+ * leaves the tag scan's results queued up until browsing's done.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "browse.h"
+
+// What a song's listed under at 'level'
+static const char *level_name(int level, const struct library *lib, int id)
+{
+    if (level == BROWSE_ARTISTS)
+        return library_artist(lib, id);
+    if (level == BROWSE_ALBUMS)
+        return library_album(lib, id);
+    return library_title(lib, id);
+}
+
+static int same(const struct browse *b, const struct library *lib, int pos, const char *name)
+{
+    return (view_name_compare(level_name(b->level, lib, b->ids[pos]), name) == 0);
+}
+
+// Where the run of songs listed under the same name as 'pos' ends
+static int run_end(const struct browse *b, const struct library *lib, int pos)
+{
+    const char *name = level_name(b->level, lib, b->ids[pos]);
+    int end = b->at[b->level].end, lo = pos, hi, step = 1, mid;
+
+    // lo is always in the run, and hi past it
+    while (lo + step < end && same(b, lib, lo + step, name))
+    {
+        lo += step;
+        step *= 2;
+    }
+    hi = (lo + step < end ? lo + step : end);
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (same(b, lib, mid, name))
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi;
+}
+
+// And where it starts
+static int run_start(const struct browse *b, const struct library *lib, int pos)
+{
+    const char *name = level_name(b->level, lib, b->ids[pos]);
+    int start = b->at[b->level].start, lo, hi = pos, step = 1, mid;
+
+    // hi is always in the run, and lo before it
+    while (hi - step >= start && same(b, lib, hi - step, name))
+    {
+        hi -= step;
+        step *= 2;
+    }
+    lo = (hi - step >= start ? hi - step : start - 1);
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (same(b, lib, mid, name))
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return hi;
+}
+
+// The one after (before) 'pos' in the list; -1 at the end (the start)
+static int next_item(const struct browse *b, const struct library *lib, int pos)
+{
+    int next = (b->level == BROWSE_TRACKS ? pos + 1 : run_end(b, lib, pos));
+
+    return (next < b->at[b->level].end ? next : -1);
+}
+
+static int prev_item(const struct browse *b, const struct library *lib, int pos)
+{
+    if (pos <= b->at[b->level].start)
+        return -1;
+    return (b->level == BROWSE_TRACKS ? pos - 1 : run_start(b, lib, pos - 1));
+}
+
+int browse_start(struct browse *b, struct library *lib)
+{
+    int count = library_order(lib, VIEW_ARTIST, &b->ids);
+
+    if (count <= 0)
+        return -1;
+    memset(b->at, 0, sizeof(b->at));
+    b->level = BROWSE_ARTISTS;
+    b->at[BROWSE_ARTISTS].end = count;
+    return 0;
+}
+
+int browse_move(struct browse *b, const struct library *lib, int steps)
+{
+    struct browse_level *l = &b->at[b->level];
+    int moved = 0, pos;
+
+    for (; steps > 0 && (pos = next_item(b, lib, l->pos)) >= 0; steps--, moved++)
+    {
+        l->pos = pos;
+        // The cursor goes down the rows, and then the rows go past it
+        if (l->row < BROWSE_ROWS - 1)
+            l->row++;
+        else
+            l->top = next_item(b, lib, l->top);
+    }
+    for (; steps < 0 && (pos = prev_item(b, lib, l->pos)) >= 0; steps++, moved++)
+    {
+        l->pos = pos;
+        if (l->row > 0)
+            l->row--;
+        else
+            l->top = pos;
+    }
+    return moved;
+}
+
+int browse_down(struct browse *b, const struct library *lib)
+{
+    struct browse_level *l = &b->at[b->level], *in;
+
+    if (b->level == BROWSE_TRACKS)
+        return -1;
+    in = &b->at[b->level + 1];
+    in->start = in->pos = in->top = l->pos;
+    in->end = run_end(b, lib, l->pos);
+    in->row = 0;
+    b->level++;
+    return 0;
+}
+
+int browse_up(struct browse *b)
+{
+    // Where it was up there is just as it was left
+    if (b->level == BROWSE_ARTISTS)
+        return -1;
+    b->level--;
+    return 0;
+}
+
+int browse_song(const struct browse *b)
+{
+    return b->ids[b->at[b->level].pos];
+}
+
+void browse_row(const struct browse *b, const struct library *lib, int row, char *buf, size_t size)
+{
+    static const char *unknown[BROWSE_LEVELS] = { "Unknown artist", "Unknown album", "" };
+    const struct browse_level *l = &b->at[b->level];
+    const char *name;
+    int pos = l->top, i;
+
+    for (i = 0; i < row && pos >= 0; i++)
+        pos = next_item(b, lib, pos);
+    if (pos < 0)
+    {
+        buf[0] = '\0';
+        return;
+    }
+    name = level_name(b->level, lib, b->ids[pos]);
+    snprintf(buf, size, "%c%s", (row == l->row ? '>' : ' '), (name[0] != '\0' ? name : unknown[b->level]));
+}
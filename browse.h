@@ -0,0 +1,56 @@
+/*
+ * header file for browse.c
+ *
+ * Going through the library by artist, then album, then track, a couple of
+ * rows at a time on the LCD
+ */
+#ifndef BROWSE_H
+#define BROWSE_H
+
+#include <stddef.h>
+
+#include "library.h"
+
+// What the list is of
+enum {
+	BROWSE_ARTISTS,
+	BROWSE_ALBUMS,      // the artist's
+	BROWSE_TRACKS,      // the album's
+	BROWSE_LEVELS
+};
+
+// Rows of the list on show at once (the LCD's)
+#define BROWSE_ROWS 2
+
+/*
+  Everything is a position in the library's artist view: an artist (album)
+  is where its first song is, and its songs run on from there.
+*/
+struct browse_level {
+	int start;          // the part of the view that's in the list
+	int end;
+	int pos;            // under the cursor
+	int top;            // on the top row
+	int row;            // that the cursor's on
+};
+
+struct browse {
+	const int *ids;     // the artist view (the library mustn't change while browsing)
+	int level;
+	struct browse_level at[BROWSE_LEVELS];
+};
+
+// Start at the first artist; 0, or -1 if there's nothing to browse (or no memory for the view)
+int browse_start(struct browse *b, struct library *lib);
+// Move the cursor 'steps' on (back, if it's less than 0), as far as the list goes; returns how many it moved
+int browse_move(struct browse *b, const struct library *lib, int steps);
+// Into the albums (tracks) of what's under the cursor; 0, or -1 if it's on a track already
+int browse_down(struct browse *b, const struct library *lib);
+// Back out to the artists (albums); 0, or -1 if it's on the artists already
+int browse_up(struct browse *b);
+// The song under the cursor (the first of an artist or album); a file id
+int browse_song(const struct browse *b);
+// Row 'row' of the list as it's shown (the cursor's marked with a '>'); "" past the end
+void browse_row(const struct browse *b, const struct library *lib, int row, char *buf, size_t size);
+
+#endif
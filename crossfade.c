@@ -0,0 +1,356 @@
+/*
+ * crossfade.c
+ *
+ * Crossfade for lcd-mp3.
+ *
+ * A few seconds before the end of a song play_song asks for the next one to be
+ * opened with a second decoder (forced to the same rate / channels / encoding,
+ * so mpg123 does any resampling or up/down mixing for us) and mixes the two
+ * with equal power curves.  The opening (and the closing, if the fade is
+ * called off) is done on the read-ahead I/O thread, so the audio thread never
+ * waits on the disk or the decoder pool for it; it just picks the song up
+ * once it's ready, and fades over whatever is left by then.  When the
+ * outgoing song is done the incoming decoder, its DSP chain and the open ao
+ * device are handed over to the next play_song, which carries on from where
+ * the fade left off.
+ *
+ * The extra cost is bounded: there is only ever one incoming song, for at most
+ * XFADE_MAX_SECS, and its buffers are the same size as the playing song's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(XFADE_NO_SIMD)
+#  define XFADE_SCALAR
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define XFADE_NEON
+#  include <arm_neon.h>
+#elif defined(__SSE2__)
+#  define XFADE_SSE2
+#  include <emmintrin.h>
+#else
+#  define XFADE_SCALAR
+#endif
+
+#include "rgscan.h"
+#include "pool.h"
+#include "readahead.h"
+#include "output.h"
+#include "crossfade.h"
+
+static double cpu_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Mixer
+ */
+
+#if defined(XFADE_SSE2)
+const char *xfade_kernel_name(void) { return "sse2"; }
+#elif defined(XFADE_NEON)
+const char *xfade_kernel_name(void) { return "neon"; }
+#else
+const char *xfade_kernel_name(void) { return "scalar"; }
+#endif
+
+/*
+  The gains are worked out exactly (cos/sin) at both ends of the block and
+  ramped linearly in between; a block is only ~25ms so nobody can tell.
+*/
+void xfade_mix_f32(float *a, const float *b, size_t samples, int channels, double t0, double t1)
+{
+    size_t frames = samples / channels;
+    float ga = cos(t0 * M_PI / 2.0), gb = sin(t0 * M_PI / 2.0);
+    float dga, dgb;
+    size_t i = 0;
+
+    if (frames == 0)
+        return;
+    dga = (cos(t1 * M_PI / 2.0) - ga) / frames;
+    dgb = (sin(t1 * M_PI / 2.0) - gb) / frames;
+#if defined(XFADE_SSE2) || defined(XFADE_NEON)
+    if (channels == 1 || channels == 2)
+    {
+        // Frame number of each of the 4 lanes, and how far 4 samples move us
+        float lane[4], step = 4.0f / channels;
+        int j;
+
+        for (j = 0; j < 4; j++)
+            lane[j] = (float)(j / channels);
+#  if defined(XFADE_SSE2)
+        {
+            __m128 vl = _mm_loadu_ps(lane);
+            __m128 va = _mm_add_ps(_mm_set1_ps(ga), _mm_mul_ps(vl, _mm_set1_ps(dga)));
+            __m128 vb = _mm_add_ps(_mm_set1_ps(gb), _mm_mul_ps(vl, _mm_set1_ps(dgb)));
+            __m128 sa = _mm_set1_ps(dga * step), sb = _mm_set1_ps(dgb * step);
+
+            for (; i + 4 <= samples; i += 4)
+            {
+                __m128 x = _mm_mul_ps(_mm_loadu_ps(a + i), va);
+
+                x = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(b + i), vb));
+                _mm_storeu_ps(a + i, x);
+                va = _mm_add_ps(va, sa);
+                vb = _mm_add_ps(vb, sb);
+            }
+        }
+#  else
+        {
+            float32x4_t vl = vld1q_f32(lane);
+            float32x4_t va = vmlaq_n_f32(vdupq_n_f32(ga), vl, dga);
+            float32x4_t vb = vmlaq_n_f32(vdupq_n_f32(gb), vl, dgb);
+            float32x4_t sa = vdupq_n_f32(dga * step), sb = vdupq_n_f32(dgb * step);
+
+            for (; i + 4 <= samples; i += 4)
+            {
+                float32x4_t x = vmulq_f32(vld1q_f32(a + i), va);
+
+                x = vmlaq_f32(x, vld1q_f32(b + i), vb);
+                vst1q_f32(a + i, x);
+                va = vaddq_f32(va, sa);
+                vb = vaddq_f32(vb, sb);
+            }
+        }
+#  endif
+    }
+#endif
+    // Whatever is left (or all of it for the scalar version)
+    for (; i < samples; i++)
+    {
+        size_t f = i / channels;
+
+        a[i] = a[i] * (ga + dga * f) + b[i] * (gb + dgb * f);
+    }
+}
+
+/*
+ * Incoming song
+ */
+
+static void finish_stats(struct xfade *x)
+{
+    x->stats.fades++;
+    x->stats.cpu_secs += cpu_now() - x->cpu_start;
+    x->stats.audio_secs += (double)x->pos / x->dsp.rate;
+    fprintf(stderr, "[%s - %d]: Crossfade %.1fs; %.2f%% extra CPU, %lu bytes extra memory (%lu fades, %lu aborted)\n",
+            __FILE__, __LINE__, (double)x->pos / x->dsp.rate,
+            x->stats.cpu_secs * 100.0 / (x->stats.audio_secs > 0 ? x->stats.audio_secs : 1),
+            (unsigned long)x->stats.extra_bytes, x->stats.fades, x->stats.aborted);
+}
+
+static void close_incoming(struct xfade *x)
+{
+    pool_put(x->mh);
+    dsp_close(&x->dsp);
+    x->mh = NULL;
+    x->buffer = NULL;
+}
+
+// The I/O thread's side of xfade_prepare
+static void open_job(void *arg)
+{
+    struct xfade *x = arg;
+    long r;
+    int c, e, ready = XF_READY, state = XF_OPENING;
+    size_t pool_size;
+    double rg_db = 0.0, rg_peak = 0.0;
+    mpg123_id3v1 *v1;
+    mpg123_id3v2 *v2;
+
+    memset(&x->dsp, 0, sizeof(x->dsp));
+    x->mh = pool_get(&x->buffer, &pool_size);
+    if (x->mh == NULL)
+        ready = XF_FAILED;
+    else
+    {
+        // Same format as what's playing; mpg123 resamples / mixes the channels if it has to
+        mpg123_format_none(x->mh);
+        mpg123_format(x->mh, x->rate, x->channels, x->encoding);
+        if (ra_open(x->mh, x->filename) != MPG123_OK || mpg123_getformat(x->mh, &r, &c, &e) != MPG123_OK
+            || r != x->rate || c != x->channels || e != x->encoding)
+        {
+            fprintf(stderr, "[%s - %d]: Cannot crossfade into %s\n", __FILE__, __LINE__, x->filename);
+            ready = XF_FAILED;
+        }
+    }
+    if (ready == XF_READY)
+    {
+        if ((mpg123_meta_check(x->mh) & MPG123_ID3) && mpg123_id3(x->mh, &v1, &v2) == MPG123_OK && v2 != NULL)
+        {
+            if (!rgscan_from_id3(v2, &rg_db, &rg_peak))
+                rgscan_lookup(x->filename, &rg_db, &rg_peak);
+        }
+        else
+            rgscan_lookup(x->filename, &rg_db, &rg_peak);
+        if (x->buffer_size > pool_size)
+            x->buffer_size = pool_size;
+        if (dsp_open(&x->dsp, x->rate, x->channels, x->encoding, x->buffer_size, x->master, x->eq, rg_db, rg_peak) != 0)
+            ready = XF_FAILED;
+        else
+            x->stats.extra_bytes = x->buffer_size + x->dsp.max_samples * (sizeof(int16_t) + (x->dsp.work != NULL ? sizeof(float) : 0));
+    }
+    if (ready == XF_FAILED)
+    {
+        x->stats.aborted++;
+        close_incoming(x);
+    }
+    // Unless play_song's called it off in the meantime
+    if (__atomic_compare_exchange_n(&x->state, &state, ready, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+    if (ready == XF_READY)
+    {
+        x->stats.aborted++;
+        close_incoming(x);
+    }
+    __atomic_store_n(&x->state, XF_IDLE, __ATOMIC_RELEASE);
+}
+
+// An incoming song play_song's finished with
+static void close_job(void *arg)
+{
+    struct xfade *x = arg;
+
+    close_incoming(x);
+    __atomic_store_n(&x->state, XF_IDLE, __ATOMIC_RELEASE);
+}
+
+int xfade_prepare(struct xfade *x, const char *filename, long rate, int channels, int encoding,
+                  size_t buffer_size, struct gain_stage *master, struct eq *eq)
+{
+    if (!xfade_idle(x))
+        return -1;
+    snprintf(x->filename, sizeof(x->filename), "%s", filename);
+    x->rate = rate;
+    x->channels = channels;
+    x->encoding = encoding;
+    x->buffer_size = buffer_size;
+    x->master = master;
+    x->eq = eq;
+    x->pos = x->total = 0;
+    __atomic_store_n(&x->state, XF_OPENING, __ATOMIC_RELEASE);
+    // Without an I/O thread it's done here, the way it always used to be
+    if (ra_call(open_job, x) != 0)
+        open_job(x);
+    return 0;
+}
+
+void xfade_wait(struct xfade *x)
+{
+    while (__atomic_load_n(&x->state, __ATOMIC_ACQUIRE) == XF_OPENING)
+        usleep(1000);
+}
+
+int xfade_idle(struct xfade *x)
+{
+    return (__atomic_load_n(&x->state, __ATOMIC_ACQUIRE) == XF_IDLE);
+}
+
+void xfade_begin(struct xfade *x, long frames)
+{
+    if (x->total != 0 || __atomic_load_n(&x->state, __ATOMIC_ACQUIRE) != XF_READY)
+        return;
+    x->total = (frames > 0 ? frames : 1);
+    x->pos = 0;
+    x->cpu_start = cpu_now();
+    gain_init(&x->quant);
+}
+
+int xfade_started(struct xfade *x)
+{
+    return (x->total > 0);
+}
+
+int xfade_active(struct xfade *x)
+{
+    return (x->total > 0 && x->pos < x->total);
+}
+
+size_t xfade_run(struct xfade *x, struct dsp_chain *cur, unsigned char *in, size_t in_bytes, unsigned char **out)
+{
+    size_t na, got = 0;
+    float *a, *b;
+    int err;
+    double t0;
+
+    if (in_bytes > x->buffer_size)
+        in_bytes = x->buffer_size;
+    na = dsp_run_float(cur, in, in_bytes, &a);
+    // Same format, so the same number of bytes is the same stretch of time
+    err = mpg123_read(x->mh, x->buffer, in_bytes, &got);
+    if (err != MPG123_OK && err != MPG123_DONE)
+        got = 0;
+    if (got < in_bytes)
+        memset(x->buffer + got, 0, in_bytes - got);
+    dsp_run_float(&x->dsp, x->buffer, in_bytes, &b);
+    t0 = (double)x->pos / x->total;
+    x->pos += na / x->channels;
+    if (x->pos > x->total)
+        x->pos = x->total;
+    xfade_mix_f32(a, b, na, x->channels, t0, (double)x->pos / x->total);
+    // The mix gets sped up / slowed down / resampled as a whole by the outgoing song's chain
+    na = dsp_finish(cur, a, na, &a);
+    gain_f32_to_s16(&x->quant, a, cur->out, na);
+    if (x->pos == x->total)
+        finish_stats(x);
+    *out = (unsigned char *)cur->out;
+    return na * sizeof(int16_t);
+}
+
+int xfade_adopt(struct xfade *x, const char *filename, mpg123_handle **mh, unsigned char **buffer,
+                size_t *buffer_size, struct dsp_chain *dsp)
+{
+    if (!xfade_started(x) || strcmp(x->filename, filename) != 0)
+    {
+        xfade_cancel(x);
+        return 0;
+    }
+    // The outgoing song finished before the fade did
+    if (x->pos < x->total)
+    {
+        x->total = x->pos;
+        finish_stats(x);
+    }
+    *mh = x->mh;
+    *buffer = x->buffer;
+    *buffer_size = x->buffer_size;
+    *dsp = x->dsp;
+    memset(&x->dsp, 0, sizeof(x->dsp));
+    x->mh = NULL;
+    x->buffer = NULL;
+    x->pos = x->total = 0;
+    x->state = XF_IDLE;
+    return 1;
+}
+
+void xfade_cancel(struct xfade *x)
+{
+    int state = XF_OPENING;
+
+    // Still being opened; the I/O thread throws it away when it's done
+    if (!__atomic_compare_exchange_n(&x->state, &state, XF_CLOSING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        if (state == XF_READY)
+        {
+            if (x->pos < x->total || x->total == 0)
+                x->stats.aborted++;
+            x->state = XF_CLOSING;
+            if (ra_call(close_job, x) != 0)
+                close_job(x);
+        }
+        else if (state == XF_FAILED)
+            __atomic_store_n(&x->state, XF_IDLE, __ATOMIC_RELAXED);
+    }
+    out_close(x->dev);
+    x->dev = NULL;
+    x->pos = x->total = 0;
+}
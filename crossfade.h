@@ -0,0 +1,96 @@
+/*
+ * header file for crossfade.c
+ *
+ * Crossfading into the next song with a second decoder
+ */
+#ifndef CROSSFADE_H
+#define CROSSFADE_H
+
+#include <limits.h>
+#include <ao/ao.h>
+#include <mpg123.h>
+
+#include "dsp.h"
+
+#define XFADE_MIN_SECS 1
+#define XFADE_MAX_SECS 10
+
+struct xfade_stats {
+	unsigned long fades;      // finished crossfades
+	unsigned long aborted;    // next/prev/shuffle/quit during a fade, or a file that wouldn't open
+	double cpu_secs;          // CPU spent on the incoming song while both were running
+	double audio_secs;        // audio mixed over the same period
+	size_t extra_bytes;       // buffers allocated for the incoming song
+};
+
+// Where the incoming song is up to
+enum {
+	XF_IDLE,                  // none
+	XF_OPENING,               // the I/O thread's opening it
+	XF_READY,                 // open; play_song can start the fade
+	XF_FAILED,                // it wouldn't open (cleared by xfade_cancel)
+	XF_CLOSING                // called off; the I/O thread's closing it
+};
+
+struct xfade {
+	/*
+	  The incoming song.  The I/O thread fills these in while it's XF_OPENING
+	  (or empties them when XF_CLOSING); the rest of the time they're play_song's.
+	*/
+	int state;
+	mpg123_handle *mh;
+	char filename[PATH_MAX];
+	long rate;
+	int encoding;
+	struct gain_stage *master;
+	struct eq *eq;
+	unsigned char *buffer;
+	size_t buffer_size;
+	struct dsp_chain dsp;
+	long total;               // frames in the fade
+	long pos;                 // frames mixed so far
+	int channels;
+	struct gain_stage quant;  // unity gain; just used for dithering the mix back to 16 bit
+	double cpu_start;
+	// Handed over to the next play_song so there is no gap re-opening the device
+	ao_device *dev;
+	ao_sample_format format;
+	struct xfade_stats stats;
+};
+
+/*
+  Have the I/O thread open 'filename' in the same format as the song that's
+  playing (xfade_begin starts the fade once it's ready).  -1 if there's
+  already an incoming song (or one still being closed).
+*/
+int xfade_prepare(struct xfade *x, const char *filename, long rate, int channels, int encoding,
+                  size_t buffer_size, struct gain_stage *master, struct eq *eq);
+// Until the I/O thread's done opening it (not for the audio thread)
+void xfade_wait(struct xfade *x);
+// Nothing incoming; xfade_prepare can be called
+int xfade_idle(struct xfade *x);
+// If the incoming song's ready and not started yet, fade it in over 'frames' frames
+void xfade_begin(struct xfade *x, long frames);
+// The fade's been started (it may be over)
+int xfade_started(struct xfade *x);
+// Is there an incoming song still being faded in?
+int xfade_active(struct xfade *x);
+/*
+  Mix a block of the outgoing song (run through 'cur') with the next block of
+  the incoming song.  Same contract as dsp_run.
+*/
+size_t xfade_run(struct xfade *x, struct dsp_chain *cur, unsigned char *in, size_t in_bytes, unsigned char **out);
+/*
+  Take over the incoming song (if it is 'filename').  Returns 1 and fills in the
+  decoder, buffer and chain if it was; the caller owns them after that.
+*/
+int xfade_adopt(struct xfade *x, const char *filename, mpg123_handle **mh, unsigned char **buffer,
+                size_t *buffer_size, struct dsp_chain *dsp);
+// Throw the incoming song away (and the handed over device, if any)
+void xfade_cancel(struct xfade *x);
+
+// Equal power mix of b into a; t0/t1 are the fade position (0..1) at the start/end of the block
+void xfade_mix_f32(float *a, const float *b, size_t samples, int channels, double t0, double t1);
+const char *xfade_kernel_name(void);
+
+#endif
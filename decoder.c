@@ -0,0 +1,232 @@
+/*
+ * decoder.c
+ *
+ * mpg123 has several decoders built in (generic, fixed point, ARM, NEON, ...)
+ * and which one mpg123_new(NULL, ...) picks isn't necessarily the fastest on a
+ * given board; on a Pi the difference can be several times over.
+ *
+ * Calibration decodes the first CAL_SECONDS of a clip with each decoder the
+ * CPU supports, twice, and keeps the better CPU time.  Every decoder's output
+ * is compared to the generic (plain C, floating point) decoder's, and any that
+ * are further out than MAX_RMS_LSB / MAX_ERR_LSB are passed over; the fastest
+ * of the rest wins.
+ *
+ * The choice is kept in a cache file together with the list of decoders it was
+ * picked from, so a new libmpg123 (or a different CPU, if the card is moved to
+ * another board) gets calibrated again.  If none of them passes, mpg123's
+ * default is what's kept (as a blank name), so that isn't calibrated again
+ * on every boot either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "decoder.h"
+
+// Audio decoded by each decoder
+#define CAL_SECONDS 10
+// Runs per decoder; the fastest counts
+#define CAL_RUNS 2
+// Most a decoder may differ from the generic one (in 16 bit steps)
+#define MAX_RMS_LSB 4.0
+#define MAX_ERR_LSB 64
+// Highest rate mpg123 decodes at
+#define CAL_MAX_RATE 48000
+
+static char chosen[64];
+
+static double cpu_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *decoder_name(void)
+{
+    return (chosen[0] != '\0' ? chosen : NULL);
+}
+
+mpg123_handle *decoder_new(int *err)
+{
+    mpg123_handle *mh = mpg123_new(decoder_name(), err);
+
+    // Shouldn't happen (it's one mpg123 said it supports) but just in case
+    if (mh == NULL && decoder_name() != NULL)
+        mh = mpg123_new(NULL, err);
+    return mh;
+}
+
+// Comma separated list of the decoders this CPU can use (what the cache is valid for)
+static void supported_list(char *list, size_t size)
+{
+    const char **dec = mpg123_supported_decoders();
+    size_t len = 0;
+
+    list[0] = '\0';
+    for (; dec != NULL && *dec != NULL; dec++)
+        len += snprintf(list + len, (len < size ? size - len : 0), "%s%s", (len ? "," : ""), *dec);
+}
+
+int decoder_load(const char *cache_file)
+{
+    FILE *fp;
+    char name[sizeof(chosen)], list[1024], want[1024];
+    int ret = -1;
+
+    fp = fopen(cache_file, "r");
+    if (fp == NULL)
+        return -1;
+    supported_list(want, sizeof(want));
+    if (fgets(name, sizeof(name), fp) != NULL && fgets(list, sizeof(list), fp) != NULL)
+    {
+        name[strcspn(name, "\n")] = '\0';
+        list[strcspn(list, "\n")] = '\0';
+        if (strcmp(list, want) == 0)
+        {
+            strcpy(chosen, name);
+            ret = 0;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+// Decode up to max_samples of 16 bit stereo into 'out'; returns the samples or -1
+static long decode_clip(const char *decoder, const char *clip, int16_t *out, size_t max_samples, double *cpu, long *rate)
+{
+    mpg123_handle *mh;
+    const long *rates;
+    size_t num_rates, i, n = 0, done, want;
+    int channels, encoding, err;
+    double start;
+
+    mh = mpg123_new(decoder, &err);
+    if (mh == NULL)
+        return -1;
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+    // Same output format from all of them so they can be compared
+    mpg123_rates(&rates, &num_rates);
+    mpg123_format_none(mh);
+    for (i = 0; i < num_rates; i++)
+        mpg123_format(mh, rates[i], MPG123_STEREO, MPG123_ENC_SIGNED_16);
+    if (mpg123_open(mh, clip) != MPG123_OK || mpg123_getformat(mh, rate, &channels, &encoding) != MPG123_OK)
+    {
+        mpg123_delete(mh);
+        return -1;
+    }
+    // Only as much as CAL_SECONDS at this rate
+    if (max_samples > (size_t)(*rate * 2 * CAL_SECONDS))
+        max_samples = *rate * 2 * CAL_SECONDS;
+    start = cpu_now();
+    while (n < max_samples)
+    {
+        want = (max_samples - n) * sizeof(int16_t);
+        err = mpg123_read(mh, (unsigned char *)(out + n), want, &done);
+        if (err != MPG123_OK && err != MPG123_NEW_FORMAT)
+            break;
+        n += done / sizeof(int16_t);
+    }
+    *cpu = cpu_now() - start;
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    return n;
+}
+
+int decoder_calibrate(const char *clip, const char *cache_file, int verbose)
+{
+    const char **dec;
+    size_t max_samples = CAL_MAX_RATE * 2 * CAL_SECONDS;
+    int16_t *ref, *test;
+    long ref_samples = -1, samples, rate, i;
+    double best_cost = HUGE_VAL;
+    char list[1024];
+    FILE *fp;
+    int d, run;
+
+    ref = malloc(max_samples * sizeof(int16_t));
+    test = malloc(max_samples * sizeof(int16_t));
+    if (ref == NULL || test == NULL)
+    {
+        perror("malloc: decoder_calibrate");
+        free(ref);
+        free(test);
+        return -1;
+    }
+    dec = mpg123_supported_decoders();
+    // The reference: mpg123's plain C floating point decoder (or the default if it was left out)
+    ref_samples = decode_clip("generic", clip, ref, max_samples, &best_cost, &rate);
+    if (ref_samples <= 0)
+        ref_samples = decode_clip(NULL, clip, ref, max_samples, &best_cost, &rate);
+    if (ref_samples <= 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot decode %s for calibration\n", __FILE__, __LINE__, clip);
+        free(ref);
+        free(test);
+        return -1;
+    }
+    best_cost = HUGE_VAL;
+    chosen[0] = '\0';
+    if (verbose)
+        printf("%-16s %10s %10s %10s\n", "decoder", "x realtime", "rms (lsb)", "max (lsb)");
+    for (d = 0; dec != NULL && dec[d] != NULL; d++)
+    {
+        double cpu, best_cpu = HUGE_VAL, sum = 0.0, cost;
+        long max_err = 0;
+
+        for (run = 0; run < CAL_RUNS; run++)
+        {
+            samples = decode_clip(dec[d], clip, test, max_samples, &cpu, &rate);
+            if (samples < 0)
+                break;
+            if (cpu < best_cpu)
+                best_cpu = cpu;
+        }
+        if (samples <= 0)
+            continue;
+        if (samples > ref_samples)
+            samples = ref_samples;
+        for (i = 0; i < samples; i++)
+        {
+            long e = labs((long)test[i] - ref[i]);
+
+            sum += (double)e * e;
+            if (e > max_err)
+                max_err = e;
+        }
+        // CPU seconds per second of audio
+        cost = best_cpu / ((double)samples / 2 / rate);
+        if (verbose)
+            printf("%-16s %10.1f %10.2f %10ld%s\n", dec[d], 1.0 / cost, sqrt(sum / samples), max_err,
+                   (sqrt(sum / samples) > MAX_RMS_LSB || max_err > MAX_ERR_LSB ? "  (too far off)" : ""));
+        if (sqrt(sum / samples) > MAX_RMS_LSB || max_err > MAX_ERR_LSB)
+            continue;
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            snprintf(chosen, sizeof(chosen), "%s", dec[d]);
+        }
+    }
+    supported_list(list, sizeof(list));
+    free(ref);
+    free(test);
+    if (chosen[0] == '\0')
+        fprintf(stderr, "[%s - %d]: No decoder matched the generic one; using mpg123's default\n", __FILE__, __LINE__);
+    else
+        fprintf(stderr, "[%s - %d]: Using the %s decoder (%.1fx realtime)\n", __FILE__, __LINE__, chosen, 1.0 / best_cost);
+    // Kept either way (a blank name is mpg123's default), so it isn't all done again on the next boot
+    fp = fopen(cache_file, "w");
+    if (fp == NULL)
+        perror("fopen: decoder cache");
+    else
+    {
+        fprintf(fp, "%s\n%s\n", chosen, list);
+        fclose(fp);
+    }
+    return (chosen[0] != '\0' ? 0 : -1);
+}
@@ -0,0 +1,29 @@
+/*
+ * header file for decoder.c
+ *
+ * Picking the fastest of mpg123's decoders for this board
+ */
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <mpg123.h>
+
+/*
+  Load the choice made last time.  Returns 0 if there was one and it is still
+  good (same set of decoders available as when it was made).
+*/
+int decoder_load(const char *cache_file);
+/*
+  Decode the start of 'clip' with every decoder this CPU can run, check each
+  one's output against the generic decoder and pick the fastest one that
+  passes.  Saves the choice to 'cache_file'; when none of them passes that's
+  mpg123's default, and -1 is returned.  Prints a table if 'verbose'.
+  Returns 0 on success.
+*/
+int decoder_calibrate(const char *clip, const char *cache_file, int verbose);
+// The chosen decoder, or NULL for mpg123's default
+const char *decoder_name(void);
+// mpg123_new with the chosen decoder
+mpg123_handle *decoder_new(int *err);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * dsp.c
+ *
+ * The processing chain between mpg123_read and ao_play:
+ *
+ *   16 bit in, no EQ:  gain (in place)                        -> 16 bit out
+ *   16 bit in, EQ:     to float -> EQ -> gain + dither to 16 bit
+ *   float in:          EQ (in place, if any) -> gain + dither to 16 bit
+ *
+ * and when the speed isn't 1x, or the sound card can't do the song's rate, the
+ * float version always runs, with the time stretch and then the rate
+ * conversion just before going back to 16 bit.
+ *
+ * ao can't take float samples, so anything that went through the float stages
+ * comes out as dithered 16 bit.
+ *
+ * Every song gets its own chain (with its own ReplayGain and EQ state) so two
+ * of them can run at once when crossfading; the volume is shared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpg123.h>
+
+#include "pool.h"
+#include "dsp.h"
+
+int dsp_open(struct dsp_chain *d, long rate, int channels, int encoding, size_t max_bytes,
+             struct gain_stage *master, struct eq *eq, double rg_db, double rg_peak)
+{
+    memset(d, 0, sizeof(*d));
+    d->rate = rate;
+    d->channels = channels;
+    d->in_encoding = encoding;
+    d->in_bytes = (encoding == MPG123_ENC_FLOAT_32 ? sizeof(float) : sizeof(int16_t));
+    d->master = master;
+    d->tempo.speed = 1.0;
+    d->out_rate = rate;
+    gain_init(&d->gain);
+    gain_set_replaygain(&d->gain, rg_db, rg_peak);
+    if (encoding != MPG123_ENC_SIGNED_16 && encoding != MPG123_ENC_FLOAT_32)
+    {
+        fprintf(stderr, "[%s - %d]: Unsupported encoding 0x%x\n", __FILE__, __LINE__, encoding);
+        return -1;
+    }
+    if (eq != NULL && eq->num_bands > 0)
+    {
+        // Only works the coefficients out again if the rate (or the settings) changed
+        eq_prepare(eq, rate, channels);
+        d->eq = *eq;
+        eq_reset(&d->eq);
+        d->use_eq = 1;
+    }
+    d->max_samples = max_bytes / d->in_bytes;
+    d->use_float = (d->use_eq || encoding == MPG123_ENC_FLOAT_32);
+    // The float buffers are always there; crossfading needs them even without the EQ
+    if (encoding == MPG123_ENC_SIGNED_16)
+    {
+        d->work = pool_alloc(d->max_samples * sizeof(float));
+        if (d->work == NULL)
+        {
+            perror("pool_alloc: dsp work");
+            return -1;
+        }
+    }
+    // Room for the longest the speed stage can make a block
+    d->out_samples = tempo_max_out(rate, d->max_samples / channels) * channels;
+    d->out = pool_alloc(d->out_samples * sizeof(int16_t));
+    if (d->out == NULL)
+    {
+        perror("pool_alloc: dsp out");
+        dsp_close(d);
+        return -1;
+    }
+    return 0;
+}
+
+int dsp_out_bits(void)
+{
+    return 16;
+}
+
+// Volume and mute are shared by all the chains
+static void sync_master(struct dsp_chain *d)
+{
+    gain_set_volume(&d->gain, gain_get_volume(d->master));
+    gain_set_mute(&d->gain, gain_get_mute(d->master));
+    d->gain.preamp_db = d->master->preamp_db;
+}
+
+// To float, then EQ; returns the float samples (may be 'in' itself)
+static float *run_float_stages(struct dsp_chain *d, unsigned char *in, size_t samples)
+{
+    float *f;
+    size_t i;
+
+    if (d->in_encoding == MPG123_ENC_SIGNED_16)
+    {
+        const int16_t *s = (const int16_t *)in;
+
+        f = d->work;
+        for (i = 0; i < samples; i++)
+            f[i] = s[i] * (1.0f / 32768.0f);
+    }
+    else
+        f = (float *)in;
+    if (d->use_eq)
+        eq_process_f32(&d->eq, f, samples / d->channels);
+    return f;
+}
+
+size_t dsp_finish(struct dsp_chain *d, float *in, size_t samples, float **out)
+{
+    size_t frames = tempo_process(&d->tempo, in, samples / d->channels, out);
+
+    if (d->rs.coef != NULL)
+        frames = resample_process(&d->rs, *out, frames, out);
+    return frames * d->channels;
+}
+
+void dsp_set_speed(struct dsp_chain *d, double speed)
+{
+    if (speed == d->tempo.speed)
+        return;
+    // Nothing gets allocated until somebody actually changes the speed
+    if (d->tempo.in == NULL)
+    {
+        if (speed == 1.0 || tempo_open(&d->tempo, d->rate, d->channels, d->max_samples / d->channels) != 0)
+            return;
+    }
+    tempo_set_speed(&d->tempo, speed);
+}
+
+int dsp_set_out_rate(struct dsp_chain *d, long out_rate)
+{
+    size_t max_frames = tempo_max_out(d->rate, d->max_samples / d->channels);
+    size_t samples;
+    int16_t *out;
+
+    if (out_rate == d->out_rate)
+        return 0;
+    resample_close(&d->rs);
+    d->out_rate = out_rate;
+    if (out_rate == d->rate)
+        return 0;
+    if (resample_open(&d->rs, d->rate, out_rate, d->channels, max_frames) != 0)
+    {
+        d->out_rate = d->rate;
+        return -1;
+    }
+    samples = resample_max_out(d->rate, out_rate, max_frames) * d->channels;
+    if (samples > d->out_samples)
+    {
+        // Nothing in it to keep; a bigger one from the pool
+        out = pool_alloc(samples * sizeof(int16_t));
+        if (out == NULL)
+        {
+            perror("pool_alloc: dsp out");
+            resample_close(&d->rs);
+            d->out_rate = d->rate;
+            return -1;
+        }
+        pool_free(d->out);
+        d->out = out;
+        d->out_samples = samples;
+    }
+    return 0;
+}
+
+void dsp_handover(struct dsp_chain *to, struct dsp_chain *from)
+{
+    struct tempo t = to->tempo;
+    struct resampler r = to->rs;
+    long out_rate = to->out_rate;
+    int16_t *out = to->out;
+    size_t out_samples = to->out_samples;
+
+    to->tempo = from->tempo;
+    from->tempo = t;
+    to->rs = from->rs;
+    from->rs = r;
+    to->out_rate = from->out_rate;
+    from->out_rate = out_rate;
+    // The output buffer has to be big enough for the resampler it goes with
+    to->out = from->out;
+    from->out = out;
+    to->out_samples = from->out_samples;
+    from->out_samples = out_samples;
+}
+
+size_t dsp_run(struct dsp_chain *d, unsigned char *in, size_t in_bytes, unsigned char **out)
+{
+    size_t samples = in_bytes / d->in_bytes;
+    float *f;
+
+    if (samples > d->max_samples)
+        samples = d->max_samples;
+    sync_master(d);
+    if (!d->use_float && !tempo_active(&d->tempo) && d->rs.coef == NULL)
+    {
+        gain_apply_s16(&d->gain, (int16_t *)in, samples);
+        *out = in;
+        return samples * sizeof(int16_t);
+    }
+    f = run_float_stages(d, in, samples);
+    samples = dsp_finish(d, f, samples, &f);
+    gain_f32_to_s16(&d->gain, f, d->out, samples);
+    *out = (unsigned char *)d->out;
+    return samples * sizeof(int16_t);
+}
+
+size_t dsp_run_float(struct dsp_chain *d, unsigned char *in, size_t in_bytes, float **out)
+{
+    size_t samples = in_bytes / d->in_bytes;
+    float *f;
+
+    if (samples > d->max_samples)
+        samples = d->max_samples;
+    sync_master(d);
+    f = run_float_stages(d, in, samples);
+    gain_apply_f32(&d->gain, f, samples);
+    *out = f;
+    return samples;
+}
+
+size_t dsp_drain(struct dsp_chain *d, unsigned char **out)
+{
+    float tail[EQ_MAX_BANDS * 2];
+    float *f = NULL;
+    size_t samples = 0;
+
+    // From the top of the chain down, each stage's leftovers going through the ones after it
+    // (one at a time, as together they can be more than 'out' holds)
+    while (samples == 0 && d->drained < 3)
+    {
+        switch (d->drained++)
+        {
+        case 0:
+            if (d->use_eq && d->channels <= 2 && (samples = eq_flush(&d->eq, tail) * d->channels) > 0)
+                samples = dsp_finish(d, tail, samples, &f);
+            break;
+        case 1:
+            samples = tempo_flush(&d->tempo, &f);
+            if (samples > 0 && d->rs.coef != NULL)
+                samples = resample_process(&d->rs, f, samples, &f);
+            samples *= d->channels;
+            break;
+        case 2:
+            samples = resample_flush(&d->rs, &f) * d->channels;
+            break;
+        }
+    }
+    if (samples == 0)
+        return 0;
+    sync_master(d);
+    gain_f32_to_s16(&d->gain, f, d->out, samples);
+    *out = (unsigned char *)d->out;
+    return samples * sizeof(int16_t);
+}
+
+void dsp_close(struct dsp_chain *d)
+{
+    tempo_close(&d->tempo);
+    resample_close(&d->rs);
+    pool_free(d->work);
+    pool_free(d->out);
+    d->work = NULL;
+    d->out = NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * header file for dsp.c
+ *
+ * The processing between mpg123_read and ao_play
+ */
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gain.h"
+#include "eq.h"
+#include "tempo.h"
+#include "resample.h"
+
+struct dsp_chain {
+	long rate;
+	int channels;
+	int in_encoding;        // what mpg123 is giving us
+	int in_bytes;           // bytes per sample in
+	int use_float;          // run the float stages (EQ) or just the gain
+	struct gain_stage *master; // volume / mute come from here
+	struct gain_stage gain;    // this song's ReplayGain (and dither state)
+	struct eq eq;              // this song's copy of the EQ
+	int use_eq;
+	struct tempo tempo;        // speed; only set up once it's not 1x
+	long out_rate;             // what the sound card is running at
+	struct resampler rs;       // only set up if that isn't 'rate'
+	float *work;            // float version of the block (16 bit input only)
+	int16_t *out;           // what goes to ao_play when we had to convert
+	size_t out_samples;     // size of 'out'
+	size_t max_samples;     // in a block (the output can be longer when slowed down)
+	int drained;            // stages dsp_drain has emptied so far
+};
+
+/*
+  Set up the chain for a song.  max_bytes is the largest block that will be
+  passed to dsp_run (i.e. mpg123_outblock).  'master' has the volume, 'eq' the
+  EQ settings (or NULL), rg_db/rg_peak are the song's ReplayGain.
+  Returns 0 on success.
+*/
+int dsp_open(struct dsp_chain *d, long rate, int channels, int encoding, size_t max_bytes,
+             struct gain_stage *master, struct eq *eq, double rg_db, double rg_peak);
+// Bits per sample of the output (what to tell ao_open_live)
+int dsp_out_bits(void);
+/*
+  Run a block through all the stages.  Sets *out to the processed data (which
+  may be 'in' itself) and returns the number of bytes in it.
+*/
+size_t dsp_run(struct dsp_chain *d, unsigned char *in, size_t in_bytes, unsigned char **out);
+/*
+  Same, but stop before going back to 16 bit; *out is the float samples with
+  the gain applied (for mixing).  Returns the number of samples.
+*/
+size_t dsp_run_float(struct dsp_chain *d, unsigned char *in, size_t in_bytes, float **out);
+/*
+  The speed and sample rate stages on their own (dsp_run does them,
+  dsp_run_float doesn't, so mixed audio can go through them in one go).
+  Returns the number of samples.
+*/
+size_t dsp_finish(struct dsp_chain *d, float *in, size_t samples, float **out);
+/*
+  The song's over: what the EQ, the speed and the rate stages were still
+  holding back, one stage at a time, through the rest of the chain like
+  dsp_run.  Call until it returns 0; returns the number of bytes in *out.
+*/
+size_t dsp_drain(struct dsp_chain *d, unsigned char **out);
+// Playback speed (TEMPO_MIN_SPEED to TEMPO_MAX_SPEED); cheap to call every block
+void dsp_set_speed(struct dsp_chain *d, double speed);
+/*
+  Rate the output has to be at (the sound card's); converts if it isn't the
+  song's.  Returns 0 on success.
+*/
+int dsp_set_out_rate(struct dsp_chain *d, long out_rate);
+// Hand the speed and rate stages (and whatever they're holding back) over to another chain
+void dsp_handover(struct dsp_chain *to, struct dsp_chain *from);
+void dsp_close(struct dsp_chain *d);
+
+#endif
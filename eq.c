@@ -0,0 +1,347 @@
+/*
+ * eq.c
+ *
+ * Parametric equalizer for lcd-mp3; mostly to make small cheap speakers sound
+ * less small and cheap.
+ *
+ * Filters are the usual ones from Robert Bristow-Johnson's "Audio EQ Cookbook".
+ * The coefficients are worked out when the sample rate or the settings change,
+ * never per block.
+ *
+ * A biquad can't be vectorized across time (every output depends on the one
+ * before it) so the SIMD versions vectorize across bands instead: the bands are
+ * run as a pipeline, with band k working on the sample band k-1 produced on the
+ * previous step.  That way two bands x two channels fill a 4 lane register, at
+ * the cost of one sample of delay per band.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(EQ_NO_SIMD)
+#  define EQ_SCALAR
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define EQ_NEON
+#  include <arm_neon.h>
+#elif defined(__SSE2__)
+#  define EQ_SSE2
+#  include <emmintrin.h>
+#else
+#  define EQ_SCALAR
+#endif
+
+#include "eq.h"
+
+// Keeps the filter tails from decaying into (slow) denormals
+#define ANTI_DENORMAL 1e-18f
+
+void eq_init(struct eq *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->dirty = 1;
+}
+
+int eq_add_band(struct eq *e, int type, double freq, double gain_db, double q)
+{
+    struct eq_band *b;
+
+    if (e->num_bands == EQ_MAX_BANDS || freq <= 0.0 || q <= 0.0)
+        return -1;
+    b = &e->band[e->num_bands++];
+    b->type = type;
+    b->freq = freq;
+    b->gain_db = gain_db;
+    b->q = q;
+    e->dirty = 1;
+    return 0;
+}
+
+int eq_parse(struct eq *e, const char *spec)
+{
+    const char *p = spec;
+
+    while (*p != '\0')
+    {
+        char type[3];
+        double freq, gain, q = 0.7071;
+        int n, used = 0, t;
+
+        n = sscanf(p, "%2[a-z]:%lf:%lf%n:%lf%n", type, &freq, &gain, &used, &q, &used);
+        if (n < 3)
+            return -1;
+        if (strcmp(type, "ls") == 0)
+            t = EQ_LOWSHELF;
+        else if (strcmp(type, "pk") == 0)
+            t = EQ_PEAK;
+        else if (strcmp(type, "hs") == 0)
+            t = EQ_HIGHSHELF;
+        else
+            return -1;
+        if (eq_add_band(e, t, freq, gain, q) != 0)
+            return -1;
+        p += used;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+    return 0;
+}
+
+static void set_lane(float v[EQ_MAX_VECS][4], int band, float x)
+{
+    // Same value for both channels
+    v[band / 2][(band % 2) * 2] = x;
+    v[band / 2][(band % 2) * 2 + 1] = x;
+}
+
+void eq_prepare(struct eq *e, long rate, int channels)
+{
+    int k;
+
+    if (!e->dirty && rate == e->rate && channels == e->channels)
+        return;
+    e->rate = rate;
+    e->channels = channels;
+    e->num_vecs = (e->num_bands + 1) / 2;
+    for (k = 0; k < e->num_vecs * 2; k++)
+    {
+        struct eq_band *b = &e->band[k];
+        double A, w0, cs, alpha, sa, b0, b1, b2, a0, a1, a2;
+
+        if (k >= e->num_bands || b->freq >= rate / 2.0)
+        {
+            // Padding (or a band above Nyquist); pass straight through
+            b0 = a0 = 1.0;
+            b1 = b2 = a1 = a2 = 0.0;
+        }
+        else
+        {
+            A = pow(10.0, b->gain_db / 40.0);
+            w0 = 2.0 * M_PI * b->freq / rate;
+            cs = cos(w0);
+            alpha = sin(w0) / (2.0 * b->q);
+            sa = 2.0 * sqrt(A) * alpha;
+            switch (b->type)
+            {
+                case EQ_LOWSHELF:
+                    b0 = A * ((A + 1) - (A - 1) * cs + sa);
+                    b1 = 2 * A * ((A - 1) - (A + 1) * cs);
+                    b2 = A * ((A + 1) - (A - 1) * cs - sa);
+                    a0 = (A + 1) + (A - 1) * cs + sa;
+                    a1 = -2 * ((A - 1) + (A + 1) * cs);
+                    a2 = (A + 1) + (A - 1) * cs - sa;
+                    break;
+                case EQ_HIGHSHELF:
+                    b0 = A * ((A + 1) + (A - 1) * cs + sa);
+                    b1 = -2 * A * ((A - 1) + (A + 1) * cs);
+                    b2 = A * ((A + 1) + (A - 1) * cs - sa);
+                    a0 = (A + 1) - (A - 1) * cs + sa;
+                    a1 = 2 * ((A - 1) - (A + 1) * cs);
+                    a2 = (A + 1) - (A - 1) * cs - sa;
+                    break;
+                default: // EQ_PEAK
+                    b0 = 1 + alpha * A;
+                    b1 = -2 * cs;
+                    b2 = 1 - alpha * A;
+                    a0 = 1 + alpha / A;
+                    a1 = -2 * cs;
+                    a2 = 1 - alpha / A;
+                    break;
+            }
+        }
+        set_lane(e->b0, k, b0 / a0);
+        set_lane(e->b1, k, b1 / a0);
+        set_lane(e->b2, k, b2 / a0);
+        set_lane(e->a1, k, a1 / a0);
+        set_lane(e->a2, k, a2 / a0);
+    }
+    e->dirty = 0;
+    eq_reset(e);
+}
+
+void eq_reset(struct eq *e)
+{
+    memset(e->z1, 0, sizeof(e->z1));
+    memset(e->z2, 0, sizeof(e->z2));
+    memset(e->y, 0, sizeof(e->y));
+}
+
+// The pipeline's last eq_latency() samples come out by putting that much silence in after them
+size_t eq_flush(struct eq *e, float *buf)
+{
+    int n = eq_latency(e);
+
+    memset(buf, 0, n * e->channels * sizeof(float));
+    eq_process_f32(e, buf, n);
+    return n;
+}
+
+#if defined(EQ_SSE2)
+
+const char *eq_kernel_name(void) { return "sse2"; }
+
+int eq_latency(struct eq *e)
+{
+    return (e->num_vecs ? e->num_vecs * 2 - 1 : 0);
+}
+
+void eq_process_f32(struct eq *e, float *buf, size_t frames)
+{
+    __m128 b0[EQ_MAX_VECS], b1[EQ_MAX_VECS], b2[EQ_MAX_VECS], a1[EQ_MAX_VECS], a2[EQ_MAX_VECS];
+    __m128 z1[EQ_MAX_VECS], z2[EQ_MAX_VECS], y[EQ_MAX_VECS];
+    __m128 tiny = _mm_set1_ps(ANTI_DENORMAL);
+    int nv = e->num_vecs, last = e->num_vecs - 1, v;
+    size_t i;
+
+    if (nv == 0)
+        return;
+    for (v = 0; v < nv; v++)
+    {
+        b0[v] = _mm_load_ps(e->b0[v]);
+        b1[v] = _mm_load_ps(e->b1[v]);
+        b2[v] = _mm_load_ps(e->b2[v]);
+        a1[v] = _mm_load_ps(e->a1[v]);
+        a2[v] = _mm_load_ps(e->a2[v]);
+        z1[v] = _mm_load_ps(e->z1[v]);
+        z2[v] = _mm_load_ps(e->z2[v]);
+        y[v] = _mm_load_ps(e->y[v]);
+    }
+    for (i = 0; i < frames; i++)
+    {
+        float *p = buf + i * e->channels;
+        __m128 in, x;
+
+        if (e->channels == 2)
+            in = _mm_castpd_ps(_mm_load_sd((const double *)p));
+        else
+            in = _mm_set_ss(*p);
+        in = _mm_add_ps(in, tiny);
+        // Top down, so y[v - 1] still holds the previous step's output
+        for (v = last; v >= 0; v--)
+        {
+            if (v == 0)
+                x = _mm_movelh_ps(in, y[0]);
+            else
+                x = _mm_shuffle_ps(y[v - 1], y[v], _MM_SHUFFLE(1, 0, 3, 2));
+            y[v] = _mm_add_ps(_mm_mul_ps(b0[v], x), z1[v]);
+            z1[v] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1[v], x), _mm_mul_ps(a1[v], y[v])), z2[v]);
+            z2[v] = _mm_sub_ps(_mm_mul_ps(b2[v], x), _mm_mul_ps(a2[v], y[v]));
+        }
+        // The last band's output is in the top two lanes
+        if (e->channels == 2)
+            _mm_storeh_pi((__m64 *)p, y[last]);
+        else
+            _mm_store_ss(p, _mm_movehl_ps(y[last], y[last]));
+    }
+    for (v = 0; v < nv; v++)
+    {
+        _mm_store_ps(e->z1[v], z1[v]);
+        _mm_store_ps(e->z2[v], z2[v]);
+        _mm_store_ps(e->y[v], y[v]);
+    }
+}
+
+#elif defined(EQ_NEON)
+
+const char *eq_kernel_name(void) { return "neon"; }
+
+int eq_latency(struct eq *e)
+{
+    return (e->num_vecs ? e->num_vecs * 2 - 1 : 0);
+}
+
+void eq_process_f32(struct eq *e, float *buf, size_t frames)
+{
+    float32x4_t b0[EQ_MAX_VECS], b1[EQ_MAX_VECS], b2[EQ_MAX_VECS], a1[EQ_MAX_VECS], a2[EQ_MAX_VECS];
+    float32x4_t z1[EQ_MAX_VECS], z2[EQ_MAX_VECS], y[EQ_MAX_VECS];
+    float32x2_t tiny = vdup_n_f32(ANTI_DENORMAL);
+    int nv = e->num_vecs, last = e->num_vecs - 1, v;
+    size_t i;
+
+    if (nv == 0)
+        return;
+    for (v = 0; v < nv; v++)
+    {
+        b0[v] = vld1q_f32(e->b0[v]);
+        b1[v] = vld1q_f32(e->b1[v]);
+        b2[v] = vld1q_f32(e->b2[v]);
+        a1[v] = vld1q_f32(e->a1[v]);
+        a2[v] = vld1q_f32(e->a2[v]);
+        z1[v] = vld1q_f32(e->z1[v]);
+        z2[v] = vld1q_f32(e->z2[v]);
+        y[v] = vld1q_f32(e->y[v]);
+    }
+    for (i = 0; i < frames; i++)
+    {
+        float *p = buf + i * e->channels;
+        float32x2_t in;
+        float32x4_t x;
+
+        if (e->channels == 2)
+            in = vld1_f32(p);
+        else
+            in = vset_lane_f32(*p, vdup_n_f32(0.0f), 0);
+        in = vadd_f32(in, tiny);
+        // Top down, so y[v - 1] still holds the previous step's output
+        for (v = last; v >= 0; v--)
+        {
+            if (v == 0)
+                x = vcombine_f32(in, vget_low_f32(y[0]));
+            else
+                x = vextq_f32(y[v - 1], y[v], 2);
+            y[v] = vmlaq_f32(z1[v], b0[v], x);
+            z1[v] = vaddq_f32(vmlsq_f32(vmulq_f32(b1[v], x), a1[v], y[v]), z2[v]);
+            z2[v] = vmlsq_f32(vmulq_f32(b2[v], x), a2[v], y[v]);
+        }
+        // The last band's output is in the top two lanes
+        if (e->channels == 2)
+            vst1_f32(p, vget_high_f32(y[last]));
+        else
+            *p = vgetq_lane_f32(y[last], 2);
+    }
+    for (v = 0; v < nv; v++)
+    {
+        vst1q_f32(e->z1[v], z1[v]);
+        vst1q_f32(e->z2[v], z2[v]);
+        vst1q_f32(e->y[v], y[v]);
+    }
+}
+
+#else // EQ_SCALAR
+
+const char *eq_kernel_name(void) { return "scalar"; }
+
+int eq_latency(struct eq *e)
+{
+    return 0;
+}
+
+void eq_process_f32(struct eq *e, float *buf, size_t frames)
+{
+    size_t i;
+    int k, ch;
+
+    for (i = 0; i < frames; i++)
+    {
+        for (ch = 0; ch < e->channels; ch++)
+        {
+            float x = buf[i * e->channels + ch] + ANTI_DENORMAL;
+
+            for (k = 0; k < e->num_bands; k++)
+            {
+                int v = k / 2, l = (k % 2) * 2 + ch;
+                float y = e->b0[v][l] * x + e->z1[v][l];
+
+                e->z1[v][l] = e->b1[v][l] * x - e->a1[v][l] * y + e->z2[v][l];
+                e->z2[v][l] = e->b2[v][l] * x - e->a2[v][l] * y;
+                x = y;
+            }
+            buf[i * e->channels + ch] = x;
+        }
+    }
+}
+
+#endif
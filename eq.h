@@ -0,0 +1,74 @@
+/*
+ * header file for eq.c
+ *
+ * Parametric equalizer; a cascade of biquads (shelves and peaking filters)
+ */
+#ifndef EQ_H
+#define EQ_H
+
+#include <stddef.h>
+
+#define EQ_MAX_BANDS 8
+// Bands are processed two at a time (x 2 channels = 4 lanes)
+#define EQ_MAX_VECS  (EQ_MAX_BANDS / 2)
+
+typedef enum {
+	EQ_LOWSHELF,
+	EQ_PEAK,
+	EQ_HIGHSHELF
+} eq_type_enum;
+
+struct eq_band {
+	int type;
+	double freq;    // Hz
+	double gain_db;
+	double q;
+};
+
+struct eq {
+	int num_bands;
+	struct eq_band band[EQ_MAX_BANDS];
+	int dirty;      // settings changed; coefficients need working out again
+	long rate;      // rate the coefficients are for
+	int channels;
+	/*
+	  Coefficients and filter state, 4 floats per vector:
+	  [band 2v left, band 2v right, band 2v+1 left, band 2v+1 right]
+	*/
+	int num_vecs;
+	float b0[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float b1[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float b2[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float a1[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float a2[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float z1[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float z2[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+	float y[EQ_MAX_VECS][4] __attribute__((aligned(16)));
+};
+
+void eq_init(struct eq *e);
+/*
+  Parse a comma separated list of bands; each is type:freq:gain[:q] where type
+  is ls (low shelf), pk (peaking) or hs (high shelf).  e.g.
+    ls:120:4,pk:2500:-3:1.4,hs:9000:2
+  Returns 0 if it all made sense.
+*/
+int eq_parse(struct eq *e, const char *spec);
+int eq_add_band(struct eq *e, int type, double freq, double gain_db, double q);
+// Work out the coefficients; does nothing unless the rate or the settings changed
+void eq_prepare(struct eq *e, long rate, int channels);
+// Clear the filter state (new song)
+void eq_reset(struct eq *e);
+// Interleaved float samples, processed in place
+void eq_process_f32(struct eq *e, float *buf, size_t frames);
+// Samples of delay the filter adds (the SIMD version pipelines the bands)
+int eq_latency(struct eq *e);
+/*
+  End of the song: write the frames still in the pipeline (eq_latency() of
+  them, which is at most EQ_MAX_BANDS - 1) to buf, and return how many.
+*/
+size_t eq_flush(struct eq *e, float *buf);
+
+const char *eq_kernel_name(void);
+
+#endif
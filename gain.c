@@ -0,0 +1,370 @@
+/*
+ * gain.c
+ *
+ * Software gain stage for lcd-mp3.
+ *
+ * Applies the user volume and the per-track ReplayGain to the PCM coming out of
+ * mpg123_read before it is handed to ao_play.  This way the volume knob works on
+ * cards that have no hardware mixer, and the volume curve isn't limited to the
+ * steps the mixer happens to offer.
+ *
+ * The kernels come in three flavours; NEON (Pi 2/3 built with -mfpu=neon),
+ * SSE2 (for testing on a PC) and plain C for everything else.  All three use the
+ * same dither so the output doesn't depend (much) on which one was compiled in.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#if defined(GAIN_NO_SIMD)
+#  define GAIN_SCALAR
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define GAIN_NEON
+#  include <arm_neon.h>
+#elif defined(__SSE2__)
+#  define GAIN_SSE2
+#  include <emmintrin.h>
+#else
+#  define GAIN_SCALAR
+#endif
+
+#include "gain.h"
+
+void gain_init(struct gain_stage *g)
+{
+    memset(g, 0, sizeof(*g));
+    g->volume = 1.0;
+    g->dither[0] = 0x9e3779b9;
+    g->dither[1] = 0x7f4a7c15;
+    g->dither[2] = 0x85ebca6b;
+    g->dither[3] = 0xc2b2ae35;
+}
+
+// Volume is 0..1, same as the ALSA get/set_normalized_volume functions
+void gain_set_volume(struct gain_stage *g, double volume)
+{
+    float v;
+
+    if (volume < 0.0)
+        volume = 0.0;
+    else if (volume > 1.0)
+        volume = 1.0;
+    v = volume;
+    __atomic_store(&g->volume, &v, __ATOMIC_RELAXED);
+}
+
+double gain_get_volume(struct gain_stage *g)
+{
+    float v;
+
+    __atomic_load(&g->volume, &v, __ATOMIC_RELAXED);
+    return v;
+}
+
+void gain_set_mute(struct gain_stage *g, int muted)
+{
+    __atomic_store_n(&g->muted, muted, __ATOMIC_RELAXED);
+}
+
+int gain_get_mute(struct gain_stage *g)
+{
+    return __atomic_load_n(&g->muted, __ATOMIC_RELAXED);
+}
+
+// gain_db is the ReplayGain track gain; peak is the linear track peak (0 if not known)
+void gain_set_replaygain(struct gain_stage *g, double gain_db, double peak)
+{
+    g->rg_db = gain_db;
+    g->rg_peak = (peak > 0.0 ? peak : 0.0);
+}
+
+// Linear factor for the current settings
+float gain_factor(struct gain_stage *g)
+{
+    double vol, rg;
+
+    if (gain_get_mute(g))
+        return 0.0;
+    // The ALSA code maps 0..1 onto 60dB (6000 * log10(volume)); in amplitude
+    // terms that is just volume cubed.
+    vol = gain_get_volume(g);
+    vol = vol * vol * vol;
+    rg = pow(10.0, (g->rg_db + g->preamp_db) / 20.0);
+    // Don't let the ReplayGain push the loudest sample into clipping
+    if (g->rg_peak > 0.0 && rg * g->rg_peak > 1.0)
+        rg = 1.0 / g->rg_peak;
+    return (float)(vol * rg);
+}
+
+/*
+ * Scalar helpers (also used for the odd samples left over by the SIMD loops)
+ */
+
+static inline uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Triangular (TPDF) dither of +-1 LSB; the two halves of one random word are
+// the two uniform variables.
+static inline float tpdf(uint32_t *state)
+{
+    uint32_t x = xorshift32(state);
+
+    return (float)((int32_t)((x >> 16) + (x & 0xffff)) - 65535) * (1.0f / 65536.0f);
+}
+
+static inline int16_t clip16(float x)
+{
+    long v = lrintf(x);
+
+    if (v > 32767)
+        return 32767;
+    if (v < -32768)
+        return -32768;
+    return (int16_t)v;
+}
+
+// A gain of 0 (muted, or the volume all the way down) is silence, not dither
+static void s16_scalar(uint32_t *state, float f, int16_t *buf, size_t n)
+{
+    size_t i;
+
+    if (f == 0.0f)
+    {
+        memset(buf, 0, n * sizeof(int16_t));
+        return;
+    }
+    for (i = 0; i < n; i++)
+        buf[i] = clip16((float)buf[i] * f + tpdf(state));
+}
+
+static void f32_scalar(float f, float *buf, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        buf[i] *= f;
+}
+
+static void f32_to_s16_scalar(uint32_t *state, float f, const float *in, int16_t *out, size_t n)
+{
+    size_t i;
+
+    if (f == 0.0f)
+    {
+        memset(out, 0, n * sizeof(int16_t));
+        return;
+    }
+    f *= 32768.0f;
+    for (i = 0; i < n; i++)
+        out[i] = clip16(in[i] * f + tpdf(state));
+}
+
+#if defined(GAIN_SSE2)
+
+const char *gain_kernel_name(void) { return "sse2"; }
+
+static inline __m128 sse_tpdf(__m128i *state)
+{
+    __m128i x = *state;
+    __m128i d;
+
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    *state = x;
+    d = _mm_add_epi32(_mm_srli_epi32(x, 16), _mm_and_si128(x, _mm_set1_epi32(0xffff)));
+    d = _mm_sub_epi32(d, _mm_set1_epi32(65535));
+    return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+void gain_apply_s16(struct gain_stage *g, int16_t *buf, size_t samples)
+{
+    float f = gain_factor(g);
+    __m128 vf = _mm_set1_ps(f);
+    __m128i st;
+    size_t i = 0;
+
+    if (f == 1.0f)
+        return;
+    if (f == 0.0f)
+    {
+        memset(buf, 0, samples * sizeof(int16_t));
+        return;
+    }
+    st = _mm_loadu_si128((__m128i *)g->dither);
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+        // Sign extend 8 x s16 into 2 x (4 x s32)
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        __m128 flo = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), vf), sse_tpdf(&st));
+        __m128 fhi = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), vf), sse_tpdf(&st));
+        // cvtps rounds to nearest, packs saturates to s16
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi32(_mm_cvtps_epi32(flo), _mm_cvtps_epi32(fhi)));
+    }
+    _mm_storeu_si128((__m128i *)g->dither, st);
+    s16_scalar(&g->dither[0], f, buf + i, samples - i);
+}
+
+void gain_apply_f32(struct gain_stage *g, float *buf, size_t samples)
+{
+    float f = gain_factor(g);
+    __m128 vf = _mm_set1_ps(f);
+    size_t i = 0;
+
+    if (f == 1.0f)
+        return;
+    for (; i + 4 <= samples; i += 4)
+        _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_loadu_ps(buf + i), vf));
+    f32_scalar(f, buf + i, samples - i);
+}
+
+void gain_f32_to_s16(struct gain_stage *g, const float *in, int16_t *out, size_t samples)
+{
+    float f = gain_factor(g);
+    __m128 vf = _mm_set1_ps(f * 32768.0f);
+    __m128i st;
+    size_t i = 0;
+
+    if (f == 0.0f)
+    {
+        memset(out, 0, samples * sizeof(int16_t));
+        return;
+    }
+    st = _mm_loadu_si128((__m128i *)g->dither);
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m128 lo = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), vf), sse_tpdf(&st));
+        __m128 hi = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), vf), sse_tpdf(&st));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+    }
+    _mm_storeu_si128((__m128i *)g->dither, st);
+    f32_to_s16_scalar(&g->dither[0], f, in + i, out + i, samples - i);
+}
+
+#elif defined(GAIN_NEON)
+
+const char *gain_kernel_name(void) { return "neon"; }
+
+static inline float32x4_t neon_tpdf(uint32x4_t *state)
+{
+    uint32x4_t x = *state;
+    int32x4_t d;
+
+    x = veorq_u32(x, vshlq_n_u32(x, 13));
+    x = veorq_u32(x, vshrq_n_u32(x, 17));
+    x = veorq_u32(x, vshlq_n_u32(x, 5));
+    *state = x;
+    d = vreinterpretq_s32_u32(vaddq_u32(vshrq_n_u32(x, 16), vandq_u32(x, vdupq_n_u32(0xffff))));
+    d = vsubq_s32(d, vdupq_n_s32(65535));
+    return vmulq_n_f32(vcvtq_f32_s32(d), 1.0f / 65536.0f);
+}
+
+// vcvtq_s32_f32 truncates towards zero (and saturates), so add +-0.5 first
+static inline int32x4_t neon_round(float32x4_t v)
+{
+    uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(v), vdupq_n_u32(0x80000000));
+    float32x4_t half = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vdupq_n_f32(0.5f)), sign));
+
+    return vcvtq_s32_f32(vaddq_f32(v, half));
+}
+
+void gain_apply_s16(struct gain_stage *g, int16_t *buf, size_t samples)
+{
+    float f = gain_factor(g);
+    uint32x4_t st;
+    size_t i = 0;
+
+    if (f == 1.0f)
+        return;
+    if (f == 0.0f)
+    {
+        memset(buf, 0, samples * sizeof(int16_t));
+        return;
+    }
+    st = vld1q_u32(g->dither);
+    for (; i + 8 <= samples; i += 8)
+    {
+        int16x8_t v = vld1q_s16(buf + i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+
+        lo = vaddq_f32(vmulq_n_f32(lo, f), neon_tpdf(&st));
+        hi = vaddq_f32(vmulq_n_f32(hi, f), neon_tpdf(&st));
+        vst1q_s16(buf + i, vcombine_s16(vqmovn_s32(neon_round(lo)), vqmovn_s32(neon_round(hi))));
+    }
+    vst1q_u32(g->dither, st);
+    s16_scalar(&g->dither[0], f, buf + i, samples - i);
+}
+
+void gain_apply_f32(struct gain_stage *g, float *buf, size_t samples)
+{
+    float f = gain_factor(g);
+    size_t i = 0;
+
+    if (f == 1.0f)
+        return;
+    for (; i + 4 <= samples; i += 4)
+        vst1q_f32(buf + i, vmulq_n_f32(vld1q_f32(buf + i), f));
+    f32_scalar(f, buf + i, samples - i);
+}
+
+void gain_f32_to_s16(struct gain_stage *g, const float *in, int16_t *out, size_t samples)
+{
+    float f = gain_factor(g);
+    float fs = f * 32768.0f;
+    uint32x4_t st;
+    size_t i = 0;
+
+    if (f == 0.0f)
+    {
+        memset(out, 0, samples * sizeof(int16_t));
+        return;
+    }
+    st = vld1q_u32(g->dither);
+    for (; i + 8 <= samples; i += 8)
+    {
+        float32x4_t lo = vaddq_f32(vmulq_n_f32(vld1q_f32(in + i), fs), neon_tpdf(&st));
+        float32x4_t hi = vaddq_f32(vmulq_n_f32(vld1q_f32(in + i + 4), fs), neon_tpdf(&st));
+
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(neon_round(lo)), vqmovn_s32(neon_round(hi))));
+    }
+    vst1q_u32(g->dither, st);
+    f32_to_s16_scalar(&g->dither[0], f, in + i, out + i, samples - i);
+}
+
+#else // GAIN_SCALAR
+
+const char *gain_kernel_name(void) { return "scalar"; }
+
+void gain_apply_s16(struct gain_stage *g, int16_t *buf, size_t samples)
+{
+    float f = gain_factor(g);
+
+    if (f != 1.0f)
+        s16_scalar(&g->dither[0], f, buf, samples);
+}
+
+void gain_apply_f32(struct gain_stage *g, float *buf, size_t samples)
+{
+    float f = gain_factor(g);
+
+    if (f != 1.0f)
+        f32_scalar(f, buf, samples);
+}
+
+void gain_f32_to_s16(struct gain_stage *g, const float *in, int16_t *out, size_t samples)
+{
+    f32_to_s16_scalar(&g->dither[0], gain_factor(g), in, out, samples);
+}
+
+#endif
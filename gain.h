@@ -0,0 +1,47 @@
+/*
+ * header file for gain.c
+ *
+ * Software gain stage: user volume + ReplayGain applied to the decoded PCM.
+ */
+#ifndef GAIN_H
+#define GAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ReplayGain reference level is 89 dB SPL, which works out to -18 LUFS.
+#define RG_REFERENCE_LUFS -18.0
+
+// volume and muted are set from the UI thread while the audio thread reads them,
+// so they're only ever got at through the functions below (atomically)
+struct gain_stage {
+	float volume;            // user volume 0..1 (same curve as the ALSA mixer code)
+	float rg_db;             // per-track ReplayGain in dB
+	float rg_peak;           // per-track peak (linear, 1.0 = full scale); 0 if unknown
+	float preamp_db;
+	int muted;
+	uint32_t dither[4];      // xorshift state for the TPDF dither, one per SIMD lane
+};
+
+void gain_init(struct gain_stage *g);
+void gain_set_volume(struct gain_stage *g, double volume);
+double gain_get_volume(struct gain_stage *g);
+void gain_set_mute(struct gain_stage *g, int muted);
+int gain_get_mute(struct gain_stage *g);
+void gain_set_replaygain(struct gain_stage *g, double gain_db, double peak);
+float gain_factor(struct gain_stage *g);
+
+/*
+  Kernels. 'samples' is the number of samples (frames * channels).
+  The 16-bit paths add TPDF dither whenever the gain isn't exactly 1.0 or 0.0
+  (a gain of 0 gives plain digital silence);
+  with a gain of 1.0 the 16-bit in-place path leaves the data untouched.
+*/
+void gain_apply_s16(struct gain_stage *g, int16_t *buf, size_t samples);
+void gain_apply_f32(struct gain_stage *g, float *buf, size_t samples);
+void gain_f32_to_s16(struct gain_stage *g, const float *in, int16_t *out, size_t samples);
+
+// Name of the kernel compiled in ("neon", "sse2" or "scalar")
+const char *gain_kernel_name(void);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * hal.c
+ *
+ * Hardware layer for lcd-mp3.
+ *
+ * lcd-mp3.c used to call wiringPi (digitalRead, lcdPuts, millis, ...) and the
+ * ALSA mixer directly, so none of it could run anywhere but on a Pi with the
+ * board attached.  Now it goes through these functions, which pass the calls
+ * on to one of two backends: hal_pi.c (wiringPi and ALSA; the default when
+ * built with HAVE_WIRINGPI) or hal_sim.c (pins set from a script, the LCD in
+ * memory and optionally drawn on the terminal, software volume).
+ *
+ * The player also says when it opens, writes to, pauses and closes the audio
+ * output.  The Pi doesn't need to know (libao talks to the card), but the
+ * simulator's card runs its clock from it.
+ *
+ * Writes to the LCD are timed for the metrics (on the Pi, wiringPi's lcd
+ * driver waits out the HD44780's timings a character at a time).
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "hal.h"
+#include "metrics.h"
+
+#ifdef HAVE_WIRINGPI
+static const struct hal_ops *ops = &hal_pi_ops;
+#else
+static const struct hal_ops *ops = &hal_sim_ops;
+#endif
+// The mixer opened
+static int have_mixer = 0;
+
+void hal_use_sim(void)
+{
+    ops = &hal_sim_ops;
+}
+
+const char *hal_name(void)
+{
+    return ops->name;
+}
+
+int hal_simulated(void)
+{
+    return (ops == &hal_sim_ops);
+}
+
+int hal_setup(void)
+{
+    return ops->setup();
+}
+
+unsigned int hal_millis(void)
+{
+    return ops->millis();
+}
+
+void hal_delay(unsigned int ms)
+{
+    ops->delay(ms);
+}
+
+void hal_input(int pin)
+{
+    ops->input(pin);
+}
+
+int hal_read(int pin)
+{
+    return ops->read(pin);
+}
+
+int hal_watch(int pin, void (*function)(void))
+{
+    return ops->watch(pin, function);
+}
+
+void hal_priority(int pri)
+{
+    ops->priority(pri);
+}
+
+int hal_lcd_init(int rows, int cols, int bits, int rs, int strb,
+                 int d0, int d1, int d2, int d3, int d4, int d5, int d6, int d7)
+{
+    return ops->lcd_init(rows, cols, bits, rs, strb, d0, d1, d2, d3, d4, d5, d6, d7);
+}
+
+void hal_lcd_clear(int fd)
+{
+    unsigned long long start = metrics_now();
+
+    ops->lcd_clear(fd);
+    metrics_since(MET_LCD, start);
+}
+
+void hal_lcd_position(int fd, int x, int y)
+{
+    ops->lcd_position(fd, x, y);
+}
+
+void hal_lcd_putchar(int fd, unsigned char c)
+{
+    unsigned long long start = metrics_now();
+
+    ops->lcd_putchar(fd, c);
+    metrics_since(MET_LCD, start);
+}
+
+void hal_lcd_puts(int fd, const char *s)
+{
+    unsigned long long start = metrics_now();
+
+    ops->lcd_puts(fd, s);
+    metrics_since(MET_LCD, start);
+}
+
+void hal_lcd_printf(int fd, const char *format, ...)
+{
+    char buffer[64];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    hal_lcd_puts(fd, buffer);
+}
+
+void hal_lcd_chardef(int fd, int index, unsigned char data[8])
+{
+    ops->lcd_chardef(fd, index, data);
+}
+
+int hal_mixer_open(const char *card)
+{
+    have_mixer = (ops->mixer_open(card) == 0);
+    return (have_mixer ? 0 : -1);
+}
+
+int hal_mixer_present(void)
+{
+    return have_mixer;
+}
+
+double hal_mixer_get(void)
+{
+    return ops->mixer_get();
+}
+
+void hal_mixer_set(double volume)
+{
+    ops->mixer_set(volume);
+}
+
+int hal_mixer_toggle_mute(void)
+{
+    return ops->mixer_toggle_mute();
+}
+
+void hal_mixer_close(void)
+{
+    if (have_mixer)
+        ops->mixer_close();
+    have_mixer = 0;
+}
+
+void hal_audio_open(void)
+{
+    ops->audio_open();
+}
+
+void hal_audio_played(long frames, long rate)
+{
+    ops->audio_played(frames, rate);
+}
+
+void hal_audio_pause(int paused)
+{
+    ops->audio_pause(paused);
+}
+
+void hal_audio_close(void)
+{
+    ops->audio_close();
+}
@@ -0,0 +1,119 @@
+/*
+ * header file for hal.c
+ *
+ * The buttons, rotary encoder, LCD and volume control, on the Pi (wiringPi and
+ * the ALSA mixer) or simulated
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifndef HIGH
+#  define HIGH 1
+#  define LOW  0
+#endif
+
+struct hal_ops {
+	const char *name;
+	int (*setup)(void);
+	unsigned int (*millis)(void);
+	void (*delay)(unsigned int ms);
+	void (*input)(int pin);                            // input with the pull up on
+	int (*read)(int pin);
+	int (*watch)(int pin, void (*function)(void));     // call 'function' on both edges
+	void (*priority)(int pri);
+	// The LCD (same arguments as wiringPi's lcdInit)
+	int (*lcd_init)(int rows, int cols, int bits, int rs, int strb,
+	                int d0, int d1, int d2, int d3, int d4, int d5, int d6, int d7);
+	void (*lcd_clear)(int fd);
+	void (*lcd_position)(int fd, int x, int y);
+	void (*lcd_putchar)(int fd, unsigned char c);
+	void (*lcd_puts)(int fd, const char *s);
+	void (*lcd_chardef)(int fd, int index, unsigned char data[8]);
+	// The card's volume control; mixer_open returns -1 if there isn't one
+	int (*mixer_open)(const char *card);
+	double (*mixer_get)(void);                         // 0..1
+	void (*mixer_set)(double volume);
+	int (*mixer_toggle_mute)(void);                    // 1 if now muted
+	void (*mixer_close)(void);
+	// What the player does with the card (the simulator plays at the card's pace from these)
+	void (*audio_open)(void);
+	void (*audio_played)(long frames, long rate);
+	void (*audio_pause)(int paused);
+	void (*audio_close)(void);
+};
+
+extern const struct hal_ops hal_sim_ops;
+#ifdef HAVE_WIRINGPI
+extern const struct hal_ops hal_pi_ops;
+#endif
+
+// Pick the simulator instead of the Pi (before hal_setup); always the simulator without wiringPi
+void hal_use_sim(void);
+const char *hal_name(void);
+int hal_simulated(void);
+
+int hal_setup(void);
+unsigned int hal_millis(void);
+void hal_delay(unsigned int ms);
+void hal_input(int pin);
+int hal_read(int pin);
+int hal_watch(int pin, void (*function)(void));
+void hal_priority(int pri);
+
+int hal_lcd_init(int rows, int cols, int bits, int rs, int strb,
+                 int d0, int d1, int d2, int d3, int d4, int d5, int d6, int d7);
+void hal_lcd_clear(int fd);
+void hal_lcd_position(int fd, int x, int y);
+void hal_lcd_putchar(int fd, unsigned char c);
+void hal_lcd_puts(int fd, const char *s);
+void hal_lcd_printf(int fd, const char *format, ...);
+void hal_lcd_chardef(int fd, int index, unsigned char data[8]);
+
+// Returns 0 if the card has a mixer to use
+int hal_mixer_open(const char *card);
+int hal_mixer_present(void);
+double hal_mixer_get(void);
+void hal_mixer_set(double volume);
+int hal_mixer_toggle_mute(void);
+void hal_mixer_close(void);
+
+// Called by the player: an output opened, audio written to it, paused/resumed, closed
+void hal_audio_open(void);
+void hal_audio_played(long frames, long rate);
+void hal_audio_pause(int paused);
+void hal_audio_close(void);
+
+/*
+  Simulator.  Time (hal_millis) is the simulated card's clock, which ticks a
+  millisecond at a time in step with the real one; events happen on the tick
+  they're due.
+*/
+// Name a pin for scripts, and say what level it sits at
+void hal_sim_pin(const char *name, int pin, int level);
+// Name a rotary encoder's pair of pins (they sit low)
+void hal_sim_encoder(const char *name, int pin_a, int pin_b);
+/*
+  Play the events in 'script' (one per line, times in ms from the start):
+    <ms> press <button> [held ms]
+    <ms> turn <encoder> <clicks>      (negative to go the other way)
+    <ms> set <pin name> <level>
+  Returns 0 if it could be read.
+*/
+int hal_sim_script(const char *script);
+// Set a pin at 'ms'
+void hal_sim_event(unsigned int ms, int pin, int level);
+// Move the encoder on pin_a/pin_b 'steps' quadrature steps (4 to a click) starting at 'ms'
+void hal_sim_turn(unsigned int ms, int pin_a, int pin_b, long steps);
+// Move the clock on by hand (for benchmarks; only without hal_setup, which starts the card)
+void hal_sim_advance(unsigned int ms);
+// Draw the LCD on the terminal whenever it changes
+void hal_sim_render(int on);
+// What's on the LCD now, a line per row
+void hal_sim_screen(char *buffer, size_t size);
+// Events, how long the LCD took to respond to them, and underruns
+void hal_sim_report(FILE *fp);
+
+#endif
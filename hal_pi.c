@@ -0,0 +1,242 @@
+/*
+ * hal_pi.c
+ *
+ * The real hardware: buttons, encoder and LCD through wiringPi, and the
+ * volume through the card's ALSA "PCM" mixer element.
+ *
+ * The volume code is borrowed from the MPD project.
+ * Info can be found here: http://theatticlight.net/posts/My-Embedded-Music-Player-and-Sound-Server
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+#include <alsa/asoundlib.h>
+#include <wiringPi.h>
+#include <lcd.h>
+
+#include "hal.h"
+
+static snd_mixer_t *handle = NULL;
+static snd_mixer_elem_t *elem = NULL;
+
+static int pi_setup(void)
+{
+    return wiringPiSetup();
+}
+
+static unsigned int pi_millis(void)
+{
+    return millis();
+}
+
+static void pi_delay(unsigned int ms)
+{
+    delay(ms);
+}
+
+static void pi_input(int pin)
+{
+    pinMode(pin, INPUT);
+    pullUpDnControl(pin, PUD_UP);
+}
+
+static int pi_read(int pin)
+{
+    return digitalRead(pin);
+}
+
+static int pi_watch(int pin, void (*function)(void))
+{
+    return wiringPiISR(pin, INT_EDGE_BOTH, function);
+}
+
+static void pi_priority(int pri)
+{
+    piHiPri(pri);
+}
+
+static int pi_lcd_init(int rows, int cols, int bits, int rs, int strb,
+                       int d0, int d1, int d2, int d3, int d4, int d5, int d6, int d7)
+{
+    return lcdInit(rows, cols, bits, rs, strb, d0, d1, d2, d3, d4, d5, d6, d7);
+}
+
+static void pi_lcd_clear(int fd)
+{
+    lcdClear(fd);
+}
+
+static void pi_lcd_position(int fd, int x, int y)
+{
+    lcdPosition(fd, x, y);
+}
+
+static void pi_lcd_putchar(int fd, unsigned char c)
+{
+    lcdPutchar(fd, c);
+}
+
+static void pi_lcd_puts(int fd, const char *s)
+{
+    lcdPuts(fd, s);
+}
+
+static void pi_lcd_chardef(int fd, int index, unsigned char data[8])
+{
+    lcdCharDef(fd, index, data);
+}
+
+// Open the ALSA mixer and find the PCM element
+static int pi_mixer_open(const char *card)
+{
+    snd_mixer_selem_id_t *sid;
+
+    snd_mixer_selem_id_alloca(&sid);
+    snd_mixer_selem_id_set_index(sid, 0);
+    snd_mixer_selem_id_set_name(sid, "PCM");
+    if (snd_mixer_open(&handle, 0) < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error openning mixer\n", __FILE__, __LINE__);
+        handle = NULL;
+        return -1;
+    }
+    if (snd_mixer_attach(handle, card) < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error attaching mixer\n", __FILE__, __LINE__);
+        snd_mixer_close(handle);
+        handle = NULL;
+        return -1;
+    }
+    if (snd_mixer_selem_register(handle, NULL, NULL) < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error registering mixer\n", __FILE__, __LINE__);
+        snd_mixer_close(handle);
+        handle = NULL;
+        return -1;
+    }
+    if (snd_mixer_load(handle) < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error loading mixer\n", __FILE__, __LINE__);
+        snd_mixer_close(handle);
+        handle = NULL;
+        return -1;
+    }
+    elem = snd_mixer_find_selem(handle, sid);
+    if (!elem)
+    {
+        fprintf(stderr, "[%s - %d]: Error finding simple control\n", __FILE__, __LINE__);
+        snd_mixer_close(handle);
+        handle = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static double pi_mixer_get(void)
+{
+    long max, min, value;
+    int err;
+
+    err = snd_mixer_selem_get_playback_dB_range(elem, &min, &max);
+    if (err < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error getting volume\n", __FILE__, __LINE__);
+        return 0;
+    }
+    err = snd_mixer_selem_get_playback_dB(elem, 0, &value);
+    if (err < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error getting volume\n", __FILE__, __LINE__);
+        return 0;
+    }
+    // Perceived 'loudness' does not scale linearly with the actual decible level
+    // it scales logarithmically
+    return pow(10.0, (value - max) / 6000.0);
+}
+
+// Set the volume from a floating point number 0..1
+static void pi_mixer_set(double volume)
+{
+    long min, max, value;
+    int err;
+
+    if (volume < 0.017170)
+        volume = 0.017170;
+    else if (volume > 1.0)
+        volume = 1.0;
+    err = snd_mixer_selem_get_playback_dB_range(elem, &min, &max);
+    if (err < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Error setting volume\n", __FILE__, __LINE__);
+        return;
+    }
+    // Perceived 'loudness' does not scale linearly with the actual decible level
+    // it scales logarithmically
+    value = lrint(6000.0 * log10(volume)) + max;
+    snd_mixer_selem_set_playback_dB(elem, 0, value, 0);
+}
+
+static int pi_mixer_toggle_mute(void)
+{
+    int ival;
+
+    snd_mixer_selem_get_playback_switch(elem, 0, &ival);
+    snd_mixer_selem_set_playback_switch(elem, 0, !ival);
+    // The switch is 1 when the channel is playing, so it was on and is now off
+    return (ival == 1 ? 1 : 0);
+}
+
+static void pi_mixer_close(void)
+{
+    if (handle != NULL)
+        snd_mixer_close(handle);
+    handle = NULL;
+    elem = NULL;
+}
+
+// libao and the card look after themselves
+static void pi_audio_open(void)
+{
+}
+
+static void pi_audio_played(long frames, long rate)
+{
+    (void)frames;
+    (void)rate;
+}
+
+static void pi_audio_pause(int paused)
+{
+    (void)paused;
+}
+
+static void pi_audio_close(void)
+{
+}
+
+const struct hal_ops hal_pi_ops = {
+    "pi",
+    pi_setup,
+    pi_millis,
+    pi_delay,
+    pi_input,
+    pi_read,
+    pi_watch,
+    pi_priority,
+    pi_lcd_init,
+    pi_lcd_clear,
+    pi_lcd_position,
+    pi_lcd_putchar,
+    pi_lcd_puts,
+    pi_lcd_chardef,
+    pi_mixer_open,
+    pi_mixer_get,
+    pi_mixer_set,
+    pi_mixer_toggle_mute,
+    pi_mixer_close,
+    pi_audio_open,
+    pi_audio_played,
+    pi_audio_pause,
+    pi_audio_close,
+};
@@ -0,0 +1,643 @@
+/*
+ * hal_sim.c
+ *
+ * Simulated hardware, so the whole player (UI loop included) can be run and
+ * profiled on any Linux box.
+ *
+ * The LCD is a block of characters in memory, drawn on the terminal after
+ * every change if asked to.  Pins sit at the level they were given with
+ * hal_sim_pin (buttons high, with the pull up; the board test pin low, as if
+ * the board were attached) and are changed by events from a script or a
+ * recording (recorder.c): a button press is the pin going low and back high,
+ * an encoder click four quadrature steps.  Anything watching a pin is called
+ * when it changes, as wiringPi's ISRs are.  There's no mixer, so the player
+ * uses the software volume.
+ *
+ * Time is a simulated sound card's: a thread ticks its clock a millisecond at
+ * a time, in step with the real clock, and each tick the card plays a
+ * millisecond of whatever the player has written (hal_audio_played).  The
+ * player is held up once the card has CARD_BUFFER_MS waiting, as it would be
+ * by ALSA; if the card runs out while a song is playing (not paused) that's an
+ * underrun.  hal_millis is this clock and the events are set off on the tick
+ * they're due, so a run of events lands at the same points in the songs every
+ * time it's replayed.
+ *
+ * How long the player takes to respond to an event is taken to be the time
+ * (real, not simulated) until the next change to what's on the LCD.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hal.h"
+#include "trace.h"
+#include "rtsched.h"
+
+#define SIM_PINS 64
+#define SIM_NAMES 16
+#define SIM_ROWS 4
+#define SIM_COLS 40
+// How long a button is held if the script doesn't say
+#define SIM_PRESS_MS 100
+// Between the steps of an encoder click
+#define SIM_STEP_MS 2
+// How far ahead of the card the player can get
+#define CARD_BUFFER_MS 100
+// Response times kept for the report
+#define MAX_LATENCIES 4096
+
+struct sim_name {
+    char name[16];
+    int pin_a, pin_b;   // pin_b is -1 for a button
+};
+
+struct sim_event {
+    unsigned int ms;
+    int pin;
+    int level;
+    int order;          // keeps events at the same time in the order they were added
+};
+
+// Where each encoder's pins are in their quadrature cycle, as the events are added
+struct sim_phase {
+    int pin_a, pin_b;
+    int phase;
+};
+
+static int levels[SIM_PINS];
+static void (*watchers[SIM_PINS])(void);
+static struct sim_name names[SIM_NAMES];
+static int num_names = 0;
+static struct sim_phase phases[SIM_NAMES];
+static int num_phases = 0;
+static struct sim_event *events = NULL;
+static int num_events = 0;
+static int next_event = 0;
+static pthread_mutex_t simMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The card
+static pthread_t card_thread;
+static pthread_cond_t cardCond = PTHREAD_COND_INITIALIZER;
+// Changed under simMutex, but hal_millis reads it without
+static unsigned int card_ms = 0;
+static double queued_ms = 0.0;
+// The player has one output open at a time (a crossfade hands it over to the next song)
+static int stream_open = 0;
+static int paused = 0;
+static int in_underrun = 0;
+static unsigned long underruns = 0;
+static unsigned long underrun_ms = 0;
+
+// Response times
+static double pending_since = 0.0;     // when the first event not yet responded to happened
+static double latencies[MAX_LATENCIES];
+static int num_latencies = 0;
+static unsigned long num_injected = 0;
+
+static char screen[SIM_ROWS][SIM_COLS + 1];
+static int lcd_rows = 2, lcd_cols = 16;
+static int cur_x = 0, cur_y = 0;
+static int render = 0;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int sim_millis(void)
+{
+    return __atomic_load_n(&card_ms, __ATOMIC_RELAXED);
+}
+
+static void sim_delay(unsigned int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+// Set a pin and call whatever is watching it (simMutex not held)
+static void set_pin(int pin, int level)
+{
+    void (*function)(void);
+
+    if (pin < 0 || pin >= SIM_PINS)
+        return;
+    pthread_mutex_lock(&simMutex);
+    function = (levels[pin] != level ? watchers[pin] : NULL);
+    if (levels[pin] != level)
+    {
+        num_injected++;
+        if (pending_since == 0.0)
+            pending_since = now();
+    }
+    levels[pin] = level;
+    pthread_mutex_unlock(&simMutex);
+    if (function != NULL)
+        function();
+}
+
+static void *card_loop(void *arg)
+{
+    struct timespec next;
+    struct sim_event due;
+    int have_due;
+
+    (void)arg;
+    trace_thread("sim card");
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1)
+    {
+        next.tv_nsec += 1000000;
+        if (next.tv_nsec >= 1000000000)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+            ;
+        pthread_mutex_lock(&simMutex);
+        __atomic_fetch_add(&card_ms, 1, __ATOMIC_RELAXED);
+        // Play a millisecond
+        if (stream_open && !paused)
+        {
+            if (queued_ms >= 1.0)
+            {
+                queued_ms -= 1.0;
+                in_underrun = 0;
+            }
+            else
+            {
+                queued_ms = 0.0;
+                if (!in_underrun)
+                    underruns++;
+                in_underrun = 1;
+                underrun_ms++;
+            }
+        }
+        pthread_cond_broadcast(&cardCond);
+        pthread_mutex_unlock(&simMutex);
+        // Anything due
+        do
+        {
+            pthread_mutex_lock(&simMutex);
+            have_due = (next_event < num_events && events[next_event].ms <= card_ms);
+            if (have_due)
+                due = events[next_event++];
+            pthread_mutex_unlock(&simMutex);
+            if (have_due)
+                set_pin(due.pin, due.level);
+        } while (have_due);
+    }
+    return NULL;
+}
+
+static int by_time(const void *a, const void *b)
+{
+    const struct sim_event *x = a, *y = b;
+
+    if (x->ms != y->ms)
+        return (x->ms < y->ms ? -1 : 1);
+    return x->order - y->order;
+}
+
+static int sim_setup(void)
+{
+    // The card is fed from the audio thread, at real-time priority with -rt
+    rt_mutex_inherit(&simMutex);
+    pthread_mutex_lock(&simMutex);
+    qsort(events, num_events, sizeof(*events), by_time);
+    pthread_mutex_unlock(&simMutex);
+    if (pthread_create(&card_thread, NULL, card_loop, NULL) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot start the simulated card\n", __FILE__, __LINE__);
+        return -1;
+    }
+    pthread_detach(card_thread);
+    return 0;
+}
+
+static void sim_input(int pin)
+{
+    (void)pin;
+}
+
+static int sim_read(int pin)
+{
+    int level;
+
+    if (pin < 0 || pin >= SIM_PINS)
+        return HIGH;
+    pthread_mutex_lock(&simMutex);
+    level = levels[pin];
+    pthread_mutex_unlock(&simMutex);
+    return level;
+}
+
+static int sim_watch(int pin, void (*function)(void))
+{
+    if (pin < 0 || pin >= SIM_PINS)
+        return -1;
+    pthread_mutex_lock(&simMutex);
+    watchers[pin] = function;
+    pthread_mutex_unlock(&simMutex);
+    return 0;
+}
+
+static void sim_priority(int pri)
+{
+    (void)pri;
+}
+
+// The LCD changed (simMutex held); draw it at the top of the terminal, and count it as a response
+static void changed()
+{
+    int y;
+
+    if (pending_since != 0.0)
+    {
+        if (num_latencies < MAX_LATENCIES)
+            latencies[num_latencies++] = now() - pending_since;
+        pending_since = 0.0;
+    }
+    if (!render)
+        return;
+    printf("\033[s\033[H+%.*s+\n", lcd_cols, "----------------------------------------");
+    for (y = 0; y < lcd_rows; y++)
+        printf("|%s|\n", screen[y]);
+    printf("+%.*s+\n\033[u", lcd_cols, "----------------------------------------");
+    fflush(stdout);
+}
+
+static int sim_lcd_init(int rows, int cols, int bits, int rs, int strb,
+                        int d0, int d1, int d2, int d3, int d4, int d5, int d6, int d7)
+{
+    int y;
+
+    (void)bits; (void)rs; (void)strb;
+    (void)d0; (void)d1; (void)d2; (void)d3; (void)d4; (void)d5; (void)d6; (void)d7;
+    if (rows < 1 || rows > SIM_ROWS || cols < 1 || cols > SIM_COLS)
+        return -1;
+    pthread_mutex_lock(&simMutex);
+    lcd_rows = rows;
+    lcd_cols = cols;
+    for (y = 0; y < SIM_ROWS; y++)
+    {
+        memset(screen[y], ' ', lcd_cols);
+        screen[y][lcd_cols] = '\0';
+    }
+    if (render)
+        printf("\033[2J");
+    changed();
+    pthread_mutex_unlock(&simMutex);
+    return 0;
+}
+
+static void sim_lcd_clear(int fd)
+{
+    int y, was_blank = 1;
+
+    (void)fd;
+    pthread_mutex_lock(&simMutex);
+    for (y = 0; y < lcd_rows; y++)
+    {
+        if (screen[y][strspn(screen[y], " ")] != '\0')
+            was_blank = 0;
+        memset(screen[y], ' ', lcd_cols);
+    }
+    cur_x = cur_y = 0;
+    if (!was_blank)
+        changed();
+    pthread_mutex_unlock(&simMutex);
+}
+
+static void sim_lcd_position(int fd, int x, int y)
+{
+    (void)fd;
+    if (x < 0 || x >= lcd_cols || y < 0 || y >= lcd_rows)
+        return;
+    pthread_mutex_lock(&simMutex);
+    cur_x = x;
+    cur_y = y;
+    pthread_mutex_unlock(&simMutex);
+}
+
+// One character (simMutex held); wraps onto the next row like the HD44780 driver does.  Returns 1 if it changed anything.
+static int put(unsigned char c)
+{
+    // Custom characters (the music note)
+    char shown = (c < 8 ? '*' : (c < ' ' || c > '~' ? '?' : c));
+    int differs = (screen[cur_y][cur_x] != shown);
+
+    screen[cur_y][cur_x] = shown;
+    if (++cur_x == lcd_cols)
+    {
+        cur_x = 0;
+        if (++cur_y == lcd_rows)
+            cur_y = 0;
+    }
+    return differs;
+}
+
+static void sim_lcd_putchar(int fd, unsigned char c)
+{
+    (void)fd;
+    pthread_mutex_lock(&simMutex);
+    if (put(c))
+        changed();
+    pthread_mutex_unlock(&simMutex);
+}
+
+static void sim_lcd_puts(int fd, const char *s)
+{
+    int differs = 0;
+
+    (void)fd;
+    pthread_mutex_lock(&simMutex);
+    while (*s != '\0')
+        differs |= put((unsigned char)*s++);
+    if (differs)
+        changed();
+    pthread_mutex_unlock(&simMutex);
+}
+
+static void sim_lcd_chardef(int fd, int index, unsigned char data[8])
+{
+    (void)fd; (void)index; (void)data;
+}
+
+static int sim_mixer_open(const char *card)
+{
+    (void)card;
+    return -1;
+}
+
+static double sim_mixer_get(void)
+{
+    return 0.0;
+}
+
+static void sim_mixer_set(double volume)
+{
+    (void)volume;
+}
+
+static int sim_mixer_toggle_mute(void)
+{
+    return 0;
+}
+
+static void sim_mixer_close(void)
+{
+}
+
+static void sim_audio_open(void)
+{
+    pthread_mutex_lock(&simMutex);
+    stream_open = 1;
+    pthread_mutex_unlock(&simMutex);
+}
+
+// Queue it for the card; wait while the card has a buffer's worth
+static void sim_audio_played(long frames, long rate)
+{
+    if (rate <= 0)
+        return;
+    pthread_mutex_lock(&simMutex);
+    queued_ms += frames * 1000.0 / rate;
+    while (queued_ms > CARD_BUFFER_MS && stream_open && !paused)
+        pthread_cond_wait(&cardCond, &simMutex);
+    pthread_mutex_unlock(&simMutex);
+}
+
+static void sim_audio_pause(int pause)
+{
+    pthread_mutex_lock(&simMutex);
+    paused = pause;
+    pthread_mutex_unlock(&simMutex);
+}
+
+static void sim_audio_close(void)
+{
+    pthread_mutex_lock(&simMutex);
+    // What was still in the card goes with it
+    stream_open = 0;
+    queued_ms = 0.0;
+    in_underrun = 0;
+    pthread_cond_broadcast(&cardCond);
+    pthread_mutex_unlock(&simMutex);
+}
+
+void hal_sim_pin(const char *name, int pin, int level)
+{
+    if (pin < 0 || pin >= SIM_PINS)
+        return;
+    levels[pin] = level;
+    if (num_names < SIM_NAMES)
+    {
+        snprintf(names[num_names].name, sizeof(names[num_names].name), "%s", name);
+        names[num_names].pin_a = pin;
+        names[num_names].pin_b = -1;
+        num_names++;
+    }
+}
+
+void hal_sim_encoder(const char *name, int pin_a, int pin_b)
+{
+    if (pin_a < 0 || pin_a >= SIM_PINS || pin_b < 0 || pin_b >= SIM_PINS)
+        return;
+    levels[pin_a] = levels[pin_b] = LOW;
+    if (num_names < SIM_NAMES)
+    {
+        snprintf(names[num_names].name, sizeof(names[num_names].name), "%s", name);
+        names[num_names].pin_a = pin_a;
+        names[num_names].pin_b = pin_b;
+        num_names++;
+    }
+}
+
+static struct sim_name *find_name(const char *name)
+{
+    int i;
+
+    for (i = 0; i < num_names; i++)
+    {
+        if (strcmp(names[i].name, name) == 0)
+            return &names[i];
+    }
+    return NULL;
+}
+
+void hal_sim_event(unsigned int ms, int pin, int level)
+{
+    struct sim_event *more;
+
+    pthread_mutex_lock(&simMutex);
+    more = realloc(events, (num_events + 1) * sizeof(*events));
+    if (more == NULL)
+    {
+        pthread_mutex_unlock(&simMutex);
+        perror("realloc: simulator events");
+        return;
+    }
+    events = more;
+    events[num_events].ms = ms;
+    events[num_events].pin = pin;
+    events[num_events].level = level;
+    events[num_events].order = num_events;
+    num_events++;
+    pthread_mutex_unlock(&simMutex);
+}
+
+void hal_sim_turn(unsigned int ms, int pin_a, int pin_b, long steps)
+{
+    // (A, B) around the cycle; going forward counts the encoder up
+    static const int cycle[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+    struct sim_phase *p = NULL;
+    int i;
+
+    for (i = 0; i < num_phases && p == NULL; i++)
+    {
+        if (phases[i].pin_a == pin_a && phases[i].pin_b == pin_b)
+            p = &phases[i];
+    }
+    if (p == NULL)
+    {
+        if (num_phases == SIM_NAMES)
+            return;
+        p = &phases[num_phases++];
+        p->pin_a = pin_a;
+        p->pin_b = pin_b;
+        p->phase = 0;
+    }
+    for (; steps != 0; steps += (steps > 0 ? -1 : 1), ms += SIM_STEP_MS)
+    {
+        p->phase = (p->phase + (steps > 0 ? 1 : 3)) % 4;
+        hal_sim_event(ms, pin_a, cycle[p->phase][0]);
+        hal_sim_event(ms, pin_b, cycle[p->phase][1]);
+    }
+}
+
+int hal_sim_script(const char *script)
+{
+    FILE *fp;
+    char line[256], action[16], name[16];
+    struct sim_name *n;
+    unsigned int ms;
+    int arg, fields, line_number = 0;
+
+    fp = fopen(script, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot read %s\n", __FILE__, __LINE__, script);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_number++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        fields = sscanf(line, "%u %15s %15s %d", &ms, action, name, &arg);
+        n = (fields >= 3 ? find_name(name) : NULL);
+        if (n != NULL && strcmp(action, "press") == 0)
+        {
+            hal_sim_event(ms, n->pin_a, LOW);
+            hal_sim_event(ms + (fields == 4 ? arg : SIM_PRESS_MS), n->pin_a, HIGH);
+        }
+        else if (n != NULL && strcmp(action, "turn") == 0 && fields == 4 && n->pin_b >= 0)
+            hal_sim_turn(ms, n->pin_a, n->pin_b, arg * 4L);
+        else if (n != NULL && strcmp(action, "set") == 0 && fields == 4)
+            hal_sim_event(ms, n->pin_a, arg);
+        else
+            fprintf(stderr, "[%s - %d]: %s line %d: don't understand '%s'\n", __FILE__, __LINE__, script, line_number, strtok(line, "\n"));
+    }
+    fclose(fp);
+    return 0;
+}
+
+void hal_sim_advance(unsigned int ms)
+{
+    pthread_mutex_lock(&simMutex);
+    __atomic_fetch_add(&card_ms, ms, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&simMutex);
+}
+
+void hal_sim_render(int on)
+{
+    render = on;
+}
+
+void hal_sim_screen(char *buffer, size_t size)
+{
+    size_t len = 0;
+    int y;
+
+    if (size == 0)
+        return;
+    buffer[0] = '\0';
+    pthread_mutex_lock(&simMutex);
+    for (y = 0; y < lcd_rows && len < size; y++)
+        len += snprintf(buffer + len, size - len, "%s\n", screen[y]);
+    pthread_mutex_unlock(&simMutex);
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+void hal_sim_report(FILE *fp)
+{
+    double sum = 0.0;
+    int i;
+
+    pthread_mutex_lock(&simMutex);
+    qsort(latencies, num_latencies, sizeof(double), by_value);
+    for (i = 0; i < num_latencies; i++)
+        sum += latencies[i];
+    fprintf(fp, "sim: %u ms simulated, %d of %d events played, %lu pin changes\n",
+            card_ms, next_event, num_events, num_injected);
+    if (num_latencies > 0)
+        fprintf(fp, "sim: LCD response to %d events: min %.2f ms, avg %.2f ms, 95%% %.2f ms, max %.2f ms\n",
+                num_latencies, latencies[0] * 1000, sum * 1000 / num_latencies,
+                latencies[num_latencies * 95 / 100] * 1000, latencies[num_latencies - 1] * 1000);
+    fprintf(fp, "sim: %lu underruns, %lu ms of silence\n", underruns, underrun_ms);
+    pthread_mutex_unlock(&simMutex);
+}
+
+const struct hal_ops hal_sim_ops = {
+    "sim",
+    sim_setup,
+    sim_millis,
+    sim_delay,
+    sim_input,
+    sim_read,
+    sim_watch,
+    sim_priority,
+    sim_lcd_init,
+    sim_lcd_clear,
+    sim_lcd_position,
+    sim_lcd_putchar,
+    sim_lcd_puts,
+    sim_lcd_chardef,
+    sim_mixer_open,
+    sim_mixer_get,
+    sim_mixer_set,
+    sim_mixer_toggle_mute,
+    sim_mixer_close,
+    sim_audio_open,
+    sim_audio_played,
+    sim_audio_pause,
+    sim_audio_close,
+};
@@ -68,23 +68,46 @@
 
 // For mounting
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <dirent.h> 
+#include <fcntl.h>
 
 // For subdirectory searching
 #include <limits.h>
 #include <sys/types.h>
 
-// For wiringPi
-#include <wiringPi.h>
-#include <lcd.h>
+// Buttons, LCD and mixer (wiringPi/ALSA, or simulated)
+#include "hal.h"
+#include "recorder.h"
 
 #include "lcd-mp3.h"
 
 // For rotary encoder for volume
 #include "rotaryencoder.h"
 
+// Software volume / ReplayGain / EQ
+#include "gain.h"
+#include "rgscan.h"
+#include "eq.h"
+#include "dsp.h"
+#include "crossfade.h"
+#include "decoder.h"
+#include "pool.h"
+#include "readahead.h"
+#include "allocstats.h"
+#include "metrics.h"
+#include "trace.h"
+#include "playstate.h"
+#include "rtsched.h"
+#include "output.h"
+
 #define exp10(x) (exp((x) * log(10)))
 
+// From the ChangeLog, by the Makefile
+#ifndef VERSION
+#  define VERSION "unknown"
+#endif
+
 // --------- BEGIN USER MODIFIABLE VARS ---------
 
 // GPIO pins (using wiringPi numbers)
@@ -117,6 +140,15 @@ const int D3 = 6;	// GPIO 6
 
 #define BTN_DELAY 30
 
+// Where to keep things that have to survive a restart (/MUSIC is mounted read only)
+#define CACHE_DIR "/var/lib/lcd-mp3"
+// kill -USR1 writes the timings here (make METRICS=off to leave them out)
+#define METRICS_FILE "/tmp/lcd-mp3.metrics"
+// kill -USR2 writes the last few seconds of events here (or to the -trace file)
+#define TRACE_FILE "/tmp/lcd-mp3-trace.json"
+// Underruns and the card going away, with the totals when it stops
+#define SESSION_LOG CACHE_DIR "/session.log"
+
 //#define DEBUG 0
 
 // --------- END USER MODIFIABLE VARS ---------
@@ -136,11 +168,31 @@ const int numButtons = 7;
 const int buttonPins[] = { playButtonPin, prevButtonPin, nextButtonPin, infoButtonPin, quitButtonPin, shufButtonPin, muteButtonPin };
 
 // Global variables
-static int Index = 0;
-static playlist_t Tmp_Playlist;
 static char card[64] = "hw:0";
-snd_mixer_t *handle = NULL;
-snd_mixer_elem_t *elem = NULL;
+// Software gain stage; also does the volume when there is no hardware mixer
+struct gain_stage softgain;
+// Tone correction (-eq); no bands = off
+struct eq equalizer;
+// Crossfade (-crossfade); 0 = off
+int crossfade_secs = 0;
+struct xfade incoming;
+// Playback speed (-speed, or the encoder while paused)
+double playback_speed = 1.0;
+double speed_steps[] = { 0.75, 0.9, 1.0, 1.1, 1.25, 1.5, 1.75, 2.0 };
+#define NUM_SPEED_STEPS (int)(sizeof(speed_steps) / sizeof(speed_steps[0]))
+// Encoder counts per click
+#define ENCODER_DETENT 4
+// How long info is held down for the library browser (ms)
+#define BROWSE_HOLD_MS 1000
+// -bench: play_song times its stages into this (NULL when playing normally)...
+struct bench_track *bench = NULL;
+// ...and plays into a WAV file (if set) or the null device instead of the card
+char bench_wav[MAXDATALEN] = "";
+// When next/prev/shuffle was pressed (metrics_now), until the next song gets going
+unsigned long long switch_pressed = 0;
+// What the buttons have asked play_song to do with the song that's on (PS_PLAY for nothing);
+// only the main thread uses this, play_song gets it through ps_send
+int ui_command = PS_PLAY;
 
 /*
  * System stuff
@@ -148,6 +200,7 @@ snd_mixer_elem_t *elem = NULL;
 // Error stuff
 int printErr(char *msg, char *f, int l)
 {
+    trace_mark(TR_ERROR, l, msg);
     fprintf(stderr, "[%s - %d]: %s\n", f, l, msg);
     return 0;
 }
@@ -162,90 +215,89 @@ static void die(int sig)
 {
     // Insert any GPIO cleaning here.
     // TODO maybe try to unmount the usb stick or some other clean up here... maybe?
-    lcdClear(lcdHandle);
+    hal_lcd_clear(lcdHandle);
     if (sig != 0 && sig != 2)
         (void)fprintf(stderr, "caught signal %d\n", sig);
     if (sig == 2)
     {
         (void)fprintf(stderr, "Exiting due to Ctrl + C\n");
-        if (handle != NULL)
-            snd_mixer_close(handle);
+        hal_mixer_close();
     }
     exit(1);
 }
 
-/*
-   BRAND NEW!!!
-
-   Volume control!
+double map(float x, float x0, float x1, float y0, float y1)
+{
+	float y = y0 + ((y1 - y0) * ((x - x0) / (x1 - x0)));
+    double z = (double)y;
+	return z;
+}
 
-   The following code is borrowed from the MPD project.
-   Info can be found here: http://theatticlight.net/posts/My-Embedded-Music-Player-and-Sound-Server
- */
+// Volume 0..1 from either the hardware mixer or the software gain stage
+double current_volume()
+{
+    return (hal_mixer_present() ? hal_mixer_get() : gain_get_volume(&softgain));
+}
 
-double get_normalized_volume(snd_mixer_elem_t *elem)
+// Called with the number of steps the rotary encoder moved
+void change_volume(int change)
 {
-    long max, min, value;
-    int err;
+    int chn = 0;
 
-    err = snd_mixer_selem_get_playback_dB_range(elem, &min, &max);
-    if (err < 0)
+    if (!hal_mixer_present())
     {
-        printErr("Error getting volume", __FILE__, __LINE__);
-        return 0;
+        // Same step size as the mixer loop below (it runs once per channel id)
+        gain_set_volume(&softgain, gain_get_volume(&softgain) + (change * 0.00065105 * (SND_MIXER_SCHN_LAST + 1)));
+        return;
     }
-    err = snd_mixer_selem_get_playback_dB(elem, 0, &value);
-    if (err < 0)
+    for (; chn <= SND_MIXER_SCHN_LAST; chn++)
     {
-        printErr("Error getting volume", __FILE__, __LINE__);
-        return 0;
+        double vol = hal_mixer_get();
+        hal_mixer_set(vol + (change * 0.00065105));
     }
-    // Perceived 'loudness' does not scale linearly with the actual decible level
-    // it scales logarithmically
-    return exp10((value - max) / 6000.0);
 }
 
-// Set the volume from a floating point number 0..1
-void set_normalized_volume(snd_mixer_elem_t *elem, double volume)
+// Go up or down a speed step; called with the number of encoder clicks
+void change_speed(int change)
 {
-    long min, max, value;
-    int err;
+    int i;
 
-    if (volume < 0.017170)
-        volume = 0.017170;
-    else if (volume > 1.0)
-        volume = 1.0;
-    err = snd_mixer_selem_get_playback_dB_range(elem, &min, &max);
-    if (err < 0)
-    {
-        // XXX
-        printErr("Error setting volume", __FILE__, __LINE__);
-        return;
-    }
-    // Perceived 'loudness' does not scale linearly with the actual decible level
-    // it scales logarithmically
-    value = lrint(6000.0 * log10(volume)) + max;
-    snd_mixer_selem_set_playback_dB(elem, 0, value, 0);
+    // Nearest step to where we are now (-speed can be anything in between)
+    for (i = 0; i < NUM_SPEED_STEPS - 1 && speed_steps[i] < playback_speed; i++)
+      ;
+    if (change > 0 && speed_steps[i] > playback_speed)
+      i--;
+    i += change;
+    if (i < 0)
+      i = 0;
+    else if (i >= NUM_SPEED_STEPS)
+      i = NUM_SPEED_STEPS - 1;
+    // play_song reads it every block
+    __atomic_store(&playback_speed, &speed_steps[i], __ATOMIC_RELAXED);
 }
 
-double map(float x, float x0, float x1, float y0, float y1)
+// Toggle mute; returns TRUE if we are now muted
+int toggle_mute()
 {
-	float y = y0 + ((y1 - y0) * ((x - x0) / (x1 - x0)));
-    double z = (double)y;
-	return z;
+    if (!hal_mixer_present())
+    {
+        gain_set_mute(&softgain, !gain_get_mute(&softgain));
+        return (gain_get_mute(&softgain) ? TRUE : FALSE);
+    }
+    return (hal_mixer_toggle_mute() ? TRUE : FALSE);
 }
 
-void print_vol_num(snd_mixer_elem_t *elem)
+void print_vol_num()
 {
-    int volbar_length = rint(get_normalized_volume(elem) * (double)CO-1);
+    int volbar_length = rint(current_volume() * (double)CO-1);
     int cur_vol = 0;
 
 //    printf("%d\n", volbar_length);
     cur_vol = map(volbar_length, -1, CO - 1, 0, 99);
-    lcdPosition(lcdHandle, 14, 1);
-    lcdPrintf(lcdHandle, "%2d", cur_vol);
+    hal_lcd_position(lcdHandle, 14, 1);
+    hal_lcd_printf(lcdHandle, "%2d", cur_vol);
 #if 0
-    int volbar_length = rint(get_normalized_volume(elem) * (double)CO-1);
+    int volbar_length = rint(current_volume() * (double)CO-1);
     char volbar[CO];
     int idx = 0;
 
@@ -257,15 +309,15 @@ void print_vol_num(snd_mixer_elem_t *elem)
         volbar[idx] = ' ';
     volbar[CO - 1] = '+';
     volbar[CO] = '\0';
-    lcdPosition(lcdHandle, 0, 1);
-    lcdPuts(lcdHandle, volbar);
+    hal_lcd_position(lcdHandle, 0, 1);
+    hal_lcd_puts(lcdHandle, volbar);
 #endif
 /*
     strcpy(volume_text, cur_song.SecondRow_text);
     strcpy(cur_song.SecondRow_text, volbar);
     strcpy(cur_song.prevArtist, cur_song.artist);
-    lcdPosition(lcdHandle, 0, 1);
-    lcdPuts(lcdHandle, lcd_clear);
+    hal_lcd_position(lcdHandle, 0, 1);
+    hal_lcd_puts(lcdHandle, lcd_clear);
     return printLcdSecondRow();
 */
 }
@@ -279,6 +331,13 @@ void wall(char *msg)
     system(message);
 }
 
+// A button changed (after the debounce)
+void button_changed(int pin, int level)
+{
+    rec_button(pin, level);
+    trace_mark(TR_BUTTON, pin * 2 + level, NULL);
+}
+
 // Print usage
 int usage(const char *progName)
 {
@@ -290,7 +349,44 @@ int usage(const char *progName)
       "\t-halt (part of -usb\n"
       "       allows the program to halt the system after\n"
       "       the 'quit' button was pressed.)\n"
-      "\t-shuffle (part of -usb; shuffles playlist)\n",
+      "\t-shuffle (part of -usb; shuffles playlist)\n"
+      "-order [found|artist|title|added|shuffle] (what order to play the songs in:\n"
+      "       as found, by artist/album/track, by title, newest first or shuffled;\n"
+      "       the shuffle button steps through them)\n"
+      "-softvol (use the software volume even if the card has a mixer)\n"
+      "-noscan (don't analyze untagged files for ReplayGain in the background)\n"
+      "-notags (don't read every song's tags into the library in the background)\n"
+      "-noreadahead (let mpg123 read the files itself instead of the I/O thread)\n"
+      "-mmap (map each song into memory instead of reading it; for fast local disks)\n"
+      "-rt [audio[,io]] (SCHED_FIFO priorities for play_song and the read-ahead thread;\n"
+      "       0 for normal scheduling; 70,60 if not given)\n"
+      "-cpu [audio[,io]] (CPUs to keep them on; -1 for any, which is the default)\n"
+      "-nolock (don't lock the player into memory)\n"
+      "-rtprobe (time how late a thread at the audio's priority wakes up; shown on exit\n"
+      "       and with the metrics)\n"
+      "-allocs (print how many mallocs and frees each track took; should be none\n"
+      "       once the first few have played)\n"
+      "-sim [script] (no Pi needed: simulated LCD (drawn on the terminal), buttons\n"
+      "       pressed by the script, no sound card; see hal.h for the script)\n"
+      "-record [file] (write down what's done with the buttons and knob)\n"
+      "-replay [file] (do it all again on the simulator, and say how long\n"
+      "       the LCD took to respond and how often the sound ran out)\n"
+      "-trace [file] (write what every thread was doing lately, as a Chrome trace,\n"
+      "       when the player exits; kill -USR2 writes it to " TRACE_FILE " any time)\n"
+      "-eq [bands] (equalizer; comma separated type:freq:gain[:q] where type is\n"
+      "       ls (low shelf), pk (peaking) or hs (high shelf)\n"
+      "       e.g. -eq ls:120:4,pk:2500:-3:1.4,hs:9000:2)\n"
+      "-crossfade [seconds] (fade into the next song; 1 to 10 seconds)\n"
+      "-speed [speed] (0.75 to 2.0 without changing the pitch;\n"
+      "       can also be changed with the volume knob while paused)\n"
+      "-calibrate [MP3 file] (time all of mpg123's decoders on the file and\n"
+      "       remember the fastest; otherwise done on the first run)\n"
+      "-bench [-wav file.wav] [MP3 or .m3u files] (no LCD, buttons or sound card;\n"
+      "       decode and play the songs as fast as possible into nothing, or\n"
+      "       a WAV file, and show where the time went)\n"
+      "-suite [dir] (benchmarks: scanning, tags, shuffling, skipping songs, the LCD\n"
+      "       and the button loop, on a library made up in dir (/tmp/lcd-mp3-suite); prints JSON;\n"
+      "       fails if 10000 track changes leave anything allocated)\n",
       progName);
     return EXIT_FAILURE;
 }
@@ -366,68 +462,115 @@ int checkMount()
 }
 
 /*
- * Linked list / playlist functions
+ * Playlist functions
  *
- * Possible FIXME ... maybe convert this whole program into C++ and make the following a class...?
+ * The songs' paths are kept in a path store (paths.c) and the order they're
+ * played in is an array of its file ids, so song N is order[N - 1].  It
+ * used to be a linked list with a malloc'd 256 byte path in every node, so
+ * getting song N (every track, and every next/prev) was a walk down the list
+ * and adding one was a walk to the end of it.  Each song also has an entry
+ * in the library (library.c), under the same id, for its artist, album and so on.
+ * A filter (playlist_filter) leaves just some of the songs in the order.
  */
-// TODO also, why is this even returning anything at all?
 int playlist_init(playlist_t *playlistptr)
 {
-    *playlistptr = NULL;
-    return 1; // ???? Why?
+    paths_init(&playlistptr->paths);
+    library_init(&playlistptr->lib);
+    playlistptr->order = NULL;
+    playlistptr->length = 0;
+    playlistptr->max_songs = 0;
+    playlistptr->filtered = 0;
+    memset(playlistptr->filter_by, 0, sizeof(playlistptr->filter_by));
+    bitmap_init(&playlistptr->filter);
+    bitmap_init(&playlistptr->work[0]);
+    bitmap_init(&playlistptr->work[1]);
+    return 1;
 }
 
-// again; why is this returning anything?
-int playlist_add_song(int index, void *songptr, playlist_t *playlistptr)
+// Free the list and the songs in it
+void playlist_free(playlist_t *playlistptr)
 {
-    playlist_node_t *cur, *prev, *new;
-    int found = FALSE;
+    paths_free(&playlistptr->paths);
+    library_free(&playlistptr->lib);
+    free(playlistptr->order);
+    bitmap_free(&playlistptr->filter);
+    bitmap_free(&playlistptr->work[0]);
+    bitmap_free(&playlistptr->work[1]);
+    playlist_init(playlistptr);
+}
 
-    for (cur = prev = *playlistptr; cur != NULL; prev = cur, cur = cur->nextptr)
-    {
-        if (cur->index == index)
-        {
-            free(cur->songptr);
-            cur->songptr = songptr;
-            found = TRUE;
-            break;
-        }
-        else if (cur->index > index)
-            break;
-    }
-    if (!found)
+// Number of songs actually in the list (the ones picked out, if there's a filter)
+int playlist_length(playlist_t *playlistptr)
+{
+    return playlistptr->length;
+}
+
+// Room in the order for one more song
+static int playlist_grow(playlist_t *playlistptr)
+{
+    int n = (playlistptr->max_songs > 0 ? playlistptr->max_songs * 2 : 256);
+    int *more;
+
+    if (playlistptr->paths.num_files < playlistptr->max_songs)
+        return 0;
+    more = realloc(playlistptr->order, n * sizeof(int));
+    if (more == NULL)
     {
-        new = (playlist_node_t *)malloc(sizeof(playlist_node_t));
-        new->index = index;
-        new->songptr = songptr;
-        new->nextptr = cur;
-        if (cur == *playlistptr)
-            *playlistptr = new;
-        else
-            prev->nextptr = new;
+        perror("realloc: playlist");
+        return -1;
     }
-    return 1; // WHYWYWYWYWY????
+    playlistptr->order = more;
+    playlistptr->max_songs = n;
+    return 0;
 }
 
-// Get song name from playlist with index
-int playlist_get_song(int index, void **songptr, playlist_t *playlistptr)
+// Add 'name', in the path store's directory 'dir', to the end; returns its song number or -1
+int playlist_add_file(int dir, const char *name, playlist_t *playlistptr)
 {
-    playlist_node_t *cur, *prev;
+    int id;
+
+    if (playlist_grow(playlistptr) != 0 || (id = paths_add(&playlistptr->paths, dir, name)) < 0)
+        return -1;
+    // Not played until the filter's next picked, if there is one
+    if (!playlistptr->filtered)
+        playlistptr->order[playlistptr->length++] = id;
+    // Out of memory for it; it's in the list (so the ids still line up) but stop adding
+    if (library_add(&playlistptr->lib, &playlistptr->paths, id) != 0)
+        return -1;
+    return id + 1;
+}
+
+// Add a song by its path to the end; returns its song number or -1
+int playlist_add_song(const char *path, playlist_t *playlistptr)
+{
+    int id;
+
+    if (playlist_grow(playlistptr) != 0 || (id = paths_add_path(&playlistptr->paths, path)) < 0)
+        return -1;
+    // Not played until the filter's next picked, if there is one
+    if (!playlistptr->filtered)
+        playlistptr->order[playlistptr->length++] = id;
+    // Out of memory for it; it's in the list (so the ids still line up) but stop adding
+    if (library_add(&playlistptr->lib, &playlistptr->paths, id) != 0)
+        return -1;
+    return id + 1;
+}
+
+/*
+ * Song 'index' (1 to playlist_length)'s path into buf; 0 if there's such a
+ * song and it fitted, -1 if not
+ */
+int playlist_get_song(int index, char *buf, size_t size, playlist_t *playlistptr)
+{
+    int len;
 
-    // Initialize to "not found"
-    *songptr = NULL;
-    // Look through index for our entry
-    for (cur = prev = *playlistptr; cur != NULL; prev = cur, cur = cur->nextptr)
+    if (index < 1 || index > playlist_length(playlistptr))
     {
-        if (cur->index == index)
-        {
-            *songptr = cur->songptr;
-            break;
-        }
-        else if (cur->index > index)
-            break;
+        buf[0] = '\0';
+        return -1;
     }
-    return 1; // WHY ARE YOU RETURNING ANYTHING?
+    len = paths_get(&playlistptr->paths, playlistptr->order[index - 1], buf, size);
+    return (len >= 0 && (size_t)len < size ? 0 : -1);
 }
 
 /*
@@ -436,14 +579,18 @@ int playlist_get_song(int index, void **songptr, playlist_t *playlistptr)
 
 // NOTE: Brand new! Now we read in sub directories!!
 
-// Recursive function to enter sub directories
-void list_dir(const char *dir_name)
+/*
+ * Recursive function to enter sub directories.  'fd' is open on the directory
+ * 'dir_name', which is 'dir' in the playlist's path store; each level is
+ * opened relative to the one above it, so there's no limit (PATH_MAX or
+ * otherwise) on how long the whole path gets.
+ */
+void list_dir(int fd, const char *dir_name, int dir, playlist_t *playlistptr)
 {
     DIR *d;
-    char *basec, *bname;
-    char *string;
+    int sub_fd, sub;
 
-    d = opendir(dir_name);
+    d = fdopendir(fd);
     if (!d)
     {
         fprintf(stderr, "[%s - %d]: Cannot open directory '%s': %s\n", __FILE__, __LINE__, dir_name, strerror(errno));
@@ -451,47 +598,37 @@ void list_dir(const char *dir_name)
     }
     while (1)
     {
-        struct dirent *dir;
+        struct dirent *entry;
         const char *d_name;
 
-        dir = readdir(d);
+        entry = readdir(d);
         // There are no more entries in this directory, so break out of the while loop.
-        if (!dir)
+        if (!entry)
             break;
-        d_name = dir->d_name;
-        // 8 = normal file; non-directory
-        if (dir->d_type == 8)
+        d_name = entry->d_name;
+        // 8 = normal file; non-directory.  Make sure we only add mp3 files
+        if (entry->d_type == 8 && strcasecmp(get_filename_ext(d_name), "mp3") == 0)
         {
-            string = malloc(MAXDATALEN);
-            if (string == NULL)
-                perror("malloc: reReadPlaylist");
-            strcpy(string, dir_name);
-            strcat(string, "/");
-            strcat(string, d_name);
-            // Get just the filename, strip the path info
-            basec = strdup(string);
-            bname = basename(basec);
-            // Make sure we only add mp3 files
-            if (strcasecmp(get_filename_ext(bname), "mp3") == 0)
-                playlist_add_song(Index++, string, &Tmp_Playlist); // FIXME I REALLY hate having to use global variables...
+            if (playlist_add_file(dir, d_name, playlistptr) < 0)
+                break;
         }
-        if (dir->d_type & DT_DIR)
+        // Check that the directory is not "d" or d's parent.
+        else if (entry->d_type == DT_DIR && strcmp(d_name, "..") != 0 && strcmp(d_name, ".") != 0)
         {
-            // Check that the directory is not "d" or d's parent.
-            if (strcmp(d_name, "..") != 0 && strcmp(d_name, ".") != 0)
+            sub_fd = openat(dirfd(d), d_name, O_RDONLY | O_DIRECTORY);
+            if (sub_fd < 0)
             {
-                int path_length;
-                char path[PATH_MAX];
-
-                path_length = snprintf(path, PATH_MAX, "%s/%s", dir_name, d_name);
-                if (path_length >= PATH_MAX)
-                {
-                    fprintf(stderr, "[%s - %d]: Path length has become too long.\n", __FILE__, __LINE__);
-                    exit(EXIT_FAILURE);
-                }
-                list_dir(path); // Recursively call "list_dir" with the new path.
+                fprintf(stderr, "[%s - %d]: Cannot open directory '%s': %s\n", __FILE__, __LINE__, d_name, strerror(errno));
+                exit(EXIT_FAILURE);
             }
-        } // end if dir
+            sub = paths_dir(&playlistptr->paths, dir, d_name);
+            if (sub < 0)
+            {
+                close(sub_fd);
+                break;
+            }
+            list_dir(sub_fd, d_name, sub, playlistptr); // Recursively call "list_dir" with the new directory.
+        }
     } // end while
     if (closedir(d))
     {
@@ -500,22 +637,22 @@ void list_dir(const char *dir_name)
     }
 }
 
-// Create the playlist; NOTE Now we read in sub directories...
-// Tmp_Playlist and Index are global vars...
-playlist_t reReadPlaylist(char *dir_name)
+// Create the playlist (replacing whatever was in it); NOTE Now we read in sub directories...
+void reReadPlaylist(char *dir_name, playlist_t *playlistptr)
 {
-    playlist_t new_playlist;
+    int fd;
 
-    playlist_init(&new_playlist);
-    playlist_init(&Tmp_Playlist);
-    Index = 0;
-    list_dir(dir_name);
-    new_playlist = Tmp_Playlist;
-    playlist_init(&Tmp_Playlist);
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    num_songs = Index - 1;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
-    return new_playlist;
+    playlist_free(playlistptr);
+    fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot open directory '%s': %s\n", __FILE__, __LINE__, dir_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // The top directory is kept the way it was given
+    list_dir(fd, dir_name, paths_dir(&playlistptr->paths, -1, dir_name), playlistptr);
+    // Only the main thread uses num_songs
+    num_songs = playlist_length(playlistptr);
 }
 
 // If USB has been mounted, load in songs.
@@ -558,124 +695,293 @@ playlist_t reReadPlaylist(char *dir_name)
         }
     }
     closedir(d);
-    pthread_mutex_lock(&cur_song.pauseMutex);
     num_songs = index - 1;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
     return new_playlist;
 }
 #endif
 
-// Convert linked list into array so it can be shuffled
-void ll2array(playlist_t *playlistptr, char **arr)
+// Shuffle / randomize playlist (just the order; the paths stay where they are, and nothing's allocated)
+void randomize(playlist_t *playlistptr)
 {
-    int i;
-    playlist_node_t *cur;
+    int *order = playlistptr->order;
+    int i, j, t;
 
-    for (i = 0, cur = *playlistptr; cur != NULL; i++, cur = cur->nextptr)
+    srand((unsigned)time(NULL));
+    for (i = playlist_length(playlistptr) - 1; i > 0; i--)
     {
-        if (cur->songptr != NULL)
-            arr[i] = cur->songptr;
+        j = rand() / (RAND_MAX / (i + 1) + 1);
+        t = order[j];
+        order[j] = order[i];
+        order[i] = t;
     }
 }
 
-// Shuffle / randomize playlist
-playlist_t randomize(playlist_t cur_playlist)
+// What the LCD says when the order changes, and what -order takes
+static const char *order_names[ORDERS] = { "Folders", "By artist", "By title", "Newest first", "Shuffled" };
+static const char *order_args[ORDERS] = { "found", "artist", "title", "added", "shuffle" };
+
+/*
+ * Play the songs in 'order' from now on.  The library keeps its views
+ * sorted as the tags come in, so this is just a copy of one (or a shuffle),
+ * and the copy stays put while the views go on changing.  With a filter
+ * it's only the songs in it: a few are sorted by themselves, and more than
+ * that are picked out of the view as it's copied.  0, or -1 if the view
+ * couldn't be made (the order's left as it was)
+ */
+int playlist_order(int order, playlist_t *playlistptr)
 {
-    char *tmp[MAXDATALEN];
-    char *string;
-    playlist_t new_playlist;
-    int index = 0;
+    static const int views[ORDERS] = { -1, VIEW_ARTIST, VIEW_TITLE, VIEW_ADDED, -1 };
+    const int *ids;
+    int n = playlistptr->paths.num_files, count, i;
 
-    ll2array(&cur_playlist, tmp);
-    srand((unsigned)time(NULL));
-    if (num_songs > 1)
+    if (views[order] >= 0)
     {
-        size_t i;
-        for (i = 0; i < num_songs - 1; i++)
+        // A few songs are quicker sorted by themselves than picked out of the whole view
+        if (playlistptr->filtered && bitmap_count(&playlistptr->filter) < n / 32)
         {
-            if (strlen(tmp[i]) > 3)
+            n = bitmap_ids(&playlistptr->filter, playlistptr->order, playlistptr->max_songs);
+            view_sort(playlistptr->order, n, views[order], &playlistptr->lib);
+        }
+        else
+        {
+            count = library_order(&playlistptr->lib, views[order], &ids);
+            // Out of memory, or there are songs the library couldn't take
+            if (count < 0 || (!playlistptr->filtered && count != n))
+                return -1;
+            if (!playlistptr->filtered)
+                memcpy(playlistptr->order, ids, n * sizeof(int));
+            else
             {
-                size_t j = i + rand() / (RAND_MAX / (num_songs - i) + 1);
-                char *t = tmp[j];
-                tmp[j] = tmp[i];
-                tmp[i] = t;
+                // Looked up once for every song in the view, so as bits rather than searched for
+                if (bitmap_copy_bits(&playlistptr->work[0], &playlistptr->filter) != 0)
+                    return -1;
+                for (i = n = 0; i < count; i++)
+                {
+                    if (bitmap_contains(&playlistptr->work[0], ids[i]))
+                        playlistptr->order[n++] = ids[i];
+                }
             }
         }
+        playlistptr->length = n;
+        return 0;
     }
-    // Convert array back into linked list.
-    playlist_init(&new_playlist);
-    index = 0;
-    while (index < num_songs)
+    if (playlistptr->filtered)
+        n = bitmap_ids(&playlistptr->filter, playlistptr->order, playlistptr->max_songs);
+    else
     {
-        string = malloc(MAXDATALEN);
-        if (string == NULL)
-            perror("malloc: shuffle");
-        strcpy(string, tmp[index]);
-        playlist_add_song(index, string, &new_playlist);
-        index++;
+        for (i = 0; i < n; i++)
+            playlistptr->order[i] = i;
+    }
+    playlistptr->length = n;
+    if (order == ORDER_SHUFFLE)
+        randomize(playlistptr);
+    return 0;
+}
+
+/*
+ * Play only the songs by artist by[LIB_ARTIST], on album by[LIB_ALBUM] and
+ * in genre by[LIB_GENRE] (library ids; 0 for any, and all 0 for every
+ * song), in 'order'.  The library keeps a bitmap of each one's songs, so
+ * this is a copy of one, or an "and" of two or three, into bitmaps that are
+ * kept from last time.  0, or -1 if no songs are all of them, or it's out of
+ * memory (the playlist's left as it was)
+ */
+int playlist_filter(int order, const uint32_t by[LIB_FIELDS], playlist_t *playlistptr)
+{
+    const struct bitmap *terms[LIB_FIELDS], *songs;
+    struct bitmap *out, swap;
+    int f, n = 0;
+
+    for (f = 0; f < LIB_FIELDS; f++)
+    {
+        if (by[f] != 0)
+            terms[n++] = library_songs(&playlistptr->lib, f, by[f]);
+    }
+    if (n > 0)
+    {
+        out = &playlistptr->work[0];
+        if ((n == 1 ? bitmap_copy(out, terms[0]) : bitmap_and(out, terms[0], terms[1])) != 0)
+            return -1;
+        for (f = 2; f < n; f++)
+        {
+            songs = out;
+            out = &playlistptr->work[(f - 1) & 1];
+            if (bitmap_and(out, songs, terms[f]) != 0)
+                return -1;
+        }
+        if (bitmap_count(out) == 0)
+            return -1;
+        swap = playlistptr->filter;
+        playlistptr->filter = *out;
+        *out = swap;
+    }
+    playlistptr->filtered = (n > 0);
+    memcpy(playlistptr->filter_by, by, sizeof(playlistptr->filter_by));
+    // The view couldn't be made; they're still the right songs, just as they were found
+    if (playlist_order(order, playlistptr) != 0)
+        playlist_order(ORDER_FOUND, playlistptr);
+    return 0;
+}
+
+/*
+ * The filter menu (info while paused): every song, just the playing song's
+ * artist or album, or one of the genres (FILTER_GENRES + the genre's id - 1)
+ */
+enum { FILTER_ALL, FILTER_ARTIST, FILTER_ALBUM, FILTER_GENRES };
+
+static int filter_choices(playlist_t *playlistptr)
+{
+    return FILTER_GENRES + playlistptr->lib.genres.count;
+}
+
+static const char *filter_name(int choice, playlist_t *playlistptr)
+{
+    static const char *names[FILTER_GENRES] = { "All songs", "This artist", "This album" };
+
+    if (choice < FILTER_GENRES)
+        return names[choice];
+    return library_string(&playlistptr->lib.genres, choice - FILTER_GENRES + 1);
+}
+
+/*
+ * Play the songs for menu entry 'choice' ('song' is the file id of the one
+ * that was playing).  An artist or album goes with the genre picked before,
+ * and a genre with the artist or album, so they narrow each other down.  0,
+ * or -1 if there are no such songs (or what they'd be by isn't known)
+ */
+static int filter_pick(int choice, int song, int order, playlist_t *playlistptr)
+{
+    uint32_t by[LIB_FIELDS];
+    int field = (choice == FILTER_ARTIST ? LIB_ARTIST : LIB_ALBUM);
+
+    memcpy(by, playlistptr->filter_by, sizeof(by));
+    if (choice == FILTER_ALL)
+        memset(by, 0, sizeof(by));
+    else if (choice == FILTER_ARTIST || choice == FILTER_ALBUM)
+    {
+        if (song < 0 || song >= playlistptr->lib.num_tracks)
+            return -1;
+        by[LIB_ARTIST] = by[LIB_ALBUM] = 0;
+        by[field] = (field == LIB_ARTIST ? playlistptr->lib.artist[song] : playlistptr->lib.album[song]);
+        if (by[field] == 0)
+            return -1;
+    }
+    else
+        by[LIB_GENRE] = choice - FILTER_GENRES + 1;
+    return playlist_filter(order, by, playlistptr);
+}
+
+/*
+ * Play the album that song 'id' (picked in the browser) is on, in track
+ * order; returns the song's number in it, or -1 if it can't
+ */
+static int browse_play(int id, playlist_t *playlistptr)
+{
+    uint32_t by[LIB_FIELDS] = { 0 };
+    int i;
+
+    // Not knowing the album it's every song, by artist, which still has this one in it
+    by[LIB_ALBUM] = playlistptr->lib.album[id];
+    if (playlist_filter(ORDER_ARTIST, by, playlistptr) != 0)
+        return -1;
+    for (i = 0; i < playlistptr->length; i++)
+    {
+        if (playlistptr->order[i] == id)
+            return i + 1;
+    }
+    return -1;
+}
+
+// The browser's rows, all the way across so there's nothing left of what was there
+static void browse_show(const struct browse *b, const struct library *lib)
+{
+    char row[MAXDATALEN], line[MAXDATALEN];
+    int i;
+
+    for (i = 0; i < BROWSE_ROWS; i++)
+    {
+        browse_row(b, lib, i, row, sizeof(row));
+        snprintf(line, sizeof(line), "%-*.*s", CO, CO, row);
+        hal_lcd_position(lcdHandle, 0, i);
+        hal_lcd_puts(lcdHandle, line);
     }
-    return new_playlist;
 }
 
 /*
  * Threading functions
  *
- * Functions for when buttons are pressed
+ * Functions for when buttons are pressed; they go to play_song through
+ * playstate.c (ps_send / ps_pause), and it tells us how it's doing with
+ * ps_publish
  */
+void sendCommand(int command)
+{
+    ui_command = command;
+    ps_send(command);
+}
+
 void nextSong()
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    cur_song.play_status = NEXT;
-    cur_song.song_over = TRUE;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    trace_mark(TR_SKIP, NEXT, "next");
+    __atomic_store_n(&switch_pressed, metrics_now(), __ATOMIC_RELAXED);
+    sendCommand(PS_NEXT);
 }
 
 void prevSong()
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    cur_song.play_status = PREV;
-    cur_song.song_over = TRUE;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    trace_mark(TR_SKIP, PREV, "prev");
+    __atomic_store_n(&switch_pressed, metrics_now(), __ATOMIC_RELAXED);
+    sendCommand(PS_PREV);
 }
 
 void shuffleMe()
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    cur_song.play_status = SHUFFLE;
-    cur_song.song_over = TRUE;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    trace_mark(TR_SKIP, SHUFFLE, "shuffle");
+    __atomic_store_n(&switch_pressed, metrics_now(), __ATOMIC_RELAXED);
+    sendCommand(PS_SHUFFLE);
 }
 
 void quitMe()
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    cur_song.play_status = QUIT;
-    cur_song.song_over = TRUE;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    sendCommand(PS_QUIT);
 }
 
 void pauseMe()
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    cur_song.play_status = PAUSE;
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    ps_pause(TRUE);
+    // Let the ReplayGain analyzer have more of the CPU while we're paused
+    rgscan_set_idle(TRUE);
 }
 
 
 void playMe()
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    cur_song.play_status = PLAY;
-    pthread_cond_broadcast(&cur_song.m_resumeCond);
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    ps_pause(FALSE);
+    rgscan_set_idle(FALSE);
+}
+
+// play_song: sit out a pause (letting the UI know it is)
+void checkPause(struct play_state *state)
+{
+    if (ps_paused())
+    {
+      state->paused = TRUE;
+      ps_publish(state);
+      hal_audio_pause(TRUE);
+      ps_wait_resume();
+      hal_audio_pause(FALSE);
+      // The card's been quiet on purpose
+      out_resync();
+      state->paused = FALSE;
+      ps_publish(state);
+    }
 }
 
-void checkPause()
+// The main loop: is the song still going (and nothing pressed to stop it)?
+int songGoing(struct play_state *state)
 {
-    pthread_mutex_lock(&cur_song.pauseMutex);
-    while (cur_song.play_status == PAUSE)
-      pthread_cond_wait(&cur_song.m_resumeCond, &cur_song.pauseMutex);
-    pthread_mutex_unlock(&cur_song.pauseMutex);
+    ps_read(state);
+    return (state->song_over == FALSE && ui_command == PS_PLAY);
 }
 
 /*
@@ -737,29 +1043,49 @@ void make_id(mpg123_string *inlines, int type)
     }
 }
 
+// cur_song's file names for 'filename' (no tags yet); 'next_filename' can be NULL
+void set_song(const char *filename, const char *next_filename)
+{
+    char base[PATH_MAX];
+
+    snprintf(cur_song.filename, sizeof(cur_song.filename), "%s", filename);
+    snprintf(base, sizeof(base), "%s", filename);
+    snprintf(cur_song.base_filename, sizeof(cur_song.base_filename), "%s", basename(base));
+    snprintf(cur_song.next_filename, sizeof(cur_song.next_filename), "%s", (next_filename != NULL ? next_filename : ""));
+}
+
 int id3_tagger()
 {
     int meta;
     mpg123_handle* m;
     mpg123_id3v1 *v1;
     mpg123_id3v2 *v2;
+    int rg_found = FALSE;
+    unsigned long long start = trace_now();
 
     // ID3 tag info for the song
-    mpg123_init();
-    m = mpg123_new(NULL, NULL);
+    m = pool_get(NULL, NULL);
+    if (m == NULL)
+        return 1;
     if (mpg123_open(m, cur_song.filename) != MPG123_OK)
     {
         fprintf(stderr, "[%s - %d]: Cannot open %s: %s\n", __FILE__, __LINE__, cur_song.filename, mpg123_strerror(m));
+        pool_put(m);
+        trace_mark(TR_ERROR, __LINE__, "id3_tagger: cannot open the song");
         return 1;
     }
     mpg123_scan(m);
     meta = mpg123_meta_check(m);
-    if (meta & MPG123_ID3 && mpg123_id3(m, &v1, &v2) == MPG123_OK)
+    cur_song.rg_gain = 0.0;
+    cur_song.rg_peak = 0.0;
+    // (a file with only an ID3v1 tag has no v2)
+    if (meta & MPG123_ID3 && mpg123_id3(m, &v1, &v2) == MPG123_OK && v2 != NULL)
     {
         make_id(v2->title, TITLE);
         make_id(v2->artist, ARTIST);
         make_id(v2->album, ALBUM);
         make_id(v2->genre, GENRE);
+        rg_found = rgscan_from_id3(v2, &cur_song.rg_gain, &cur_song.rg_peak);
     }
     else
     {
@@ -769,6 +1095,9 @@ int id3_tagger()
         sprintf(cur_song.album,  "UNKNOWN");
         sprintf(cur_song.genre,  "UNKNOWN");
     }
+    // No ReplayGain tags; see if the background analyzer has been through it yet
+    if (rg_found == FALSE)
+        rgscan_lookup(cur_song.filename, &cur_song.rg_gain, &cur_song.rg_peak);
     // If there is no title to be found, set title to the song file name.
     if (strlen(cur_song.title) == 0)
       strcpy(cur_song.title, cur_song.base_filename);
@@ -779,12 +1108,11 @@ int id3_tagger()
     // Set the second row to be the artist by default.
     strcpy(cur_song.FirstRow_text, cur_song.title);
     strcpy(cur_song.SecondRow_text, cur_song.artist);
-    mpg123_close(m);
-    mpg123_delete(m);
-    mpg123_exit();
+    pool_put(m);
     // The following two lines are just to see when the scrolling should pause
     strncpy(cur_song.scroll_FirstRow, cur_song.FirstRow_text, 15);
     strncpy(cur_song.scroll_SecondRow, cur_song.SecondRow_text, 16);
+    trace_span(TR_TAGS, start, 0);
     return 0;
 }
 
@@ -800,8 +1128,8 @@ int printLcdFirstRow()
     // Do I even use this?
     if (strcmp(cur_song.FirstRow_text, " QUIT - Shutdown") == 0)
     {
-      lcdPosition(lcdHandle, 0, 0);
-      lcdPuts(lcdHandle, cur_song.FirstRow_text);
+      hal_lcd_position(lcdHandle, 0, 0);
+      hal_lcd_puts(lcdHandle, cur_song.FirstRow_text);
       flag = FALSE;
     }
     else
@@ -812,11 +1140,11 @@ int printLcdFirstRow()
         // New song; set the previous title
         if (strcmp(cur_song.title, cur_song.prevTitle) != 0)
           strcpy(cur_song.prevTitle, cur_song.title);
-        lcdCharDef(lcdHandle, 2, musicNote);
-        lcdPosition(lcdHandle, 0, 0);
-        lcdPutchar(lcdHandle, 2);
-        lcdPosition(lcdHandle, 1, 0);
-        lcdPuts(lcdHandle, cur_song.FirstRow_text);
+        hal_lcd_chardef(lcdHandle, 2, musicNote);
+        hal_lcd_position(lcdHandle, 0, 0);
+        hal_lcd_putchar(lcdHandle, 2);
+        hal_lcd_position(lcdHandle, 1, 0);
+        hal_lcd_puts(lcdHandle, cur_song.FirstRow_text);
         flag = FALSE;
       }
     }
@@ -830,8 +1158,8 @@ int printLcdSecondRow()
 
     if (strlen(cur_song.SecondRow_text) < 15)
     {
-      lcdPosition(lcdHandle, 0, 1);
-      lcdPuts(lcdHandle, cur_song.SecondRow_text);
+      hal_lcd_position(lcdHandle, 0, 1);
+      hal_lcd_puts(lcdHandle, cur_song.SecondRow_text);
       flag = FALSE;
       // New song; set the previous artist
       if (strcmp(cur_song.artist, cur_song.prevArtist) != 0)
@@ -859,16 +1187,16 @@ void scroll_Message_FirstRow(int *pause_Scroll_FirstRow_Flag)
     strncat(my_songname, cur_song.title, strlen(cur_song.title));
     strcat(my_songname, spaces);
     my_songname[strlen(my_songname) + 1] = 0;
-    if (millis() < timer)
+    if (hal_millis() < timer)
       return;
-    timer = millis() + 200;
+    timer = hal_millis() + 200;
     strncpy(buf, &my_songname[position], width);
     buf[width] = 0;
-    lcdCharDef(lcdHandle, 2, musicNote);
-    lcdPosition(lcdHandle, 0, 0);
-    lcdPutchar(lcdHandle, 2);
-    lcdPosition(lcdHandle, 1, 0);
-    lcdPuts(lcdHandle, buf);
+    hal_lcd_chardef(lcdHandle, 2, musicNote);
+    hal_lcd_position(lcdHandle, 0, 0);
+    hal_lcd_putchar(lcdHandle, 2);
+    hal_lcd_position(lcdHandle, 1, 0);
+    hal_lcd_puts(lcdHandle, buf);
     position++;
     if (position == (strlen(my_songname) - width))
       position = 0;
@@ -896,13 +1224,13 @@ void scroll_Message_SecondRow(int *pause_Scroll_SecondRow_Flag)
     strncat(my_string, cur_song.SecondRow_text, strlen(cur_song.SecondRow_text));
     strcat(my_string, spaces);
     my_string[strlen(my_string) + 1] = 0;
-    if (millis() < timer)
+    if (hal_millis() < timer)
       return;
-    timer = millis() + 200;
+    timer = hal_millis() + 200;
     strncpy(buf, &my_string[position], width);
     buf[width] = 0;
-    lcdPosition(lcdHandle, 0, 1);
-    lcdPuts(lcdHandle, buf);
+    hal_lcd_position(lcdHandle, 0, 1);
+    hal_lcd_puts(lcdHandle, buf);
     position++;
     if (position == (strlen(my_string) - width))
       position = 0;
@@ -910,91 +1238,1209 @@ void scroll_Message_SecondRow(int *pause_Scroll_SecondRow_Flag)
     *pause_Scroll_SecondRow_Flag = (strcmp(buf, cur_song.scroll_SecondRow) == 0 ? TRUE : FALSE);
 }
 
+/*
+  Pin down what mpg123 gives us: always stereo (mono is just copied to both
+  channels, so that's still bit exact) and always the same encoding, so the
+  only thing that can change in the middle of a file is the rate.  Float if
+  the EQ is on (saves converting), as long as the library can do it.
+*/
+// Every rate, stereo, in one encoding; -1 if the library can't do that encoding
+int pin_output_format(mpg123_handle *mh, int encoding)
+{
+    const long *rates;
+    size_t num_rates, i;
+
+    mpg123_rates(&rates, &num_rates);
+    mpg123_format_none(mh);
+    for (i = 0; i < num_rates; i++)
+    {
+        if (mpg123_format(mh, rates[i], MPG123_STEREO, encoding) != MPG123_OK)
+            return -1;
+    }
+    return 0;
+}
+
+// Returns 0, or -1 if mpg123 won't even do 16 bit
+int set_output_format(mpg123_handle *mh, int want_float)
+{
+    if (want_float == TRUE && pin_output_format(mh, MPG123_ENC_FLOAT_32) == 0)
+        return 0;
+    // Library was built without float output
+    return pin_output_format(mh, MPG123_ENC_SIGNED_16);
+}
+
+// What the sound card can do (from probe_rates); none means we don't know
+long device_rates[16];
+int num_device_rates = 0;
+
+/*
+  Ask the card which of mpg123's rates it can run at natively.  Has to be the
+  hw device; "default" goes through plug and says yes to everything.
+*/
+void probe_rates()
+{
+    snd_pcm_t *pcm;
+    snd_pcm_hw_params_t *params;
+    const long *rates;
+    size_t num_rates, i;
+
+    if (snd_pcm_open(&pcm, card, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0)
+    {
+      printErr("Cannot open the sound card to ask about rates; leaving it to ALSA", __FILE__, __LINE__);
+      return;
+    }
+    if (snd_pcm_hw_params_malloc(&params) == 0)
+    {
+      if (snd_pcm_hw_params_any(pcm, params) >= 0)
+      {
+        mpg123_rates(&rates, &num_rates);
+        for (i = 0; i < num_rates && num_device_rates < (int)(sizeof(device_rates) / sizeof(device_rates[0])); i++)
+        {
+          if (snd_pcm_hw_params_test_rate(pcm, params, rates[i], 0) == 0)
+            device_rates[num_device_rates++] = rates[i];
+        }
+      }
+      snd_pcm_hw_params_free(params);
+    }
+    snd_pcm_close(pcm);
+}
+
+// Rate to open the card at for a song at 'rate'; dsp.c converts if they differ
+long output_rate(long rate)
+{
+    long best = 0;
+    int i;
+
+    if (num_device_rates == 0)
+      return rate;
+    for (i = 0; i < num_device_rates; i++)
+    {
+      if (device_rates[i] == rate)
+        return rate;
+    }
+    // The closest rate above it (so nothing gets thrown away)...
+    for (i = 0; i < num_device_rates; i++)
+    {
+      if (device_rates[i] > rate && (best == 0 || device_rates[i] < best))
+        best = device_rates[i];
+    }
+    if (best != 0)
+      return best;
+    // ...or failing that the highest
+    for (i = 0; i < num_device_rates; i++)
+    {
+      if (device_rates[i] > best)
+        best = device_rates[i];
+    }
+    return best;
+}
+
+double wall_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add the time since 'since' to a -bench stage; returns now
+double bench_stage(double *stage, double since)
+{
+    double t = wall_now();
+
+    *stage += t - since;
+    return t;
+}
+
+// -bench and -sim output: libao's null device, or its WAV writer (-bench -wav)
+ao_device *bench_output(ao_sample_format *format)
+{
+    ao_device *dev;
+
+    if (bench_wav[0] != '\0')
+    {
+      dev = ao_open_file(ao_driver_id("wav"), bench_wav, TRUE, format, NULL);
+      if (dev != NULL)
+        return dev;
+      fprintf(stderr, "[%s - %d]: Cannot write %s; using the null device\n", __FILE__, __LINE__, bench_wav);
+    }
+    return ao_open_live(ao_driver_id("null"), format, NULL);
+}
+
+// The end of one of play_song's stages, for the metrics and the trace; returns now
+unsigned long long stage_done(int metric, int kind, unsigned long long start)
+{
+    unsigned long long t = trace_now();
+
+    metrics_record(metric, t - start);
+    trace_span_at(kind, start, t, 0);
+    return t;
+}
+
 // The actual thing that plays the song
 void play_song(void *arguments)
 {
     struct song_info *args = (struct song_info *)arguments;
     mpg123_handle *mh;
-    mpg123_pars *mpar;
     unsigned char *buffer;
+    unsigned char *out;
     size_t buffer_size;
     size_t done;
+    size_t out_size;
     int err;
+    struct dsp_chain dsp;
 
     int driver;
-    ao_device *dev;
+    // What out_play reopens if the card fails (-1: the -bench/-sim output, which isn't)
+    int live_driver = -1;
+    ao_device *dev = NULL;
     ao_sample_format format;
     int channels, encoding;
     long rate;
-
-    ao_initialize();
+    off_t length;
+    double stamp = 0.0;
+    unsigned long long song_start, mark, pressed;
+    int first_block = TRUE;
+    struct play_state state;
+    int command = PS_PLAY;
+    long frames;
+    double speed;
+
+    song_start = trace_now();
+    trace_thread("play_song");
+    // Its own thread when playing for real (SCHED_FIFO; -bench and -suite run it as they are)
+    if (bench == NULL)
+      rt_thread(RT_AUDIO);
+    // Started off by ps_start; from here on only we change it
+    ps_read(&state);
     driver = ao_default_driver_id();
-    mpg123_init();
-    // Try to not show error messages
-    mh = mpg123_new(NULL, &err);
-    mpar = mpg123_new_pars(&err);
-    mpg123_par(mpar, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
-    mh = mpg123_parnew(mpar, NULL, &err);
-    buffer_size = mpg123_outblock(mh);
-    buffer = (unsigned char*) malloc(buffer_size * sizeof(unsigned char));
-    // Open the file and get the decoding format
-    mpg123_open(mh, args->filename);
-    mpg123_getformat(mh, &rate, &channels, &encoding);
-    // Set the output format and open the output device
-    format.bits = mpg123_encsize(encoding) * 8;
-    format.rate = rate;
-    format.channels = channels;
-    format.byte_format = AO_FMT_NATIVE;
-    format.matrix = 0;
-    dev = ao_open_live(driver, &format, NULL);
-    // Decode and play
-    while (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
+    // If we crossfaded into this song, the decoder (and the output) is already going
+    if (xfade_adopt(&incoming, args->filename, &mh, &buffer, &buffer_size, &dsp))
     {
-      checkPause();
-      ao_play(dev, (char *) buffer, done);
-      // Stop playing if the user pressed quit, shuffle, next, or prev buttons
-      if (cur_song.play_status == QUIT || cur_song.play_status == NEXT || cur_song.play_status == PREV || cur_song.play_status == SHUFFLE)
-        break;
+      rate = dsp.rate;
+      channels = dsp.channels;
+      encoding = dsp.in_encoding;
+      format = incoming.format;
+      dev = incoming.dev;
+      incoming.dev = NULL;
+      if (bench == NULL && !hal_simulated())
+        live_driver = driver;
+      // Normally already done (the rate stage came over with the device)
+      dsp_set_out_rate(&dsp, format.rate);
     }
-    // Clean up
-    free(buffer);
-    ao_close(dev);
-    mpg123_close(mh);
-    mpg123_delete(mh);
-    mpg123_exit();
-    ao_shutdown();
-    pthread_mutex_lock(&(cur_song.writeMutex));
-    args->song_over = TRUE;
-    // Only set the status to play if the song finished normally
-    if (cur_song.play_status != QUIT && cur_song.play_status != SHUFFLE && cur_song.play_status != NEXT && cur_song.play_status != PREV)
-      args->play_status = PLAY;
-    cur_status.song_over = TRUE; // FIXME only time cur_status is used?! Might just delete the entire struct...
-    pthread_mutex_unlock(&(cur_song.writeMutex));
-}
+    else
+    {
+      // Decoder and its buffer come from the pool (and go back to it at the end)
+      mh = pool_get(&buffer, &buffer_size);
+      if (mh == NULL)
+      {
+        state.song_over = TRUE;
+        state.ended_by = command;
+        ps_publish(&state);
+        if (bench == NULL)
+          rt_thread_done(RT_AUDIO);
+        return;
+      }
+      if (set_output_format(mh, (equalizer.num_bands > 0 ? TRUE : FALSE)) != 0)
+      {
+        printErr("Cannot set the decoder's output format", __FILE__, __LINE__);
+        pool_put(mh);
+        state.song_over = TRUE;
+        state.ended_by = command;
+        ps_publish(&state);
+        if (bench == NULL)
+          rt_thread_done(RT_AUDIO);
+        return;
+      }
+      // Open the file (read ahead by the I/O thread) and get the decoding format
+      ra_open(mh, args->filename);
+      mpg123_getformat(mh, &rate, &channels, &encoding);
+      // Volume / ReplayGain / EQ
+      if (dsp_open(&dsp, rate, channels, encoding, buffer_size, &softgain, &equalizer, args->rg_gain, args->rg_peak) != 0)
+      {
+        // Without its buffers there's nothing to run the song through
+        printErr("Cannot set up the DSP chain", __FILE__, __LINE__);
+        pool_put(mh);
+        state.song_over = TRUE;
+        state.ended_by = command;
+        ps_publish(&state);
+        if (bench == NULL)
+          rt_thread_done(RT_AUDIO);
+        return;
+      }
+      // Set the output format; if the card can't do the song's rate, the chain converts it
+      format.bits = dsp_out_bits();
+      format.rate = output_rate(rate);
+      if (dsp_set_out_rate(&dsp, format.rate) != 0)
+        format.rate = rate;
+      format.channels = channels;
+      format.byte_format = AO_FMT_NATIVE;
+      format.matrix = 0;
+    }
+    if (dev == NULL && (bench != NULL || hal_simulated()))
+    {
+      dev = bench_output(&format);
+      if (bench == NULL)
+        hal_audio_open();
+    }
+    else if (dev == NULL)
+    {
+      live_driver = driver;
+      dev = out_open(driver, &format);
+    }
+    if (dev == NULL)
+    {
+      // Nothing to play it on; the next song will try again
+      printErr("Cannot open the sound card", __FILE__, __LINE__);
+      xfade_cancel(&incoming);
+      dsp_close(&dsp);
+      pool_put(mh);
+      state.song_over = TRUE;
+      state.ended_by = command;
+      ps_publish(&state);
+      if (bench == NULL)
+        rt_thread_done(RT_AUDIO);
+      return;
+    }
+    if (bench != NULL)
+      stamp = wall_now();
+    mark = trace_now();
+    // Decode and play
+    while ((err = mpg123_read(mh, buffer, buffer_size, &done)) == MPG123_OK || err == MPG123_NEW_FORMAT)
+    {
+      stage_done(MET_DECODE, TR_DECODE, mark);
+      if (bench != NULL)
+        stamp = bench_stage(&bench->decode_secs, stamp);
+      // The rate changed in the middle of the file; the card stays where it is
+      if (err == MPG123_NEW_FORMAT)
+      {
+        long new_rate;
 
-// Main function
-int main(int argc, char **argv)
-{
-    pthread_t song_thread;
-    playlist_t init_playlist;
-    playlist_t cur_playlist;
-    clock_t startPauseFirstRow;  // For pausing scroll display
-    clock_t startPauseSecondRow; // For pausing scroll display
-    char *basec, *bname;
-    char *string;
+        mpg123_getformat(mh, &new_rate, &channels, &encoding);
+        if (new_rate != rate)
+        {
+          xfade_cancel(&incoming);
+          rate = new_rate;
+          dsp_close(&dsp);
+          if (dsp_open(&dsp, rate, channels, encoding, buffer_size, &softgain, &equalizer, args->rg_gain, args->rg_peak) != 0
+              || dsp_set_out_rate(&dsp, format.rate) != 0)
+          {
+            printErr("Cannot follow the rate change", __FILE__, __LINE__);
+            break;
+          }
+        }
+        if (done == 0)
+          continue;
+      }
+      checkPause(&state);
+      __atomic_load(&playback_speed, &speed, __ATOMIC_RELAXED);
+      dsp_set_speed(&dsp, speed);
+      if (crossfade_secs > 0 && !xfade_started(&incoming) && args->next_filename[0] != '\0'
+          && (length = mpg123_length(mh)) > 0)
+      {
+        // Time to start bringing in the next song?  (in frames of this one, so sped up it's sooner)
+        length -= mpg123_tell(mh);
+        if (xfade_idle(&incoming) && length <= crossfade_secs * rate * speed)
+        {
+          xfade_prepare(&incoming, args->next_filename, rate, channels, encoding, buffer_size, &softgain, &equalizer);
+          // -bench doesn't go in real time; the song would be over before the I/O thread got to it
+          if (bench != NULL)
+            xfade_wait(&incoming);
+        }
+        // The I/O thread opens it; once it's ready, fade over whatever's left
+        xfade_begin(&incoming, length);
+      }
+      mark = trace_now();
+      if (xfade_active(&incoming))
+        out_size = xfade_run(&incoming, &dsp, buffer, done, &out);
+      else
+        out_size = dsp_run(&dsp, buffer, done, &out);
+      mark = stage_done(MET_DSP, TR_DSP, mark);
+      if (bench != NULL)
+        stamp = bench_stage(&bench->dsp_secs, stamp);
+      // The card went and didn't come back; give up on the song
+      if (out_play(&dev, live_driver, &format, (char *) out, out_size) != 0)
+      {
+        printErr("Lost the sound card", __FILE__, __LINE__);
+        break;
+      }
+      frames = out_size / (format.channels * format.bits / 8);
+      if (bench == NULL)
+        hal_audio_played(frames, format.rate);
+      mark = stage_done(MET_OUTPUT, TR_OUTPUT, mark);
+      // Where we're up to, for the UI
+      state.frames += frames;
+      state.rate = format.rate;
+      state.volume = gain_get_volume(&softgain);
+      state.muted = gain_get_mute(&softgain);
+      ps_publish(&state);
+      // The song someone skipped to is out
+      if (first_block == TRUE)
+      {
+        first_block = FALSE;
+        pressed = __atomic_exchange_n(&switch_pressed, 0, __ATOMIC_RELAXED);
+        if (pressed != 0)
+          metrics_since(MET_SWITCH, pressed);
+      }
+      if (bench != NULL)
+      {
+        stamp = bench_stage(&bench->output_secs, stamp);
+        bench->audio_secs += (double)out_size / (format.channels * format.bits / 8) / format.rate;
+      }
+      // Stop playing if the user pressed quit, shuffle, next, or prev buttons
+      if ((command = ps_take_command()) != PS_PLAY)
+        break;
+      // The next song has completely taken over
+      if (xfade_started(&incoming) && !xfade_active(&incoming))
+        break;
+    }
+    // Played to the end; the last few samples are still in the EQ and the speed/rate stages
+    if (err == MPG123_DONE && command == PS_PLAY && !xfade_started(&incoming))
+    {
+      while ((out_size = dsp_drain(&dsp, &out)) > 0)
+        if (out_play(&dev, live_driver, &format, (char *) out, out_size) != 0)
+          break;
+    }
+    // Hand the device over to the next song if we're in the middle of a crossfade
+    // (quit/prev/shuffle throw the incoming song away when the next one starts)
+    if (xfade_started(&incoming) && command != PS_QUIT && dev != NULL)
+    {
+      incoming.dev = dev;
+      incoming.format = format;
+      // Along with anything the speed/rate stages are still holding on to
+      dsp_handover(&incoming.dsp, &dsp);
+    }
+    else
+    {
+      xfade_cancel(&incoming);
+      out_close(dev);
+      if (bench == NULL)
+        hal_audio_close();
+    }
+    // Clean up
+    dsp_close(&dsp);
+    pool_put(mh);
+    state.song_over = TRUE;
+    state.ended_by = command;
+    ps_publish(&state);
+    if (bench == NULL)
+      rt_thread_done(RT_AUDIO);
+    trace_span(TR_SONG, song_start, 0);
+}
+
+/*
+ * -bench: the songs go through id3_tagger and play_song (decoder, DSP chain,
+ * crossfade and all) as fast as they'll go, into libao's null device or a WAV
+ * file, without the LCD, buttons or sound card.  For each track and in all it
+ * prints how many times realtime it ran at, the CPU it took (every thread,
+ * read-ahead included), what was allocated, and the time in each stage.  With
+ * -crossfade the next song's decoding during the fade counts as DSP time.
+ */
+void bench_add_song(const char *name, playlist_t *playlist, int *count)
+{
+    if (playlist_add_song(name, playlist) > 0)
+      (*count)++;
+}
+
+// Songs in an .m3u (relative ones are relative to where the .m3u is)
+void bench_read_m3u(const char *m3u, playlist_t *playlist, int *count)
+{
+    FILE *fp;
+    char line[PATH_MAX];
+    char path[PATH_MAX];
+    char dir[PATH_MAX];
+    const char *base;
+    size_t len;
+
+    if (snprintf(dir, sizeof(dir), "%s", m3u) >= (int)sizeof(dir))
+    {
+      fprintf(stderr, "[%s - %d]: Path too long: %s\n", __FILE__, __LINE__, m3u);
+      return;
+    }
+    fp = fopen(m3u, "r");
+    if (fp == NULL)
+    {
+      fprintf(stderr, "[%s - %d]: Cannot read %s\n", __FILE__, __LINE__, m3u);
+      return;
+    }
+    base = dirname(dir);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      len = strcspn(line, "\r\n");
+      // Longer than any path can be; skip the rest of it
+      if (line[len] == '\0' && !feof(fp))
+      {
+        fprintf(stderr, "[%s - %d]: Path too long in %s\n", __FILE__, __LINE__, m3u);
+        while (fgets(line, sizeof(line), fp) != NULL && line[strcspn(line, "\n")] == '\0')
+          ;
+        continue;
+      }
+      line[len] = '\0';
+      if (line[0] == '\0' || line[0] == '#')
+        continue;
+      if (line[0] == '/')
+        bench_add_song(line, playlist, count);
+      else if (snprintf(path, sizeof(path), "%s/%s", base, line) >= (int)sizeof(path))
+        fprintf(stderr, "[%s - %d]: Path too long: %s/%s\n", __FILE__, __LINE__, base, line);
+      else
+        bench_add_song(path, playlist, count);
+    }
+    fclose(fp);
+}
+
+double process_cpu_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_print(const char *name, struct bench_track *t, double wall, double cpu, struct alloc_stats *allocs)
+{
+    printf("%-24.24s %7.1f %8.1fx %7.2f %5.1f%% %7.1f %8.1f %7.1f %7.1f %7lu %7lu %9.1f\n",
+           name, t->audio_secs, (wall > 0.0 ? t->audio_secs / wall : 0.0), cpu,
+           (t->audio_secs > 0.0 ? cpu * 100.0 / t->audio_secs : 0.0),
+           t->tags_secs * 1000, t->decode_secs * 1000, t->dsp_secs * 1000, t->output_secs * 1000,
+           allocs->allocs, allocs->frees, allocs->bytes / 1024.0);
+}
+
+int run_bench(int argc, char **argv, int ra_mode)
+{
+    playlist_t playlist;
+    struct bench_track track, total;
+    struct alloc_stats before, after, allocs, total_allocs;
+    char song[PATH_MAX], next[PATH_MAX];
+    char stem[MAXDATALEN];
+    const char *wav = NULL;
+    double start, cpu_start, wall, cpu, total_wall = 0.0, total_cpu = 0.0;
+    int count = 0, i, t;
+
+    playlist_init(&playlist);
+    for (i = 2; i < argc; i++)
+    {
+      if (strcmp(argv[i], "-wav") == 0 && i + 1 < argc)
+        wav = argv[++i];
+      // The other options have been dealt with already
+      else if ((strcmp(argv[i], "-eq") == 0 || strcmp(argv[i], "-crossfade") == 0 || strcmp(argv[i], "-speed") == 0 ||
+                strcmp(argv[i], "-rt") == 0 || strcmp(argv[i], "-cpu") == 0) && i + 1 < argc)
+        i++;
+      else if (argv[i][0] == '-')
+        continue;
+      else if (strcasecmp(get_filename_ext(argv[i]), "m3u") == 0)
+        bench_read_m3u(argv[i], &playlist, &count);
+      else
+        bench_add_song(argv[i], &playlist, &count);
+    }
+    if (count == 0)
+      return usage(argv[0]);
+    // Same decoder and buffers as playing for real
+    decoder_load(CACHE_DIR "/decoder.cache");
+    pool_fill(3);
+    if (ra_init(ra_mode) != 0)
+      printErr("Cannot start the read-ahead thread", __FILE__, __LINE__);
+    if (wav != NULL)
+    {
+      snprintf(stem, sizeof(stem), "%s", wav);
+      if (strcasecmp(get_filename_ext(stem), "wav") == 0)
+        stem[strlen(stem) - 4] = '\0';
+    }
+    printf("decoder: %s, output: %s\n", (decoder_name() != NULL ? decoder_name() : "default"), (wav != NULL ? wav : "null"));
+    printf("%-24s %7s %9s %7s %6s %7s %8s %7s %7s %7s %7s %9s\n", "track", "audio s", "realtime", "CPU s", "CPU",
+           "tags ms", "decode ms", "dsp ms", "out ms", "allocs", "frees", "alloc KB");
+    memset(&total, 0, sizeof(total));
+    memset(&total_allocs, 0, sizeof(total_allocs));
+    for (t = 1; t <= count; t++)
+    {
+      if (playlist_get_song(t, song, sizeof(song), &playlist) != 0)
+        continue;
+      next[0] = '\0';
+      if (t < count)
+        playlist_get_song(t + 1, next, sizeof(next), &playlist);
+      set_song(song, next);
+      // One WAV file per track
+      if (wav != NULL && count > 1)
+        snprintf(bench_wav, sizeof(bench_wav), "%s-%d.wav", stem, t);
+      else if (wav != NULL)
+        snprintf(bench_wav, sizeof(bench_wav), "%s", wav);
+      memset(&track, 0, sizeof(track));
+      bench = &track;
+      alloc_stats(&before);
+      start = wall_now();
+      cpu_start = process_cpu_now();
+      id3_tagger();
+      track.tags_secs = wall_now() - start;
+      ps_start(t);
+      play_song(&cur_song);
+      wall = wall_now() - start;
+      cpu = process_cpu_now() - cpu_start;
+      alloc_stats(&after);
+      allocs.allocs = after.allocs - before.allocs;
+      allocs.frees = after.frees - before.frees;
+      allocs.bytes = after.bytes - before.bytes;
+      bench_print(cur_song.base_filename, &track, wall, cpu, &allocs);
+      total.tags_secs += track.tags_secs;
+      total.decode_secs += track.decode_secs;
+      total.dsp_secs += track.dsp_secs;
+      total.output_secs += track.output_secs;
+      total.audio_secs += track.audio_secs;
+      total_allocs.allocs += allocs.allocs;
+      total_allocs.frees += allocs.frees;
+      total_allocs.bytes += allocs.bytes;
+      total_wall += wall;
+      total_cpu += cpu;
+    }
+    bench = NULL;
+    bench_print("total", &total, total_wall, total_cpu, &total_allocs);
+    ra_report(stdout);
+    pool_report(stdout, count);
+    metrics_dump(stdout);
+    ra_shutdown();
+    pool_shutdown();
+    return 0;
+}
+
+/*
+ * -suite: benchmarks of the player's own code (lcd-mp3-bench does the DSP
+ * modules) on a made up library, printed as JSON so runs can be kept and
+ * compared from one version to the next.  The LCD and buttons are the
+ * simulator's, with its clock moved on by hand, so what's timed is our code
+ * and not the HD44780's delays.  It ends with 10000 track changes counted for
+ * allocations, and fails (exit status 1) if they weren't all freed again.
+ */
+
+// The library is made once and kept here
+#define SUITE_DIR "/tmp/lcd-mp3-suite"
+// Files with real tags for id3_tagger
+#define SUITE_TAGGED 200
+// MPEG-1 layer III, 128 kbps, 44.1 kHz: 26 ms a frame
+#define SUITE_FRAME_BYTES 417
+#define SUITE_SHORT_FRAMES 40
+#define SUITE_LONG_FRAMES 2300
+#define SUITE_LOOKUPS 1000
+#define SUITE_SWITCHES 20
+// Track changes counted for allocations, after the ones that fill the pools
+#define SUITE_TRACKS 10000
+#define SUITE_WARMUP 10
+#define SUITE_SCROLLS 2000
+#define SUITE_POLLS 100000
+// Genres the songs are spread over, for the filters
+#define SUITE_GENRES 20
+
+static const int suite_sizes[] = { 1000, 10000, 100000 };
+static const char *suite_view_names[VIEWS] = { "view_build_artist", "view_build_title", "view_build_added" };
+// Picking out a random song's artist, genre, or both (in the folder order, and by artist); then two genres' songs together
+#define SUITE_FILTERS 5
+static const char *suite_filter_names[SUITE_FILTERS] = { "filter_artist", "filter_genre", "filter_genre_and_artist",
+                                                         "filter_genre_by_artist", "filter_two_genres" };
+#define NUM_SUITE_SIZES (int)(sizeof(suite_sizes) / sizeof(suite_sizes[0]))
+
+// A v2.3 text frame
+static void suite_id3_frame(FILE *fp, const char *id, const char *text)
+{
+    unsigned long size = strlen(text) + 1;
+    unsigned char header[10] = { id[0], id[1], id[2], id[3], size >> 24, size >> 16, size >> 8, size, 0, 0 };
+
+    fwrite(header, 1, sizeof(header), fp);
+    fputc(0, fp);   // ISO-8859-1
+    fwrite(text, 1, size - 1, fp);
+}
+
+// An ID3v2 tag (if 'title' is set) followed by 'frames' frames of silence
+static int suite_write_mp3(const char *path, const char *title, const char *artist, const char *album, int frames)
+{
+    static const unsigned char frame_header[4] = { 0xff, 0xfb, 0x90, 0x00 };
+    unsigned char frame[SUITE_FRAME_BYTES];
+    unsigned char header[10] = { 'I', 'D', '3', 3, 0, 0, 0, 0, 0, 0 };
+    unsigned long size;
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot create %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+        return -1;
+    }
+    if (title != NULL)
+    {
+        size = 4 * 11 + strlen(title) + strlen(artist) + strlen(album) + strlen("Rock");
+        // Sizes in the tag header are 7 bits a byte
+        header[6] = (size >> 21) & 0x7f;
+        header[7] = (size >> 14) & 0x7f;
+        header[8] = (size >> 7) & 0x7f;
+        header[9] = size & 0x7f;
+        fwrite(header, 1, sizeof(header), fp);
+        suite_id3_frame(fp, "TIT2", title);
+        suite_id3_frame(fp, "TPE1", artist);
+        suite_id3_frame(fp, "TALB", album);
+        suite_id3_frame(fp, "TCON", "Rock");
+    }
+    memset(frame, 0, sizeof(frame));
+    memcpy(frame, frame_header, sizeof(frame_header));
+    for (i = 0; i < frames; i++)
+        fwrite(frame, 1, sizeof(frame), fp);
+    return fclose(fp);
+}
+
+static int suite_mkdir(const char *path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot create %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  dir/scan-N: N empty .mp3 files as Artist/Album/NN - Song.mp3, ten to an
+  album and ten albums to an artist (only the names matter to list_dir)
+  dir/tagged: SUITE_TAGGED short songs with titles long enough to scroll
+  dir/switch: two long songs to skip between
+*/
+static int suite_make_library(const char *dir)
+{
+    char path[PATH_MAX];
+    char title[MAXDATALEN];
+    char artist[MAXDATALEN];
+    FILE *fp;
+    int s, n;
+
+    snprintf(path, sizeof(path), "%s/.complete", dir);
+    if (access(path, F_OK) == 0)
+        return 0;
+    fprintf(stderr, "Making a library in %s...\n", dir);
+    if (suite_mkdir(dir) != 0)
+        return -1;
+    for (s = 0; s < NUM_SUITE_SIZES; s++)
+    {
+        snprintf(path, sizeof(path), "%s/scan-%d", dir, suite_sizes[s]);
+        if (suite_mkdir(path) != 0)
+            return -1;
+        for (n = 0; n < suite_sizes[s]; n++)
+        {
+            if (n % 100 == 0)
+            {
+                snprintf(path, sizeof(path), "%s/scan-%d/Artist %04d", dir, suite_sizes[s], n / 100);
+                if (suite_mkdir(path) != 0)
+                    return -1;
+            }
+            if (n % 10 == 0)
+            {
+                snprintf(path, sizeof(path), "%s/scan-%d/Artist %04d/Album %02d", dir, suite_sizes[s], n / 100, n / 10 % 10);
+                if (suite_mkdir(path) != 0)
+                    return -1;
+            }
+            snprintf(path, sizeof(path), "%s/scan-%d/Artist %04d/Album %02d/%02d - Song %d.mp3", dir, suite_sizes[s], n / 100, n / 10 % 10, n % 10 + 1, n);
+            fp = fopen(path, "wb");
+            if (fp == NULL)
+            {
+                fprintf(stderr, "[%s - %d]: Cannot create %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+                return -1;
+            }
+            fclose(fp);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/tagged", dir);
+    if (suite_mkdir(path) != 0)
+        return -1;
+    for (n = 0; n < SUITE_TAGGED; n++)
+    {
+        snprintf(path, sizeof(path), "%s/tagged/%03d.mp3", dir, n);
+        // Anything from a short title to one that scrolls for a while
+        snprintf(title, sizeof(title), "Song %d%.*s", n, n % 60, " from the album that was recorded live at the end of the tour");
+        snprintf(artist, sizeof(artist), "The Artist Number %d", n / 10);
+        if (suite_write_mp3(path, title, artist, "An Album", SUITE_SHORT_FRAMES) != 0)
+            return -1;
+    }
+    snprintf(path, sizeof(path), "%s/switch", dir);
+    if (suite_mkdir(path) != 0)
+        return -1;
+    for (n = 0; n < 2; n++)
+    {
+        snprintf(path, sizeof(path), "%s/switch/%c.mp3", dir, 'a' + n);
+        if (suite_write_mp3(path, (n == 0 ? "First Song" : "Second Song"), "Somebody", "Something", SUITE_LONG_FRAMES) != 0)
+            return -1;
+    }
+    snprintf(path, sizeof(path), "%s/.complete", dir);
+    fp = fopen(path, "w");
+    if (fp != NULL)
+        fclose(fp);
+    return 0;
+}
+
+static int suite_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/*
+  One result: 'times' are the seconds each of 'runs' runs took, each of which
+  did 'items' of whatever it is (files, lookups, ...)
+*/
+static void suite_print(int *first, const char *name, long items, double *times, int runs)
+{
+    qsort(times, runs, sizeof(double), suite_compare);
+    printf("%s    {\"name\": \"%s\", \"items\": %ld, \"runs\": %d, \"min_us\": %.3f, \"median_us\": %.3f, \"max_us\": %.3f, \"per_item_ns\": %.1f}",
+           (*first ? "" : ",\n"), name, items, runs, times[0] * 1e6, times[runs / 2] * 1e6, times[runs - 1] * 1e6,
+           times[runs / 2] * 1e9 / items);
+    *first = FALSE;
+    fflush(stdout);
+}
+
+// How much memory 'items' of something take, and what they took the way it used to be done
+static void suite_print_bytes(int *first, const char *name, long items, size_t bytes, size_t was)
+{
+    printf("%s    {\"name\": \"%s\", \"items\": %ld, \"bytes\": %zu, \"per_item_bytes\": %.1f, \"was_bytes\": %zu, \"was_per_item_bytes\": %.1f}",
+           (*first ? "" : ",\n"), name, items, bytes, (double)bytes / items, was, (double)was / items);
+    *first = FALSE;
+    fflush(stdout);
+}
+
+/*
+  What the main loop does each time round while a song plays and nothing is
+  pressed: the seven debounced buttons (as in main, in a loop rather than
+  written out seven times) and the scrolling, which is usually waiting for its
+  next step.
+*/
+static int suite_poll(int *last, int *state, unsigned int *since)
+{
+    int i, reading, pressed = 0, pause_flag = FALSE;
+
+    for (i = 0; i < numButtons; i++)
+    {
+        reading = hal_read(buttonPins[i]);
+        if (reading != last[i])
+            since[i] = hal_millis();
+        if ((hal_millis() - since[i]) > debounceDelay && reading != state[i])
+        {
+            state[i] = reading;
+            pressed += (reading == LOW);
+        }
+        last[i] = reading;
+    }
+    scroll_Message_FirstRow(&pause_flag);
+    scroll_Message_SecondRow(&pause_flag);
+    return pressed;
+}
+
+// Wait for play_song to get its first block out
+static void suite_wait_audio()
+{
+    struct play_state state;
+
+    for (ps_read(&state); state.frames == 0 && state.song_over == FALSE; ps_read(&state))
+        sched_yield();
+}
+
+int run_suite(int argc, char **argv, int ra_mode)
+{
+    const char *dir = SUITE_DIR;
+    char path[PATH_MAX];
+    char song[PATH_MAX], next[PATH_MAX];
+    struct path_stats paths;
+    struct library_stats lib;
+    struct lib_tags tags;
+    const int *ids;
+    uint32_t by[LIB_FIELDS];
+    struct bitmap either;
+    struct browse browser;
+    double *times;
+    double start;
+    playlist_t list;
+    struct bench_track track;
+    struct alloc_stats before, after;
+    pthread_t thread;
+    int last[16], state[16];
+    unsigned int since[16];
+    unsigned int seed = 1;
+    int first = TRUE, leaked, runs, s, r, n, i, v, pick;
+    unsigned long filters = 0, filter_allocs = 0;
+
+    if (argc > 2 && argv[2][0] != '-')
+        dir = argv[2];
+    if (suite_make_library(dir) != 0)
+        return 1;
+    times = calloc(SUITE_SWITCHES > SUITE_TAGGED ? SUITE_SWITCHES : SUITE_TAGGED, sizeof(double));
+    if (times == NULL)
+    {
+        perror("calloc: -suite");
+        return 1;
+    }
+    bitmap_init(&either);
+    hal_use_sim();
+    for (n = 0; n < numButtons; n++)
+        hal_sim_pin("button", buttonPins[n], HIGH);
+    lcdHandle = hal_lcd_init(RO, CO, BS, RS, EN, D0, D1, D2, D3, D0, D1, D2, D3);
+    decoder_load(CACHE_DIR "/decoder.cache");
+    pool_fill(3);
+    if (ra_init(ra_mode) != 0)
+        printErr("Cannot start the read-ahead thread", __FILE__, __LINE__);
+    printf("{\n  \"version\": \"%s\",\n  \"decoder\": \"%s\",\n  \"library\": \"%s\",\n  \"results\": [\n",
+           VERSION, (decoder_name() != NULL ? decoder_name() : "default"), dir);
+    // Reading the library in, picking songs out of it and shuffling it
+    for (s = 0; s < NUM_SUITE_SIZES; s++)
+    {
+        n = suite_sizes[s];
+        runs = (n >= 100000 ? 1 : 5);
+        snprintf(path, sizeof(path), "%s/scan-%d", dir, n);
+        playlist_init(&list);
+        for (r = 0; r < runs; r++)
+        {
+            start = wall_now();
+            reReadPlaylist(path, &list);
+            times[r] = wall_now() - start;
+        }
+        suite_print(&first, "list_dir", n, times, runs);
+        paths_stats(&list.paths, &paths);
+        suite_print_bytes(&first, "path_store", n, paths.bytes + list.max_songs * sizeof(int),
+                          (size_t)n * (MAXDATALEN + 3 * sizeof(void *)));
+        // Every song's artist, album, genre and title, against cur_song's four buffers for them
+        library_stats(&list.lib, &lib);
+        suite_print_bytes(&first, "library", n, lib.bytes, (size_t)n * 4 * MAXDATALEN);
+        for (r = 0; r < runs; r++)
+        {
+            start = wall_now();
+            for (i = 0; i < SUITE_LOOKUPS; i++)
+                playlist_get_song(rand_r(&seed) % n + 1, song, sizeof(song), &list);
+            times[r] = wall_now() - start;
+        }
+        suite_print(&first, "playlist_lookup", SUITE_LOOKUPS, times, runs);
+        for (r = 0; r < runs; r++)
+        {
+            start = wall_now();
+            randomize(&list);
+            times[r] = wall_now() - start;
+        }
+        suite_print(&first, "randomize", n, times, runs);
+        // Every song in one of the genres, for the filters
+        memset(&tags, 0, sizeof(tags));
+        for (i = 0; i < n; i++)
+        {
+            tags.id = i;
+            snprintf(tags.genre, sizeof(tags.genre), "Genre %02d", i % SUITE_GENRES);
+            library_set(&list.lib, &tags);
+        }
+        // The sorted views: made from scratch once, then kept in order as songs change, come and go
+        for (v = 0; v < VIEWS; v++)
+        {
+            for (r = 0; r < runs; r++)
+            {
+                view_free(&list.lib.views[v]);
+                start = wall_now();
+                library_order(&list.lib, v, &ids);
+                times[r] = wall_now() - start;
+            }
+            suite_print(&first, suite_view_names[v], n, times, runs);
+        }
+        for (r = 0; r < runs; r++)
+        {
+            start = wall_now();
+            playlist_order(ORDER_ARTIST, &list);
+            times[r] = wall_now() - start;
+        }
+        suite_print(&first, "order_switch", n, times, runs);
+        // Picking songs out; once through first, so the bitmaps they go in have grown as big as they get
+        for (r = -1; r < runs; r++)
+        {
+            if (r == 0)
+                alloc_stats(&before);
+            for (v = 0; v < SUITE_FILTERS; v++)
+            {
+                start = wall_now();
+                for (i = 0; i < SUITE_LOOKUPS; i++)
+                {
+                    pick = rand_r(&seed) % n;
+                    by[LIB_ARTIST] = (v != 1 && v != 3 ? list.lib.artist[pick] : 0);
+                    by[LIB_ALBUM] = 0;
+                    by[LIB_GENRE] = (v != 0 ? list.lib.genre[pick] : 0);
+                    if (v < 4)
+                        playlist_filter(v == 3 ? ORDER_ARTIST : ORDER_FOUND, by, &list);
+                    else
+                        bitmap_or(&either, library_songs(&list.lib, LIB_GENRE, by[LIB_GENRE]),
+                                  library_songs(&list.lib, LIB_GENRE, by[LIB_GENRE] % SUITE_GENRES + 1));
+                }
+                if (r >= 0)
+                    times[v * runs + r] = wall_now() - start;
+            }
+        }
+        alloc_stats(&after);
+        filters += (unsigned long)runs * SUITE_FILTERS * SUITE_LOOKUPS;
+        filter_allocs += after.allocs - before.allocs;
+        for (v = 0; v < SUITE_FILTERS; v++)
+            suite_print(&first, suite_filter_names[v], SUITE_LOOKUPS, times + v * runs, runs);
+        memset(by, 0, sizeof(by));
+        playlist_filter(ORDER_FOUND, by, &list);
+        // Turning through the browser (a few clicks at a time, either way, through every level) and drawing its rows
+        for (r = 0; r < runs; r++)
+        {
+            start = wall_now();
+            browse_start(&browser, &list.lib);
+            for (i = 0; i < SUITE_LOOKUPS; i++)
+            {
+                // Now and then in a level, and from the tracks back out to the artists
+                if (i % 100 == 99 && browse_down(&browser, &list.lib) != 0)
+                {
+                    browse_up(&browser);
+                    browse_up(&browser);
+                }
+                browse_move(&browser, &list.lib, rand_r(&seed) % 17 - 8);
+                for (v = 0; v < BROWSE_ROWS; v++)
+                    browse_row(&browser, &list.lib, v, song, sizeof(song));
+            }
+            times[r] = wall_now() - start;
+        }
+        suite_print(&first, "browse_scroll", SUITE_LOOKUPS, times, runs);
+        // New tags for a song: it moves in all three views
+        memset(&tags, 0, sizeof(tags));
+        for (r = 0; r < runs; r++)
+        {
+            start = wall_now();
+            for (i = 0; i < SUITE_LOOKUPS; i++)
+            {
+                tags.id = rand_r(&seed) % n;
+                snprintf(tags.artist, sizeof(tags.artist), "Artist %04d", rand_r(&seed) % (n / 100));
+                snprintf(tags.title, sizeof(tags.title), "Song %d", rand_r(&seed) % n);
+                tags.track = rand_r(&seed) % 10 + 1;
+                tags.added = rand_r(&seed);
+                library_set(&list.lib, &tags);
+            }
+            times[r] = wall_now() - start;
+        }
+        suite_print(&first, "view_update", SUITE_LOOKUPS, times, runs);
+        start = wall_now();
+        for (i = 0; i < SUITE_LOOKUPS; i++)
+        {
+            if (snprintf(song, sizeof(song), "%s/Artist %04d/Album 00/%02d - New Song %d.mp3",
+                         path, rand_r(&seed) % (n / 100), i % 10 + 1, i) < (int)sizeof(song))
+                playlist_add_song(song, &list);
+        }
+        times[0] = wall_now() - start;
+        suite_print(&first, "view_add", SUITE_LOOKUPS, times, 1);
+        start = wall_now();
+        for (i = 0; i < SUITE_LOOKUPS; i++)
+            library_remove(&list.lib, rand_r(&seed) % n);
+        times[0] = wall_now() - start;
+        suite_print(&first, "view_remove", SUITE_LOOKUPS, times, 1);
+        playlist_free(&list);
+    }
+    bitmap_free(&either);
+    // Filtering (after the first time) shouldn't allocate anything either
+    printf(",\n    {\"name\": \"filter_allocs\", \"items\": %lu, \"allocs\": %lu, \"per_item_allocs\": %.4f}",
+           filters, filter_allocs, (double)filter_allocs / filters);
+    // Tags, one file at a time
+    for (n = 0; n < SUITE_TAGGED; n++)
+    {
+        snprintf(path, sizeof(path), "%s/tagged/%03d.mp3", dir, n);
+        set_song(path, NULL);
+        start = wall_now();
+        id3_tagger();
+        times[n] = wall_now() - start;
+    }
+    suite_print(&first, "id3_tagger", 1, times, SUITE_TAGGED);
+    // The same files through the library's tag scan, all of it handed over to the library
+    snprintf(path, sizeof(path), "%s/tagged", dir);
+    playlist_init(&list);
+    reReadPlaylist(path, &list);
+    start = wall_now();
+    library_scan_start(&list.paths);
+    while (library_scanning())
+    {
+        if (library_poll(&list.lib) == 0)
+            usleep(1000);
+    }
+    library_scan_stop();
+    times[0] = wall_now() - start;
+    suite_print(&first, "library_scan", SUITE_TAGGED, times, 1);
+    library_stats(&list.lib, &lib);
+    if (lib.tagged != SUITE_TAGGED)
+        fprintf(stderr, "[%s - %d]: The library scan found %d of %d tags\n", __FILE__, __LINE__, lib.tagged, SUITE_TAGGED);
+    playlist_free(&list);
+    // Drawing the song on the LCD and scrolling it along, a step each time the clock says so
+    snprintf(path, sizeof(path), "%s/tagged/%03d.mp3", dir, SUITE_TAGGED - 1);
+    set_song(path, NULL);
+    id3_tagger();
+    // Artist and album together, or just the artist if both don't fit
+    if (snprintf(cur_song.SecondRow_text, sizeof(cur_song.SecondRow_text), "%s - %s",
+                 cur_song.artist, cur_song.album) >= (int)sizeof(cur_song.SecondRow_text))
+        strcpy(cur_song.SecondRow_text, cur_song.artist);
+    for (r = 0; r < 5; r++)
+    {
+        start = wall_now();
+        for (n = 0; n < SUITE_SCROLLS; n++)
+        {
+            int pause_flag;
+
+            hal_sim_advance(200);
+            if (n % 100 == 0)
+            {
+                printLcdFirstRow();
+                printLcdSecondRow();
+            }
+            scroll_Message_FirstRow(&pause_flag);
+            scroll_Message_SecondRow(&pause_flag);
+        }
+        times[r] = wall_now() - start;
+    }
+    suite_print(&first, "lcd_scroll", SUITE_SCROLLS, times, 5);
+    // The main loop with nothing happening
+    for (n = 0; n < numButtons; n++)
+    {
+        last[n] = state[n] = HIGH;
+        since[n] = 0;
+    }
+    for (r = 0; r < 5; r++)
+    {
+        start = wall_now();
+        for (n = 0; n < SUITE_POLLS; n++)
+        {
+            if (n % 1000 == 0)
+                hal_sim_advance(1);
+            suite_poll(last, state, since);
+        }
+        times[r] = wall_now() - start;
+    }
+    suite_print(&first, "debounce_loop", SUITE_POLLS, times, 5);
+    // Next: from the button to the next song's first block going out (tags, LCD and all)
+    bench = &track;
+    memset(&track, 0, sizeof(track));
+    snprintf(path, sizeof(path), "%s/switch/a.mp3", dir);
+    set_song(path, NULL);
+    id3_tagger();
+    ps_start(1);
+    pthread_create(&thread, NULL, (void *) play_song, (void *) &cur_song);
+    suite_wait_audio();
+    for (r = 0; r < SUITE_SWITCHES; r++)
+    {
+        start = wall_now();
+        nextSong();
+        pthread_join(thread, NULL);
+        ps_take_command();
+        ui_command = PS_PLAY;
+        snprintf(path, sizeof(path), "%s/switch/%c.mp3", dir, (r % 2 == 0 ? 'b' : 'a'));
+        set_song(path, NULL);
+        id3_tagger();
+        memset(&track, 0, sizeof(track));
+        ps_start(r % 2 == 0 ? 2 : 1);
+        pthread_create(&thread, NULL, (void *) play_song, (void *) &cur_song);
+        hal_lcd_clear(lcdHandle);
+        printLcdFirstRow();
+        printLcdSecondRow();
+        suite_wait_audio();
+        times[r] = wall_now() - start;
+    }
+    nextSong();
+    pthread_join(thread, NULL);
+    ps_take_command();
+    ui_command = PS_PLAY;
+    bench = NULL;
+    suite_print(&first, "next_track", 1, times, SUITE_SWITCHES);
+    /*
+      Track changes the way the main loop does them, with a reshuffle every
+      so often.  Once the pools are full nothing of ours should allocate, and
+      what the libraries allocate for a song they have to free again.
+    */
+    playlist_init(&list);
+    n = 0;
+    for (i = 0; i < 2; i++)
+    {
+        snprintf(path, sizeof(path), "%s/switch/%c.mp3", dir, 'a' + i);
+        bench_add_song(path, &list, &n);
+    }
+    bench = &track;
+    for (r = 0; r < SUITE_WARMUP + SUITE_TRACKS; r++)
+    {
+        if (r == SUITE_WARMUP)
+            alloc_stats(&before);
+        if (r % 100 == 99)
+            randomize(&list);
+        playlist_get_song(r % 2 + 1, song, sizeof(song), &list);
+        playlist_get_song((r + 1) % 2 + 1, next, sizeof(next), &list);
+        set_song(song, next);
+        id3_tagger();
+        memset(&track, 0, sizeof(track));
+        ps_start(r % 2 + 1);
+        pthread_create(&thread, NULL, (void *) play_song, (void *) &cur_song);
+        suite_wait_audio();
+        nextSong();
+        pthread_join(thread, NULL);
+        ps_take_command();
+        ui_command = PS_PLAY;
+    }
+    alloc_stats(&after);
+    bench = NULL;
+    playlist_free(&list);
+    leaked = (after.allocs - before.allocs != after.frees - before.frees);
+    printf(",\n    {\"name\": \"track_allocs\", \"items\": %d, \"allocs\": %lu, \"frees\": %lu, \"alloc_kb\": %.1f, \"per_item_allocs\": %.2f}",
+           SUITE_TRACKS, after.allocs - before.allocs, after.frees - before.frees, (after.bytes - before.bytes) / 1024.0,
+           (double)(after.allocs - before.allocs) / SUITE_TRACKS);
+    printf("\n  ]\n}\n");
+    if (leaked)
+        fprintf(stderr, "[%s - %d]: %lu allocs but %lu frees over %d track changes\n", __FILE__, __LINE__,
+                after.allocs - before.allocs, after.frees - before.frees, SUITE_TRACKS);
+    free(times);
+    ra_shutdown();
+    pool_shutdown();
+    return (leaked ? 1 : 0);
+}
+
+// Main function
+int main(int argc, char **argv)
+{
+    pthread_t song_thread;
+    playlist_t playlist;
+    clock_t startPauseFirstRow;  // For pausing scroll display
+    clock_t startPauseSecondRow; // For pausing scroll display
+    char song_path[PATH_MAX];
+    char next_path[PATH_MAX];
     char pause_text[MAXDATALEN];
     char muted_text[MAXDATALEN];
     char lcd_clear[] = "                ";
-    int ival; // for mute
+    // Where the songs were found (-usb or -dir); the loudness cache goes by the paths under it
+    char *musicDir = NULL;
     int index;
     int song_index;
     int i;
     int ctrSecondRowScroll;
     int reading;
+    // What play_song last published, and whether it's done with the song
+    struct play_state state;
+    int song_over = FALSE;
     // Flags
     int haltFlag = FALSE;
     int shuffFlag = FALSE;
+    int playOrder = ORDER_FOUND;
+    // The order's just changed; say so instead of the artist
+    int showOrder = FALSE;
+    // The filter menu's up (info while paused), what's showing in it, and the song that was playing when it came up
+    int filterMenu = FALSE;
+    int filterChoice = FILTER_ALL;
+    int filterSong = 0;
+    // In the library browser (info held down), and what it's showing
+    int browsing = FALSE;
+    int browsePick = FALSE;
+    int infoHeld = FALSE;
+    long infoPressTime = 0;
+    int picked;
+    struct browse browser;
+    int softVolFlag = FALSE;
+    int scanFlag = TRUE;
+    int tagsFlag = TRUE;
+    int readaheadFlag = TRUE;
+    int mmapFlag = FALSE;
+    int lockFlag = TRUE;
+    int rtProbeFlag = FALSE;
+    int allocsFlag = FALSE;
+    struct alloc_stats track_allocs, now_allocs;
+    char *sim_script = NULL;
+    char *replay_file = NULL;
+    char *trace_file = NULL;
+    unsigned long long loop_mark;
     int playlistStatusErr = FILES_OK;
+    unsigned long tracks = 0;
 
     int scroll_FirstRow_Flag = FALSE;
     int scroll_SecondRow_Flag = FALSE;
@@ -1006,10 +2452,21 @@ int main(int argc, char **argv)
     int temp_SecondRow_Flag = FALSE;
 
     // Initializations
-    playlist_init(&cur_playlist);
-    playlist_init(&init_playlist);
+    // (before any threads start, so SIGUSR1 goes to the metrics thread)
+    if (metrics_init(METRICS_FILE) != 0)
+      printErr("Cannot start the metrics", __FILE__, __LINE__);
+    // The card's underruns and recoveries go in the snapshot too
+    metrics_add_report(out_report);
+    if (trace_init(TRACE_FILE) != 0)
+      printErr("Cannot start the trace", __FILE__, __LINE__);
+    trace_thread("main");
+    playlist_init(&playlist);
+    gain_init(&softgain);
+    eq_init(&equalizer);
+    // mpg123 and libao stay set up until we exit
+    if (pool_init() != 0)
+      return 1;
     ctrSecondRowScroll = 0;
-    cur_song.song_over = FALSE;
     lastPlayButtonState = lastPrevButtonState =
       lastNextButtonState = lastInfoButtonState =
       lastQuitButtonState = lastShufButtonState = lastMuteButtonState = HIGH;
@@ -1027,7 +2484,94 @@ int main(int argc, char **argv)
         if (strcmp(argv[i], "-shuffle") == 0)
         {
           shuffFlag = TRUE;
-          break;
+          playOrder = ORDER_SHUFFLE;
+        }
+        else if (strcmp(argv[i], "-order") == 0 && i + 1 < argc)
+        {
+          for (playOrder = 0; playOrder < ORDERS && strcmp(argv[i + 1], order_args[playOrder]) != 0; playOrder++)
+            ;
+          if (playOrder == ORDERS)
+          {
+            fprintf(stderr, "[%s - %d]: Bad order '%s'\n", __FILE__, __LINE__, argv[i + 1]);
+            return usage(argv[0]);
+          }
+          i++;
+        }
+        else if (strcmp(argv[i], "-softvol") == 0)
+          softVolFlag = TRUE;
+        else if (strcmp(argv[i], "-noscan") == 0)
+          scanFlag = FALSE;
+        else if (strcmp(argv[i], "-notags") == 0)
+          tagsFlag = FALSE;
+        else if (strcmp(argv[i], "-noreadahead") == 0)
+          readaheadFlag = FALSE;
+        else if (strcmp(argv[i], "-mmap") == 0)
+          mmapFlag = TRUE;
+        else if (strcmp(argv[i], "-nolock") == 0)
+          lockFlag = FALSE;
+        else if (strcmp(argv[i], "-rtprobe") == 0)
+          rtProbeFlag = TRUE;
+        else if (strcmp(argv[i], "-allocs") == 0)
+          allocsFlag = TRUE;
+        else if (strcmp(argv[i], "-rt") == 0 && i + 1 < argc)
+        {
+          if (rt_parse_priorities(argv[++i]) != 0)
+          {
+            fprintf(stderr, "[%s - %d]: Bad priorities '%s'\n", __FILE__, __LINE__, argv[i]);
+            return usage(argv[0]);
+          }
+        }
+        else if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc)
+        {
+          if (rt_parse_cpus(argv[++i]) != 0)
+          {
+            fprintf(stderr, "[%s - %d]: Bad CPUs '%s'\n", __FILE__, __LINE__, argv[i]);
+            return usage(argv[0]);
+          }
+        }
+        else if (strcmp(argv[i], "-sim") == 0)
+        {
+          hal_use_sim();
+          if (i + 1 < argc && argv[i + 1][0] != '-')
+            sim_script = argv[++i];
+        }
+        else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+        {
+          if (rec_start(argv[++i]) != 0)
+            return 1;
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+          trace_file = argv[++i];
+        else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+        {
+          hal_use_sim();
+          replay_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-eq") == 0 && i + 1 < argc)
+        {
+          if (eq_parse(&equalizer, argv[++i]) != 0)
+          {
+            fprintf(stderr, "[%s - %d]: Bad equalizer settings '%s'\n", __FILE__, __LINE__, argv[i]);
+            return usage(argv[0]);
+          }
+        }
+        else if (strcmp(argv[i], "-crossfade") == 0 && i + 1 < argc)
+        {
+          crossfade_secs = atoi(argv[++i]);
+          if (crossfade_secs < XFADE_MIN_SECS || crossfade_secs > XFADE_MAX_SECS)
+          {
+            fprintf(stderr, "[%s - %d]: Crossfade has to be %d to %d seconds\n", __FILE__, __LINE__, XFADE_MIN_SECS, XFADE_MAX_SECS);
+            return usage(argv[0]);
+          }
+        }
+        else if (strcmp(argv[i], "-speed") == 0 && i + 1 < argc)
+        {
+          playback_speed = atof(argv[++i]);
+          if (playback_speed < TEMPO_MIN_SPEED || playback_speed > TEMPO_MAX_SPEED)
+          {
+            fprintf(stderr, "[%s - %d]: Speed has to be %.2f to %.2f\n", __FILE__, __LINE__, TEMPO_MIN_SPEED, TEMPO_MAX_SPEED);
+            return usage(argv[0]);
+          }
         }
       }
       if (strcmp(argv[1], "-pins") == 0)
@@ -1035,16 +2579,25 @@ int main(int argc, char **argv)
         showPins();
         return 1;
       }
+      // Try all of mpg123's decoders on a song and remember the fastest
+      else if (strcmp(argv[1], "-calibrate") == 0 && argc > 2)
+      {
+        if (mkdir(CACHE_DIR, 0755) != 0 && errno != EEXIST)
+          printErr("Cannot create " CACHE_DIR, __FILE__, __LINE__);
+        return (decoder_calibrate(argv[2], CACHE_DIR "/decoder.cache", TRUE) == 0 ? 0 : 1);
+      }
+      // Headless: decode the songs as fast as possible and time it
+      else if (strcmp(argv[1], "-bench") == 0)
+        return run_bench(argc, argv, (readaheadFlag == FALSE ? RA_MODE_READ : (mmapFlag == TRUE ? RA_MODE_MMAP : RA_MODE_READAHEAD)));
+      // Benchmarks of the player itself on a made up library (JSON)
+      else if (strcmp(argv[1], "-suite") == 0)
+        return run_suite(argc, argv, (readaheadFlag == FALSE ? RA_MODE_READ : (mmapFlag == TRUE ? RA_MODE_MMAP : RA_MODE_READAHEAD)));
       else if (strcmp(argv[1], "-songs") == 0)
       {
         for (index = 2; index < argc; index++)
         {
-          string = malloc(MAXDATALEN);
-          if (string == NULL)
-            perror("malloc: -songs");
-          strcpy(string, argv[index]);
-          playlist_add_song(index - 1, string, &init_playlist);
-          num_songs = argc - 2;
+          playlist_add_song(argv[index], &playlist);
+          num_songs = playlist_length(&playlist);
         }
         // FIXME I'm lazy right now; just threw this in so the test at the end
         // won't fail.
@@ -1065,24 +2618,31 @@ int main(int argc, char **argv)
       else if (strcmp(argv[1], "-usb") == 0)
       {
         // First, check to see if we need to halt
-        if (argc == 3)
+        for (i = 2; i < argc; i++)
         {
-          if (strcmp(argv[2], "-halt") == 0)
+          if (strcmp(argv[i], "-halt") == 0)
             haltFlag = TRUE;
         }
+        // Not the machine we're simulating on
+        if (hal_simulated())
+          haltFlag = FALSE;
         // Secondly, check if USB is mounted.
         playlistStatusErr = checkMount();
         if (playlistStatusErr != MOUNT_ERROR)
         {
           if (playlistStatusErr == FILES_OK)
-            init_playlist = reReadPlaylist("/MUSIC");
+          {
+            reReadPlaylist("/MUSIC", &playlist);
+            musicDir = "/MUSIC";
+          }
           if (num_songs == 0)
             playlistStatusErr = NO_FILES;
         }
       }
       else if (strcmp(argv[1], "-dir") == 0)
       {
-        init_playlist = reReadPlaylist(argv[2]);
+        reReadPlaylist(argv[2], &playlist);
+        musicDir = argv[2];
         if (num_songs == 0)
         {
           fprintf(stderr, "[%s - %d]: No songs found in directory %s\n", __FILE__, __LINE__, argv[2]);
@@ -1106,12 +2666,30 @@ int main(int argc, char **argv)
     (void)signal(SIGINT, die);
     (void)signal(SIGHUP, die);
     (void)signal(SIGTERM, die);
-    if (wiringPiSetup() == -1)
+    // Simulated board: name the pins for the script, which starts with hal_setup
+    if (hal_simulated())
+    {
+      hal_sim_pin("play", playButtonPin, HIGH);
+      hal_sim_pin("prev", prevButtonPin, HIGH);
+      hal_sim_pin("next", nextButtonPin, HIGH);
+      hal_sim_pin("info", infoButtonPin, HIGH);
+      hal_sim_pin("quit", quitButtonPin, HIGH);
+      hal_sim_pin("shuffle", shufButtonPin, HIGH);
+      hal_sim_pin("mute", muteButtonPin, HIGH);
+      hal_sim_pin("board", boardTestPin, LOW);
+      hal_sim_encoder("volume", encoderPinA, encoderPinB);
+      if (sim_script != NULL && hal_sim_script(sim_script) != 0)
+        return 1;
+      if (replay_file != NULL && rec_replay(replay_file, encoderPinA, encoderPinB, debounceDelay) != 0)
+        return 1;
+      hal_sim_render(isatty(STDOUT_FILENO));
+    }
+    if (hal_setup() == -1)
     {
       fprintf(stdout, "[%s - %d]: %s\n", __FILE__, __LINE__, strerror(errno));
       return 1;
     }
-    lcdHandle = lcdInit(RO, CO, BS, RS, EN, D0, D1, D2, D3, D0, D1, D2, D3);
+    lcdHandle = hal_lcd_init(RO, CO, BS, RS, EN, D0, D1, D2, D3, D0, D1, D2, D3);
     if (lcdHandle < 0)
     {
       fprintf(stderr, "[%s - %d]: %s: lcdInit failed\n", __FILE__, __LINE__, argv[0]);
@@ -1120,22 +2698,19 @@ int main(int argc, char **argv)
     // Setup buttons
     for (i = 0; i < numButtons; i++)
     {
-      pinMode(buttonPins[i], INPUT);
-      pullUpDnControl(buttonPins[i], PUD_UP);
+      hal_input(buttonPins[i]);
     }
-    // Setup our priority
-    piHiPri(99);
+    // The UI stays at normal priority; play_song and the read-ahead thread get theirs in rtsched.c
     // Setup board test
-    pinMode(boardTestPin, INPUT);
-    pullUpDnControl(boardTestPin, PUD_UP);
+    hal_input(boardTestPin);
     // Test to see if the display/buttons are attached.
     // CE0 is unused; so on the pcb attach CE0 to ground as we have set it up to the pull up resisitor
-    if (digitalRead(boardTestPin) == HIGH)
+    if (hal_read(boardTestPin) == HIGH)
     {
       if (haltFlag == TRUE)
       {
         wall("LCD and/or buttons not found. Shutting down.");
-        delay(1000);
+        hal_delay(1000);
         system("shutdown -h now");
       }
       else
@@ -1146,85 +2721,109 @@ int main(int argc, char **argv)
     struct encoder *vol_selector = setupencoder(encoderPinA, encoderPinB);
     if (vol_selector == NULL)
         exit(1);
-    int oldvalue = vol_selector->value;
-    snd_mixer_selem_id_t *sid;
-    snd_mixer_selem_id_alloca(&sid);
-    snd_mixer_selem_id_set_index(sid, 0);
-    snd_mixer_selem_id_set_name(sid, "PCM");
-    if (snd_mixer_open(&handle, 0) < 0)
-    {
-        printErr("Error openning mixer", __FILE__, __LINE__);
-        exit(1);
-    }
-    if (snd_mixer_attach(handle, card) < 0)
-    {
-        printErr("Error attaching mixer", __FILE__, __LINE__);
-        snd_mixer_close(handle);
-        exit(1);
-    }
-    if (snd_mixer_selem_register(handle, NULL, NULL) < 0)
-    {
-        printErr("Error registering mixer", __FILE__, __LINE__);
-        snd_mixer_close(handle);
-        exit(1);
-    }
-    if (snd_mixer_load(handle) < 0)
-    {
-        printErr("Error loading mixer", __FILE__, __LINE__);
-        snd_mixer_close(handle);
-        exit(1);
-    }
-    elem = snd_mixer_find_selem(handle, sid);
-    if (!elem)
-    {
-        printErr("Error finding simple control", __FILE__, __LINE__);
-        snd_mixer_close(handle);
-        exit(1);
-    }
+    int oldvalue = __atomic_load_n(&vol_selector->value, __ATOMIC_RELAXED);
+    // Where the knob was when it was last recorded (-record)
+    long recorded_value = oldvalue;
+    // Where it is now (the interrupt moves it)
+    long knob;
+    // Cards without a PCM mixer element just get the software volume
+    if (softVolFlag == FALSE && hal_mixer_open(card) != 0)
+        printErr("No hardware mixer; using software volume", __FILE__, __LINE__);
+    // Find out what rates the card really runs at, so we don't leave it to ALSA's plug
+    probe_rates();
     if (playlistStatusErr == FILES_OK)
     {
       song_index = 1;
-      if (shuffFlag == TRUE)
-        cur_playlist = randomize(init_playlist);
-      else
-        cur_playlist = init_playlist;
-      cur_song.play_status = PLAY;
+      if (playOrder != ORDER_FOUND && playlist_order(playOrder, &playlist) != 0)
+        printErr("Cannot sort the songs; playing them as found", __FILE__, __LINE__);
+      ui_command = PS_PLAY;
       strcpy(cur_song.prevTitle, cur_song.title);
       strcpy(cur_song.prevArtist, cur_song.artist);
+      if (mkdir(CACHE_DIR, 0755) != 0 && errno != EEXIST)
+        printErr("Cannot create " CACHE_DIR, __FILE__, __LINE__);
+      out_log_open(SESSION_LOG);
+      // Pick the fastest decoder for this board (first time only, or after mpg123 changes)
+      if (decoder_load(CACHE_DIR "/decoder.cache") != 0)
+      {
+        if (playlist_get_song(1, next_path, sizeof(next_path), &playlist) == 0)
+        {
+          hal_lcd_position(lcdHandle, 0, 0);
+          hal_lcd_puts(lcdHandle, "Calibrating...");
+          decoder_calibrate(next_path, CACHE_DIR "/decoder.cache", FALSE);
+          hal_lcd_clear(lcdHandle);
+        }
+      }
+      // Player, crossfade, tag reader (and analyzer, and library scan); made now so there's nothing to allocate per song
+      pool_fill(3 + (scanFlag == TRUE) + (tagsFlag == TRUE));
+      // The decoders are all there now; keep them (and whatever else the audio touches) in memory,
+      // before the read-ahead thread starts so it finds it locked and touches its stack too
+      if (lockFlag == TRUE && rt_lock_memory() != 0)
+        printErr("Cannot lock the player into memory", __FILE__, __LINE__);
+      // Keep the songs being played read well ahead of the decoder
+      if (readaheadFlag == TRUE && ra_init(mmapFlag == TRUE ? RA_MODE_MMAP : RA_MODE_READAHEAD) != 0)
+        printErr("Cannot start the read-ahead thread", __FILE__, __LINE__);
+      if (rtProbeFlag == TRUE)
+        rt_probe_start();
+      // Start working out the loudness of any untagged songs in the background
+      if (scanFlag == TRUE)
+        rgscan_start(CACHE_DIR "/replaygain.cache", musicDir, &playlist.paths);
+      // And what's in every song, for the library
+      if (tagsFlag == TRUE)
+        library_scan_start(&playlist.paths);
       /*
        * The below was once part of the while loop but I took it out so the playlist can loop.
        * TODO maybe in the future, add it as an option if you don't want it to loop?
        *
        *  && song_index < num_songs)
        */
-      while (cur_song.play_status != QUIT)
+      while (ui_command != PS_QUIT)
       {
         // Loop playlist; reset song to begining of list
         if (song_index > num_songs)
           song_index = 1;
-        string = malloc(MAXDATALEN);
-        if (string == NULL)
-          perror("malloc: song string");
-        playlist_get_song(song_index, (void **) &string, &cur_playlist);
-        if (string != NULL)
+        // Nothing gets allocated from here on (-allocs to check)
+        if (allocsFlag == TRUE)
+          alloc_stats(&track_allocs);
+        if (playlist_get_song(song_index, song_path, sizeof(song_path), &playlist) == 0)
         {
-          basec = strdup(string);
-          // Get just the filename, strip the path info and extension
-          bname = basename(basec);
-          strcpy(cur_song.filename, string);
-          strcpy(cur_song.base_filename, bname);
+          // What comes next (for the crossfade)
+          playlist_get_song((song_index + 1 > num_songs ? 1 : song_index + 1), next_path, sizeof(next_path), &playlist);
+          set_song(song_path, next_path);
           // See if we can get the song info from the file.
           id3_tagger();
+          if (showOrder == TRUE)
+          {
+            snprintf(cur_song.SecondRow_text, sizeof(cur_song.SecondRow_text), "%s", order_names[playOrder]);
+            showOrder = FALSE;
+          }
           // Play the song as a thread
+          tracks++;
+          ps_start(song_index);
           pthread_create(&song_thread, NULL, (void *) play_song, (void *) &cur_song);
-          // The following displays stuff to the LCD without scrolling
-          scroll_FirstRow_Flag = printLcdFirstRow();
-          scroll_SecondRow_Flag = printLcdSecondRow();
+          // The following displays stuff to the LCD without scrolling (unless it's the browser's)
+          if (browsing == TRUE)
+            browse_show(&browser, &playlist.lib);
+          else
+          {
+            scroll_FirstRow_Flag = printLcdFirstRow();
+            scroll_SecondRow_Flag = printLcdSecondRow();
+          }
           // Loop to play the song
-          while (cur_song.song_over == FALSE)
+          loop_mark = metrics_now();
+          while (songGoing(&state))
           {
+            loop_mark = metrics_since(MET_LOOP, loop_mark);
+            // Whatever tags the library scan has read (they wait while the library's being browsed)
+            if (browsing == FALSE)
+              library_poll(&playlist.lib);
+            knob = __atomic_load_n(&vol_selector->value, __ATOMIC_RELAXED);
+            if (knob != recorded_value)
+            {
+              rec_encoder(knob - recorded_value);
+              recorded_value = knob;
+            }
             // First row song-name
-            if (cur_song.play_status != PAUSE)
+            if (ps_paused() == FALSE && browsing == FALSE)
             {
               if (scroll_FirstRow_Flag == TRUE)
               {
@@ -1310,14 +2909,14 @@ int main(int argc, char **argv)
             /*
              * Play / Pause button
              */
-            reading = digitalRead(playButtonPin);
+            reading = hal_read(playButtonPin);
             // Check to see if you just pressed the button 
             // (i.e. the input went from HIGH to LOW),  and you've waited 
             // long enough since the last press to ignore any noise:  
             // If the switch changed, due to noise or pressing:
             if (reading != lastPlayButtonState)
-              lastPlayDebounceTime = millis(); // reset the debouncing timer
-            if ((millis() - lastPlayDebounceTime) > debounceDelay)
+              lastPlayDebounceTime = hal_millis(); // reset the debouncing timer
+            if ((hal_millis() - lastPlayDebounceTime) > debounceDelay)
             {
               // Whatever the reading is at, it's been there for longer
               // than the debounce delay, so take it as the actual current state:
@@ -1325,14 +2924,30 @@ int main(int argc, char **argv)
               if (reading != playButtonState)
               {
                 playButtonState = reading;
+                button_changed(playButtonPin, reading);
                 if (playButtonState == LOW)
                 {
-                  if (cur_song.play_status == PAUSE)
+                  if (browsing == TRUE)
+                    browsePick = TRUE;
+                  else if (ps_paused())
                   {
                     playMe();
+                    // Play what's showing in the filter menu, from its first song once this one's done
+                    if (filterMenu == TRUE)
+                    {
+                      filterMenu = FALSE;
+                      if (filter_pick(filterChoice, filterSong, playOrder, &playlist) == 0)
+                      {
+                        num_songs = playlist_length(&playlist);
+                        song_index = 0;
+                        snprintf(pause_text, sizeof(pause_text), "%s", filter_name(filterChoice, &playlist));
+                      }
+                      else
+                        strcpy(pause_text, "No such songs");
+                    }
                     strcpy(cur_song.SecondRow_text, pause_text);
-                    lcdPosition(lcdHandle, 0, 1);
-                    lcdPuts(lcdHandle, lcd_clear);
+                    hal_lcd_position(lcdHandle, 0, 1);
+                    hal_lcd_puts(lcdHandle, lcd_clear);
                     scroll_SecondRow_Flag = printLcdSecondRow();
                   }
                   else
@@ -1342,8 +2957,8 @@ int main(int argc, char **argv)
                     strcpy(pause_text, cur_song.SecondRow_text);
                     strcpy(cur_song.SecondRow_text, "PAUSED");
                     strcpy(cur_song.prevArtist, cur_song.artist);
-                    lcdPosition(lcdHandle, 0, 1);
-                    lcdPuts(lcdHandle, lcd_clear);
+                    hal_lcd_position(lcdHandle, 0, 1);
+                    hal_lcd_puts(lcdHandle, lcd_clear);
                     scroll_SecondRow_Flag = printLcdSecondRow();
                   }
                 }
@@ -1351,74 +2966,183 @@ int main(int argc, char **argv)
             }
             // Save the reading. Next time through the loop, it'll be the lastButtonState:
             lastPlayButtonState = reading;
-            // Don't even check to see if the prev/next/info/quit/shuffle buttons
+            /*
+             * Info button (the filter menu while paused; held down, the library browser)
+             */
+            reading = hal_read(infoButtonPin);
+            if (reading != lastInfoButtonState)
+              lastInfoDebounceTime = hal_millis();
+            if ((hal_millis() - lastInfoDebounceTime) > debounceDelay)
+            {
+              if (reading != infoButtonState)
+              {
+                infoButtonState = reading;
+                button_changed(infoButtonPin, reading);
+                if (infoButtonState == LOW && ps_paused())
+                {
+                  // Up, or (pressed again) away without picking anything
+                  filterMenu = (filterMenu == TRUE ? FALSE : TRUE);
+                  if (filterMenu == TRUE)
+                  {
+                    filterSong = playlist.order[song_index > 0 ? song_index - 1 : 0];
+                    filterChoice = FILTER_ALL;
+                    snprintf(cur_song.SecondRow_text, sizeof(cur_song.SecondRow_text), "%s", filter_name(filterChoice, &playlist));
+                  }
+                  else
+                    strcpy(cur_song.SecondRow_text, "PAUSED");
+                  hal_lcd_position(lcdHandle, 0, 1);
+                  hal_lcd_puts(lcdHandle, lcd_clear);
+                  scroll_SecondRow_Flag = printLcdSecondRow();
+                }
+                else if (infoButtonState == LOW && browsing == TRUE)
+                {
+                  // Back out to the albums (artists), and from the artists out of the browser
+                  if (browse_up(&browser) == 0)
+                    browse_show(&browser, &playlist.lib);
+                  else
+                  {
+                    browsing = FALSE;
+                    hal_lcd_clear(lcdHandle);
+                    scroll_FirstRow_Flag = printLcdFirstRow();
+                    scroll_SecondRow_Flag = printLcdSecondRow();
+                  }
+                }
+                else if (infoButtonState == LOW)
+                {
+                  // Held down long enough it's the browser (below); let go before that it's artist / album
+                  infoHeld = TRUE;
+                  infoPressTime = hal_millis();
+                }
+                else if (infoHeld == TRUE)
+                {
+                  infoHeld = FALSE;
+                  // TODO surely there's a better way than always running a strcmp ...
+                  // Toggle what to display
+                  strcpy(cur_song.SecondRow_text, (strcmp(cur_song.SecondRow_text, cur_song.artist) == 0 ? cur_song.album : cur_song.artist));
+                  // First clear just the second row, then re-display the second row
+                  hal_lcd_position(lcdHandle, 0, 1);
+                  hal_lcd_puts(lcdHandle, lcd_clear);
+                  scroll_SecondRow_Flag = printLcdSecondRow();
+//printf("scroll_SecondRow_flag: %s\n", printFlag(scroll_SecondRow_Flag));
+                }
+              }
+            }
+            lastInfoButtonState = reading;
+            if (infoHeld == TRUE && hal_millis() - infoPressTime >= BROWSE_HOLD_MS)
+            {
+              infoHeld = FALSE;
+              // The artists, from the first (the view's made now if it hasn't been)
+              if (ps_paused() == FALSE && browse_start(&browser, &playlist.lib) == 0)
+              {
+                browsing = TRUE;
+                scroll_FirstRow_Flag = scroll_SecondRow_Flag = FALSE;
+                browse_show(&browser, &playlist.lib);
+              }
+            }
+            // Don't even check to see if the prev/next/quit/shuffle buttons
             // have been pressed if we are in a pause state.
-            if (cur_song.play_status != PAUSE)
+            if (ps_paused() == FALSE)
             {
               /*
                * Mute
                */
-              reading = digitalRead(muteButtonPin);
+              reading = hal_read(muteButtonPin);
               if (reading != lastMuteButtonState)
-                lastMuteDebounceTime = millis();
-              if ((millis() - lastMuteDebounceTime) > debounceDelay)
+                lastMuteDebounceTime = hal_millis();
+              if ((hal_millis() - lastMuteDebounceTime) > debounceDelay)
               {
                 if (reading != muteButtonState)
                 {
                     muteButtonState = reading;
-                    if (muteButtonState == LOW)
+                    button_changed(muteButtonPin, reading);
+                    // The knob's button picks in the browser, as play does
+                    if (muteButtonState == LOW && browsing == TRUE)
+                      browsePick = TRUE;
+                    else if (muteButtonState == LOW)
                     {
-                      snd_mixer_selem_get_playback_switch(elem, 0, &ival);
-                      if (ival == 1) // 1 = muted
+                      if (toggle_mute() == TRUE)
                       {
                           strcpy(muted_text, cur_song.SecondRow_text);
                           strcpy(cur_song.SecondRow_text, "-- MUTED --");
                           strcpy(cur_song.prevArtist, cur_song.artist);
-                          lcdPosition(lcdHandle, 0, 1);
-                          lcdPuts(lcdHandle, lcd_clear);
+                          hal_lcd_position(lcdHandle, 0, 1);
+                          hal_lcd_puts(lcdHandle, lcd_clear);
                           scroll_SecondRow_Flag = printLcdSecondRow();
                       }
                       else
                       {
                           //if (muted_text[0] == '\0') strcpy(muted_text, cur_song.SecondRow_text);
                           strcpy(cur_song.SecondRow_text, muted_text);
-                          lcdPosition(lcdHandle, 0, 1);
-                          lcdPuts(lcdHandle, lcd_clear);
+                          hal_lcd_position(lcdHandle, 0, 1);
+                          hal_lcd_puts(lcdHandle, lcd_clear);
                           scroll_SecondRow_Flag = printLcdSecondRow();
                       }
-                      snd_mixer_selem_set_playback_switch(elem, 0, !ival);
                     }
                 }
               }
               lastMuteButtonState = reading;
               /*
-               * Volume (using rotary encoder)
+               * Library browser: into an artist or album, or play the track
                */
-              if (oldvalue != vol_selector->value)
+              if (browsePick == TRUE)
               {
-                  int change = vol_selector->value - oldvalue;
-                  int chn = 0;
-                  for (; chn <= SND_MIXER_SCHN_LAST; chn++)
+                browsePick = FALSE;
+                if (browse_down(&browser, &playlist.lib) == 0)
+                  browse_show(&browser, &playlist.lib);
+                else
+                {
+                  browsing = FALSE;
+                  if ((picked = browse_play(browse_song(&browser), &playlist)) > 0)
+                  {
+                    playOrder = ORDER_ARTIST;
+                    num_songs = playlist_length(&playlist);
+                    song_index = picked;
+                    nextSong();
+                  }
+                  else
                   {
-                      double vol = get_normalized_volume(elem);
-                      set_normalized_volume(elem, vol + (change * 0.00065105));
+                    hal_lcd_clear(lcdHandle);
+                    scroll_FirstRow_Flag = printLcdFirstRow();
+                    scroll_SecondRow_Flag = printLcdSecondRow();
                   }
-                  oldvalue = vol_selector->value;
+                }
+              }
+              /*
+               * Scrolling the browser (rotary encoder while it's up), a click at a time
+               */
+              if (browsing == TRUE)
+              {
+                if (knob - oldvalue >= ENCODER_DETENT || oldvalue - knob >= ENCODER_DETENT)
+                {
+                  // However many clicks since last time, and the rows drawn once for them all
+                  if (browse_move(&browser, &playlist.lib, (knob - oldvalue) / ENCODER_DETENT) != 0)
+                    browse_show(&browser, &playlist.lib);
+                  oldvalue += (knob - oldvalue) / ENCODER_DETENT * ENCODER_DETENT;
+                }
+              }
+              /*
+               * Volume (using rotary encoder)
+               */
+              else if (oldvalue != knob)
+              {
+                  change_volume(knob - oldvalue);
+                  oldvalue = knob;
               }
               /*
                * Previous button
                */
-              reading = digitalRead(prevButtonPin);
+              reading = hal_read(prevButtonPin);
               if (reading != lastPrevButtonState)
-                lastPrevDebounceTime = millis();
-              if ((millis() - lastPrevDebounceTime) > debounceDelay)
+                lastPrevDebounceTime = hal_millis();
+              if ((hal_millis() - lastPrevDebounceTime) > debounceDelay)
               {
                 if (reading != prevButtonState)
                 {
                   prevButtonState = reading;
+                  button_changed(prevButtonPin, reading);
                   if (prevButtonState == LOW)
                   {
-                    song_index = (song_index - 1 != 0 ? song_index - 1 : num_songs - 1);
+                    song_index = (song_index > 1 ? song_index - 1 : num_songs);
                     prevSong();
                   }
                 }
@@ -1427,58 +3151,35 @@ int main(int argc, char **argv)
               /*
                * Next button
                */
-              reading = digitalRead(nextButtonPin);
+              reading = hal_read(nextButtonPin);
               if (reading != lastNextButtonState)
-                lastNextDebounceTime = millis();
-              if ((millis() - lastNextDebounceTime) > debounceDelay)
+                lastNextDebounceTime = hal_millis();
+              if ((hal_millis() - lastNextDebounceTime) > debounceDelay)
               {
                 if (reading != nextButtonState)
                 {
                   nextButtonState = reading;
+                  button_changed(nextButtonPin, reading);
                   if (nextButtonState == LOW)
                   {
-                    song_index = (song_index + 1 < num_songs ? song_index + 1 : 1);
+                    song_index = (song_index < num_songs ? song_index + 1 : 1);
                     nextSong();
                   }
                 }
               }
               lastNextButtonState = reading;
-              /*
-               * Info button
-               */
-              reading = digitalRead(infoButtonPin);
-              if (reading != lastInfoButtonState)
-                lastInfoDebounceTime = millis();
-              if ((millis() - lastInfoDebounceTime) > debounceDelay)
-              {
-                if (reading != infoButtonState)
-                {
-                  infoButtonState = reading;
-                  if (infoButtonState == LOW)
-                  {
-                    // TODO surely there's a better way than always running a strcmp ...
-                    // Toggle what to display
-                    strcpy(cur_song.SecondRow_text, (strcmp(cur_song.SecondRow_text, cur_song.artist) == 0 ? cur_song.album : cur_song.artist));
-                    // First clear just the second row, then re-display the second row
-                    lcdPosition(lcdHandle, 0, 1);
-                    lcdPuts(lcdHandle, lcd_clear);
-                    scroll_SecondRow_Flag = printLcdSecondRow();
-//printf("scroll_SecondRow_flag: %s\n", printFlag(scroll_SecondRow_Flag));
-                  }
-                }
-              }
-              lastInfoButtonState = reading;
               /*
                * Quit button
                */
-              reading = digitalRead(quitButtonPin);
+              reading = hal_read(quitButtonPin);
               if (reading != lastQuitButtonState)
-                lastQuitDebounceTime = millis();
-              if ((millis() - lastQuitDebounceTime) > debounceDelay)
+                lastQuitDebounceTime = hal_millis();
+              if ((hal_millis() - lastQuitDebounceTime) > debounceDelay)
               {
                 if (reading != quitButtonState)
                 {
                   quitButtonState = reading;
+                  button_changed(quitButtonPin, reading);
                   if (quitButtonState == LOW)
                     quitMe();
                 }
@@ -1487,19 +3188,19 @@ int main(int argc, char **argv)
               /*
                * Shuffle button
                */
-              reading = digitalRead(shufButtonPin);
+              reading = hal_read(shufButtonPin);
               if (reading != lastShufButtonState)
-                lastShufDebounceTime = millis();
-              if ((millis() - lastShufDebounceTime) > debounceDelay)
+                lastShufDebounceTime = hal_millis();
+              if ((hal_millis() - lastShufDebounceTime) > debounceDelay)
               {
                 if (reading != shufButtonState)
                 {
                   shufButtonState = reading;
+                  button_changed(shufButtonPin, reading);
                   if (shufButtonState == LOW)
                   {
-                    // Toggle shuffle state
-                    // (NOTE: shuffFlag is useless here)
-                    shuffFlag = (shuffFlag == TRUE ? FALSE : TRUE);
+                    // On to the next order (folders, artist, title, newest, shuffled)
+                    playOrder = (playOrder + 1) % ORDERS;
                     // The following function signals to go to next song
                     // and sets the play status to SHUFFLE
                     shuffleMe();
@@ -1509,9 +3210,41 @@ int main(int argc, char **argv)
               lastShufButtonState = reading;
               // TODO if the following is put above, the sound skips ...
               // FIXME also ... if the following is removed / commented out the song skips ...
-              print_vol_num(elem);
+              if (browsing == FALSE)
+                print_vol_num();
 // HEYJOHN
             } // end ! pause
+            else
+            {
+              /*
+               * Filter menu (rotary encoder while it's up)
+               */
+              if (filterMenu == TRUE)
+              {
+                if (knob - oldvalue >= ENCODER_DETENT || oldvalue - knob >= ENCODER_DETENT)
+                {
+                  filterChoice = ((filterChoice + (knob - oldvalue) / ENCODER_DETENT) % filter_choices(&playlist)
+                                  + filter_choices(&playlist)) % filter_choices(&playlist);
+                  oldvalue += (knob - oldvalue) / ENCODER_DETENT * ENCODER_DETENT;
+                  snprintf(cur_song.SecondRow_text, sizeof(cur_song.SecondRow_text), "%s", filter_name(filterChoice, &playlist));
+                  hal_lcd_position(lcdHandle, 0, 1);
+                  hal_lcd_puts(lcdHandle, lcd_clear);
+                  scroll_SecondRow_Flag = printLcdSecondRow();
+                }
+              }
+              /*
+               * Speed (rotary encoder while paused)
+               */
+              else if (knob - oldvalue >= ENCODER_DETENT || oldvalue - knob >= ENCODER_DETENT)
+              {
+                change_speed((knob - oldvalue) / ENCODER_DETENT);
+                oldvalue += (knob - oldvalue) / ENCODER_DETENT * ENCODER_DETENT;
+                snprintf(cur_song.SecondRow_text, sizeof(cur_song.SecondRow_text), "PAUSED %.2fx", playback_speed);
+                hal_lcd_position(lcdHandle, 0, 1);
+                hal_lcd_puts(lcdHandle, lcd_clear);
+                scroll_SecondRow_Flag = printLcdSecondRow();
+              }
+            }
           } // end while
           // Reset all the flags.
           scroll_FirstRow_Flag = scroll_SecondRow_Flag = FALSE;
@@ -1521,106 +3254,139 @@ int main(int argc, char **argv)
           ctrSecondRowScroll = 0;
           if (pthread_join(song_thread, NULL) != 0)
             perror("join error\n");
+          out_log_flush();
+          // A button pressed just as it finished is for us rather than play_song now
+          ps_take_command();
+          ps_read(&state);
+          song_over = state.song_over;
           // Clear the lcd for next song.
-          lcdClear(lcdHandle);
+          hal_lcd_clear(lcdHandle);
+          if (allocsFlag == TRUE)
+          {
+            alloc_stats(&now_allocs);
+            fprintf(stderr, "allocs: track %lu (%s): %lu allocs, %lu frees, %.1f KB\n", tracks, cur_song.base_filename,
+                    now_allocs.allocs - track_allocs.allocs, now_allocs.frees - track_allocs.frees,
+                    (now_allocs.bytes - track_allocs.bytes) / 1024.0);
+          }
         }
-        lcdClear(lcdHandle);
+        else
+        {
+          // Longer than PATH_MAX; nothing could open it anyway
+          printErr("Song path too long; skipping it", __FILE__, __LINE__);
+          song_over = TRUE;
+        }
+        hal_lcd_clear(lcdHandle);
         // Increment the song_index if the song is over but the next/prev wasn't hit
-        if (cur_song.song_over == TRUE && cur_song.play_status == PLAY)
+        if (song_over == TRUE && ui_command == PS_PLAY)
         {
-          pthread_mutex_lock(&cur_song.pauseMutex);
-          cur_song.song_over = FALSE;
-          pthread_mutex_unlock(&cur_song.pauseMutex);
+          song_over = FALSE;
           song_index++;
         }
         // Reset everything if next, prev, or shuffle buttons were pressed
-        else if (cur_song.song_over == TRUE && (cur_song.play_status == NEXT || cur_song.play_status == PREV || cur_song.play_status == SHUFFLE))
+        else if (song_over == TRUE && (ui_command == PS_NEXT || ui_command == PS_PREV || ui_command == PS_SHUFFLE))
         {
-          pthread_mutex_lock(&cur_song.pauseMutex);
           // Empty out song/artist data
           strcpy(cur_song.title, "");
           strcpy(cur_song.artist, "");
           strcpy(cur_song.album, "");
-          if (cur_song.play_status == SHUFFLE)
+          if (ui_command == PS_SHUFFLE)
           {
-            if (shuffFlag == TRUE)
-              cur_playlist = randomize(init_playlist);
-            else
-              cur_playlist = init_playlist;
+            if (playlist_order(playOrder, &playlist) != 0)
+              printErr("Cannot sort the songs; keeping the order", __FILE__, __LINE__);
             song_index = 1;
+            showOrder = TRUE;
           }
-          cur_song.play_status = PLAY;
-          cur_song.song_over = FALSE;
-          pthread_mutex_unlock(&cur_song.pauseMutex);
+          ui_command = PS_PLAY;
+          song_over = FALSE;
         }
       }
       // Quit button was pressed
-      lcdClear(lcdHandle);
-      if (handle != NULL)
-          snd_mixer_close(handle);
+      rgscan_stop();
+      library_scan_stop();
+      rt_probe_stop();
+      rt_report(stderr);
+      out_report(stderr);
+      out_log_close();
+      pool_report(stderr, tracks);
+      pool_shutdown();
+      paths_report(stderr, &playlist.paths);
+      library_report(stderr, &playlist.lib);
+      if (readaheadFlag == TRUE)
+        ra_report(stderr);
+      ra_shutdown();
+      rec_stop();
+      if (trace_file != NULL)
+        trace_write(trace_file);
+      if (hal_simulated())
+      {
+        hal_sim_report(stderr);
+        metrics_dump(stderr);
+      }
+      hal_lcd_clear(lcdHandle);
+      hal_mixer_close();
       // Don't shutdown unless the quit button was pressed.
-      if (cur_song.play_status == QUIT)
+      if (ui_command == PS_QUIT)
       {
-        lcdPosition(lcdHandle, 0, 0);
-        lcdPuts(lcdHandle, "Good Bye!");
-        lcdPosition(lcdHandle, 0, 1);
+        hal_lcd_position(lcdHandle, 0, 0);
+        hal_lcd_puts(lcdHandle, "Good Bye!");
+        hal_lcd_position(lcdHandle, 0, 1);
         if (haltFlag == TRUE)
         {
-          lcdPuts(lcdHandle, "Shuting down.");
-          delay(1000);
+          hal_lcd_puts(lcdHandle, "Shuting down.");
+          hal_delay(1000);
           system("shutdown -h now");
         }
         else
-          lcdPuts(lcdHandle, "Please shutdown.");
+          hal_lcd_puts(lcdHandle, "Please shutdown.");
       }
       // The following will never happen because the playlist loops now
       // TODO either remove it or add a possible "loop" flag option
       /*
       else
       {
-        lcdPosition(lcdHandle, 0, 0);
-        lcdPuts(lcdHandle, "No more songs.");
-        lcdPosition(lcdHandle, 0, 1);
+        hal_lcd_position(lcdHandle, 0, 0);
+        hal_lcd_puts(lcdHandle, "No more songs.");
+        hal_lcd_position(lcdHandle, 0, 1);
         if (haltFlag == TRUE)
         {
-          lcdPuts(lcdHandle, "Shuting down.");
-          delay(1000);
+          hal_lcd_puts(lcdHandle, "Shuting down.");
+          hal_delay(1000);
           system("shutdown -h now");
         }
         else
-          lcdPuts(lcdHandle, "Please shutdown.");
+          hal_lcd_puts(lcdHandle, "Please shutdown.");
       }
       */
     }
     else if (playlistStatusErr == MOUNT_ERROR)
     {
-        lcdClear(lcdHandle);
-        lcdPosition(lcdHandle, 0, 0);
-        lcdPuts(lcdHandle, "No USB inserted.");
-        lcdPosition(lcdHandle, 0, 1);
+        hal_lcd_clear(lcdHandle);
+        hal_lcd_position(lcdHandle, 0, 0);
+        hal_lcd_puts(lcdHandle, "No USB inserted.");
+        hal_lcd_position(lcdHandle, 0, 1);
         if (haltFlag == TRUE)
         {
-            lcdPuts(lcdHandle, "Shutting down.");
-            delay(1000);
+            hal_lcd_puts(lcdHandle, "Shutting down.");
+            hal_delay(1000);
             system("shutdown -h now");
         }
         else
-            lcdPuts(lcdHandle, "Please shutdown.");
+            hal_lcd_puts(lcdHandle, "Please shutdown.");
     }
     else if (playlistStatusErr == NO_FILES)
     {
-        lcdClear(lcdHandle);
-        lcdPosition(lcdHandle, 0, 0);
-        lcdPuts(lcdHandle, "No songs on USB.");
-        lcdPosition(lcdHandle, 0, 1);
+        hal_lcd_clear(lcdHandle);
+        hal_lcd_position(lcdHandle, 0, 0);
+        hal_lcd_puts(lcdHandle, "No songs on USB.");
+        hal_lcd_position(lcdHandle, 0, 1);
         if (haltFlag == TRUE)
         {
-            lcdPuts(lcdHandle, "Shutting down.");
-            delay(1000);
+            hal_lcd_puts(lcdHandle, "Shutting down.");
+            hal_delay(1000);
             system("shutdown -h now");
         }
         else
-          lcdPuts(lcdHandle, "Please shutdown.");
+          hal_lcd_puts(lcdHandle, "Please shutdown.");
     }
     return 0;
 }
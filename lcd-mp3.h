@@ -11,6 +11,11 @@
 #include <mpg123.h>
 // for id3
 #include <sys/types.h>
+// for the playlist
+#include <limits.h>
+#include "paths.h"
+#include "library.h"
+#include "browse.h"
 
 // # defines:
 #ifndef	TRUE
@@ -48,18 +53,34 @@ typedef enum {
 	QUIT
 } status_enum;
 
-// playlist
-typedef struct playlist_node {
-  int index;
-  void *songptr;
-  struct playlist_node *nextptr;
-} playlist_node_t;
+// Orders to play in (-order; the shuffle button steps through them)
+typedef enum {
+	ORDER_FOUND,    // as the directories were read
+	ORDER_ARTIST,   // by artist, album and track
+	ORDER_TITLE,
+	ORDER_ADDED,    // newest first
+	ORDER_SHUFFLE,
+	ORDERS
+} order_enum;
 
-typedef playlist_node_t *playlist_t;
+// playlist: where the songs are, what's in them, and the order they're played in (song N is order[N - 1])
+typedef struct playlist {
+  struct path_store paths;
+  struct library lib;   // by the same file ids
+  int *order;           // file ids in the path store
+  int length;           // songs in 'order' (all of them, unless they're filtered)
+  int max_songs;        // room in 'order'
+  // Whether only some songs are played, what by (library ids; 0 for any), and which ones
+  int filtered;
+  uint32_t filter_by[LIB_FIELDS];
+  struct bitmap filter;
+  struct bitmap work[2];  // for working the next one out, so a new filter allocates nothing
+} playlist_t;
 
 struct song_info {
 	char base_filename[MAXDATALEN];
-	char filename[MAXDATALEN];
+	char filename[PATH_MAX];
+	char next_filename[PATH_MAX];
 	char title[MAXDATALEN];
 	char artist[MAXDATALEN];
 	char genre[MAXDATALEN];
@@ -70,21 +91,19 @@ struct song_info {
 	char SecondRow_text[MAXDATALEN];
 	char scroll_FirstRow[32];
 	char scroll_SecondRow[32];
+	double rg_gain; // ReplayGain track gain in dB (from the tags)
+	double rg_peak; // ReplayGain track peak; 0 if unknown
 	int song_number;
-	int song_over;
-	int play_status;
-	pthread_mutex_t pauseMutex;
-	pthread_mutex_t writeMutex;
-	pthread_cond_t m_resumeCond;
 }; struct song_info cur_song;
 
-// TODO use this somewhere... because right now it's not being used.
-struct play_status {
-	int is_playing;
-	int is_paused;
-	int is_stopped;
-	int song_over;
-}; struct play_status cur_status;
+// -bench: where play_song's time goes, per track
+struct bench_track {
+	double tags_secs;    // id3_tagger
+	double decode_secs;  // mpg123_read (including the file reads)
+	double dsp_secs;     // gain / EQ / speed / rate / crossfade
+	double output_secs;  // ao_play
+	double audio_secs;   // how much audio came out
+};
 
 // Musical note char for LCD
 static unsigned char musicNote[8] = {
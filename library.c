@@ -0,0 +1,655 @@
+/*
+ * library.c
+ *
+ * What's on the stick, by artist, album, genre and title.
+ *
+ * The only song anything was known about used to be the one playing:
+ * id3_tagger filled cur_song's 256 byte buffers for it and they were
+ * overwritten by the next one.  Here every song in the playlist has an entry,
+ * kept as a handful of parallel arrays indexed by the song's file id in the
+ * path store rather than as a struct per song: an artist, album and genre
+ * are small ids into tables where each name is stored once (strtab.c, as
+ * the path store's directories are), and a title is an offset into
+ * one long run of them.  Anything that goes through the whole library for
+ * one field (grouping by artist, picking out a genre) walks one contiguous
+ * array of 2 or 4 byte ids instead of striding over kilobytes of strings.
+ *
+ * A song gets its entry as it's added to the playlist, with the artist and
+ * album guessed from the directories it's in (and the track number from its
+ * name).  Sorted views of the library (views.c) are kept in order as songs
+ * are added and change, and so are bitmaps (bitmap.c) of every artist's,
+ * album's and genre's songs, for picking them out.  Then a low priority thread
+ * reads every song's ID3 tag and queues what it finds, and the main loop
+ * takes that into the library with library_poll, so the library only ever
+ * changes in the thread that reads it and doesn't need a lock of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <mpg123.h>
+
+#include "library.h"
+#include "pool.h"
+#include "rtsched.h"
+#include "trace.h"
+
+// Tags read by the scan for library_poll to pick up
+static struct lib_tags queue[LIB_QUEUE];
+static int queue_head = 0;
+static int queued = 0;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+static const struct path_store *scan_paths;
+static pthread_t scan_thread;
+static int scan_running = 0;
+// Set from the main thread while the scan runs
+static int scan_stop = 0;
+// Cleared by the scan when it's been through every song
+static int scan_busy = 0;
+
+void library_init(struct library *lib)
+{
+    memset(lib, 0, sizeof(*lib));
+}
+
+// The id of (parent, s), added if it's not there already; 0 for "", -1 if out of memory
+static int intern(struct str_table *t, uint32_t parent, const char *s, size_t len)
+{
+    if (len == 0)
+        return 0;
+    return strtab_intern(t, parent, s, len);
+}
+
+const char *library_string(const struct str_table *t, uint32_t id)
+{
+    if (id == 0 || id > (uint32_t)t->count)
+        return "";
+    return t->arena + t->names[id - 1];
+}
+
+uint32_t library_album_artist(const struct library *lib, uint32_t album)
+{
+    if (album == 0 || album > (uint32_t)lib->albums.count)
+        return 0;
+    return lib->albums.parents[album - 1];
+}
+
+// Song 'id' into the bitmap for 'value' (made if it's the first); 0, or -1 if out of memory
+static int index_add(struct lib_index *x, uint32_t value, int id)
+{
+    int n = (x->max > 0 ? x->max * 2 : 64), i;
+    struct bitmap *more;
+
+    if (value == 0)
+        return 0;
+    if (value >= (uint32_t)x->max)
+    {
+        while ((uint32_t)n <= value)
+            n *= 2;
+        more = realloc(x->songs, n * sizeof(struct bitmap));
+        if (more == NULL)
+        {
+            perror("realloc: library");
+            return -1;
+        }
+        for (i = x->max; i < n; i++)
+            bitmap_init(&more[i]);
+        x->songs = more;
+        x->max = n;
+    }
+    return bitmap_add(&x->songs[value], id);
+}
+
+static void index_remove(struct lib_index *x, uint32_t value, int id)
+{
+    if (value != 0 && value < (uint32_t)x->max)
+        bitmap_remove(&x->songs[value], id);
+}
+
+/*
+  Move song 'id' in each index from what it was to what it is now; if
+  there's no room for it under a new one it's left where it was in all of
+  them.  0, or -1 if out of memory
+*/
+static int index_move(struct library *lib, int id, const uint32_t was[LIB_FIELDS], const uint32_t now[LIB_FIELDS])
+{
+    int f;
+
+    for (f = 0; f < LIB_FIELDS; f++)
+    {
+        if (now[f] != was[f] && index_add(&lib->index[f], now[f], id) != 0)
+        {
+            while (--f >= 0)
+            {
+                if (now[f] != was[f])
+                    index_remove(&lib->index[f], now[f], id);
+            }
+            return -1;
+        }
+    }
+    for (f = 0; f < LIB_FIELDS; f++)
+    {
+        if (now[f] != was[f])
+            index_remove(&lib->index[f], was[f], id);
+    }
+    return 0;
+}
+
+static void index_free(struct lib_index *x)
+{
+    int i;
+
+    for (i = 0; i < x->max; i++)
+        bitmap_free(&x->songs[i]);
+    free(x->songs);
+    x->songs = NULL;
+    x->max = 0;
+}
+
+// Room in every array for one more song
+static int grow_tracks(struct library *lib)
+{
+    int n = (lib->max_tracks > 0 ? lib->max_tracks * 2 : 256);
+    void *more;
+
+    if (lib->num_tracks < lib->max_tracks)
+        return 0;
+    // Each one is kept as soon as it's bigger, so a failure part way through leaves them all usable
+    if ((more = realloc(lib->artist, n * sizeof(uint32_t))) == NULL)
+        goto fail;
+    lib->artist = more;
+    if ((more = realloc(lib->album, n * sizeof(uint32_t))) == NULL)
+        goto fail;
+    lib->album = more;
+    if ((more = realloc(lib->genre, n * sizeof(uint16_t))) == NULL)
+        goto fail;
+    lib->genre = more;
+    if ((more = realloc(lib->title, n * sizeof(uint32_t))) == NULL)
+        goto fail;
+    lib->title = more;
+    if ((more = realloc(lib->disc, n * sizeof(uint8_t))) == NULL)
+        goto fail;
+    lib->disc = more;
+    if ((more = realloc(lib->track, n * sizeof(uint16_t))) == NULL)
+        goto fail;
+    lib->track = more;
+    if ((more = realloc(lib->added, n * sizeof(uint32_t))) == NULL)
+        goto fail;
+    lib->added = more;
+    if ((more = realloc(lib->flags, n * sizeof(uint8_t))) == NULL)
+        goto fail;
+    lib->flags = more;
+    lib->max_tracks = n;
+    return 0;
+fail:
+    perror("realloc: library");
+    return -1;
+}
+
+// A directory's name, if it's below the top one (the top's is the whole path it was given)
+static const char *dir_name(const struct path_store *paths, int dir)
+{
+    if (paths_dir_parent(paths, dir) < 0)
+        return NULL;
+    return paths_dir_name(paths, dir);
+}
+
+// "07 - Song.mp3" is track 7, and "107 Song.mp3" disc 1, track 7
+static void guess_number(const char *name, uint8_t *disc, uint16_t *track)
+{
+    int n = 0, digits = 0;
+
+    while (digits < 4 && name[digits] >= '0' && name[digits] <= '9')
+        n = n * 10 + (name[digits++] - '0');
+    *disc = 0;
+    *track = 0;
+    if (digits == 0 || digits == 4)
+        return;
+    if (n >= 100)
+    {
+        *disc = n / 100;
+        n %= 100;
+    }
+    *track = n;
+}
+
+int library_add(struct library *lib, const struct path_store *paths, int id)
+{
+    const char *album, *artist;
+    uint32_t none[LIB_FIELDS] = {0}, fields[LIB_FIELDS] = {0};
+    int dir, album_id = 0, artist_id = 0, v;
+
+    if (id != lib->num_tracks || id >= paths->num_files)
+    {
+        fprintf(stderr, "[%s - %d]: Song %d added out of order\n", __FILE__, __LINE__, id);
+        return -1;
+    }
+    if (grow_tracks(lib) != 0)
+        return -1;
+    lib->paths = paths;
+    dir = paths->files[id].dir;
+    if ((album = dir_name(paths, dir)) != NULL)
+    {
+        if ((artist = dir_name(paths, paths_dir_parent(paths, dir))) != NULL)
+            artist_id = intern(&lib->artists, 0, artist, strlen(artist));
+        if (artist_id >= 0)
+            album_id = intern(&lib->albums, artist_id, album, strlen(album));
+    }
+    if (album_id < 0 || artist_id < 0)
+        return -1;
+    fields[LIB_ARTIST] = artist_id;
+    fields[LIB_ALBUM] = album_id;
+    if (index_move(lib, id, none, fields) != 0)
+        return -1;
+    lib->artist[id] = artist_id;
+    lib->album[id] = album_id;
+    lib->genre[id] = 0;
+    lib->title[id] = LIB_NO_TITLE;
+    guess_number(paths_name(paths, id), &lib->disc[id], &lib->track[id]);
+    lib->added[id] = 0;
+    lib->flags[id] = 0;
+    lib->num_tracks++;
+    for (v = 0; v < VIEWS; v++)
+    {
+        // Can't keep it up to date without room for it; it'll be made again when it's next wanted
+        if (lib->views[v].built && view_insert(&lib->views[v], v, lib, id) != 0)
+            view_free(&lib->views[v]);
+    }
+    return 0;
+}
+
+int library_set(struct library *lib, const struct lib_tags *t)
+{
+    uint32_t title, artist, album, was[LIB_FIELDS], now[LIB_FIELDS];
+    const char *album_name = t->album;
+    int id = t->id, genre, pos[VIEWS], v, n;
+
+    if (id < 0 || id >= lib->num_tracks)
+        return -1;
+    // Everything that could run out of memory first, so a song's never left half changed
+    artist = lib->artist[id];
+    if (t->artist[0] != '\0')
+    {
+        if ((n = intern(&lib->artists, 0, t->artist, strlen(t->artist))) < 0)
+            return -1;
+        artist = n;
+    }
+    // A new artist moves the album it had (guessed or not) to them
+    if (album_name[0] == '\0' && artist != lib->artist[id])
+        album_name = library_string(&lib->albums, lib->album[id]);
+    album = lib->album[id];
+    if (album_name[0] != '\0')
+    {
+        if ((n = intern(&lib->albums, artist, album_name, strlen(album_name))) < 0)
+            return -1;
+        album = n;
+    }
+    genre = lib->genre[id];
+    if (t->genre[0] != '\0')
+    {
+        if ((n = intern(&lib->genres, 0, t->genre, strlen(t->genre))) < 0)
+            return -1;
+        // Not many genres; any past what fits are left unknown
+        genre = (n <= UINT16_MAX ? n : 0);
+    }
+    // Only a changed title takes more room
+    title = lib->title[id];
+    if (t->title[0] != '\0' && (title == LIB_NO_TITLE || strcmp(lib->titles.arena + title, t->title) != 0)
+        && (title = strtab_add(&lib->titles, t->title, strlen(t->title))) == (uint32_t)-1)
+        return -1;
+    // A song that's gone isn't in the indexes any more, and doesn't go back in
+    if (!(lib->flags[id] & LIB_GONE))
+    {
+        was[LIB_ARTIST] = lib->artist[id];
+        was[LIB_ALBUM] = lib->album[id];
+        was[LIB_GENRE] = lib->genre[id];
+        now[LIB_ARTIST] = artist;
+        now[LIB_ALBUM] = album;
+        now[LIB_GENRE] = genre;
+        if (index_move(lib, id, was, now) != 0)
+            return -1;
+    }
+    // Where it is in the views by what it was...
+    for (v = 0; v < VIEWS; v++)
+        pos[v] = (lib->views[v].built ? view_find(&lib->views[v], v, lib, id) : -1);
+    lib->artist[id] = artist;
+    lib->album[id] = album;
+    lib->genre[id] = genre;
+    lib->title[id] = title;
+    if (t->disc > 0 && t->disc <= UINT8_MAX)
+        lib->disc[id] = t->disc;
+    if (t->track > 0 && t->track <= UINT16_MAX)
+        lib->track[id] = t->track;
+    if (t->added > 0)
+        lib->added[id] = t->added;
+    if (t->title[0] != '\0' || t->artist[0] != '\0' || t->album[0] != '\0' || t->genre[0] != '\0')
+        lib->flags[id] |= LIB_TAGGED;
+    // ...and then to where it goes now
+    for (v = 0; v < VIEWS; v++)
+    {
+        if (pos[v] >= 0)
+            view_moved(&lib->views[v], v, lib, pos[v]);
+    }
+    return 0;
+}
+
+void library_remove(struct library *lib, int id)
+{
+    int v, pos;
+
+    if (id < 0 || id >= lib->num_tracks || (lib->flags[id] & LIB_GONE))
+        return;
+    for (v = 0; v < VIEWS; v++)
+    {
+        if (lib->views[v].built && (pos = view_find(&lib->views[v], v, lib, id)) >= 0)
+            view_remove(&lib->views[v], pos);
+    }
+    index_remove(&lib->index[LIB_ARTIST], lib->artist[id], id);
+    index_remove(&lib->index[LIB_ALBUM], lib->album[id], id);
+    index_remove(&lib->index[LIB_GENRE], lib->genre[id], id);
+    lib->flags[id] |= LIB_GONE;
+}
+
+int library_order(struct library *lib, int order, const int **ids)
+{
+    struct lib_view *v = &lib->views[order];
+
+    if (!v->built && view_build(v, order, lib) != 0)
+        return -1;
+    *ids = v->ids;
+    return v->count;
+}
+
+const struct bitmap *library_songs(const struct library *lib, int field, uint32_t value)
+{
+    static const struct bitmap none;
+
+    if (field < 0 || field >= LIB_FIELDS || value == 0 || value >= (uint32_t)lib->index[field].max)
+        return &none;
+    return &lib->index[field].songs[value];
+}
+
+const char *library_artist(const struct library *lib, int id)
+{
+    return (id >= 0 && id < lib->num_tracks ? library_string(&lib->artists, lib->artist[id]) : "");
+}
+
+const char *library_album(const struct library *lib, int id)
+{
+    return (id >= 0 && id < lib->num_tracks ? library_string(&lib->albums, lib->album[id]) : "");
+}
+
+const char *library_genre(const struct library *lib, int id)
+{
+    return (id >= 0 && id < lib->num_tracks ? library_string(&lib->genres, lib->genre[id]) : "");
+}
+
+const char *library_title(const struct library *lib, int id)
+{
+    const char *name;
+
+    if (id < 0 || id >= lib->num_tracks)
+        return "";
+    if (lib->title[id] != LIB_NO_TITLE)
+        return lib->titles.arena + lib->title[id];
+    name = paths_name(lib->paths, id);
+    return (name != NULL ? name : "");
+}
+
+static size_t index_bytes(const struct lib_index *x)
+{
+    size_t n = x->max * sizeof(struct bitmap);
+    int i;
+
+    for (i = 0; i < x->max; i++)
+        n += bitmap_bytes(&x->songs[i]);
+    return n;
+}
+
+void library_stats(const struct library *lib, struct library_stats *s)
+{
+    int i;
+
+    s->tracks = lib->num_tracks;
+    s->tagged = 0;
+    for (i = 0; i < lib->num_tracks; i++)
+        s->tagged += (lib->flags[i] & LIB_TAGGED);
+    s->artists = lib->artists.count;
+    s->albums = lib->albums.count;
+    s->genres = lib->genres.count;
+    s->track_bytes = lib->max_tracks * (4 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + 2 * sizeof(uint8_t));
+    s->view_bytes = 0;
+    for (i = 0; i < VIEWS; i++)
+        s->view_bytes += lib->views[i].max * sizeof(int);
+    s->index_bytes = 0;
+    for (i = 0; i < LIB_FIELDS; i++)
+        s->index_bytes += index_bytes(&lib->index[i]);
+    s->bytes = s->track_bytes + strtab_bytes(&lib->artists) + strtab_bytes(&lib->albums)
+               + strtab_bytes(&lib->genres) + strtab_bytes(&lib->titles) + s->view_bytes + s->index_bytes;
+}
+
+void library_report(FILE *fp, const struct library *lib)
+{
+    struct library_stats s;
+
+    library_stats(lib, &s);
+    fprintf(fp, "library: %d songs (%d tagged), %d artists, %d albums, %d genres, %.1f KB (%.1f bytes a song)\n",
+            s.tracks, s.tagged, s.artists, s.albums, s.genres, s.bytes / 1024.0,
+            (s.tracks ? (double)s.bytes / s.tracks : 0.0));
+}
+
+void library_free(struct library *lib)
+{
+    int v;
+
+    for (v = 0; v < VIEWS; v++)
+        view_free(&lib->views[v]);
+    for (v = 0; v < LIB_FIELDS; v++)
+        index_free(&lib->index[v]);
+    free(lib->artist);
+    free(lib->album);
+    free(lib->genre);
+    free(lib->title);
+    free(lib->disc);
+    free(lib->track);
+    free(lib->added);
+    free(lib->flags);
+    strtab_free(&lib->artists);
+    strtab_free(&lib->albums);
+    strtab_free(&lib->genres);
+    strtab_free(&lib->titles);
+    library_init(lib);
+}
+
+/*
+ * The tag scan
+ */
+
+// The first line of a tag's text, without the spaces ID3v1 pads with
+static void tag_text(char *buf, const char *text, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len && n < LIB_TAG_LEN - 1 && text[n] != '\0' && text[n] != '\n' && text[n] != '\r')
+    {
+        buf[n] = text[n];
+        n++;
+    }
+    while (n > 0 && buf[n - 1] == ' ')
+        n--;
+    buf[n] = '\0';
+}
+
+static void tag_string(char *buf, const mpg123_string *s)
+{
+    if (s != NULL && s->fill > 0)
+        tag_text(buf, s->p, s->fill);
+    else
+        buf[0] = '\0';
+}
+
+// "3/12" is 3
+static int tag_number(const mpg123_string *s)
+{
+    char buf[16];
+
+    tag_string(buf, s);
+    return atoi(buf);
+}
+
+/*
+  What the file's tag says into t (everything empty or 0 if it hasn't got
+  one); -1 if the file couldn't be opened
+*/
+static int read_tags(mpg123_handle *mh, const char *path, struct lib_tags *t)
+{
+    mpg123_id3v1 *v1;
+    mpg123_id3v2 *v2;
+    long rate;
+    int channels, encoding, ret = -1;
+    size_t i;
+
+    t->title[0] = t->artist[0] = t->album[0] = t->genre[0] = '\0';
+    t->disc = t->track = 0;
+    // Getting the format reads as far as the first frame, which is past an ID3v2 tag
+    if (mpg123_open(mh, path) == MPG123_OK && mpg123_getformat(mh, &rate, &channels, &encoding) == MPG123_OK)
+    {
+        ret = 0;
+        if ((mpg123_meta_check(mh) & MPG123_ID3) && mpg123_id3(mh, &v1, &v2) == MPG123_OK)
+        {
+            if (v2 != NULL)
+            {
+                tag_string(t->title, v2->title);
+                tag_string(t->artist, v2->artist);
+                tag_string(t->album, v2->album);
+                tag_string(t->genre, v2->genre);
+                for (i = 0; i < v2->texts; i++)
+                {
+                    if (memcmp(v2->text[i].id, "TRCK", 4) == 0)
+                        t->track = tag_number(&v2->text[i].text);
+                    else if (memcmp(v2->text[i].id, "TPOS", 4) == 0)
+                        t->disc = tag_number(&v2->text[i].text);
+                }
+            }
+            else if (v1 != NULL)
+            {
+                tag_text(t->title, v1->title, sizeof(v1->title));
+                tag_text(t->artist, v1->artist, sizeof(v1->artist));
+                tag_text(t->album, v1->album, sizeof(v1->album));
+                // Just a number, and there's no list of them in mpg123
+                t->genre[0] = '\0';
+                // ID3v1.1 puts the track in the last byte of the comment
+                if (v1->comment[28] == '\0')
+                    t->track = (unsigned char)v1->comment[29];
+            }
+        }
+    }
+    mpg123_close(mh);
+    return ret;
+}
+
+static void *scan_main(void *arg)
+{
+    mpg123_handle *mh;
+    struct lib_tags t;
+    struct stat st;
+    char path[PATH_MAX];
+    unsigned long long start;
+    int i, failed;
+
+    rt_idle_thread();
+    trace_thread("tags");
+    // One handle for the whole scan (the pool has one set aside for it)
+    if ((mh = pool_get(NULL, NULL)) == NULL)
+    {
+        __atomic_store_n(&scan_busy, 0, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (i = 0; i < scan_paths->num_files && !__atomic_load_n(&scan_stop, __ATOMIC_RELAXED); i++)
+    {
+        if (paths_get(scan_paths, i, path, sizeof(path)) >= (int)sizeof(path) || stat(path, &st) != 0)
+            continue;
+        start = trace_now();
+        failed = read_tags(mh, path, &t);
+        trace_span(TR_TAGS, start, i);
+        if (failed)
+            continue;
+        t.id = i;
+        t.added = st.st_mtime;
+        pthread_mutex_lock(&queueMutex);
+        while (queued == LIB_QUEUE && !__atomic_load_n(&scan_stop, __ATOMIC_RELAXED))
+            pthread_cond_wait(&queueCond, &queueMutex);
+        if (queued < LIB_QUEUE)
+        {
+            queue[(queue_head + queued) % LIB_QUEUE] = t;
+            __atomic_store_n(&queued, queued + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&queueMutex);
+    }
+    pool_put(mh);
+    __atomic_store_n(&scan_busy, 0, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int library_scan_start(const struct path_store *paths)
+{
+    scan_paths = paths;
+    scan_stop = 0;
+    scan_busy = 1;
+    // library_poll in the UI takes the queue from a thread at the lowest priority there is
+    rt_mutex_inherit(&queueMutex);
+    if (pthread_create(&scan_thread, NULL, scan_main, NULL) != 0)
+    {
+        perror("pthread_create: library");
+        scan_busy = 0;
+        return -1;
+    }
+    scan_running = 1;
+    return 0;
+}
+
+void library_scan_stop(void)
+{
+    if (!scan_running)
+        return;
+    pthread_mutex_lock(&queueMutex);
+    __atomic_store_n(&scan_stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueMutex);
+    pthread_join(scan_thread, NULL);
+    scan_running = 0;
+    queue_head = queued = 0;
+}
+
+int library_scanning(void)
+{
+    return (__atomic_load_n(&scan_busy, __ATOMIC_RELAXED) || __atomic_load_n(&queued, __ATOMIC_RELAXED) > 0);
+}
+
+int library_poll(struct library *lib)
+{
+    struct lib_tags *t;
+    int n = 0;
+
+    // Nearly always nothing there; don't take the lock for that
+    if (__atomic_load_n(&queued, __ATOMIC_RELAXED) == 0)
+        return 0;
+    pthread_mutex_lock(&queueMutex);
+    while (queued > 0)
+    {
+        t = &queue[queue_head];
+        library_set(lib, t);
+        queue_head = (queue_head + 1) % LIB_QUEUE;
+        __atomic_store_n(&queued, queued - 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueMutex);
+    return n;
+}
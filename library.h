@@ -0,0 +1,149 @@
+/*
+ * header file for library.c
+ *
+ * Artist, album, genre and title for every song, the strings each stored once
+ * and the songs kept as arrays of small ids
+ */
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "paths.h"
+#include "strtab.h"
+#include "views.h"
+#include "bitmap.h"
+
+// Longest tag text the scan hands over (longer ones are cut short)
+#define LIB_TAG_LEN   128
+// Tags read but not yet picked up by library_poll; the scan waits when it's full
+#define LIB_QUEUE     32
+// No title of its own; it's the file name
+#define LIB_NO_TITLE  UINT32_MAX
+
+// Flags
+#define LIB_TAGGED    1     // from the file's tags, not guessed from where it is
+#define LIB_GONE      2     // removed (the id stays, so nothing else moves)
+
+// A song's tags, read by the scan (or anyone else) for library_set
+struct lib_tags {
+	int id;
+	char title[LIB_TAG_LEN];
+	char artist[LIB_TAG_LEN];
+	char album[LIB_TAG_LEN];
+	char genre[LIB_TAG_LEN];
+	int disc;           // 0 if not known
+	int track;
+	long added;         // when the file was put there (its mtime); 0 if not known
+};
+
+
+// What the library's indexed by
+enum {
+	LIB_ARTIST,
+	LIB_ALBUM,
+	LIB_GENRE,
+	LIB_FIELDS
+};
+
+// For each artist (album, genre) id, the songs that have it
+struct lib_index {
+	struct bitmap *songs;       // by id; 0 ("not known") is never filled in
+	int max;
+};
+
+/*
+  One element of each array per song, by the song's file id in the path
+  store, so going through the whole library for one thing (every song's
+  artist, say) is going along one array.
+*/
+struct library {
+	uint32_t *artist;   // ids in 'artists'
+	uint32_t *album;    // ids in 'albums'
+	uint16_t *genre;    // ids in 'genres'
+	uint32_t *title;    // offset into 'titles', or LIB_NO_TITLE
+	uint8_t *disc;
+	uint16_t *track;
+	uint32_t *added;    // seconds since 1970
+	uint8_t *flags;
+	int num_tracks;
+	int max_tracks;
+	const struct path_store *paths;     // what the ids are of (the titles that are file names)
+	// Known by an id (0 is "", which isn't stored).  An album's parent is its artist,
+	// so two artists' "Greatest Hits" are two albums; for the others it's always 0.
+	struct str_table artists;
+	struct str_table albums;
+	struct str_table genres;
+	struct str_table titles;            // titles aren't shared, so they just go in its arena
+	struct lib_view views[VIEWS];       // made when they're first wanted; kept up to date from then on
+	struct lib_index index[LIB_FIELDS]; // always kept up to date
+};
+
+struct library_stats {
+	int tracks;
+	int tagged;         // read from the tags so far
+	int artists;
+	int albums;
+	int genres;
+	size_t track_bytes; // the arrays
+	size_t view_bytes;  // the views made so far
+	size_t index_bytes; // the bitmaps of who's by whom
+	size_t bytes;       // everything allocated (arrays, strings, hashes, views and indexes)
+};
+
+void library_init(struct library *lib);
+/*
+  Add the path store's file 'id' (the next one after what's there), with
+  the album and artist guessed from the directories it's in
+  (.../Artist/Album/song.mp3) and the track number from its name
+  ("07 - ...") until its tags are read.  0, or -1 if out of memory
+*/
+int library_add(struct library *lib, const struct path_store *paths, int id);
+/*
+  Song t->id's tags; an empty string (or a 0) leaves what was there.  The
+  views are kept in order, and the indexes up to date.  0, or -1 if out of memory
+*/
+int library_set(struct library *lib, const struct lib_tags *t);
+// Take song 'id' out of the views and indexes (it keeps its id, and its entry, but it's not in any order)
+void library_remove(struct library *lib, int id);
+/*
+  The songs in one of the orders in views.h, made the first time it's
+  wanted; *ids is good until the library next changes.  The number of
+  songs, or -1 if out of memory
+*/
+int library_order(struct library *lib, int order, const int **ids);
+/*
+  The songs by artist (on album, in genre) 'value', a LIB_ARTIST (...) id;
+  empty for 0, or one there isn't.  Good until the library next changes
+*/
+const struct bitmap *library_songs(const struct library *lib, int field, uint32_t value);
+// The strings for song 'id' ("" if there isn't one; the title is the file name if it has no other)
+const char *library_artist(const struct library *lib, int id);
+const char *library_album(const struct library *lib, int id);
+const char *library_genre(const struct library *lib, int id);
+const char *library_title(const struct library *lib, int id);
+// An artist's (album's, genre's) name by its id
+const char *library_string(const struct str_table *t, uint32_t id);
+// The artist an album id is by (0 if it's not known)
+uint32_t library_album_artist(const struct library *lib, uint32_t album);
+void library_stats(const struct library *lib, struct library_stats *s);
+void library_report(FILE *fp, const struct library *lib);
+void library_free(struct library *lib);
+
+/*
+  Start reading the tags of every song in 'paths' in the background (they're
+  not copied; as with rgscan the store has to stay as it is until
+  library_scan_stop).  What's been read is put into the library by
+  library_poll, from the thread that owns it, so nothing here locks the
+  library itself.  Returns 0 on success.
+*/
+int library_scan_start(const struct path_store *paths);
+void library_scan_stop(void);
+// Whether the scan still has songs to read (or tags to hand over)
+int library_scanning(void);
+// Take what the scan has read so far into the library; returns how many songs that was
+int library_poll(struct library *lib);
+
+#endif
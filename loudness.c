@@ -0,0 +1,178 @@
+/*
+ * loudness.c
+ *
+ * EBU R128 integrated loudness, as described in ITU-R BS.1770-4:
+ *
+ * - K-weight every channel (high shelf + high pass)
+ * - mean square over 400ms blocks, overlapping by 75% (so one every 100ms)
+ * - throw away blocks under -70 LUFS, then blocks 10 LU under the average of the rest
+ *
+ * The filter coefficients are worked out for whatever rate the file is at
+ * (the ones in the spec are for 48kHz only); the formulas are the same ones
+ * libebur128 uses.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "loudness.h"
+
+#define ABSOLUTE_GATE -70.0
+#define RELATIVE_GATE -10.0
+
+static void k_weighting(struct loudness_meter *m)
+{
+    double f0, G, Q, K, Vh, Vb, a0;
+    int ch;
+
+    // Stage 1; high shelf modelling the head
+    f0 = 1681.974450955533;
+    G = 3.999843853973347;
+    Q = 0.7071752369554196;
+    K = tan(M_PI * f0 / (double)m->rate);
+    Vh = pow(10.0, G / 20.0);
+    Vb = pow(Vh, 0.4996667741545416);
+    a0 = 1.0 + K / Q + K * K;
+    for (ch = 0; ch < LOUDNESS_MAX_CHANNELS; ch++)
+    {
+        m->shelf[ch].b0 = (Vh + Vb * K / Q + K * K) / a0;
+        m->shelf[ch].b1 = 2.0 * (K * K - Vh) / a0;
+        m->shelf[ch].b2 = (Vh - Vb * K / Q + K * K) / a0;
+        m->shelf[ch].a1 = 2.0 * (K * K - 1.0) / a0;
+        m->shelf[ch].a2 = (1.0 - K / Q + K * K) / a0;
+    }
+    // Stage 2; RLB weighting high pass
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / (double)m->rate);
+    a0 = 1.0 + K / Q + K * K;
+    for (ch = 0; ch < LOUDNESS_MAX_CHANNELS; ch++)
+    {
+        m->hipass[ch].b0 = 1.0;
+        m->hipass[ch].b1 = -2.0;
+        m->hipass[ch].b2 = 1.0;
+        m->hipass[ch].a1 = 2.0 * (K * K - 1.0) / a0;
+        m->hipass[ch].a2 = (1.0 - K / Q + K * K) / a0;
+    }
+}
+
+static inline double biquad_run(struct biquad_df2 *f, double x)
+{
+    double y = f->b0 * x + f->z1;
+
+    f->z1 = f->b1 * x - f->a1 * y + f->z2;
+    f->z2 = f->b2 * x - f->a2 * y;
+    return y;
+}
+
+int loudness_init(struct loudness_meter *m, long rate, int channels)
+{
+    memset(m, 0, sizeof(*m));
+    if (rate <= 0 || channels < 1 || channels > LOUDNESS_MAX_CHANNELS)
+        return -1;
+    m->rate = rate;
+    m->channels = channels;
+    m->sub_len = rate / 10;
+    k_weighting(m);
+    return 0;
+}
+
+static void push_energy(struct loudness_meter *m, double e)
+{
+    if (m->num_energy == m->max_energy)
+    {
+        size_t n = (m->max_energy ? m->max_energy * 2 : 3000); // 3000 = 5 minutes
+        double *p = realloc(m->energy, n * sizeof(double));
+
+        if (p == NULL)
+            return; // just lose the block; we're only after an estimate
+        m->energy = p;
+        m->max_energy = n;
+    }
+    m->energy[m->num_energy++] = e;
+}
+
+void loudness_add_s16(struct loudness_meter *m, const int16_t *buf, size_t frames)
+{
+    size_t i;
+    int ch;
+
+    for (i = 0; i < frames; i++)
+    {
+        for (ch = 0; ch < m->channels; ch++)
+        {
+            double x = buf[i * m->channels + ch] / 32768.0;
+            double a = fabs(x);
+
+            if (a > m->peak)
+                m->peak = a;
+            x = biquad_run(&m->hipass[ch], biquad_run(&m->shelf[ch], x));
+            // Both front channels have a weight of 1.0
+            m->sub_sum += x * x;
+        }
+        if (++m->sub_fill == m->sub_len)
+        {
+            push_energy(m, m->sub_sum / m->sub_len);
+            m->sub_sum = 0.0;
+            m->sub_fill = 0;
+        }
+    }
+}
+
+static double to_lufs(double energy)
+{
+    return -0.691 + 10.0 * log10(energy);
+}
+
+double loudness_integrated(struct loudness_meter *m)
+{
+    double abs_gate = pow(10.0, (ABSOLUTE_GATE + 0.691) / 10.0);
+    double rel_gate, sum, z;
+    size_t i, n;
+
+    if (m->num_energy < 4)
+        return -HUGE_VAL;
+    // First pass; absolute gate
+    sum = 0.0;
+    n = 0;
+    for (i = 0; i + 4 <= m->num_energy; i++)
+    {
+        z = (m->energy[i] + m->energy[i + 1] + m->energy[i + 2] + m->energy[i + 3]) / 4.0;
+        if (z > abs_gate)
+        {
+            sum += z;
+            n++;
+        }
+    }
+    if (n == 0)
+        return -HUGE_VAL;
+    rel_gate = pow(10.0, (to_lufs(sum / n) + RELATIVE_GATE + 0.691) / 10.0);
+    // Second pass; relative gate
+    sum = 0.0;
+    n = 0;
+    for (i = 0; i + 4 <= m->num_energy; i++)
+    {
+        z = (m->energy[i] + m->energy[i + 1] + m->energy[i + 2] + m->energy[i + 3]) / 4.0;
+        if (z > abs_gate && z > rel_gate)
+        {
+            sum += z;
+            n++;
+        }
+    }
+    if (n == 0)
+        return -HUGE_VAL;
+    return to_lufs(sum / n);
+}
+
+double loudness_peak(struct loudness_meter *m)
+{
+    return m->peak;
+}
+
+void loudness_free(struct loudness_meter *m)
+{
+    free(m->energy);
+    m->energy = NULL;
+    m->num_energy = m->max_energy = 0;
+}
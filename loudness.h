@@ -0,0 +1,43 @@
+/*
+ * header file for loudness.c
+ *
+ * EBU R128 / ITU BS.1770 loudness meter (integrated loudness + sample peak)
+ */
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOUDNESS_MAX_CHANNELS 2
+
+struct biquad_df2 {
+	double b0, b1, b2, a1, a2;
+	double z1, z2;
+};
+
+struct loudness_meter {
+	long rate;
+	int channels;
+	// K-weighting: pre-filter (high shelf) followed by the RLB high pass
+	struct biquad_df2 shelf[LOUDNESS_MAX_CHANNELS];
+	struct biquad_df2 hipass[LOUDNESS_MAX_CHANNELS];
+	// 100ms sub-blocks; the 400ms gating blocks are made from 4 of these
+	long sub_len;
+	long sub_fill;
+	double sub_sum;
+	double *energy;
+	size_t num_energy;
+	size_t max_energy;
+	double peak;
+};
+
+int loudness_init(struct loudness_meter *m, long rate, int channels);
+void loudness_add_s16(struct loudness_meter *m, const int16_t *buf, size_t frames);
+// Integrated (gated) loudness in LUFS; -HUGE_VAL if there was nothing above the gate
+double loudness_integrated(struct loudness_meter *m);
+// Sample peak, 1.0 = full scale
+double loudness_peak(struct loudness_meter *m);
+void loudness_free(struct loudness_meter *m);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * metrics.c
+ *
+ * Hot path instrumentation for lcd-mp3.
+ *
+ * stderr goes to /dev/null on the player, so there's normally no way to see
+ * where the time goes.  The decoder, DSP, ao_play, read-ahead, LCD and main
+ * loop record what they take into histograms here; kill -USR1 the player and
+ * a snapshot is written to a file (METRICS_FILE in lcd-mp3.c).
+ *
+ * The histograms are HDR style: a bucket per 1/16th of each power of two,
+ * so any value from 1 ns to hours is kept to within 6%, with nothing to set
+ * up.  Each thread has its own set, written only by that thread with plain
+ * (relaxed atomic) stores, so recording is a clock read, a couple of shifts
+ * and an add: no locks and nothing shared between the audio and UI threads.
+ * A thread's set goes back on the list when it exits, for the next thread to
+ * carry on counting in (play_song is a new thread every song).  The dump adds
+ * them all up.
+ *
+ * SIGUSR1 is waited for by a thread of its own (sigwait), so the snapshot is
+ * written in that thread, with nothing done in a signal handler or in the way
+ * of the audio.
+ *
+ * make METRICS=off leaves all of this out.
+ */
+
+#ifdef HAVE_METRICS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "rtsched.h"
+
+struct met_hist {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned int buckets[MET_BUCKETS];
+};
+
+struct met_thread {
+    struct met_thread *next;
+    int in_use;
+    struct met_hist hist[MET_STAGES];
+};
+
+static const char *stage_names[MET_STAGES] = {
+    "decode", "dsp", "output", "ring fill", "stall", "switch", "lcd", "loop", "wakeup"
+};
+// Shown in KB rather than ms
+static const int stage_bytes[MET_STAGES] = { 0, 0, 0, 1, 0, 0, 0, 0, 0 };
+
+// All the sets there have ever been (only ever added to)
+static struct met_thread *threads = NULL;
+static __thread struct met_thread *mine = NULL;
+static pthread_key_t exit_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static const char *dump_file = NULL;
+static unsigned long long started = 0;
+// metrics_add_report's; only the main thread adds them
+static void (*reports[MET_REPORTS])(FILE *fp);
+static int num_reports = 0;
+
+unsigned long long metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket(unsigned long long value)
+{
+    int shift;
+
+    if (value < MET_SUB)
+        return value;
+    shift = 63 - __builtin_clzll(value) - MET_SUB_BITS;
+    return (shift + 1) * MET_SUB + ((value >> shift) & (MET_SUB - 1));
+}
+
+// The smallest value that goes in bucket 'b'
+static unsigned long long bucket_value(int b)
+{
+    if (b < 2 * MET_SUB)
+        return b;
+    return (unsigned long long)(MET_SUB + b % MET_SUB) << (b / MET_SUB - 1);
+}
+
+static void thread_exit(void *set)
+{
+    __atomic_store_n(&((struct met_thread *)set)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key()
+{
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+// This thread's set: one left by a thread that's gone, or a new one
+static struct met_thread *claim()
+{
+    struct met_thread *t;
+    int free_set;
+
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    {
+        free_set = 0;
+        if (__atomic_compare_exchange_n(&t->in_use, &free_set, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (t == NULL)
+    {
+        t = calloc(1, sizeof(*t));
+        if (t == NULL)
+            return NULL;
+        t->in_use = 1;
+        t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(exit_key, t);
+    return t;
+}
+
+void metrics_record(int stage, unsigned long long value)
+{
+    struct met_hist *h;
+    int b;
+
+    if (mine == NULL && (mine = claim()) == NULL)
+        return;
+    h = &mine->hist[stage];
+    b = bucket(value);
+    // Only this thread writes these; the stores just have to be whole for the dump
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+unsigned long long metrics_since(int stage, unsigned long long start)
+{
+    unsigned long long t = metrics_now();
+
+    metrics_record(stage, t - start);
+    return t;
+}
+
+// The value 'fraction' of the way through
+static unsigned long long percentile(unsigned long long *buckets, unsigned long long count, double fraction)
+{
+    unsigned long long seen = 0, want = (unsigned long long)(count * fraction);
+    int b;
+
+    for (b = 0; b < MET_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen > want)
+            return bucket_value(b);
+    }
+    return bucket_value(MET_BUCKETS - 1);
+}
+
+void metrics_dump(FILE *fp)
+{
+    static unsigned long long buckets[MET_BUCKETS];
+    struct met_thread *t;
+    struct met_hist *h;
+    unsigned long long count, sum, max;
+    double secs = (metrics_now() - started) / 1e9, unit;
+    int stage, b, num_threads = 0;
+
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+        num_threads++;
+    fprintf(fp, "metrics: %.1f s, %d thread%s\n", secs, num_threads, (num_threads == 1 ? "" : "s"));
+    fprintf(fp, "%-10s %10s %10s %9s %9s %9s %9s %9s %9s\n", "", "count", "per sec", "avg", "p50", "p90", "p99", "p99.9", "max");
+    for (stage = 0; stage < MET_STAGES; stage++)
+    {
+        memset(buckets, 0, sizeof(buckets));
+        count = sum = max = 0;
+        for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+        {
+            h = &t->hist[stage];
+            count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&h->max, __ATOMIC_RELAXED) > max)
+                max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            for (b = 0; b < MET_BUCKETS; b++)
+                buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+        if (count == 0)
+        {
+            fprintf(fp, "%-10s %10d\n", stage_names[stage], 0);
+            continue;
+        }
+        // ms, or KB
+        unit = (stage_bytes[stage] ? 1024.0 : 1e6);
+        fprintf(fp, "%-10s %10llu %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f%s\n", stage_names[stage], count, count / secs,
+                (double)sum / count / unit, percentile(buckets, count, 0.5) / unit, percentile(buckets, count, 0.9) / unit,
+                percentile(buckets, count, 0.99) / unit, percentile(buckets, count, 0.999) / unit, max / unit,
+                (stage_bytes[stage] ? " KB" : " ms"));
+    }
+}
+
+static void *dump_loop(void *arg)
+{
+    sigset_t set;
+    FILE *fp;
+    int sig, i;
+
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (sigwait(&set, &sig) == 0)
+    {
+        fp = fopen(dump_file, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "[%s - %d]: Cannot write %s\n", __FILE__, __LINE__, dump_file);
+            continue;
+        }
+        metrics_dump(fp);
+        for (i = 0; i < __atomic_load_n(&num_reports, __ATOMIC_ACQUIRE); i++)
+            reports[i](fp);
+        fclose(fp);
+    }
+    return NULL;
+}
+
+void metrics_add_report(void (*report)(FILE *fp))
+{
+    if (num_reports < MET_REPORTS)
+    {
+        reports[num_reports] = report;
+        __atomic_store_n(&num_reports, num_reports + 1, __ATOMIC_RELEASE);
+    }
+}
+
+int metrics_init(const char *file)
+{
+    started = metrics_now();
+    dump_file = file;
+    // The snapshot is written by dump_loop, never in a signal handler
+    if (rt_signal_thread(SIGUSR1, dump_loop) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot start the metrics thread\n", __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * header file for metrics.c
+ *
+ * Latency histograms for the hot paths; make METRICS=off and all of this
+ * compiles to nothing
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// What's measured (times in ns unless it says otherwise)
+enum {
+	MET_DECODE,         // mpg123_read, a block
+	MET_DSP,            // the DSP chain, a block
+	MET_OUTPUT,         // ao_play, a block
+	MET_RING_FILL,      // bytes read ahead of the decoder (read-ahead mode)
+	MET_STALL,          // decoder waiting for the disk (the read-ahead ran dry)
+	MET_SWITCH,         // next/prev/shuffle pressed to the next song's first block out
+	MET_LCD,            // writing to the LCD
+	MET_LOOP,           // once round the main loop
+	MET_WAKEUP,         // how late the -rtprobe thread woke up
+	MET_STAGES
+};
+
+#ifdef HAVE_METRICS
+
+// Recorded as 4 bits of mantissa per power of two (within 6%), so 976 buckets cover all of 64 bits
+#define MET_SUB_BITS 4
+#define MET_SUB (1 << MET_SUB_BITS)
+#define MET_BUCKETS ((64 - MET_SUB_BITS + 1) * MET_SUB)
+#define MET_REPORTS 4
+
+// Start the thread that writes a snapshot to 'file' on SIGUSR1 (before any other threads start)
+int metrics_init(const char *file);
+// Monotonic ns
+unsigned long long metrics_now(void);
+void metrics_record(int stage, unsigned long long value);
+// Record the ns since 'start' (from metrics_now); returns now
+unsigned long long metrics_since(int stage, unsigned long long start);
+// Everything so far, all threads together
+void metrics_dump(FILE *fp);
+// Something else for the SIGUSR1 snapshot to have after the histograms (up to MET_REPORTS)
+void metrics_add_report(void (*report)(FILE *fp));
+
+#else
+
+static inline int metrics_init(const char *file) { (void)file; return 0; }
+static inline unsigned long long metrics_now(void) { return 0; }
+static inline void metrics_record(int stage, unsigned long long value) { (void)stage; (void)value; }
+static inline unsigned long long metrics_since(int stage, unsigned long long start) { (void)stage; return start; }
+static inline void metrics_dump(FILE *fp) { (void)fp; }
+static inline void metrics_add_report(void (*report)(FILE *fp)) { (void)report; }
+
+#endif
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ * output.c
+ *
+ * The sound card end of play_song.
+ *
+ * ao_play's return value was never looked at, so when the card went away
+ * (a USB DAC, or ALSA falling over) the rest of the song went nowhere, and
+ * when the decoder couldn't keep up (a slow USB stick) the card just ran
+ * dry and clicked, with nothing to say it had.
+ *
+ * libao doesn't tell us about ALSA's underruns (it re-prepares the device
+ * itself and carries on), and doesn't let us at the PCM to ask with
+ * snd_pcm_delay, so they're worked out from the clock: from the first
+ * block on a device, the card plays in real time, so if we come to send a
+ * block later than the audio we've sent so far would have lasted, it ran
+ * dry for the difference.  A pause restarts the count (out_resync).  The
+ * null and WAV devices (-bench) never block, so they're always ahead.
+ *
+ * The card's crystal doesn't keep quite the same time as the CPU's, and a
+ * crossfade hands the device (and the clock) on from song to song, so over
+ * an evening that adds up to far more than OUT_XRUN_SLACK_MS.  Whenever
+ * ao_play has to wait for room the card's buffer is full, which is as far
+ * ahead of it as we ever are; every OUT_DRIFT_SECS the clock is moved by
+ * however much the furthest ahead we've been has wandered from what it was
+ * at the start.
+ *
+ * When ao_play fails on a live device (play_song passes the driver it was
+ * opened with; -1 for the -bench and -sim ones), it's closed and opened
+ * again, a little longer between tries each time, for up to
+ * OUT_RECOVER_MS before the song is given up on.  OUT_CLUSTER underruns
+ * close together and the card is reopened with a bigger ALSA buffer (more
+ * latency, more time to catch up), which steps back down once things have
+ * been quiet for OUT_CALM_SECS.
+ *
+ * Only play_song calls the out_ functions that play; the counts can be
+ * read from any thread.  What happened goes into a small ring that the main
+ * loop writes to the session log between songs, so the audio thread never
+ * touches a file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "output.h"
+#include "trace.h"
+
+enum {
+    EV_XRUN,
+    EV_ERROR,
+    EV_REOPEN,
+    EV_FAILED,
+    EV_GROW,
+    EV_SHRINK
+};
+
+struct out_event {
+    unsigned long seq;  // event number + 1 once it's all there, 0 while it's written
+    double when;        // monotonic seconds
+    int kind;
+    double value;       // ms (the size of the underrun, how long recovery took, the new buffer)
+};
+
+// ALSA buffer_time (ms) for each level; 0 leaves it to libao
+static const int level_ms[OUT_LEVELS] = { 0, 250, 500, 1000 };
+static int level = 0;
+
+static struct out_stats stats;
+// Which device the clock is for, when it started, and how much audio's gone out since
+static ao_device *clock_dev = NULL;
+static double clock_start = 0.0;
+static double clock_sent = 0.0;
+// How far ahead of the clock a full buffer puts us: at the start, and the most this OUT_DRIFT_SECS (-1 until there's one)
+static double full_lead = -1.0;
+static double window_lead = -1.0;
+static double window_start = 0.0;
+// The last OUT_CLUSTER underruns
+static double recent[OUT_CLUSTER];
+static int num_recent = 0;
+static double last_xrun = 0.0;
+
+static struct out_event events[OUT_EVENTS];
+static unsigned long ev_head = 0;
+static unsigned long ev_tail = 0;
+static FILE *log_fp = NULL;
+static const char *event_names[] = { "underrun", "error", "reopened", "gave up", "bigger buffer", "smaller buffer" };
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Counters: only play_song changes them, anything can read them
+static void count(unsigned long *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static void add_ms(double *total, double ms)
+{
+    double v = *total + ms;
+
+    __atomic_store(total, &v, __ATOMIC_RELAXED);
+}
+
+// Same as the trace ring: the main loop skips any it catches being written over
+static void event(int kind, double value)
+{
+    unsigned long n = ev_head;
+    struct out_event *e = &events[n % OUT_EVENTS];
+    double t = now();
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store(&e->when, &t, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->kind, kind, __ATOMIC_RELAXED);
+    __atomic_store(&e->value, &value, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, n + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ev_head, n + 1, __ATOMIC_RELEASE);
+}
+
+static ao_device *open_level(int driver, ao_sample_format *format)
+{
+    ao_option *options = NULL;
+    ao_device *dev;
+    char value[16];
+
+    if (level_ms[level] != 0)
+    {
+        snprintf(value, sizeof(value), "%d", level_ms[level]);
+        ao_append_option(&options, "buffer_time", value);
+    }
+    dev = ao_open_live(driver, format, options);
+    ao_free_options(options);
+    return dev;
+}
+
+// Open, trying until OUT_RECOVER_MS is up
+static ao_device *open_retrying(int driver, ao_sample_format *format)
+{
+    struct timespec ts;
+    double start = now(), ms;
+    unsigned long long mark = trace_now();
+    int wait_ms = OUT_RETRY_MS;
+    ao_device *dev;
+
+    while ((dev = open_level(driver, format)) == NULL)
+    {
+        if ((now() - start) * 1000 + wait_ms > OUT_RECOVER_MS)
+        {
+            count(&stats.failed);
+            event(EV_FAILED, (now() - start) * 1000);
+            trace_span(TR_RECOVER, mark, 0);
+            return NULL;
+        }
+        ts.tv_sec = wait_ms / 1000;
+        ts.tv_nsec = (wait_ms % 1000) * 1000000L;
+        nanosleep(&ts, NULL);
+        wait_ms *= 2;
+    }
+    ms = (now() - start) * 1000;
+    if (ms > stats.recover_max_ms)
+        __atomic_store(&stats.recover_max_ms, &ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.buffer_ms, level_ms[level], __ATOMIC_RELAXED);
+    trace_span(TR_RECOVER, mark, 1);
+    return dev;
+}
+
+// Close it and open it again; NULL if it won't come back
+static ao_device *reopen(ao_device *dev, int driver, ao_sample_format *format)
+{
+    double start = now();
+
+    ao_close(dev);
+    clock_dev = NULL;
+    dev = open_retrying(driver, format);
+    if (dev != NULL)
+    {
+        count(&stats.reopens);
+        event(EV_REOPEN, (now() - start) * 1000);
+    }
+    return dev;
+}
+
+ao_device *out_open(int driver, ao_sample_format *format)
+{
+    // Quiet for long enough; back down a step
+    if (level > 0 && now() - last_xrun > OUT_CALM_SECS)
+    {
+        level--;
+        last_xrun = now();
+        event(EV_SHRINK, level_ms[level]);
+    }
+    return open_retrying(driver, format);
+}
+
+void out_resync(void)
+{
+    clock_dev = NULL;
+}
+
+// Nothing queued on the card (a new device, or it's just run dry): the clock starts from now
+static void restart_clock(ao_device *dev, double t)
+{
+    clock_dev = dev;
+    clock_start = t;
+    clock_sent = 0.0;
+    full_lead = window_lead = -1.0;
+    window_start = t;
+}
+
+// How far ahead we are with the card's buffer full; keeps the clock in step with the card's
+static void track_lead(double lead, double t)
+{
+    if (lead > window_lead)
+        window_lead = lead;
+    if (t - window_start < OUT_DRIFT_SECS)
+        return;
+    if (full_lead < 0.0)
+        full_lead = window_lead;
+    else
+        clock_start += full_lead - window_lead;
+    window_lead = -1.0;
+    window_start = t;
+}
+
+// The OUT_CLUSTER-th underrun inside OUT_CLUSTER_SECS?
+static int clustered(double t)
+{
+    int i;
+
+    if (num_recent == OUT_CLUSTER)
+    {
+        for (i = 1; i < OUT_CLUSTER; i++)
+            recent[i - 1] = recent[i];
+        num_recent--;
+    }
+    recent[num_recent++] = t;
+    return (num_recent == OUT_CLUSTER && t - recent[0] <= OUT_CLUSTER_SECS);
+}
+
+int out_play(ao_device **dev, int driver, ao_sample_format *format, char *buf, uint32_t size)
+{
+    double t = now(), behind, secs = 0.0, done, start;
+
+    count(&stats.blocks);
+    // Fell behind the card?
+    if (*dev != clock_dev)
+        restart_clock(*dev, t);
+    behind = (t - clock_start - clock_sent) * 1000;
+    if (behind > OUT_XRUN_SLACK_MS)
+    {
+        count(&stats.xruns);
+        add_ms(&stats.xrun_ms, behind);
+        event(EV_XRUN, behind);
+        trace_mark(TR_UNDERRUN, (long)behind, NULL);
+        last_xrun = t;
+        restart_clock(*dev, t);
+        // Keep coming; give the card more to work with
+        if (clustered(t) && driver >= 0 && level < OUT_LEVELS - 1)
+        {
+            level++;
+            num_recent = 0;
+            count(&stats.grows);
+            event(EV_GROW, level_ms[level]);
+            if ((*dev = reopen(*dev, driver, format)) == NULL)
+                return -1;
+        }
+    }
+    // A card that opens again but still won't play only gets OUT_RECOVER_MS all told too
+    start = now();
+    while (ao_play(*dev, buf, size) == 0)
+    {
+        count(&stats.errors);
+        event(EV_ERROR, 0);
+        if (driver < 0)
+            return -1;
+        if ((now() - start) * 1000 > OUT_RECOVER_MS)
+        {
+            count(&stats.failed);
+            event(EV_FAILED, (now() - start) * 1000);
+            return -1;
+        }
+        if ((*dev = reopen(*dev, driver, format)) == NULL)
+            return -1;
+    }
+    if (format->rate > 0 && format->channels > 0 && format->bits > 0)
+        secs = (double)size / (format->channels * format->bits / 8) / format->rate;
+    clock_sent += secs;
+    // It waited for room, so the card's buffer is full
+    done = now();
+    if (clock_dev == *dev && done - t > secs / 2)
+        track_lead(clock_sent - (done - clock_start), done);
+    return 0;
+}
+
+void out_close(ao_device *dev)
+{
+    if (dev == NULL)
+        return;
+    if (dev == clock_dev)
+        clock_dev = NULL;
+    ao_close(dev);
+}
+
+void out_stats(struct out_stats *s)
+{
+    s->blocks = __atomic_load_n(&stats.blocks, __ATOMIC_RELAXED);
+    s->errors = __atomic_load_n(&stats.errors, __ATOMIC_RELAXED);
+    s->xruns = __atomic_load_n(&stats.xruns, __ATOMIC_RELAXED);
+    __atomic_load(&stats.xrun_ms, &s->xrun_ms, __ATOMIC_RELAXED);
+    s->reopens = __atomic_load_n(&stats.reopens, __ATOMIC_RELAXED);
+    s->failed = __atomic_load_n(&stats.failed, __ATOMIC_RELAXED);
+    __atomic_load(&stats.recover_max_ms, &s->recover_max_ms, __ATOMIC_RELAXED);
+    s->grows = __atomic_load_n(&stats.grows, __ATOMIC_RELAXED);
+    s->buffer_ms = __atomic_load_n(&stats.buffer_ms, __ATOMIC_RELAXED);
+}
+
+void out_report(FILE *fp)
+{
+    struct out_stats s;
+
+    out_stats(&s);
+    fprintf(fp, "output: %lu blocks, %lu underruns (%.1f ms behind in all), %lu errors\n", s.blocks, s.xruns, s.xrun_ms, s.errors);
+    fprintf(fp, "output: %lu reopens (longest %.1f ms), %lu given up on, buffer grown %lu times, now ",
+            s.reopens, s.recover_max_ms, s.failed, s.grows);
+    if (s.buffer_ms == 0)
+        fprintf(fp, "libao's default\n");
+    else
+        fprintf(fp, "%d ms\n", s.buffer_ms);
+}
+
+// "2026-10-18 21:04:05 " for a monotonic time
+static void log_time(double when)
+{
+    char stamp[32];
+    time_t t = time(NULL) - (time_t)(now() - when);
+
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    fprintf(log_fp, "%s ", stamp);
+}
+
+int out_log_open(const char *file)
+{
+    log_fp = fopen(file, "a");
+    if (log_fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot write %s\n", __FILE__, __LINE__, file);
+        return -1;
+    }
+    log_time(now());
+    fprintf(log_fp, "started\n");
+    fflush(log_fp);
+    return 0;
+}
+
+void out_log_flush(void)
+{
+    unsigned long head = __atomic_load_n(&ev_head, __ATOMIC_ACQUIRE);
+    struct out_event *slot, e;
+
+    if (log_fp == NULL)
+        return;
+    // Any we've been lapped on are gone
+    if (head - ev_tail > OUT_EVENTS)
+    {
+        log_time(now());
+        fprintf(log_fp, "%lu output events lost\n", head - ev_tail - OUT_EVENTS);
+        ev_tail = head - OUT_EVENTS;
+    }
+    for (; ev_tail != head; ev_tail++)
+    {
+        slot = &events[ev_tail % OUT_EVENTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ev_tail + 1)
+            continue;
+        __atomic_load(&slot->when, &e.when, __ATOMIC_RELAXED);
+        e.kind = __atomic_load_n(&slot->kind, __ATOMIC_RELAXED);
+        __atomic_load(&slot->value, &e.value, __ATOMIC_RELAXED);
+        // Written over while we read it
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != ev_tail + 1)
+            continue;
+        log_time(e.when);
+        fprintf(log_fp, "output %s", event_names[e.kind]);
+        if (e.kind != EV_ERROR)
+            fprintf(log_fp, " %.1f ms", e.value);
+        fprintf(log_fp, "\n");
+    }
+    fflush(log_fp);
+}
+
+void out_log_close(void)
+{
+    if (log_fp == NULL)
+        return;
+    out_log_flush();
+    log_time(now());
+    fprintf(log_fp, "stopped\n");
+    out_report(log_fp);
+    fclose(log_fp);
+    log_fp = NULL;
+}
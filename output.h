@@ -0,0 +1,65 @@
+/*
+ * header file for output.c
+ *
+ * ao_play with underrun detection, reopening the card when it fails, and
+ * more buffering for a while when the underruns keep coming
+ */
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <ao/ao.h>
+
+// How long a failed card gets to come back before the song is given up on
+#define OUT_RECOVER_MS    2000
+// First wait between tries; doubles each time
+#define OUT_RETRY_MS      20
+// Behind by more than this and it's an underrun
+#define OUT_XRUN_SLACK_MS 5
+// How often the clock is brought back in step with the card's
+#define OUT_DRIFT_SECS    30
+// This many underruns within OUT_CLUSTER_SECS and the buffer is made bigger...
+#define OUT_CLUSTER       3
+#define OUT_CLUSTER_SECS  60
+// ...and a step smaller again once it's gone this long without one
+#define OUT_CALM_SECS     600
+// Buffer sizes (ALSA's buffer_time) it steps through; the first is libao's own
+#define OUT_LEVELS        4
+// Kept for the session log between out_log_flush calls
+#define OUT_EVENTS        64
+
+struct out_stats {
+	unsigned long blocks;           // ao_play calls
+	unsigned long errors;           // ao_play failures
+	unsigned long xruns;            // times the card ran dry
+	double xrun_ms;                 // how far behind, all told
+	unsigned long reopens;          // card closed and opened again (errors or a bigger buffer)
+	unsigned long failed;           // gave up on it after OUT_RECOVER_MS
+	double recover_max_ms;          // longest it took to get the card back
+	unsigned long grows;            // buffer made bigger
+	int buffer_ms;                  // what it's at now
+};
+
+// Open the card, with the buffering we're at now (trying for up to OUT_RECOVER_MS); NULL if it won't
+ao_device *out_open(int driver, ao_sample_format *format);
+/*
+  ao_play, counting an underrun if we'd fallen behind the card.  If it fails
+  it's reopened with 'driver' (*dev changes), unless that's -1; returns -1
+  if the card's gone for good (or couldn't be reopened).
+*/
+int out_play(ao_device **dev, int driver, ao_sample_format *format, char *buf, uint32_t size);
+// Stopped sending on purpose (a pause); don't count the gap
+void out_resync(void);
+// ao_close (NULL is fine), forgetting the clock for it
+void out_close(ao_device *dev);
+
+void out_stats(struct out_stats *s);
+void out_report(FILE *fp);
+
+// The session log: started, what happened since the last flush, and the counts at the end
+int out_log_open(const char *file);
+void out_log_flush(void);
+void out_log_close(void);
+
+#endif
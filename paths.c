@@ -0,0 +1,171 @@
+/*
+ * paths.c
+ *
+ * Where the songs are.
+ *
+ * Every playlist entry used to be a malloc(MAXDATALEN) with the whole path
+ * in it: 256 bytes (plus malloc's own) for every song whether the path was
+ * 20 bytes long or 300 (which it then overflowed), and "/MUSIC/Artist/Album/"
+ * over and over again.  Now a path is a directory id and a name, the names
+ * all go one after the other in a single arena, and a directory is its
+ * parent's id and its own name, looked up in a hash table (strtab.c) so
+ * each one is only stored once however many songs are in it.  The full path
+ * is put back together into the caller's buffer when it's needed, which is
+ * once a song.
+ *
+ * The arena and tables only ever grow (by doubling), and everything refers
+ * to names by their offset, so nothing moves as far as the callers can tell.
+ * Nothing here locks: it's filled in once by the main thread, and other
+ * threads (the ReplayGain scan) only read it after that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "paths.h"
+
+void paths_init(struct path_store *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+// Double *array (of *max elements) until there's room for 'need'
+static int grow(void **array, int *max, int need, size_t elem, const char *what)
+{
+    int n = (*max > 0 ? *max : 256);
+    void *more;
+
+    if (need <= *max)
+        return 0;
+    while (n < need)
+        n *= 2;
+    more = realloc(*array, n * elem);
+    if (more == NULL)
+    {
+        perror(what);
+        return -1;
+    }
+    *array = more;
+    *max = n;
+    return 0;
+}
+
+// Directory 'parent's id in the table is parent + 1, which is what its children are looked up under
+static int intern_dir(struct path_store *p, int parent, const char *name, size_t len)
+{
+    int id = strtab_intern(&p->names, parent + 1, name, len);
+
+    return (id < 0 ? -1 : id - 1);
+}
+
+int paths_dir(struct path_store *p, int parent, const char *name)
+{
+    return intern_dir(p, parent, name, strlen(name));
+}
+
+int paths_add(struct path_store *p, int dir, const char *name)
+{
+    uint32_t at;
+
+    if (grow((void **)&p->files, &p->max_files, p->num_files + 1, sizeof(struct path_file), "realloc: paths") != 0
+        || (at = strtab_add(&p->names, name, strlen(name))) == (uint32_t)-1)
+        return -1;
+    p->files[p->num_files].dir = dir;
+    p->files[p->num_files].name = at;
+    return p->num_files++;
+}
+
+int paths_add_path(struct path_store *p, const char *path)
+{
+    const char *start = path, *slash;
+    int dir = -1;
+
+    while ((slash = strchr(start, '/')) != NULL)
+    {
+        if ((dir = intern_dir(p, dir, start, slash - start)) < 0)
+            return -1;
+        start = slash + 1;
+    }
+    return paths_add(p, dir, start);
+}
+
+int paths_get(const struct path_store *p, int id, char *buf, size_t size)
+{
+    const char *name;
+    size_t len, total, n;
+    int d;
+
+    if (id < 0 || id >= p->num_files)
+        return -1;
+    // How long it is, then fill it in from the end back
+    len = strlen(p->names.arena + p->files[id].name);
+    for (d = p->files[id].dir; d >= 0; d = paths_dir_parent(p, d))
+        len += strlen(paths_dir_name(p, d)) + 1;
+    if (len >= size)
+    {
+        if (size > 0)
+            buf[0] = '\0';
+        return len;
+    }
+    total = len;
+    buf[len] = '\0';
+    name = p->names.arena + p->files[id].name;
+    n = strlen(name);
+    memcpy(buf + len - n, name, n);
+    len -= n;
+    for (d = p->files[id].dir; d >= 0; d = paths_dir_parent(p, d))
+    {
+        buf[--len] = '/';
+        name = paths_dir_name(p, d);
+        n = strlen(name);
+        memcpy(buf + len - n, name, n);
+        len -= n;
+    }
+    return total;
+}
+
+const char *paths_name(const struct path_store *p, int id)
+{
+    if (id < 0 || id >= p->num_files)
+        return NULL;
+    return p->names.arena + p->files[id].name;
+}
+
+int paths_dir_parent(const struct path_store *p, int dir)
+{
+    if (dir < 0 || dir >= p->names.count)
+        return -1;
+    return (int)p->names.parents[dir] - 1;
+}
+
+const char *paths_dir_name(const struct path_store *p, int dir)
+{
+    if (dir < 0 || dir >= p->names.count)
+        return NULL;
+    return p->names.arena + p->names.names[dir];
+}
+
+void paths_stats(const struct path_store *p, struct path_stats *s)
+{
+    s->files = p->num_files;
+    s->dirs = p->names.count;
+    s->name_bytes = p->names.used;
+    s->bytes = strtab_bytes(&p->names) + p->max_files * sizeof(struct path_file);
+}
+
+void paths_report(FILE *fp, const struct path_store *p)
+{
+    struct path_stats s;
+
+    paths_stats(p, &s);
+    fprintf(fp, "paths: %d files in %d directories, %.1f KB (%.1f bytes a file; %.1f KB of names)\n",
+            s.files, s.dirs, s.bytes / 1024.0, (s.files ? (double)s.bytes / s.files : 0.0), s.name_bytes / 1024.0);
+}
+
+void paths_free(struct path_store *p)
+{
+    strtab_free(&p->names);
+    free(p->files);
+    paths_init(p);
+}
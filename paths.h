@@ -0,0 +1,60 @@
+/*
+ * header file for paths.c
+ *
+ * File paths kept as a directory and a name in one string arena, with each
+ * directory stored once
+ */
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "strtab.h"
+
+struct path_file {
+	int dir;            // -1 if the path had no '/' in it
+	uint32_t name;
+};
+
+struct path_store {
+	// Every name; directory 'd' is id d + 1 in it, looked up under its parent's id
+	// (0 for a top one, "" for the one "/" stands for), and file names are just added
+	struct str_table names;
+	struct path_file *files;
+	int num_files;
+	int max_files;
+};
+
+struct path_stats {
+	int files;
+	int dirs;
+	size_t name_bytes;  // of the arena, used
+	size_t bytes;       // everything allocated (arena, tables and hash)
+};
+
+void paths_init(struct path_store *p);
+// A directory's id, added if it's not there already; parent -1 for a top one.  -1 if out of memory
+int paths_dir(struct path_store *p, int parent, const char *name);
+// Add 'name' in directory 'dir' (-1 for none); returns the file's id, or -1 if out of memory
+int paths_add(struct path_store *p, int dir, const char *name);
+// Add a whole path (its directories looked up or added); returns the file's id or -1
+int paths_add_path(struct path_store *p, const char *path);
+/*
+  File 'id's full path into buf.  Returns the length of the path, like
+  snprintf; if that's size or more it didn't fit and buf is just "".
+  -1 if there's no such file.
+*/
+int paths_get(const struct path_store *p, int id, char *buf, size_t size);
+// Just the name, without the directory (points into the arena; NULL if there's no such file)
+const char *paths_name(const struct path_store *p, int id);
+// A directory's parent (-1 for a top one, or if there's no such directory)
+int paths_dir_parent(const struct path_store *p, int dir);
+// and its own name (points into the arena; NULL if there's no such directory)
+const char *paths_dir_name(const struct path_store *p, int dir);
+void paths_stats(const struct path_store *p, struct path_stats *s);
+void paths_report(FILE *fp, const struct path_store *p);
+void paths_free(struct path_store *p);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * playstate.c
+ *
+ * The player's state, shared between play_song and the UI without locks.
+ *
+ * cur_song used to be read and written by both threads, with pauseMutex
+ * and writeMutex each covering some of it and play_status/song_over read
+ * without either.  Now only play_song writes the state (the main loop
+ * starts each song off with ps_start before the thread is made, and reads
+ * it again after the join), and it's published through a seqlock: the
+ * sequence number is odd while it's being written, and a reader that sees
+ * it odd, or changed by the time it's done, just reads it again.  So the
+ * audio thread never waits for the UI, and the UI never waits for more
+ * than the few stores a publish takes.
+ *
+ * The other way, the UI's commands (next/prev/shuffle/quit) go in a single
+ * slot that play_song takes from once a block, and pause is a flag of its
+ * own.  play_song waits out a pause on a futex rather than a condition
+ * variable, so there's no mutex to share with the UI there either.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "playstate.h"
+
+static struct play_state state;
+static unsigned int seq = 0;
+static int command = PS_PLAY;
+static int paused = 0;
+// Bumped (and woken) whenever paused or command change
+static int wake = 0;
+
+void ps_publish(const struct play_state *s)
+{
+    unsigned int n = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&seq, n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&state.song_number, s->song_number, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.paused, s->paused, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.song_over, s->song_over, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.ended_by, s->ended_by, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.frames, s->frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.rate, s->rate, __ATOMIC_RELAXED);
+    __atomic_store(&state.volume, &s->volume, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.muted, s->muted, __ATOMIC_RELAXED);
+    __atomic_store_n(&seq, n + 2, __ATOMIC_RELEASE);
+}
+
+void ps_read(struct play_state *s)
+{
+    unsigned int before, after;
+
+    do
+    {
+        before = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        s->song_number = __atomic_load_n(&state.song_number, __ATOMIC_RELAXED);
+        s->paused = __atomic_load_n(&state.paused, __ATOMIC_RELAXED);
+        s->song_over = __atomic_load_n(&state.song_over, __ATOMIC_RELAXED);
+        s->ended_by = __atomic_load_n(&state.ended_by, __ATOMIC_RELAXED);
+        s->frames = __atomic_load_n(&state.frames, __ATOMIC_RELAXED);
+        s->rate = __atomic_load_n(&state.rate, __ATOMIC_RELAXED);
+        __atomic_load(&state.volume, &s->volume, __ATOMIC_RELAXED);
+        s->muted = __atomic_load_n(&state.muted, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&seq, __ATOMIC_RELAXED);
+    }
+    while (before != after || (before & 1) != 0);
+}
+
+void ps_start(int song_number)
+{
+    struct play_state s;
+    int old;
+
+    ps_read(&s);
+    s.song_number = song_number;
+    s.paused = 0;
+    s.song_over = 0;
+    s.ended_by = PS_PLAY;
+    s.frames = 0;
+    ps_publish(&s);
+    // A next/prev that came in after the last song was over isn't for this one; a quit still is
+    old = __atomic_load_n(&command, __ATOMIC_RELAXED);
+    while (old != PS_QUIT && !__atomic_compare_exchange_n(&command, &old, PS_PLAY, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void wake_up()
+{
+    __atomic_fetch_add(&wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &wake, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void ps_send(int cmd)
+{
+    int old = __atomic_load_n(&command, __ATOMIC_RELAXED);
+
+    // Nothing takes over from a quit
+    do
+    {
+        if (old == PS_QUIT)
+            return;
+    }
+    while (!__atomic_compare_exchange_n(&command, &old, cmd, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    wake_up();
+}
+
+int ps_take_command(void)
+{
+    // Mostly there's nothing there, and a load is cheaper than the exchange
+    if (__atomic_load_n(&command, __ATOMIC_RELAXED) == PS_PLAY)
+        return PS_PLAY;
+    return __atomic_exchange_n(&command, PS_PLAY, __ATOMIC_ACQUIRE);
+}
+
+void ps_pause(int p)
+{
+    __atomic_store_n(&paused, p, __ATOMIC_RELEASE);
+    wake_up();
+}
+
+int ps_paused(void)
+{
+    return __atomic_load_n(&paused, __ATOMIC_ACQUIRE);
+}
+
+void ps_wait_resume(void)
+{
+    int w;
+
+    for (;;)
+    {
+        w = __atomic_load_n(&wake, __ATOMIC_ACQUIRE);
+        if (!ps_paused() || __atomic_load_n(&command, __ATOMIC_RELAXED) != PS_PLAY)
+            return;
+        // Only sleeps if nothing's changed since 'w'
+        syscall(SYS_futex, &wake, FUTEX_WAIT_PRIVATE, w, NULL, NULL, 0);
+    }
+}
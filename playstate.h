@@ -0,0 +1,46 @@
+/*
+ * header file for playstate.c
+ *
+ * What play_song is doing, published for the UI to read without locking,
+ * and what the UI wants it to do next
+ */
+#ifndef PLAYSTATE_H
+#define PLAYSTATE_H
+
+// What the UI can ask play_song to do
+enum {
+	PS_PLAY,        // nothing; carry on (and what ended_by is when a song plays to the end)
+	PS_NEXT,
+	PS_PREV,
+	PS_SHUFFLE,
+	PS_QUIT         // wins over anything already waiting
+};
+
+struct play_state {
+	int song_number;    // where the song is in the playlist
+	int paused;         // play_song is waiting in ps_check_pause
+	int song_over;      // play_song is finished with it
+	int ended_by;       // once it's over: PS_PLAY if it played to the end, or the command that stopped it
+	long frames;        // played so far
+	long rate;          // of 'frames'
+	float volume;       // software volume applied (0..1)
+	int muted;
+};
+
+// A new song (song_over clear, and no command waiting but a quit); only while play_song isn't running
+void ps_start(int song_number);
+// play_song's updates; only ever one thread at a time calls this
+void ps_publish(const struct play_state *state);
+// The latest state; never blocks the publisher
+void ps_read(struct play_state *state);
+
+// UI -> play_song
+void ps_send(int command);
+void ps_pause(int paused);
+int ps_paused(void);
+// play_song: the command waiting (PS_PLAY if none); each is only taken once
+int ps_take_command(void);
+// play_song: wait while paused (or until a command comes in)
+void ps_wait_resume(void);
+
+#endif
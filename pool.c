@@ -0,0 +1,324 @@
+/*
+ * pool.c
+ *
+ * Decoder pool for lcd-mp3.
+ *
+ * play_song used to call mpg123_init/ao_initialize and make a new mpg123
+ * handle (two, in fact; the first one leaked) and output buffer for every
+ * song, and id3_tagger did its own mpg123_init/mpg123_exit around yet another
+ * handle.  Now the libraries are set up once for the life of the process and
+ * the handles, each with an mpg123_outblock sized buffer, are kept in a small
+ * pool: the player, the crossfade, the tag reader and the ReplayGain analyzer
+ * check one out, and hand it back when they're done.  After the first song
+ * nothing gets allocated here at all.
+ *
+ * The DSP stages' buffers (the float work and 16 bit output buffers, the
+ * time stretch's and the resampler's) are the same: dsp_open and friends
+ * take them from here and dsp_close gives them back, so a song change
+ * costs a search through POOL_BLOCKS entries rather than a dozen mallocs
+ * and frees.  A block too small for what's asked is freed and a bigger one
+ * made in its place, which only happens while things are warming up (or
+ * the card's rate changes).
+ *
+ * The audio and read-ahead threads check things out of here as a song
+ * starts, and so do the scan threads at the lowest priority there is, so
+ * there's no lock to be left waiting on: an entry or a block is taken with
+ * a compare-and-swap on its in_use flag, and the counts are atomics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ao/ao.h>
+
+#include "decoder.h"
+#include "pool.h"
+
+// An entry or block is claimed by setting in_use (compare-and-swap); only whoever has it touches the rest
+struct pool_entry {
+    mpg123_handle *mh;
+    unsigned char *buffer;
+    size_t buffer_size;
+    int in_use;
+};
+
+struct pool_block {
+    void *ptr;
+    size_t size;
+    int in_use;
+};
+
+static struct pool_entry entries[POOL_MAX];
+static struct pool_block blocks[POOL_BLOCKS];
+// Relaxed atomics
+static struct pool_stats stats;
+
+int pool_init(void)
+{
+    ao_initialize();
+    if (mpg123_init() != MPG123_OK)
+    {
+        fprintf(stderr, "[%s - %d]: mpg123_init failed\n", __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+static int claim(int *in_use)
+{
+    int free = 0;
+
+    return __atomic_compare_exchange_n(in_use, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void release(int *in_use)
+{
+    __atomic_store_n(in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void count(unsigned long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+// Set up one entry (claimed)
+static int make_entry(struct pool_entry *e)
+{
+    mpg123_handle *mh;
+    int err;
+
+    mh = decoder_new(&err);
+    if (mh == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: mpg123_new: %s\n", __FILE__, __LINE__, mpg123_plain_strerror(err));
+        return -1;
+    }
+    count(&stats.handles);
+    // Try to not show error messages
+    mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+    e->buffer_size = mpg123_outblock(mh);
+    e->buffer = malloc(e->buffer_size);
+    if (e->buffer == NULL)
+    {
+        perror("malloc: pool buffer");
+        mpg123_delete(mh);
+        return -1;
+    }
+    count(&stats.buffers);
+    // Others look at it to see which entries have been made
+    __atomic_store_n(&e->mh, mh, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void pool_fill(int count)
+{
+    int i;
+
+    for (i = 0; i < POOL_MAX && count > 0; i++)
+    {
+        if (claim(&entries[i].in_use))
+        {
+            if (entries[i].mh == NULL && make_entry(&entries[i]) == 0)
+                count--;
+            release(&entries[i].in_use);
+        }
+    }
+    stats.startup_handles = __atomic_load_n(&stats.handles, __ATOMIC_RELAXED);
+    stats.startup_buffers = __atomic_load_n(&stats.buffers, __ATOMIC_RELAXED);
+}
+
+mpg123_handle *pool_get(unsigned char **buffer, size_t *buffer_size)
+{
+    struct pool_entry *e = NULL;
+    int i;
+
+    // One that's already been made if possible, otherwise a new one
+    for (i = 0; i < POOL_MAX && e == NULL; i++)
+    {
+        if (__atomic_load_n(&entries[i].mh, __ATOMIC_RELAXED) != NULL && claim(&entries[i].in_use))
+            e = &entries[i];
+    }
+    for (i = 0; i < POOL_MAX && e == NULL; i++)
+    {
+        if (claim(&entries[i].in_use))
+        {
+            // (someone may have made it since)
+            if (entries[i].mh != NULL || make_entry(&entries[i]) == 0)
+                e = &entries[i];
+            else
+                release(&entries[i].in_use);
+        }
+    }
+    if (e == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: No free decoder handles\n", __FILE__, __LINE__);
+        return NULL;
+    }
+    count(&stats.checkouts);
+    // Whoever had it last may have narrowed the formats down
+    mpg123_format_all(e->mh);
+    if (buffer != NULL)
+        *buffer = e->buffer;
+    if (buffer_size != NULL)
+        *buffer_size = e->buffer_size;
+    return e->mh;
+}
+
+void pool_put(mpg123_handle *mh)
+{
+    int i;
+
+    if (mh == NULL)
+        return;
+    mpg123_close(mh);
+    for (i = 0; i < POOL_MAX; i++)
+    {
+        if (__atomic_load_n(&entries[i].mh, __ATOMIC_RELAXED) == mh)
+            release(&entries[i].in_use);
+    }
+}
+
+void *pool_alloc(size_t size)
+{
+    struct pool_block *b;
+    void *ptr = NULL;
+    size_t have, best = 0;
+    int i;
+
+    // The smallest that's big enough; another thread can take it first, so look again if it does
+    for (;;)
+    {
+        b = NULL;
+        for (i = 0; i < POOL_BLOCKS; i++)
+        {
+            have = __atomic_load_n(&blocks[i].size, __ATOMIC_RELAXED);
+            if (!__atomic_load_n(&blocks[i].in_use, __ATOMIC_RELAXED) && have >= size
+                && __atomic_load_n(&blocks[i].ptr, __ATOMIC_RELAXED) != NULL
+                && (b == NULL || have < best))
+            {
+                b = &blocks[i];
+                best = have;
+            }
+        }
+        if (b == NULL)
+            break;
+        if (claim(&b->in_use))
+        {
+            // It's ours now, and can't change under us; it may have since it was looked at
+            if (b->ptr != NULL && b->size >= size)
+            {
+                count(&stats.block_reuses);
+                return b->ptr;
+            }
+            release(&b->in_use);
+        }
+    }
+    // An empty entry, or else the smallest of the ones that are too small
+    for (;;)
+    {
+        b = NULL;
+        for (i = 0; i < POOL_BLOCKS; i++)
+        {
+            if (__atomic_load_n(&blocks[i].in_use, __ATOMIC_RELAXED))
+                continue;
+            if (b == NULL || (__atomic_load_n(&b->ptr, __ATOMIC_RELAXED) != NULL
+                              && (__atomic_load_n(&blocks[i].ptr, __ATOMIC_RELAXED) == NULL
+                                  || __atomic_load_n(&blocks[i].size, __ATOMIC_RELAXED) < __atomic_load_n(&b->size, __ATOMIC_RELAXED))))
+                b = &blocks[i];
+        }
+        if (b == NULL || claim(&b->in_use))
+            break;
+    }
+    if (b == NULL)
+        count(&stats.overflows);
+    else if (b->ptr != NULL)
+    {
+        free(b->ptr);
+        __atomic_fetch_sub(&stats.block_bytes, b->size, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->ptr, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->size, 0, __ATOMIC_RELAXED);
+    }
+    if (posix_memalign(&ptr, 16, (size > 0 ? size : 1)) != 0)
+        ptr = NULL;
+    if (b != NULL)
+    {
+        if (ptr == NULL)
+            release(&b->in_use);
+        else
+        {
+            __atomic_store_n(&b->ptr, ptr, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->size, size, __ATOMIC_RELAXED);
+            count(&stats.blocks);
+            __atomic_fetch_add(&stats.block_bytes, size, __ATOMIC_RELAXED);
+        }
+    }
+    return ptr;
+}
+
+void pool_free(void *ptr)
+{
+    int i;
+
+    if (ptr == NULL)
+        return;
+    for (i = 0; i < POOL_BLOCKS; i++)
+    {
+        if (__atomic_load_n(&blocks[i].ptr, __ATOMIC_RELAXED) == ptr)
+        {
+            release(&blocks[i].in_use);
+            return;
+        }
+    }
+    // One of the overflows
+    free(ptr);
+}
+
+void pool_stats(struct pool_stats *s)
+{
+    s->handles = __atomic_load_n(&stats.handles, __ATOMIC_RELAXED);
+    s->buffers = __atomic_load_n(&stats.buffers, __ATOMIC_RELAXED);
+    s->checkouts = __atomic_load_n(&stats.checkouts, __ATOMIC_RELAXED);
+    s->startup_handles = stats.startup_handles;
+    s->startup_buffers = stats.startup_buffers;
+    s->blocks = __atomic_load_n(&stats.blocks, __ATOMIC_RELAXED);
+    s->block_reuses = __atomic_load_n(&stats.block_reuses, __ATOMIC_RELAXED);
+    s->overflows = __atomic_load_n(&stats.overflows, __ATOMIC_RELAXED);
+    s->block_bytes = __atomic_load_n(&stats.block_bytes, __ATOMIC_RELAXED);
+}
+
+void pool_report(FILE *fp, unsigned long tracks)
+{
+    struct pool_stats s;
+
+    pool_stats(&s);
+    fprintf(fp, "decoder pool: %lu handles + %lu buffers at startup, %lu + %lu since over %lu tracks (%.2f per track), %lu checkouts\n",
+            s.startup_handles, s.startup_buffers, s.handles - s.startup_handles, s.buffers - s.startup_buffers,
+            tracks, (tracks ? (double)(s.handles - s.startup_handles + s.buffers - s.startup_buffers) / tracks : 0.0),
+            s.checkouts);
+    fprintf(fp, "DSP buffers: %lu allocated (%.1f KB kept), %lu reused, %lu overflowed\n",
+            s.blocks, s.block_bytes / 1024.0, s.block_reuses, s.overflows);
+}
+
+void pool_shutdown(void)
+{
+    int i;
+
+    // Nobody's using any of it by now
+    for (i = 0; i < POOL_MAX; i++)
+    {
+        if (entries[i].mh != NULL)
+        {
+            mpg123_close(entries[i].mh);
+            mpg123_delete(entries[i].mh);
+            free(entries[i].buffer);
+            memset(&entries[i], 0, sizeof(entries[i]));
+        }
+    }
+    for (i = 0; i < POOL_BLOCKS; i++)
+        free(blocks[i].ptr);
+    memset(blocks, 0, sizeof(blocks));
+    stats.block_bytes = 0;
+    mpg123_exit();
+    ao_shutdown();
+}
@@ -0,0 +1,55 @@
+/*
+ * header file for pool.c
+ *
+ * Library set up for the life of the process, and a pool of mpg123 handles
+ * (each with its output buffer) and of DSP buffers that get reused from song
+ * to song
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <mpg123.h>
+
+// Player + crossfade + tag reader + ReplayGain analyzer, with room to spare
+#define POOL_MAX 6
+// DSP buffers: two chains (crossfading) of up to 10 each, with room to spare
+#define POOL_BLOCKS 24
+
+struct pool_stats {
+	unsigned long handles;      // mpg123_new calls
+	unsigned long buffers;      // output buffers allocated
+	unsigned long checkouts;
+	unsigned long startup_handles;  // of 'handles', how many were made by pool_fill
+	unsigned long startup_buffers;
+	unsigned long blocks;       // DSP buffers allocated (or made bigger)
+	unsigned long block_reuses; // pool_alloc calls that got one back
+	unsigned long overflows;    // pool_alloc calls with none free (allocated and freed the normal way)
+	size_t block_bytes;         // held in the pool now
+};
+
+// mpg123_init / ao_initialize; once, at the start.  Returns 0 on success.
+int pool_init(void);
+// Make 'count' handles up front (once the decoder has been picked)
+void pool_fill(int count);
+/*
+  Check out a handle and its output buffer.  The handle comes back with no
+  stream open and mpg123's default output formats.  NULL if they're all in use.
+*/
+mpg123_handle *pool_get(unsigned char **buffer, size_t *buffer_size);
+// Give it back (closes whatever it had open)
+void pool_put(mpg123_handle *mh);
+/*
+  A buffer for a DSP stage, 16 byte aligned and not cleared: one the size of
+  it or bigger that's been given back if there is one.  NULL if out of memory.
+*/
+void *pool_alloc(size_t size);
+// Give it back for the next song (NULL is fine)
+void pool_free(void *ptr);
+// Print what's been allocated so far
+void pool_report(FILE *fp, unsigned long tracks);
+void pool_stats(struct pool_stats *stats);
+// Free everything; mpg123_exit / ao_shutdown
+void pool_shutdown(void);
+
+#endif
@@ -0,0 +1,715 @@
+/*
+ * readahead.c
+ *
+ * Read-ahead for the files being played.
+ *
+ * The songs are usually on a USB stick, and a USB stick now and then takes a
+ * long time (tens, even hundreds of ms) to answer a read.  mpg123 reads the
+ * file a few KB at a time as it decodes, so one of those slow reads used to
+ * hold up the decoder and the sound card ran dry.
+ *
+ * Now mpg123 reads through our own reader functions (mpg123_open_handle) out
+ * of a RA_BUFFER_SIZE buffer per file, and an I/O thread keeps that buffer
+ * filled, RA_CHUNK_SIZE (aligned) at a time, well ahead of the decoder.  The
+ * kernel is told we read the file front to back (POSIX_FADV_SEQUENTIAL), is
+ * asked to start on the chunk after the one being read (POSIX_FADV_WILLNEED),
+ * and to drop what's been played (POSIX_FADV_DONTNEED) so the page cache
+ * doesn't push out anything else.
+ *
+ * Each read the I/O thread does is timed, and every time the decoder has to
+ * wait for data (a stall; with the buffer this far ahead that should only
+ * happen at the start of a song or after a seek) it's counted.
+ *
+ * The decoder and the I/O thread share no lock.  Each stream's buffer is a
+ * ring with one writer and one reader: the I/O thread moves win_end on once
+ * a chunk is in, and the decoder moves pos on once it's copied something
+ * out, each with a release store the other side reads with an acquire.  A
+ * seek outside the buffer bumps the stream's gen, and the I/O thread starts
+ * the window over from there the next time round.  The decoder waits for
+ * data, and the I/O thread for something to do, on futexes.  Streams are
+ * claimed and ra_call's jobs handed over with compare-and-swaps, and a
+ * stream's file is closed by the I/O thread, never under a read.
+ *
+ * For files on fast local storage there's also -mmap: the whole file is
+ * mapped once and mpg123's reads are a memcpy out of the mapping, with no
+ * system calls (and no lock) at all while it plays.  Anything that can't be
+ * mapped is read ahead as above instead.  If the file goes away under the
+ * mapping (the USB stick is pulled) touching it raises SIGBUS; the handler
+ * jumps back out of ra_read, which returns an error so mpg123 ends the song
+ * the same way it would for a failed read().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+
+#include "readahead.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rtsched.h"
+
+// A stream's state; a free one is claimed by ra_open, and only the I/O thread frees one
+enum {
+    RA_FREE,
+    RA_OPENING,                 // ra_open is filling it in
+    RA_OPEN,
+    RA_CLOSING                  // mpg123 is done with it; the I/O thread closes the file
+};
+
+struct ra_stream {
+    int state;
+    int fd;
+    off_t size;
+    unsigned char *buffer;      // RA_BUFFER_SIZE; file offset x is at buffer[x % RA_BUFFER_SIZE]
+    // The I/O thread's: what's in the buffer is the file from win_start to win_end, read for seek win_gen
+    off_t win_start, win_end;
+    int eof;                    // win_end is the end of the file (or a read failed)
+    unsigned win_gen;
+    int data;                   // bumped (and woken) when win_end or eof move
+    // The decoder's
+    off_t pos;                  // where mpg123 is reading
+    off_t high;                 // the furthest it's read since the window was last moved
+    off_t base;                 // where the window was moved to
+    unsigned gen;               // bumped when a seek moves the window
+    // -mmap: the whole file (only ever touched by the thread decoding it)
+    unsigned char *map;
+    int map_failed;             // SIGBUS
+};
+
+static struct ra_stream streams[RA_MAX_STREAMS];
+// Counted with relaxed atomics (times in ns); ra_stats turns them into a struct ra_stats
+static struct {
+    unsigned long reads, slow_reads, hist[RA_HIST_BUCKETS];
+    unsigned long stalls, seeks, maps, map_fallbacks, bus_errors;
+    unsigned long long bytes, read_ns, read_max_ns, stall_ns, stall_max_ns;
+} counts;
+static pthread_t io_thread;
+static int running = 0;
+static int ra_mode = RA_MODE_READAHEAD;
+// Where a SIGBUS in ra_read goes back to
+static __thread sigjmp_buf bus_jump;
+static __thread volatile sig_atomic_t in_map_copy = 0;
+static struct sigaction old_sigbus;
+// Bumped (and woken, if the I/O thread is asleep) when there's room in a buffer, a stream was opened/moved/closed, or a job came in
+static int work = 0;
+static int io_waiting = 0;
+// Bumped (and woken) when the I/O thread closes a stream for ra_open to have
+static int freed = 0;
+// What ra_call has left for the I/O thread
+enum { JOB_NONE, JOB_POSTING, JOB_READY };
+static int job_state = JOB_NONE;
+static void (*job_fn)(void *);
+static void *job_arg;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hist_bucket(double secs)
+{
+    static const double limits[RA_HIST_BUCKETS - 1] = { 0.001, 0.002, 0.005, 0.010, 0.020, 0.050, 0.100 };
+    int i;
+
+    for (i = 0; i < RA_HIST_BUCKETS - 1; i++)
+    {
+        if (secs < limits[i])
+            break;
+    }
+    return i;
+}
+
+static void count_time(unsigned long long *sum, unsigned long long *max, double secs)
+{
+    unsigned long long ns = secs * 1e9, old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(sum, ns, __ATOMIC_RELAXED);
+    while (ns > old && !__atomic_compare_exchange_n(max, &old, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void wake_io(void)
+{
+    __atomic_fetch_add(&work, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&io_waiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &work, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void data_ready(struct ra_stream *s)
+{
+    __atomic_fetch_add(&s->data, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &s->data, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Start the window over from where a seek went (I/O thread)
+static void sync_stream(struct ra_stream *s)
+{
+    unsigned gen = __atomic_load_n(&s->gen, __ATOMIC_ACQUIRE);
+
+    if (gen == s->win_gen)
+        return;
+    s->win_start = __atomic_load_n(&s->base, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->win_end, s->win_start, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->eof, (s->win_start >= s->size), __ATOMIC_RELEASE);
+    __atomic_store_n(&s->win_gen, gen, __ATOMIC_RELEASE);
+    data_ready(s);
+}
+
+// Bytes free in a stream's buffer (I/O thread).  Everything more than RA_KEEP_BEHIND behind pos can go.
+static off_t space_left(struct ra_stream *s)
+{
+    off_t keep = __atomic_load_n(&s->pos, __ATOMIC_ACQUIRE) - RA_KEEP_BEHIND;
+
+    if (keep > s->win_start)
+        s->win_start = (keep < s->win_end ? keep : s->win_end);
+    return RA_BUFFER_SIZE - (s->win_end - s->win_start);
+}
+
+// The stream most in need of a read, or NULL (I/O thread)
+static struct ra_stream *next_stream()
+{
+    struct ra_stream *s, *best = NULL;
+    off_t left, best_left = 0;
+    int i;
+
+    for (i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        s = &streams[i];
+        if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != RA_OPEN || s->map != NULL)
+            continue;
+        sync_stream(s);
+        if (s->eof || space_left(s) < RA_CHUNK_SIZE)
+            continue;
+        // Whichever has the least left to play
+        left = s->win_end - __atomic_load_n(&s->pos, __ATOMIC_RELAXED);
+        if (best == NULL || left < best_left)
+        {
+            best = s;
+            best_left = left;
+        }
+    }
+    return best;
+}
+
+// Close the files mpg123 is done with (I/O thread, or once it's gone)
+static void close_streams()
+{
+    int i, n = 0;
+
+    for (i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        if (__atomic_load_n(&streams[i].state, __ATOMIC_ACQUIRE) == RA_CLOSING)
+        {
+            close(streams[i].fd);
+            streams[i].fd = -1;
+            __atomic_store_n(&streams[i].state, RA_FREE, __ATOMIC_RELEASE);
+            n++;
+        }
+    }
+    if (n > 0)
+    {
+        __atomic_fetch_add(&freed, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &freed, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/*
+  Read the chunk at the end of s's window (I/O thread).  win_end is always
+  chunk aligned (the window starts aligned and grows a chunk at a time until
+  the end of the file) and RA_BUFFER_SIZE is a multiple of the chunk size,
+  so the chunk lands in one piece.  The decoder doesn't read that part of
+  the buffer until win_end is moved past it, and the file stays open until
+  the I/O thread closes it itself.
+*/
+static void read_chunk(struct ra_stream *s)
+{
+    off_t off = s->win_end, done_to = s->win_start;
+    unsigned gen = s->win_gen;
+    int fd = s->fd;
+    ssize_t n;
+    double start, secs;
+
+    posix_fadvise(fd, off + RA_CHUNK_SIZE, RA_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+    start = now();
+    do
+        n = pread(fd, s->buffer + off % RA_BUFFER_SIZE, RA_CHUNK_SIZE, off);
+    while (n < 0 && errno == EINTR);
+    secs = now() - start;
+    trace_span_at(TR_READ, start * 1e9, (start + secs) * 1e9, n);
+    // Played already, and behind what we keep
+    if (done_to > RA_CHUNK_SIZE)
+        posix_fadvise(fd, 0, done_to - done_to % RA_CHUNK_SIZE, POSIX_FADV_DONTNEED);
+    __atomic_fetch_add(&counts.reads, 1, __ATOMIC_RELAXED);
+    count_time(&counts.read_ns, &counts.read_max_ns, secs);
+    if (secs * 1000 >= RA_SLOW_MS)
+        __atomic_fetch_add(&counts.slow_reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counts.hist[hist_bucket(secs)], 1, __ATOMIC_RELAXED);
+    // Seeked somewhere else while we were reading
+    if (__atomic_load_n(&s->gen, __ATOMIC_ACQUIRE) != gen)
+        return;
+    if (n < 0)
+    {
+        fprintf(stderr, "[%s - %d]: read: %s\n", __FILE__, __LINE__, strerror(errno));
+        __atomic_store_n(&s->eof, 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        __atomic_fetch_add(&counts.bytes, n, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->win_end, off + n, __ATOMIC_RELEASE);
+        if (n < RA_CHUNK_SIZE)
+            __atomic_store_n(&s->eof, 1, __ATOMIC_RELEASE);
+    }
+    data_ready(s);
+}
+
+// Run what ra_call left, if anything; 1 if there was something
+static int run_job()
+{
+    void (*fn)(void *);
+    void *arg;
+
+    if (__atomic_load_n(&job_state, __ATOMIC_ACQUIRE) != JOB_READY)
+        return 0;
+    fn = job_fn;
+    arg = job_arg;
+    __atomic_store_n(&job_state, JOB_NONE, __ATOMIC_RELEASE);
+    fn(arg);
+    return 1;
+}
+
+static void *io_loop(void *arg)
+{
+    struct ra_stream *s;
+    int w;
+
+    (void)arg;
+    trace_thread("read-ahead");
+    rt_thread(RT_IO);
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        // Read before looking, so anything that comes in after shows up as a change
+        w = __atomic_load_n(&work, __ATOMIC_SEQ_CST);
+        if (run_job())
+            continue;
+        close_streams();
+        s = next_stream();
+        if (s != NULL)
+        {
+            read_chunk(s);
+            continue;
+        }
+        __atomic_store_n(&io_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&work, __ATOMIC_SEQ_CST) == w)
+            syscall(SYS_futex, &work, FUTEX_WAIT_PRIVATE, w, NULL, NULL, 0);
+        __atomic_store_n(&io_waiting, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void bus_handler(int sig, siginfo_t *info, void *context)
+{
+    if (in_map_copy)
+    {
+        in_map_copy = 0;
+        siglongjmp(bus_jump, 1);
+    }
+    // Not ours
+    if (old_sigbus.sa_flags & SA_SIGINFO)
+        old_sigbus.sa_sigaction(sig, info, context);
+    else if (old_sigbus.sa_handler != SIG_IGN && old_sigbus.sa_handler != SIG_DFL)
+        old_sigbus.sa_handler(sig);
+    else
+    {
+        signal(SIGBUS, SIG_DFL);
+        raise(SIGBUS);
+    }
+}
+
+// Read from a mapped file
+static ssize_t map_read(struct ra_stream *s, void *buf, size_t count)
+{
+    size_t n;
+
+    if (s->map_failed)
+        return -1;
+    n = (s->pos < s->size ? s->size - s->pos : 0);
+    if (n > count)
+        n = count;
+    // Not sigsetjmp(.., 1): that's a sigprocmask call on every read.  SA_NODEFER keeps SIGBUS unblocked instead.
+    if (sigsetjmp(bus_jump, 0) != 0)
+    {
+        s->map_failed = 1;
+        fprintf(stderr, "[%s - %d]: Lost the mapped file (SIGBUS)\n", __FILE__, __LINE__);
+        __atomic_fetch_add(&counts.bus_errors, 1, __ATOMIC_RELAXED);
+        errno = EIO;
+        return -1;
+    }
+    in_map_copy = 1;
+    memcpy(buf, s->map + s->pos, n);
+    in_map_copy = 0;
+    s->pos += n;
+    return n;
+}
+
+// mpg123's read (through mpg123_replace_reader_handle)
+static ssize_t ra_read(void *handle, void *buf, size_t count)
+{
+    struct ra_stream *s = handle;
+    size_t n, at, first;
+    off_t end = 0;
+    double start = 0.0, secs;
+    int data;
+
+    if (s->map != NULL)
+        return map_read(s, buf, count);
+    for (;;)
+    {
+        data = __atomic_load_n(&s->data, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->win_gen, __ATOMIC_ACQUIRE) == s->gen)
+        {
+            end = __atomic_load_n(&s->win_end, __ATOMIC_ACQUIRE);
+            if (s->pos < end || __atomic_load_n(&s->eof, __ATOMIC_ACQUIRE))
+                break;
+        }
+        // A file being opened by a job on the I/O thread; there's nobody else to read it
+        if (pthread_equal(pthread_self(), io_thread))
+        {
+            sync_stream(s);
+            if (!s->eof)
+            {
+                space_left(s);
+                read_chunk(s);
+            }
+            continue;
+        }
+        if (start == 0.0)
+            start = now();
+        // Only sleeps if the I/O thread hasn't moved anything since 'data'
+        syscall(SYS_futex, &s->data, FUTEX_WAIT_PRIVATE, data, NULL, NULL, 0);
+    }
+    if (start != 0.0)
+    {
+        secs = now() - start;
+        metrics_record(MET_STALL, secs * 1e9);
+        trace_span_at(TR_STALL, start * 1e9, (start + secs) * 1e9, 0);
+        __atomic_fetch_add(&counts.stalls, 1, __ATOMIC_RELAXED);
+        count_time(&counts.stall_ns, &counts.stall_max_ns, secs);
+    }
+    n = (s->pos < end ? end - s->pos : 0);
+    metrics_record(MET_RING_FILL, n);
+    if (n > count)
+        n = count;
+    // Copy it out (in two pieces if it wraps around the end of the buffer)
+    at = s->pos % RA_BUFFER_SIZE;
+    first = (n < RA_BUFFER_SIZE - at ? n : RA_BUFFER_SIZE - at);
+    memcpy(buf, s->buffer + at, first);
+    memcpy((unsigned char *)buf + first, s->buffer, n - first);
+    // Only once it's copied: the I/O thread can write over it from then on
+    __atomic_store_n(&s->pos, s->pos + n, __ATOMIC_RELEASE);
+    if (s->pos > s->high)
+        s->high = s->pos;
+    // There may be room for another chunk now
+    wake_io();
+    return n;
+}
+
+// mpg123's lseek; mpg123 seeks to the end and back for the ID3v1 tag, and when we seek in the song
+static off_t ra_lseek(void *handle, off_t offset, int whence)
+{
+    struct ra_stream *s = handle;
+    off_t to, end;
+
+    if (whence == SEEK_SET)
+        to = offset;
+    else if (whence == SEEK_CUR)
+        to = s->pos + offset;
+    else if (whence == SEEK_END)
+        to = s->size + offset;
+    else
+        to = -1;
+    if (to < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (s->map != NULL)
+    {
+        s->pos = to;
+        return to;
+    }
+    /*
+      What's still in the buffer: the I/O thread only lets go of what's
+      RA_KEEP_BEHIND behind a position we've read from, so anything from
+      there on (and after where the window was last moved to) up to what it's
+      read so far.
+    */
+    end = (__atomic_load_n(&s->win_gen, __ATOMIC_ACQUIRE) == s->gen ? __atomic_load_n(&s->win_end, __ATOMIC_ACQUIRE) : s->base);
+    if (to < s->base || to < s->high - RA_KEEP_BEHIND || to > end)
+    {
+        // Outside what we have; start over from the chunk it's in
+        __atomic_fetch_add(&counts.seeks, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->base, to - to % RA_CHUNK_SIZE, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->pos, to, __ATOMIC_RELAXED);
+        s->high = to;
+        __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELEASE);
+        wake_io();
+    }
+    else
+        __atomic_store_n(&s->pos, to, __ATOMIC_RELEASE);
+    return to;
+}
+
+// mpg123's cleanup, called from mpg123_close
+static void ra_cleanup(void *handle)
+{
+    struct ra_stream *s = handle;
+
+    if (s->map != NULL)
+        munmap(s->map, s->size);
+    // The I/O thread may be reading it; it closes the file once it isn't
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&s->state, RA_CLOSING, __ATOMIC_RELEASE);
+        wake_io();
+    }
+    else
+    {
+        close(s->fd);
+        s->fd = -1;
+        __atomic_store_n(&s->state, RA_FREE, __ATOMIC_RELEASE);
+    }
+}
+
+int ra_init(int mode)
+{
+    struct sigaction sa;
+    int i;
+
+    ra_mode = mode;
+
+    for (i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        streams[i].fd = -1;
+        streams[i].buffer = malloc(RA_BUFFER_SIZE);
+        if (streams[i].buffer == NULL)
+        {
+            perror("malloc: read-ahead buffer");
+            while (i-- > 0)
+                free(streams[i].buffer);
+            return -1;
+        }
+    }
+    running = 1;
+    if (pthread_create(&io_thread, NULL, io_loop, NULL) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot start the read-ahead thread\n", __FILE__, __LINE__);
+        running = 0;
+        for (i = 0; i < RA_MAX_STREAMS; i++)
+        {
+            free(streams[i].buffer);
+            streams[i].buffer = NULL;
+        }
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = bus_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &old_sigbus);
+    return 0;
+}
+
+void ra_set_mode(int mode)
+{
+    ra_mode = mode;
+}
+
+void ra_shutdown(void)
+{
+    int i;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&work, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &work, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    pthread_join(io_thread, NULL);
+    // A job nobody got round to; ra_open just uses mpg123_open now
+    run_job();
+    close_streams();
+    sigaction(SIGBUS, &old_sigbus, NULL);
+    for (i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        free(streams[i].buffer);
+        streams[i].buffer = NULL;
+    }
+}
+
+int ra_open(mpg123_handle *mh, const char *path)
+{
+    struct ra_stream *s = NULL;
+    struct stat st;
+    unsigned char *map = NULL;
+    int fd, i, err;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || ra_mode == RA_MODE_READ)
+        return mpg123_open(mh, path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return MPG123_ERR;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return MPG123_ERR;
+    }
+    if (ra_mode == RA_MODE_MMAP && st.st_size > 0 && st.st_size <= RA_MMAP_MAX)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+        {
+            // Page it all in up front, in order
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            madvise(map, st.st_size, MADV_WILLNEED);
+        }
+    }
+    if (map == NULL)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, RA_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+    }
+    for (;;)
+    {
+        int freed_before = __atomic_load_n(&freed, __ATOMIC_ACQUIRE), closing = 0;
+
+        for (i = 0; i < RA_MAX_STREAMS && s == NULL; i++)
+        {
+            int state = RA_FREE;
+
+            if (__atomic_compare_exchange_n(&streams[i].state, &state, RA_OPENING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                s = &streams[i];
+            else if (state == RA_CLOSING)
+                closing = 1;
+        }
+        if (s != NULL || !closing)
+            break;
+        // The last song's, which the I/O thread hasn't closed yet
+        if (pthread_equal(pthread_self(), io_thread))
+            close_streams();
+        else
+        {
+            wake_io();
+            syscall(SYS_futex, &freed, FUTEX_WAIT_PRIVATE, freed_before, NULL, NULL, 0);
+        }
+    }
+    if (s != NULL)
+    {
+        s->fd = fd;
+        s->size = st.st_size;
+        s->pos = s->high = s->base = 0;
+        s->map = map;
+        s->map_failed = 0;
+        // Whatever the window was for last time, it's a seek to the start
+        __atomic_store_n(&s->gen, s->gen + 1, __ATOMIC_RELAXED);
+        if (map != NULL)
+            __atomic_fetch_add(&counts.maps, 1, __ATOMIC_RELAXED);
+        else if (ra_mode == RA_MODE_MMAP)
+            __atomic_fetch_add(&counts.map_fallbacks, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->state, RA_OPEN, __ATOMIC_RELEASE);
+        // Nothing for the I/O thread to do for a mapped one
+        if (map == NULL)
+            wake_io();
+    }
+    if (s == NULL)
+    {
+        // Shouldn't happen (only the player and the crossfade use this) but just in case
+        if (map != NULL)
+            munmap(map, st.st_size);
+        close(fd);
+        return mpg123_open(mh, path);
+    }
+    err = mpg123_replace_reader_handle(mh, ra_read, ra_lseek, ra_cleanup);
+    if (err == MPG123_OK)
+        err = mpg123_open_handle(mh, s);
+    if (err != MPG123_OK)
+    {
+        // mpg123 doesn't call the cleanup if the open fails
+        ra_cleanup(s);
+        return mpg123_open(mh, path);
+    }
+    return MPG123_OK;
+}
+
+int ra_call(void (*fn)(void *), void *arg)
+{
+    int state = JOB_NONE;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)
+        || !__atomic_compare_exchange_n(&job_state, &state, JOB_POSTING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return -1;
+    job_fn = fn;
+    job_arg = arg;
+    __atomic_store_n(&job_state, JOB_READY, __ATOMIC_RELEASE);
+    wake_io();
+    return 0;
+}
+
+void ra_stats(struct ra_stats *s)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->reads = __atomic_load_n(&counts.reads, __ATOMIC_RELAXED);
+    s->bytes = __atomic_load_n(&counts.bytes, __ATOMIC_RELAXED);
+    s->read_secs = __atomic_load_n(&counts.read_ns, __ATOMIC_RELAXED) / 1e9;
+    s->read_max_secs = __atomic_load_n(&counts.read_max_ns, __ATOMIC_RELAXED) / 1e9;
+    s->slow_reads = __atomic_load_n(&counts.slow_reads, __ATOMIC_RELAXED);
+    for (i = 0; i < RA_HIST_BUCKETS; i++)
+        s->hist[i] = __atomic_load_n(&counts.hist[i], __ATOMIC_RELAXED);
+    s->stalls = __atomic_load_n(&counts.stalls, __ATOMIC_RELAXED);
+    s->stall_secs = __atomic_load_n(&counts.stall_ns, __ATOMIC_RELAXED) / 1e9;
+    s->stall_max_secs = __atomic_load_n(&counts.stall_max_ns, __ATOMIC_RELAXED) / 1e9;
+    s->seeks = __atomic_load_n(&counts.seeks, __ATOMIC_RELAXED);
+    s->maps = __atomic_load_n(&counts.maps, __ATOMIC_RELAXED);
+    s->map_fallbacks = __atomic_load_n(&counts.map_fallbacks, __ATOMIC_RELAXED);
+    s->bus_errors = __atomic_load_n(&counts.bus_errors, __ATOMIC_RELAXED);
+}
+
+void ra_report(FILE *fp)
+{
+    static const char *labels[RA_HIST_BUCKETS] = { "<1", "<2", "<5", "<10", "<20", "<50", "<100", ">=100" };
+    struct ra_stats s;
+    int i;
+
+    ra_stats(&s);
+    fprintf(fp, "read-ahead: %lu reads, %.1f MB, avg %.2f ms, max %.2f ms, %lu slow (>= %d ms), %lu seeks\n",
+            s.reads, s.bytes / 1048576.0, (s.reads ? s.read_secs * 1000 / s.reads : 0.0), s.read_max_secs * 1000,
+            s.slow_reads, RA_SLOW_MS, s.seeks);
+    fprintf(fp, "read-ahead: read ms");
+    for (i = 0; i < RA_HIST_BUCKETS; i++)
+        fprintf(fp, " %s:%lu", labels[i], s.hist[i]);
+    fprintf(fp, "\n");
+    fprintf(fp, "read-ahead: %lu stalls, %.1f ms waiting in all, max %.2f ms\n",
+            s.stalls, s.stall_secs * 1000, s.stall_max_secs * 1000);
+    if (s.maps != 0 || s.map_fallbacks != 0)
+        fprintf(fp, "read-ahead: %lu files mapped, %lu read ahead instead, %lu lost (SIGBUS)\n",
+                s.maps, s.map_fallbacks, s.bus_errors);
+}
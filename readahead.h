@@ -0,0 +1,73 @@
+/*
+ * header file for readahead.c
+ *
+ * Feeding mpg123 from a read-ahead buffer filled by an I/O thread, or straight
+ * from the file mapped into memory
+ */
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <mpg123.h>
+
+// Files being read at once (the song playing and the one crossfading in)
+#define RA_MAX_STREAMS 2
+// Per stream; ~25s of a 320kbps MP3
+#define RA_BUFFER_SIZE (1024 * 1024)
+// Size (and alignment) of the reads from the disk
+#define RA_CHUNK_SIZE  (64 * 1024)
+// Kept behind the read position for mpg123 seeking back a little
+#define RA_KEEP_BEHIND RA_CHUNK_SIZE
+// A read slower than this counts as slow
+#define RA_SLOW_MS     20
+
+// Biggest file that gets mapped (there's only so much address space on a Pi)
+#define RA_MMAP_MAX    (256 * 1024 * 1024)
+
+// How ra_open opens files
+#define RA_MODE_READ      0   // mpg123_open (mpg123 reads the file itself)
+#define RA_MODE_READAHEAD 1   // through the I/O thread's buffer
+#define RA_MODE_MMAP      2   // map the whole file; read-ahead if it can't be mapped
+
+// Read latency buckets: <1, <2, <5, <10, <20, <50, <100, >=100 ms
+#define RA_HIST_BUCKETS 8
+
+struct ra_stats {
+	unsigned long reads;           // chunks read by the I/O thread
+	unsigned long long bytes;
+	double read_secs;              // total time in read()
+	double read_max_secs;
+	unsigned long slow_reads;      // over RA_SLOW_MS
+	unsigned long hist[RA_HIST_BUCKETS];
+	unsigned long stalls;          // times the decoder had to wait for the disk
+	double stall_secs;
+	double stall_max_secs;
+	unsigned long seeks;           // seeks outside of what was buffered
+	unsigned long maps;            // files mapped
+	unsigned long map_fallbacks;   // files that couldn't be, and were read ahead instead
+	unsigned long bus_errors;      // mapped files that went away (SIGBUS) while playing
+};
+
+/*
+  Allocate the buffers, start the I/O thread and pick the mode (RA_MODE_*).
+  Returns 0 on success.
+*/
+int ra_init(int mode);
+void ra_shutdown(void);
+// Switch modes; files already open carry on the way they were opened
+void ra_set_mode(int mode);
+/*
+  Open 'path' on 'mh' the way the mode says (mpg123_open if it can't).
+  Returns what mpg123_open would.
+*/
+int ra_open(mpg123_handle *mh, const char *path);
+/*
+  Have the I/O thread call fn(arg) (it can open files with ra_open and read
+  them).  -1 if there's no I/O thread, or it already has something to do.
+*/
+int ra_call(void (*fn)(void *), void *arg);
+void ra_stats(struct ra_stats *stats);
+void ra_report(FILE *fp);
+
+#endif
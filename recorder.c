@@ -0,0 +1,99 @@
+/*
+ * recorder.c
+ *
+ * Input recorder for lcd-mp3.
+ *
+ * With -record the main loop writes down every button change and knob turn
+ * it acts on, with the time it saw it.  -replay plays the file back on the
+ * simulator (hal_sim.c), whose clock is its sound card's, so the presses land
+ * at the same point in the songs every time and two builds can be compared
+ * on exactly the same session: how long the LCD took to respond and how many
+ * times the card ran dry (hal_sim_report).
+ *
+ * The file is REC_MAGIC followed by struct rec_event records.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hal.h"
+#include "recorder.h"
+
+static FILE *rec_fp = NULL;
+
+int rec_start(const char *file)
+{
+    rec_fp = fopen(file, "wb");
+    if (rec_fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot create %s\n", __FILE__, __LINE__, file);
+        return -1;
+    }
+    fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), rec_fp);
+    return 0;
+}
+
+static void record(int type, int pin, long value)
+{
+    struct rec_event event;
+
+    if (rec_fp == NULL)
+        return;
+    event.ms = hal_millis();
+    event.type = type;
+    event.pin = pin;
+    event.value = (value > 32767 ? 32767 : (value < -32768 ? -32768 : value));
+    fwrite(&event, sizeof(event), 1, rec_fp);
+}
+
+void rec_button(int pin, int level)
+{
+    record(REC_BUTTON, pin, level);
+}
+
+void rec_encoder(long steps)
+{
+    if (steps != 0)
+        record(REC_ENCODER, 0, steps);
+}
+
+void rec_stop(void)
+{
+    if (rec_fp != NULL)
+        fclose(rec_fp);
+    rec_fp = NULL;
+}
+
+int rec_replay(const char *file, int pin_a, int pin_b, long debounce)
+{
+    FILE *fp;
+    struct rec_event event;
+    char magic[sizeof(REC_MAGIC)];
+    unsigned int ms;
+
+    fp = fopen(file, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot read %s\n", __FILE__, __LINE__, file);
+        return -1;
+    }
+    if (fread(magic, 1, strlen(REC_MAGIC), fp) != strlen(REC_MAGIC) || memcmp(magic, REC_MAGIC, strlen(REC_MAGIC)) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: %s isn't a recording\n", __FILE__, __LINE__, file);
+        fclose(fp);
+        return -1;
+    }
+    while (fread(&event, sizeof(event), 1, fp) == 1)
+    {
+        if (event.type == REC_BUTTON)
+        {
+            // The player takes a change once it's been steady for more than 'debounce'
+            ms = ((long)event.ms > debounce + 1 ? event.ms - debounce - 1 : 0);
+            hal_sim_event(ms, event.pin, event.value);
+        }
+        else if (event.type == REC_ENCODER)
+            hal_sim_turn(event.ms, pin_a, pin_b, event.value);
+    }
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * header file for recorder.c
+ *
+ * Recording what's done with the buttons and knob, and replaying it on the
+ * simulator
+ */
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#define REC_MAGIC "LCDREC1\n"
+
+// A record's type
+#define REC_BUTTON  1
+#define REC_ENCODER 2
+
+// As written to the file (little endian, like the Pi)
+struct rec_event {
+	unsigned int ms;           // hal_millis() when the player saw it
+	unsigned char type;
+	unsigned char pin;         // the button's pin
+	short value;               // button level, or encoder steps (+/-)
+};
+
+// Start recording to 'file'; returns 0 if it could be created
+int rec_start(const char *file);
+// A button changed (after the debounce), or the knob moved 'steps'
+void rec_button(int pin, int level);
+void rec_encoder(long steps);
+void rec_stop(void);
+/*
+  Queue the events in 'file' on the simulator (before hal_setup).  Buttons are
+  pressed 'debounce' ms before they were seen, so the player sees them when
+  it did the first time.  Returns 0 if it could be read.
+*/
+int rec_replay(const char *file, int pin_a, int pin_b, long debounce);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * resample.c
+ *
+ * Polyphase resampler for lcd-mp3.
+ *
+ * Most of the Pi's sound cards (and plenty of USB ones) only run at a couple of
+ * rates.  Rather than leave a mixed 44.1/48kHz library to ALSA's plug/dmix
+ * converters, play_song asks the card what it can do and, when the song's rate
+ * isn't one of them, converts it here.
+ *
+ * The filter is a Kaiser windowed sinc, RESAMPLE_TAPS long, worked out once for
+ * every phase when the song is opened; each output sample is then just one dot
+ * product per channel.  For the usual ratios (44.1k <-> 48k is 160/147) the
+ * table has an entry for every phase the output can land on, so there is no
+ * interpolation between phases.  The input is kept one row per channel so the
+ * dot products run straight down memory (NEON/SSE2, 4 taps at a time).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(RESAMPLE_NO_SIMD)
+#  define RESAMPLE_SCALAR
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define RESAMPLE_NEON
+#  include <arm_neon.h>
+#elif defined(__SSE2__)
+#  define RESAMPLE_SSE2
+#  include <emmintrin.h>
+#else
+#  define RESAMPLE_SCALAR
+#endif
+
+#include "pool.h"
+#include "resample.h"
+
+// Kaiser window shape; ~80dB stopband
+#define KAISER_BETA 8.0
+// Where the passband ends, as a fraction of the lower of the two Nyquists
+#define PASSBAND 0.91
+
+/*
+ * Dot product kernel
+ */
+
+#if defined(RESAMPLE_SSE2)
+
+const char *resample_kernel_name(void) { return "sse2"; }
+
+static float dot(const float *h, const float *x)
+{
+    __m128 acc = _mm_setzero_ps();
+    float s[4];
+    int k;
+
+    for (k = 0; k < RESAMPLE_TAPS; k += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(h + k), _mm_loadu_ps(x + k)));
+    _mm_storeu_ps(s, acc);
+    return s[0] + s[1] + s[2] + s[3];
+}
+
+#elif defined(RESAMPLE_NEON)
+
+const char *resample_kernel_name(void) { return "neon"; }
+
+static float dot(const float *h, const float *x)
+{
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    float32x2_t s;
+    int k;
+
+    for (k = 0; k < RESAMPLE_TAPS; k += 4)
+        acc = vmlaq_f32(acc, vld1q_f32(h + k), vld1q_f32(x + k));
+    s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+#else // RESAMPLE_SCALAR
+
+const char *resample_kernel_name(void) { return "scalar"; }
+
+static float dot(const float *h, const float *x)
+{
+    float acc = 0.0f;
+    int k;
+
+    for (k = 0; k < RESAMPLE_TAPS; k++)
+        acc += h[k] * x[k];
+    return acc;
+}
+
+#endif
+
+/*
+ * Filter design
+ */
+
+// Modified Bessel function of the first kind, order 0 (for the Kaiser window)
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 50; k++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static long gcd(long a, long b)
+{
+    while (b != 0)
+    {
+        long t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static void make_filter(struct resampler *r)
+{
+    // Cutoff in cycles per input sample
+    double fc = 0.5 * PASSBAND * (r->out_rate < r->in_rate ? (double)r->out_rate / r->in_rate : 1.0);
+    double half = RESAMPLE_TAPS / 2.0;
+    int p, k;
+
+    for (p = 0; p < r->phases; p++)
+    {
+        float *h = r->coef + p * RESAMPLE_TAPS;
+        double f = (double)p / r->phases, sum = 0.0;
+
+        for (k = 0; k < RESAMPLE_TAPS; k++)
+        {
+            // Distance from this tap to the output sample, in input samples
+            double d = k - half + 1.0 - f;
+            double w = 1.0 - (d / half) * (d / half);
+            double v = 2.0 * fc * (d == 0.0 ? 1.0 : sin(2.0 * M_PI * fc * d) / (2.0 * M_PI * fc * d));
+
+            v *= (w > 0.0 ? bessel_i0(KAISER_BETA * sqrt(w)) / bessel_i0(KAISER_BETA) : 0.0);
+            h[k] = v;
+            sum += v;
+        }
+        // Unity gain at DC for every phase
+        for (k = 0; k < RESAMPLE_TAPS; k++)
+            h[k] /= sum;
+    }
+}
+
+/*
+ * Resampling
+ */
+
+size_t resample_max_out(long in_rate, long out_rate, size_t max_frames)
+{
+    return (size_t)ceil((double)max_frames * out_rate / in_rate) + 2;
+}
+
+int resample_open(struct resampler *r, long in_rate, long out_rate, int channels, size_t max_frames)
+{
+    long g = gcd(in_rate, out_rate);
+    double step = (double)in_rate / out_rate;
+    int c;
+
+    memset(r, 0, sizeof(*r));
+    if (channels < 1 || channels > RESAMPLE_MAX_CHANNELS || in_rate <= 0 || out_rate <= 0)
+        return -1;
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->channels = channels;
+    // One phase for every place an output sample can land between two input samples
+    r->phases = (out_rate / g <= RESAMPLE_MAX_PHASES ? out_rate / g : RESAMPLE_MAX_PHASES);
+    r->step_int = (size_t)step;
+    r->step_frac = (uint32_t)((step - r->step_int) * 4294967296.0 + 0.5);
+    r->coef = pool_alloc(r->phases * RESAMPLE_TAPS * sizeof(float));
+    if (r->coef == NULL)
+    {
+        perror("pool_alloc: resample");
+        return -1;
+    }
+    make_filter(r);
+    r->x_cap = RESAMPLE_TAPS + max_frames + r->step_int + 1;
+    for (c = 0; c < channels; c++)
+    {
+        r->x[c] = pool_alloc(r->x_cap * sizeof(float));
+        if (r->x[c] == NULL)
+        {
+            perror("pool_alloc: resample");
+            resample_close(r);
+            return -1;
+        }
+        memset(r->x[c], 0, r->x_cap * sizeof(float));
+    }
+    r->out_cap = resample_max_out(in_rate, out_rate, max_frames);
+    r->out = pool_alloc(r->out_cap * channels * sizeof(float));
+    if (r->out == NULL)
+    {
+        perror("pool_alloc: resample");
+        resample_close(r);
+        return -1;
+    }
+    // Half a filter of silence in front, so the first output lines up with the first input
+    r->fill = RESAMPLE_TAPS / 2 - 1;
+    return 0;
+}
+
+int resample_latency(void)
+{
+    return RESAMPLE_TAPS / 2;
+}
+
+size_t resample_process(struct resampler *r, const float *in, size_t frames, float **out)
+{
+    int ch = r->channels, c;
+    size_t i, n = 0, used;
+
+    if (frames > r->x_cap - r->fill)
+        frames = r->x_cap - r->fill;
+    // Split the channels up
+    for (c = 0; c < ch; c++)
+    {
+        float *x = r->x[c] + r->fill;
+
+        for (i = 0; i < frames; i++)
+            x[i] = in[i * ch + c];
+    }
+    r->fill += frames;
+    while (r->pos + RESAMPLE_TAPS <= r->fill && n < r->out_cap)
+    {
+        // Nearest phase (exact for ratios with no more than RESAMPLE_MAX_PHASES phases)
+        uint32_t p = (uint32_t)(((uint64_t)r->frac * r->phases + 0x80000000u) >> 32);
+        size_t pos = r->pos;
+        const float *h;
+        uint32_t old = r->frac;
+
+        if (p == (uint32_t)r->phases)
+        {
+            p = 0;
+            if (++pos + RESAMPLE_TAPS > r->fill)
+                break;
+        }
+        h = r->coef + p * RESAMPLE_TAPS;
+        for (c = 0; c < ch; c++)
+            r->out[n * ch + c] = dot(h, r->x[c] + pos);
+        n++;
+        r->frac += r->step_frac;
+        r->pos += r->step_int + (r->frac < old ? 1 : 0);
+    }
+    // Drop what the filter has moved past
+    used = (r->pos < r->fill ? r->pos : r->fill);
+    for (c = 0; c < ch; c++)
+        memmove(r->x[c], r->x[c] + used, (r->fill - used) * sizeof(float));
+    r->fill -= used;
+    r->pos -= used;
+    *out = r->out;
+    return n;
+}
+
+size_t resample_flush(struct resampler *r, float **out)
+{
+    // Half a filter of silence behind, so the last output lines up with the last input
+    float zeros[RESAMPLE_TAPS / 2 * RESAMPLE_MAX_CHANNELS] = { 0.0f };
+
+    if (r->coef == NULL)
+        return 0;
+    return resample_process(r, zeros, resample_latency(), out);
+}
+
+void resample_close(struct resampler *r)
+{
+    int c;
+
+    pool_free(r->coef);
+    for (c = 0; c < RESAMPLE_MAX_CHANNELS; c++)
+    {
+        pool_free(r->x[c]);
+        r->x[c] = NULL;
+    }
+    pool_free(r->out);
+    r->coef = NULL;
+    r->out = NULL;
+}
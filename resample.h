@@ -0,0 +1,56 @@
+/*
+ * header file for resample.c
+ *
+ * Sample rate conversion for when the sound card can't do the song's rate
+ */
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Taps per phase (a multiple of 4 for the SIMD kernels)
+#define RESAMPLE_TAPS       32
+// Most phases in the filter table; ratios that need more get the nearest phase
+#define RESAMPLE_MAX_PHASES 256
+#define RESAMPLE_MAX_CHANNELS 2
+
+struct resampler {
+	long in_rate;
+	long out_rate;
+	int channels;
+	int phases;
+	float *coef;            // phases x RESAMPLE_TAPS
+	// Input, one row per channel, with the filter history in front
+	float *x[RESAMPLE_MAX_CHANNELS];
+	size_t x_cap;
+	size_t fill;            // frames in x
+	size_t pos;             // first input frame under the filter for the next output
+	uint32_t frac;          // and how far past it the output is (32 bit fraction)
+	uint32_t step_frac;     // input frames per output frame: step_int + step_frac / 2^32
+	size_t step_int;
+	float *out;
+	size_t out_cap;
+};
+
+/*
+  Set up to convert in_rate to out_rate; max_frames is the most that will be
+  passed to resample_process at once.  Returns 0 on success.
+*/
+int resample_open(struct resampler *r, long in_rate, long out_rate, int channels, size_t max_frames);
+// The most frames resample_process can return for max_frames in
+size_t resample_max_out(long in_rate, long out_rate, size_t max_frames);
+/*
+  Convert a block of interleaved float samples.  Sets *out to the result and
+  returns the number of frames.
+*/
+size_t resample_process(struct resampler *r, const float *in, size_t frames, float **out);
+// The song's over: the output still under the filter.  Returns the number of frames
+size_t resample_flush(struct resampler *r, float **out);
+// Frames of delay (at the input rate)
+int resample_latency(void);
+void resample_close(struct resampler *r);
+
+const char *resample_kernel_name(void);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * rgscan.c
+ *
+ * Background loudness analysis for lcd-mp3.
+ *
+ * Most files don't have ReplayGain tags, so the level jumps from one song to
+ * the next.  This runs a low priority thread that decodes every file in the
+ * playlist, measures its EBU R128 loudness and peak, and writes the result to a
+ * cache file.  The player then uses the cached value for any file without tags.
+ *
+ * The cache is keyed by the file's path under the music directory, its size
+ * and its modification time, so replacing a file loses the result.  Inode
+ * numbers would survive a rename, but the stick is vfat, where they're made
+ * up at mount time and so mean nothing after the next boot.  Results are
+ * appended to the cache as soon as they are known, so after a restart the
+ * scan carries on where it left off.
+ *
+ * To keep out of the way of play_song the thread runs as SCHED_IDLE with idle
+ * I/O priority, and on top of that it sleeps after every block so it only uses
+ * a small slice of the CPU (and of the USB stick) while music is playing.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <mpg123.h>
+
+#include "loudness.h"
+#include "gain.h"
+#include "rgscan.h"
+#include "pool.h"
+#include "trace.h"
+#include "rtsched.h"
+
+// Percentage of the time the analyzer may be busy while playing / while paused
+#define PLAYING_DUTY 10
+#define IDLE_DUTY    50
+
+struct rg_entry {
+    uint64_t name;          // hash of the path under the music directory
+    off_t size;
+    time_t mtime;
+    float lufs;
+    float peak;
+};
+
+static struct rg_entry *entries = NULL;
+static int num_entries = 0;
+static int max_entries = 0;
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static char cache_path[PATH_MAX];
+static char music_root[PATH_MAX];
+
+static const struct path_store *scan_paths;
+static pthread_t scan_thread;
+static int scan_running = 0;
+// Set from the main thread while the scan runs
+static int scan_stop = 0;
+static int scan_idle = 0;
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct rg_entry *x = a, *y = b;
+
+    if (x->name != y->name)
+        return (x->name < y->name ? -1 : 1);
+    if (x->size != y->size)
+        return (x->size < y->size ? -1 : 1);
+    if (x->mtime != y->mtime)
+        return (x->mtime < y->mtime ? -1 : 1);
+    return 0;
+}
+
+// The path with the music directory taken off the front (if it's in there)
+static const char *relative_path(const char *path)
+{
+    size_t n = strlen(music_root);
+
+    if (n == 0 || strncmp(path, music_root, n) != 0 || path[n] != '/')
+        return path;
+    for (path += n; *path == '/'; path++)
+        ;
+    return path;
+}
+
+// FNV-1a; with the size and mtime next to it, two files that collide won't be mixed up
+static uint64_t name_hash(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (; *name != '\0'; name++)
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    return h;
+}
+
+static void make_key(struct rg_entry *e, const char *path, const struct stat *st)
+{
+    e->name = name_hash(relative_path(path));
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+}
+
+// Needs cacheMutex
+static struct rg_entry *find_entry(const char *path, const struct stat *st)
+{
+    struct rg_entry key;
+
+    make_key(&key, path, st);
+    return bsearch(&key, entries, num_entries, sizeof(struct rg_entry), entry_cmp);
+}
+
+// Needs cacheMutex; keeps the table sorted
+static void insert_entry(const struct rg_entry *e)
+{
+    int lo = 0, hi = num_entries;
+
+    if (num_entries == max_entries)
+    {
+        int n = (max_entries ? max_entries * 2 : 256);
+        struct rg_entry *p = realloc(entries, n * sizeof(struct rg_entry));
+
+        if (p == NULL)
+        {
+            perror("realloc: rgscan");
+            return;
+        }
+        entries = p;
+        max_entries = n;
+    }
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (entry_cmp(&entries[mid], e) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < num_entries && entry_cmp(&entries[lo], e) == 0)
+    {
+        entries[lo] = *e;
+        return;
+    }
+    memmove(&entries[lo + 1], &entries[lo], (num_entries - lo) * sizeof(struct rg_entry));
+    entries[lo] = *e;
+    num_entries++;
+}
+
+/*
+ * Cache file; one line per file:
+ *   size mtime lufs peak path
+ * The path is the one under the music directory (or the whole path, for a
+ * file that's not in there); it's last so it can have spaces in it.
+ */
+static void load_cache()
+{
+    FILE *fp = fopen(cache_path, "r");
+    char line[PATH_MAX + 128];
+
+    if (fp == NULL)
+        return; // Nothing analyzed yet
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        long long size, mtime;
+        struct rg_entry e;
+        int name;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %lld %f %f %n", &size, &mtime, &e.lufs, &e.peak, &name) != 4 || line[name] == '\0')
+            continue;
+        e.name = name_hash(line + name);
+        e.size = size;
+        e.mtime = mtime;
+        insert_entry(&e);
+    }
+    fclose(fp);
+}
+
+static void save_entry(const struct rg_entry *e, const char *path)
+{
+    FILE *fp = fopen(cache_path, "a");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot write '%s': %s\n", __FILE__, __LINE__, cache_path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%lld %lld %.2f %.6f %s\n", (long long)e->size, (long long)e->mtime, e->lufs, e->peak, relative_path(path));
+    fclose(fp);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sleep long enough that we only use our share of the time
+static void throttle(double busy)
+{
+    int duty = (__atomic_load_n(&scan_idle, __ATOMIC_RELAXED) ? IDLE_DUTY : PLAYING_DUTY);
+    double rest = busy * (100 - duty) / duty;
+
+    if (rest > 0.5)
+        rest = 0.5;
+    if (rest > 0.0)
+        usleep((useconds_t)(rest * 1e6));
+}
+
+// Returns 0 if the file was analyzed
+static int analyze_file(const char *path, struct rg_entry *e)
+{
+    mpg123_handle *mh;
+    struct loudness_meter meter;
+    unsigned char *buffer;
+    size_t buffer_size, done;
+    long rate;
+    int channels, encoding, err, ret = -1;
+    double lufs, start;
+
+    mh = pool_get(&buffer, &buffer_size);
+    if (mh == NULL)
+        return -1;
+    if (mpg123_open(mh, path) != MPG123_OK || mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK)
+    {
+        pool_put(mh);
+        return -1;
+    }
+    // Keep the format from changing half way through
+    mpg123_format_none(mh);
+    mpg123_format(mh, rate, channels, MPG123_ENC_SIGNED_16);
+    if (loudness_init(&meter, rate, channels) != 0)
+    {
+        pool_put(mh);
+        return -1;
+    }
+    for (;;)
+    {
+        start = now();
+        err = mpg123_read(mh, buffer, buffer_size, &done);
+        if (err != MPG123_OK && err != MPG123_NEW_FORMAT)
+            break;
+        loudness_add_s16(&meter, (int16_t *)buffer, done / (sizeof(int16_t) * channels));
+        if (__atomic_load_n(&scan_stop, __ATOMIC_RELAXED))
+            break;
+        throttle(now() - start);
+    }
+    if (!__atomic_load_n(&scan_stop, __ATOMIC_RELAXED) && err == MPG123_DONE)
+    {
+        lufs = loudness_integrated(&meter);
+        // Silence; leave it alone
+        e->lufs = (isinf(lufs) ? RG_REFERENCE_LUFS : lufs);
+        e->peak = loudness_peak(&meter);
+        ret = 0;
+    }
+    loudness_free(&meter);
+    pool_put(mh);
+    return ret;
+}
+
+static void *scan_main(void *arg)
+{
+    struct stat st;
+    char path[PATH_MAX];
+    unsigned long long start;
+    int i, found, failed;
+
+    // Lowest possible priority for both the CPU and the disk
+    rt_idle_thread();
+    trace_thread("replaygain");
+    for (i = 0; i < scan_paths->num_files && !__atomic_load_n(&scan_stop, __ATOMIC_RELAXED); i++)
+    {
+        struct rg_entry e;
+
+        if (paths_get(scan_paths, i, path, sizeof(path)) >= (int)sizeof(path) || stat(path, &st) != 0)
+            continue;
+        pthread_mutex_lock(&cacheMutex);
+        found = (find_entry(path, &st) != NULL);
+        pthread_mutex_unlock(&cacheMutex);
+        if (found)
+            continue;
+        start = trace_now();
+        failed = analyze_file(path, &e);
+        trace_span(TR_SCAN, start, i);
+        if (failed)
+            continue;
+        make_key(&e, path, &st);
+        pthread_mutex_lock(&cacheMutex);
+        insert_entry(&e);
+        pthread_mutex_unlock(&cacheMutex);
+        save_entry(&e, path);
+    }
+    return NULL;
+}
+
+int rgscan_start(const char *cache_file, const char *root, const struct path_store *paths)
+{
+    size_t n;
+
+    snprintf(cache_path, sizeof(cache_path), "%s", cache_file);
+    snprintf(music_root, sizeof(music_root), "%s", (root != NULL ? root : ""));
+    n = strlen(music_root);
+    while (n > 0 && music_root[n - 1] == '/')
+        music_root[--n] = '\0';
+    // The UI looks songs up while the scan (at the lowest priority there is) adds to it
+    rt_mutex_inherit(&cacheMutex);
+    pthread_mutex_lock(&cacheMutex);
+    load_cache();
+    pthread_mutex_unlock(&cacheMutex);
+    scan_paths = paths;
+    scan_stop = 0;
+    if (pthread_create(&scan_thread, NULL, scan_main, NULL) != 0)
+    {
+        perror("pthread_create: rgscan");
+        return -1;
+    }
+    scan_running = 1;
+    return 0;
+}
+
+void rgscan_stop()
+{
+    if (!scan_running)
+        return;
+    __atomic_store_n(&scan_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(scan_thread, NULL);
+    scan_running = 0;
+}
+
+void rgscan_set_idle(int idle)
+{
+    __atomic_store_n(&scan_idle, idle, __ATOMIC_RELAXED);
+}
+
+int rgscan_lookup(const char *path, double *gain_db, double *peak)
+{
+    struct rg_entry *e;
+    struct stat st;
+    int found = 0;
+
+    if (stat(path, &st) != 0)
+        return 0;
+    pthread_mutex_lock(&cacheMutex);
+    e = find_entry(path, &st);
+    if (e != NULL)
+    {
+        *gain_db = RG_REFERENCE_LUFS - e->lufs;
+        *peak = e->peak;
+        found = 1;
+    }
+    pthread_mutex_unlock(&cacheMutex);
+    return found;
+}
+
+// As written by foobar2000, mp3gain -s i, etc.
+int rgscan_from_id3(mpg123_id3v2 *v2, double *gain_db, double *peak)
+{
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < v2->extras; i++)
+    {
+        mpg123_text *t = &v2->extra[i];
+
+        if (t->description.fill == 0 || t->text.fill == 0)
+            continue;
+        if (strcasecmp(t->description.p, "replaygain_track_gain") == 0)
+        {
+            *gain_db = atof(t->text.p); // e.g. "-6.54 dB"
+            found = 1;
+        }
+        else if (strcasecmp(t->description.p, "replaygain_track_peak") == 0)
+            *peak = atof(t->text.p);
+    }
+    return found;
+}
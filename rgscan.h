@@ -0,0 +1,38 @@
+/*
+ * header file for rgscan.c
+ *
+ * Background ReplayGain analysis for files without ReplayGain tags
+ */
+#ifndef RGSCAN_H
+#define RGSCAN_H
+
+#include <mpg123.h>
+
+#include "paths.h"
+
+/*
+  Loads the cache (if there is one) and starts the analyzer thread on every
+  file in 'paths'.  They're not copied, so the store has to stay around (and
+  not change) until rgscan_stop().  Files under 'root' (the music directory;
+  NULL if there isn't one) are cached by their path from there, so the cache
+  still works if the stick is mounted somewhere else.  Returns 0 on success.
+*/
+int rgscan_start(const char *cache_file, const char *root, const struct path_store *paths);
+void rgscan_stop();
+
+// Tell the analyzer whether the player is idle (paused) so it can go faster
+void rgscan_set_idle(int idle);
+
+/*
+  Look up a file in the cache.  Returns 1 and fills in the ReplayGain (dB) and
+  peak if the file has been analyzed, 0 if it hasn't (yet).
+*/
+int rgscan_lookup(const char *path, double *gain_db, double *peak);
+
+/*
+  Look for the ReplayGain TXXX frames in the ID3v2 tag.  Returns 1 if the
+  track gain was there (the peak is only changed if it was there too).
+*/
+int rgscan_from_id3(mpg123_id3v2 *v2, double *gain_db, double *peak);
+
+#endif
@@ -1,26 +1,35 @@
-#include <wiringPi.h>
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "hal.h"
 #include "rotaryencoder.h"
+#include "trace.h"
 
 int numberofencoders = 0;
 
 void updateEncoders()
 {
     struct encoder *encoder = encoders;
+    long value, old;
     for (; encoder < encoders + numberofencoders; encoder++)
     {
-        int MSB = digitalRead(encoder->pin_a);
-        int LSB = digitalRead(encoder->pin_b);
+        int MSB = hal_read(encoder->pin_a);
+        int LSB = hal_read(encoder->pin_b);
 
         int encoded = (MSB << 1) | LSB;
         int sum = (encoder->lastEncoded << 2) | encoded;
 
-        if(sum == 0b1101 || sum == 0b0100 || sum == 0b0010 || sum == 0b1011) encoder->value++;
-        if(sum == 0b1110 || sum == 0b0111 || sum == 0b0001 || sum == 0b1000) encoder->value--;
+        value = old = __atomic_load_n(&encoder->value, __ATOMIC_RELAXED);
+
+        if(sum == 0b1101 || sum == 0b0100 || sum == 0b0010 || sum == 0b1011) value++;
+        if(sum == 0b1110 || sum == 0b0111 || sum == 0b0001 || sum == 0b1000) value--;
+
+        if (value != old)
+        {
+            __atomic_store_n(&encoder->value, value, __ATOMIC_RELAXED);
+            trace_mark(TR_ENCODER, value, NULL);
+        }
 
         encoder->lastEncoded = encoded;
     }
@@ -40,12 +49,10 @@ struct encoder *setupencoder(int pin_a, int pin_b)
     newencoder->value = 0;
     newencoder->lastEncoded = 0;
 
-    pinMode(pin_a, INPUT);
-    pinMode(pin_b, INPUT);
-    pullUpDnControl(pin_a, PUD_UP);
-    pullUpDnControl(pin_b, PUD_UP);
-    wiringPiISR(pin_a,INT_EDGE_BOTH, updateEncoders);
-    wiringPiISR(pin_b,INT_EDGE_BOTH, updateEncoders);
+    hal_input(pin_a);
+    hal_input(pin_b);
+    hal_watch(pin_a, updateEncoders);
+    hal_watch(pin_b, updateEncoders);
 
     return newencoder;
 }
@@ -5,7 +5,7 @@ struct encoder
 {
     int pin_a;
     int pin_b;
-    volatile long value;
+    long value;             // changed in the interrupt; read it with __atomic_load_n
     volatile int lastEncoded;
 };
 
@@ -0,0 +1,343 @@
+/*
+ * rtsched.c
+ *
+ * Real-time scheduling for lcd-mp3.
+ *
+ * main used to piHiPri(99) itself, which put the busy UI loop above
+ * everything, the audio included, and left play_song at the default
+ * priority.  Now the UI runs as a normal thread and play_song (which does
+ * the decoding, the DSP and ao_play) and the read-ahead thread each put
+ * themselves on SCHED_FIFO as they start, at priorities that can be set
+ * with -rt, and on a CPU of their own with -cpu if the Pi has more than one.
+ *
+ * To keep the audio from waiting on the page fault handler, everything
+ * already mapped (the pool's buffers, the read-ahead buffers) is locked into
+ * memory once it's been allocated, along with some heap that malloc is told
+ * to keep rather than give back.  From then on new mappings are locked as
+ * they're touched (MCL_ONFAULT) rather than all at once, which would lock
+ * the whole 8MB stack of every thread.  Each real-time thread touches the
+ * top of its stack as it starts.  How many faults play_song took anyway is
+ * counted (getrusage per thread) and reported.
+ *
+ * -rtprobe starts a thread at the audio's priority and CPU that sleeps
+ * RT_PROBE_US at a time and records how late it wakes up (MET_WAKEUP):
+ * what the audio thread can expect from the scheduler with the settings,
+ * and what's running alongside it, as they are.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <malloc.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "rtsched.h"
+#include "metrics.h"
+#include "trace.h"
+
+// From linux/ioprio.h
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+static struct rt_stats stats = {
+    .priority = { RT_AUDIO_PRIORITY, RT_IO_PRIORITY },
+    .cpu = { -1, -1 }
+};
+static const char *role_names[RT_ROLES] = { "audio", "read-ahead" };
+// Where this thread's page faults were when it started on its role
+static __thread long start_minflt, start_majflt;
+static pthread_t probe_thread;
+static int probe_running = 0;
+
+// "a[,b]" into values[0] (and values[1]); 0 if they're all from min to max
+static int parse_pair(const char *arg, int *values, int min, int max)
+{
+    char *end;
+    long v;
+    int i;
+
+    for (i = 0; i < RT_ROLES; i++)
+    {
+        v = strtol(arg, &end, 10);
+        if (end == arg || v < min || v > max)
+            return -1;
+        values[i] = v;
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        arg = end + 1;
+    }
+    return -1;
+}
+
+int rt_parse_priorities(const char *arg)
+{
+    int values[RT_ROLES] = { stats.priority[RT_AUDIO], stats.priority[RT_IO] };
+
+    if (parse_pair(arg, values, 0, sched_get_priority_max(SCHED_FIFO)) != 0)
+        return -1;
+    memcpy(stats.priority, values, sizeof(values));
+    return 0;
+}
+
+int rt_parse_cpus(const char *arg)
+{
+    int values[RT_ROLES] = { stats.cpu[RT_AUDIO], stats.cpu[RT_IO] };
+
+    if (parse_pair(arg, values, -1, CPU_SETSIZE - 1) != 0)
+        return -1;
+    memcpy(stats.cpu, values, sizeof(values));
+    return 0;
+}
+
+int rt_lock_memory(void)
+{
+    char *heap;
+
+    // Keep what's freed, and don't give big allocations mappings of their own
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    heap = malloc(RT_HEAP_PREFAULT);
+    if (heap != NULL)
+    {
+        memset(heap, 0, RT_HEAP_PREFAULT);
+        free(heap);
+    }
+    // Everything there now, all of it faulted in
+    if (mlockall(MCL_CURRENT) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: mlockall: %s\n", __FILE__, __LINE__, strerror(errno));
+        return -1;
+    }
+    // Anything after as it's touched (older kernels: all of it as it's mapped)
+#ifdef MCL_ONFAULT
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0)
+#endif
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "[%s - %d]: mlockall (future): %s\n", __FILE__, __LINE__, strerror(errno));
+    stats.locked = 1;
+    return 0;
+}
+
+// A byte a page, through volatile stores (a memset of a dead array is dropped, volatile or not)
+static void prefault_stack(void)
+{
+    volatile char stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    if (page <= 0)
+        page = 4096;
+    for (i = 0; i < sizeof(stack); i += page)
+        stack[i] = 0;
+    stack[sizeof(stack) - 1] = 0;
+}
+
+// Put the calling thread on a role's priority and CPU; 0 if it could be
+static int schedule(int role)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int ret = 0;
+
+    if (stats.priority[role] > 0)
+    {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = stats.priority[role];
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+            ret = -1;
+    }
+    if (stats.cpu[role] >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(stats.cpu[role], &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+void rt_thread(int role)
+{
+    struct rusage ru;
+
+    // Only say so the first time
+    if (schedule(role) != 0 && __atomic_exchange_n(&stats.failed[role], 1, __ATOMIC_RELAXED) == 0)
+        fprintf(stderr, "[%s - %d]: Cannot give the %s thread priority %d on CPU %d\n", __FILE__, __LINE__,
+                role_names[role], stats.priority[role], stats.cpu[role]);
+    if (stats.locked)
+        prefault_stack();
+    getrusage(RUSAGE_THREAD, &ru);
+    start_minflt = ru.ru_minflt;
+    start_majflt = ru.ru_majflt;
+}
+
+void rt_thread_done(int role)
+{
+    struct rusage ru;
+
+    if (role != RT_AUDIO)
+        return;
+    getrusage(RUSAGE_THREAD, &ru);
+    __atomic_fetch_add(&stats.minor_faults, ru.ru_minflt - start_minflt, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.major_faults, ru.ru_majflt - start_majflt, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.songs, 1, __ATOMIC_RELAXED);
+}
+
+void rt_idle_thread(void)
+{
+    struct sched_param param;
+
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, syscall(SYS_gettid), IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+int rt_mutex_inherit(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    int err;
+
+    pthread_mutexattr_init(&attr);
+    err = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    if (err == 0)
+    {
+        pthread_mutex_destroy(mutex);
+        err = pthread_mutex_init(mutex, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    if (err != 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot make a priority inheriting mutex: %s\n", __FILE__, __LINE__, strerror(err));
+        pthread_mutex_init(mutex, NULL);
+    }
+    return err;
+}
+
+int rt_signal_thread(int sig, void *(*loop)(void *))
+{
+    pthread_t thread;
+    sigset_t set, all;
+    int err;
+
+    // Blocked here, so in every thread started after this as well
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    // The new thread starts with everything blocked and takes only what it sigwait()s for
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &set);
+    err = pthread_create(&thread, NULL, loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &set, NULL);
+    if (err != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static void *probe_loop(void *arg)
+{
+    struct timespec due, now;
+    long long late;
+
+    (void)arg;
+    trace_thread("rt probe");
+    schedule(RT_AUDIO);
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    while (__atomic_load_n(&probe_running, __ATOMIC_RELAXED))
+    {
+        due.tv_nsec += RT_PROBE_US * 1000;
+        if (due.tv_nsec >= 1000000000)
+        {
+            due.tv_nsec -= 1000000000;
+            due.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) != 0)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = (now.tv_sec - due.tv_sec) * 1000000000LL + (now.tv_nsec - due.tv_nsec);
+        if (late < 0)
+            late = 0;
+        metrics_record(MET_WAKEUP, late);
+        // Only this thread writes them
+        __atomic_store_n(&stats.probes, stats.probes + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.late_sum_ns, stats.late_sum_ns + late, __ATOMIC_RELAXED);
+        if ((unsigned long long)late > stats.late_max_ns)
+            __atomic_store_n(&stats.late_max_ns, late, __ATOMIC_RELAXED);
+        if (late > RT_PROBE_US * 1000LL)
+        {
+            __atomic_store_n(&stats.late_over, stats.late_over + 1, __ATOMIC_RELAXED);
+            // Too late to catch up; start again from now
+            due = now;
+        }
+    }
+    return NULL;
+}
+
+int rt_probe_start(void)
+{
+    probe_running = 1;
+    if (pthread_create(&probe_thread, NULL, probe_loop, NULL) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot start the wakeup probe\n", __FILE__, __LINE__);
+        probe_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void rt_probe_stop(void)
+{
+    if (!probe_running)
+        return;
+    __atomic_store_n(&probe_running, 0, __ATOMIC_RELAXED);
+    pthread_join(probe_thread, NULL);
+}
+
+void rt_stats(struct rt_stats *s)
+{
+    memcpy(s, &stats, sizeof(*s));
+    s->songs = __atomic_load_n(&stats.songs, __ATOMIC_RELAXED);
+    s->minor_faults = __atomic_load_n(&stats.minor_faults, __ATOMIC_RELAXED);
+    s->major_faults = __atomic_load_n(&stats.major_faults, __ATOMIC_RELAXED);
+    s->probes = __atomic_load_n(&stats.probes, __ATOMIC_RELAXED);
+    s->late_sum_ns = __atomic_load_n(&stats.late_sum_ns, __ATOMIC_RELAXED);
+    s->late_max_ns = __atomic_load_n(&stats.late_max_ns, __ATOMIC_RELAXED);
+    s->late_over = __atomic_load_n(&stats.late_over, __ATOMIC_RELAXED);
+}
+
+void rt_report(FILE *fp)
+{
+    struct rt_stats s;
+    int role;
+
+    rt_stats(&s);
+    for (role = 0; role < RT_ROLES; role++)
+    {
+        fprintf(fp, "rt: %s thread ", role_names[role]);
+        if (s.priority[role] > 0)
+            fprintf(fp, "SCHED_FIFO %d", s.priority[role]);
+        else
+            fprintf(fp, "normal");
+        if (s.cpu[role] >= 0)
+            fprintf(fp, " on CPU %d", s.cpu[role]);
+        fprintf(fp, "%s\n", (s.failed[role] ? " (couldn't be set)" : ""));
+    }
+    fprintf(fp, "rt: memory %slocked; %lu songs, %lu minor / %lu major page faults on the audio thread\n",
+            (s.locked ? "" : "not "), s.songs, s.minor_faults, s.major_faults);
+    if (s.probes != 0)
+        fprintf(fp, "rt: %lu wakeups, %.3f ms late on average, max %.3f ms, %lu over %.1f ms\n",
+                s.probes, s.late_sum_ns / 1e6 / s.probes, s.late_max_ns / 1e6, s.late_over, RT_PROBE_US / 1000.0);
+}
@@ -0,0 +1,81 @@
+/*
+ * header file for rtsched.c
+ *
+ * Real-time scheduling for the audio and read-ahead threads, memory locking,
+ * and a probe of how late a thread at the audio's priority gets woken
+ */
+#ifndef RTSCHED_H
+#define RTSCHED_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// The threads that can be given real-time priority
+enum {
+	RT_AUDIO,           // play_song: decode, DSP and ao_play
+	RT_IO,              // the read-ahead thread
+	RT_ROLES
+};
+
+// SCHED_FIFO priorities (wiringPi's interrupt threads are at 55)
+#define RT_AUDIO_PRIORITY 70
+#define RT_IO_PRIORITY    60
+// Touched by each real-time thread as it starts, so its stack is already there
+#define RT_STACK_PREFAULT (64 * 1024)
+// Touched once and kept by malloc, so the heap doesn't have to grow while playing
+#define RT_HEAP_PREFAULT  (1024 * 1024)
+// How often the probe wakes up
+#define RT_PROBE_US       1000
+
+struct rt_stats {
+	int priority[RT_ROLES];         // 0 for normal scheduling
+	int cpu[RT_ROLES];              // -1 for any
+	int failed[RT_ROLES];           // couldn't get the priority or CPU it asked for
+	int locked;                     // mlockall worked
+	unsigned long songs;            // audio threads done
+	unsigned long minor_faults;     // page faults the audio threads took, all told
+	unsigned long major_faults;
+	unsigned long probes;           // probe wakeups
+	unsigned long long late_sum_ns; // how late they were
+	unsigned long long late_max_ns;
+	unsigned long late_over;        // over RT_PROBE_US late
+};
+
+/*
+  "audio[,io]" for -rt (priorities, 1..99, 0 for normal) and -cpu (CPU
+  numbers, -1 for any).  Returns 0 if it made sense.
+*/
+int rt_parse_priorities(const char *arg);
+int rt_parse_cpus(const char *arg);
+/*
+  Lock what's there into memory, pre-fault some heap, and have everything
+  mapped from now on locked as it's touched.  Once the buffers are allocated.
+  Returns 0 on success.
+*/
+int rt_lock_memory(void);
+// A thread starting on a role's work: its priority and CPU, and its stack pre-faulted
+void rt_thread(int role);
+// The audio thread done with a song (counts the page faults it took)
+void rt_thread_done(int role);
+// A background thread (the scans): the lowest priority there is, for the CPU and the disk
+void rt_idle_thread(void);
+/*
+  Have a mutex (statically initialized, unlocked and not in use yet) pass
+  the priority of whoever's waiting on it on to whoever holds it, for the
+  locks the scan threads share with the rest.  Returns 0 on success; it's
+  left a plain mutex if not.
+*/
+int rt_mutex_inherit(pthread_mutex_t *mutex);
+/*
+  Start a detached thread to wait for a signal (sigwait in loop), and block
+  the signal in the calling thread and every thread it starts from then on.
+  Call before starting the threads that mustn't take it.  Returns 0 on success.
+*/
+int rt_signal_thread(int sig, void *(*loop)(void *));
+// Start/stop the wakeup probe (records into MET_WAKEUP as well)
+int rt_probe_start(void);
+void rt_probe_stop(void);
+void rt_stats(struct rt_stats *stats);
+void rt_report(FILE *fp);
+
+#endif
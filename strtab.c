@@ -0,0 +1,163 @@
+/*
+ * strtab.c
+ *
+ * Interned strings, for the path store's directories (paths.c) and the
+ * library's artists, albums and genres (library.c).
+ *
+ * The strings go one after the other in a single arena and are known by
+ * their offset, so the arena can grow (by doubling) without anything that
+ * refers to them noticing.  The ones that are shared are looked up by a
+ * parent id and the string in an open addressed hash (FNV-1a, kept at most
+ * half full), so each is stored once however many times it's added; the
+ * ones that aren't (file names, titles) just go on the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strtab.h"
+
+uint32_t strtab_add(struct str_table *t, const char *s, size_t len)
+{
+    size_t n = (t->size > 0 ? t->size : 4096);
+    uint32_t at;
+    char *more;
+
+    if (t->used + len + 1 > t->size)
+    {
+        while (n < t->used + len + 1)
+            n *= 2;
+        if (n > UINT32_MAX || (more = realloc(t->arena, n)) == NULL)
+        {
+            perror("realloc: strtab");
+            return (uint32_t)-1;
+        }
+        t->arena = more;
+        t->size = n;
+    }
+    at = t->used;
+    memcpy(t->arena + at, s, len);
+    t->arena[at + len] = '\0';
+    t->used += len + 1;
+    return at;
+}
+
+static unsigned int hash_string(uint32_t parent, const char *s, size_t len)
+{
+    // FNV-1a, parent first
+    unsigned int h = (2166136261u ^ parent) * 16777619u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Where (parent, s) is in the hash, or the empty slot it would go in
+static int *find_string(const struct str_table *t, uint32_t parent, const char *s, size_t len)
+{
+    unsigned int i = hash_string(parent, s, len) & (t->hash_size - 1);
+    const char *name;
+    int *slot;
+
+    for (;; i = (i + 1) & (t->hash_size - 1))
+    {
+        slot = &t->hash[i];
+        if (*slot == 0)
+            return slot;
+        name = t->arena + t->names[*slot - 1];
+        if (t->parents[*slot - 1] == parent && strncmp(name, s, len) == 0 && name[len] == '\0')
+            return slot;
+    }
+}
+
+// Keep the hash at most half full
+static int grow_hash(struct str_table *t)
+{
+    int n = (t->hash_size > 0 ? t->hash_size * 2 : 256);
+    int *old = t->hash, old_size = t->hash_size;
+    const char *name;
+    int i;
+
+    if ((t->count + 1) * 2 <= t->hash_size)
+        return 0;
+    t->hash = calloc(n, sizeof(int));
+    if (t->hash == NULL)
+    {
+        perror("calloc: strtab");
+        t->hash = old;
+        return -1;
+    }
+    t->hash_size = n;
+    for (i = 0; i < old_size; i++)
+    {
+        if (old[i] != 0)
+        {
+            name = t->arena + t->names[old[i] - 1];
+            *find_string(t, t->parents[old[i] - 1], name, strlen(name)) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Room in the names and parents for one more
+static int grow_ids(struct str_table *t)
+{
+    int n = (t->max > 0 ? t->max * 2 : 64);
+    uint32_t *more;
+
+    if (t->count < t->max)
+        return 0;
+    if ((more = realloc(t->names, n * sizeof(uint32_t))) == NULL)
+        goto fail;
+    t->names = more;
+    if ((more = realloc(t->parents, n * sizeof(uint32_t))) == NULL)
+        goto fail;
+    t->parents = more;
+    t->max = n;
+    return 0;
+fail:
+    perror("realloc: strtab");
+    return -1;
+}
+
+int strtab_intern(struct str_table *t, uint32_t parent, const char *s, size_t len)
+{
+    uint32_t at;
+    int *slot;
+
+    if (grow_hash(t) != 0)
+        return -1;
+    slot = find_string(t, parent, s, len);
+    if (*slot != 0)
+        return *slot;
+    if (grow_ids(t) != 0)
+        return -1;
+    if (t->arena != NULL && s >= t->arena && s < t->arena + t->used)
+        at = s - t->arena;
+    else if ((at = strtab_add(t, s, len)) == (uint32_t)-1)
+        return -1;
+    t->names[t->count] = at;
+    t->parents[t->count] = parent;
+    *slot = ++t->count;
+    return t->count;
+}
+
+size_t strtab_bytes(const struct str_table *t)
+{
+    return t->size + t->max * 2 * sizeof(uint32_t) + t->hash_size * sizeof(int);
+}
+
+void strtab_free(struct str_table *t)
+{
+    free(t->arena);
+    free(t->names);
+    free(t->parents);
+    free(t->hash);
+    memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,37 @@
+/*
+ * header file for strtab.c
+ *
+ * Strings one after the other in an arena, and the ones that are shared
+ * stored once each, looked up by their parent and the string itself
+ */
+#ifndef STRTAB_H
+#define STRTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct str_table {
+	char *arena;        // every string, each one '\0' terminated
+	size_t used;
+	size_t size;
+	uint32_t *names;    // offset into the arena, by id - 1
+	uint32_t *parents;  // whatever the caller looks them up under, by id - 1
+	int count;
+	int max;
+	int *hash;          // id (0 for empty), by parent and string
+	int hash_size;
+};
+
+// Copy a string to the end of the arena (not looked up or stored once); returns its offset or (uint32_t)-1
+uint32_t strtab_add(struct str_table *t, const char *s, size_t len);
+/*
+  The id (from 1) of (parent, s), added if it's not there already; -1 if out
+  of memory.  's' can be one of the table's own strings (an album's name,
+  being moved to another artist): that's shared rather than copied.
+*/
+int strtab_intern(struct str_table *t, uint32_t parent, const char *s, size_t len);
+// Everything allocated (arena, tables and hash)
+size_t strtab_bytes(const struct str_table *t);
+void strtab_free(struct str_table *t);
+
+#endif
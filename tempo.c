@@ -0,0 +1,338 @@
+/*
+ * tempo.c
+ *
+ * Variable playback speed (0.75x to 2x) for audiobooks and lectures, without
+ * turning everybody into chipmunks.
+ *
+ * This is WSOLA (waveform similarity overlap-add): the input is cut into short
+ * sequences which are played back at normal speed, but the next sequence is
+ * taken from further along (or not so far along) in the input than where the
+ * last one stopped.  To hide the joins each sequence starts with a short
+ * crossfade, and where exactly it is taken from is moved about a bit (up to
+ * TEMPO_SEEK_MS) to wherever the waveform lines up best with the end of the
+ * last one.
+ *
+ * Finding the best spot is nearly all of the work: it's a cross-correlation
+ * over the overlap for every candidate position.  That part has NEON/SSE2
+ * versions, and is done coarse to fine (every 4th position, then around the
+ * best one) to cut it down further for the Pi 1.
+ *
+ * The stage holds back at most one sequence plus the seek window of input, so
+ * the added latency is bounded at about 70ms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(TEMPO_NO_SIMD)
+#  define TEMPO_SCALAR
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define TEMPO_NEON
+#  include <arm_neon.h>
+#elif defined(__SSE2__)
+#  define TEMPO_SSE2
+#  include <emmintrin.h>
+#else
+#  define TEMPO_SCALAR
+#endif
+
+#include "pool.h"
+#include "tempo.h"
+
+// Step between candidates in the first pass of the search
+#define COARSE_STEP 4
+
+/*
+ * Correlation kernel: dot product of a and b, and the energy of b
+ */
+
+#if defined(TEMPO_SSE2)
+
+const char *tempo_kernel_name(void) { return "sse2"; }
+
+static void correlate(const float *a, const float *b, size_t n, float *dot, float *energy)
+{
+    __m128 d = _mm_setzero_ps(), e = _mm_setzero_ps();
+    float sd[4], se[4];
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 vb = _mm_loadu_ps(b + i);
+
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(a + i), vb));
+        e = _mm_add_ps(e, _mm_mul_ps(vb, vb));
+    }
+    _mm_storeu_ps(sd, d);
+    _mm_storeu_ps(se, e);
+    *dot = sd[0] + sd[1] + sd[2] + sd[3];
+    *energy = se[0] + se[1] + se[2] + se[3];
+    for (; i < n; i++)
+    {
+        *dot += a[i] * b[i];
+        *energy += b[i] * b[i];
+    }
+}
+
+#elif defined(TEMPO_NEON)
+
+const char *tempo_kernel_name(void) { return "neon"; }
+
+static void correlate(const float *a, const float *b, size_t n, float *dot, float *energy)
+{
+    float32x4_t d = vdupq_n_f32(0.0f), e = vdupq_n_f32(0.0f);
+    float32x2_t sd, se;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t vb = vld1q_f32(b + i);
+
+        d = vmlaq_f32(d, vld1q_f32(a + i), vb);
+        e = vmlaq_f32(e, vb, vb);
+    }
+    sd = vadd_f32(vget_low_f32(d), vget_high_f32(d));
+    se = vadd_f32(vget_low_f32(e), vget_high_f32(e));
+    *dot = vget_lane_f32(vpadd_f32(sd, sd), 0);
+    *energy = vget_lane_f32(vpadd_f32(se, se), 0);
+    for (; i < n; i++)
+    {
+        *dot += a[i] * b[i];
+        *energy += b[i] * b[i];
+    }
+}
+
+#else // TEMPO_SCALAR
+
+const char *tempo_kernel_name(void) { return "scalar"; }
+
+static void correlate(const float *a, const float *b, size_t n, float *dot, float *energy)
+{
+    float d = 0.0f, e = 0.0f;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        d += a[i] * b[i];
+        e += b[i] * b[i];
+    }
+    *dot = d;
+    *energy = e;
+}
+
+#endif
+
+/*
+ * Stretching
+ */
+
+static void lengths(long rate, int *seq, int *overlap, int *seek)
+{
+    *seq = rate * TEMPO_SEQUENCE_MS / 1000;
+    *overlap = rate * TEMPO_OVERLAP_MS / 1000;
+    *seek = rate * TEMPO_SEEK_MS / 1000;
+}
+
+// Input the stage may have to hold on to (on top of one block)
+static size_t held_frames(int seq, int overlap, int seek)
+{
+    size_t skip = (size_t)((seq - overlap) * TEMPO_MAX_SPEED) + 1;
+
+    return (skip > (size_t)(seek + seq) ? skip : (size_t)(seek + seq));
+}
+
+size_t tempo_max_out(long rate, size_t max_frames)
+{
+    int seq, overlap, seek;
+
+    lengths(rate, &seq, &overlap, &seek);
+    // Every sequence uses up at least (seq - overlap) * TEMPO_MIN_SPEED frames of input
+    return (size_t)((max_frames + held_frames(seq, overlap, seek)) / TEMPO_MIN_SPEED) + seq + overlap;
+}
+
+int tempo_open(struct tempo *t, long rate, int channels, size_t max_frames)
+{
+    memset(t, 0, sizeof(*t));
+    t->rate = rate;
+    t->channels = channels;
+    t->speed = 1.0;
+    lengths(rate, &t->seq, &t->overlap, &t->seek);
+    t->in_cap = max_frames + held_frames(t->seq, t->overlap, t->seek);
+    t->out_cap = tempo_max_out(rate, max_frames);
+    t->in = pool_alloc(t->in_cap * channels * sizeof(float));
+    t->tail = pool_alloc(t->overlap * channels * sizeof(float));
+    t->out = pool_alloc(t->out_cap * channels * sizeof(float));
+    if (t->in == NULL || t->tail == NULL || t->out == NULL)
+    {
+        perror("pool_alloc: tempo");
+        tempo_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+void tempo_set_speed(struct tempo *t, double speed)
+{
+    if (speed < TEMPO_MIN_SPEED)
+        speed = TEMPO_MIN_SPEED;
+    else if (speed > TEMPO_MAX_SPEED)
+        speed = TEMPO_MAX_SPEED;
+    t->speed = speed;
+}
+
+int tempo_active(struct tempo *t)
+{
+    return (t->in != NULL && (t->speed != 1.0 || t->have_tail));
+}
+
+int tempo_latency(struct tempo *t)
+{
+    return held_frames(t->seq, t->overlap, t->seek) + t->overlap;
+}
+
+// Where in the seek window the input lines up best with the tail
+static size_t best_offset(struct tempo *t)
+{
+    const float *base = t->in + t->in_pos * t->channels;
+    size_t n = t->overlap * t->channels;
+    size_t off, best = 0, from, to;
+    float best_score = -HUGE_VALF;
+    float dot, energy, score;
+
+    for (off = 0; off < (size_t)t->seek; off += COARSE_STEP)
+    {
+        correlate(t->tail, base + off * t->channels, n, &dot, &energy);
+        score = dot / sqrtf(energy + 1e-9f);
+        if (score > best_score)
+        {
+            best_score = score;
+            best = off;
+        }
+    }
+    from = (best >= COARSE_STEP ? best - COARSE_STEP + 1 : 0);
+    to = best + COARSE_STEP;
+    if (to > (size_t)t->seek)
+        to = t->seek;
+    for (off = from; off < to; off++)
+    {
+        if (off == best)
+            continue;
+        correlate(t->tail, base + off * t->channels, n, &dot, &energy);
+        score = dot / sqrtf(energy + 1e-9f);
+        if (score > best_score)
+        {
+            best_score = score;
+            best = off;
+        }
+    }
+    return best;
+}
+
+// Back to normal speed; finish the last sequence and hand over whatever is left
+static size_t flush(struct tempo *t, float **out)
+{
+    int ch = t->channels;
+    size_t n = 0;
+
+    if (t->have_tail)
+    {
+        memcpy(t->out, t->tail, t->overlap * ch * sizeof(float));
+        n = t->overlap;
+    }
+    if (t->cont < t->in_frames)
+    {
+        memcpy(t->out + n * ch, t->in + (t->in_pos + t->cont) * ch, (t->in_frames - t->cont) * ch * sizeof(float));
+        n += t->in_frames - t->cont;
+    }
+    t->have_tail = 0;
+    t->in_pos = t->in_frames = t->cont = 0;
+    t->skip_frac = 0.0;
+    *out = t->out;
+    return n;
+}
+
+size_t tempo_process(struct tempo *t, float *in, size_t frames, float **out)
+{
+    int ch = t->channels;
+    size_t n = 0, i;
+    int c;
+
+    if (!tempo_active(t))
+    {
+        *out = in;
+        return frames;
+    }
+    // Queue the new block up behind what's left from last time
+    if (t->in_pos + t->in_frames + frames > t->in_cap)
+    {
+        memmove(t->in, t->in + t->in_pos * ch, t->in_frames * ch * sizeof(float));
+        t->in_pos = 0;
+    }
+    if (t->in_frames + frames > t->in_cap)
+        frames = t->in_cap - t->in_frames;
+    memcpy(t->in + (t->in_pos + t->in_frames) * ch, in, frames * ch * sizeof(float));
+    t->in_frames += frames;
+    if (t->speed == 1.0)
+        return flush(t, out);
+    if (!t->have_tail)
+    {
+        // Very first sequence; line it up with itself
+        if (t->in_frames < (size_t)t->overlap)
+        {
+            *out = t->out;
+            return 0;
+        }
+        memcpy(t->tail, t->in + t->in_pos * ch, t->overlap * ch * sizeof(float));
+        t->have_tail = 1;
+        t->cont = t->overlap;
+    }
+    for (;;)
+    {
+        double advance = (t->seq - t->overlap) * t->speed + t->skip_frac;
+        size_t skip = (size_t)advance;
+        size_t need = (skip > (size_t)(t->seek + t->seq) ? skip : (size_t)(t->seek + t->seq));
+        size_t off;
+        float *src, *dst;
+
+        if (t->in_frames < need || n + t->seq - t->overlap > t->out_cap)
+            break;
+        off = best_offset(t);
+        src = t->in + (t->in_pos + off) * ch;
+        dst = t->out + n * ch;
+        // Crossfade from the end of the last sequence into this one
+        for (i = 0; i < (size_t)t->overlap; i++)
+        {
+            float w = (float)i / t->overlap;
+
+            for (c = 0; c < ch; c++)
+                dst[i * ch + c] = t->tail[i * ch + c] + (src[i * ch + c] - t->tail[i * ch + c]) * w;
+        }
+        memcpy(dst + t->overlap * ch, src + t->overlap * ch, (t->seq - 2 * t->overlap) * ch * sizeof(float));
+        memcpy(t->tail, src + (t->seq - t->overlap) * ch, t->overlap * ch * sizeof(float));
+        n += t->seq - t->overlap;
+        // Move on by how much input that was worth at this speed
+        t->skip_frac = advance - skip;
+        t->in_pos += skip;
+        t->in_frames -= skip;
+        t->cont = (off + t->seq > skip ? off + t->seq - skip : 0);
+    }
+    *out = t->out;
+    return n;
+}
+
+size_t tempo_flush(struct tempo *t, float **out)
+{
+    if (t->in == NULL)
+        return 0;
+    return flush(t, out);
+}
+
+void tempo_close(struct tempo *t)
+{
+    pool_free(t->in);
+    pool_free(t->tail);
+    pool_free(t->out);
+    t->in = t->tail = t->out = NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * header file for tempo.c
+ *
+ * Playback speed without the pitch change (WSOLA time stretch)
+ */
+#ifndef TEMPO_H
+#define TEMPO_H
+
+#include <stddef.h>
+
+#define TEMPO_MIN_SPEED 0.75
+#define TEMPO_MAX_SPEED 2.0
+
+// Lengths in milliseconds; converted to frames for the song's rate
+#define TEMPO_SEQUENCE_MS 40
+#define TEMPO_OVERLAP_MS  8
+#define TEMPO_SEEK_MS     15
+
+struct tempo {
+	long rate;
+	int channels;
+	double speed;
+	int seq;                // frames in a sequence (the bit that gets copied)
+	int overlap;            // frames crossfaded between sequences
+	int seek;               // how far the next sequence may be moved to line up with the last one
+	// Input waiting to be stretched
+	float *in;
+	size_t in_pos;          // first unused frame
+	size_t in_frames;       // unused frames from in_pos on
+	size_t in_cap;
+	double skip_frac;       // fraction of a frame carried over between sequences
+	// End of the last sequence, to crossfade with the next one
+	float *tail;
+	int have_tail;
+	size_t cont;            // where the tail's audio carries on in 'in' (relative to in_pos)
+	float *out;
+	size_t out_cap;
+};
+
+/*
+  Set up for a song.  max_frames is the most that will be passed to
+  tempo_process at once.  Returns 0 on success.
+*/
+int tempo_open(struct tempo *t, long rate, int channels, size_t max_frames);
+// The most frames tempo_process can return for max_frames in
+size_t tempo_max_out(long rate, size_t max_frames);
+void tempo_set_speed(struct tempo *t, double speed);
+// Does the stage have anything to do (speed isn't 1, or it's still emptying out)?
+int tempo_active(struct tempo *t);
+/*
+  Stretch a block of interleaved float samples.  Sets *out to the result (which
+  is 'in' itself when there's nothing to do) and returns the number of frames.
+*/
+size_t tempo_process(struct tempo *t, float *in, size_t frames, float **out);
+// The song's over: whatever the stage is holding back, at 1x.  Returns the number of frames
+size_t tempo_flush(struct tempo *t, float **out);
+// Most frames of audio held back inside the stage
+int tempo_latency(struct tempo *t);
+void tempo_close(struct tempo *t);
+
+const char *tempo_kernel_name(void);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * trace.c
+ *
+ * Event trace for lcd-mp3.
+ *
+ * printErr's messages go to stderr, which goes to /dev/null on the player,
+ * and even when they don't they say nothing about what else was going on.
+ * Instead every thread (the main loop, play_song, the read-ahead and
+ * ReplayGain threads, the encoder interrupt) adds what it's doing to a ring
+ * of the last TRACE_EVENTS events, and when something goes wrong (a skip
+ * that takes forever, a dropout) kill -USR2 writes the ring out as a Chrome
+ * trace to look at on a timeline.  -trace also writes it when the player
+ * exits.
+ *
+ * Adding an event is a fetch-and-add for a slot and a handful of stores; no
+ * locks, so it's fine from the audio thread and the interrupt.  Each slot has
+ * a sequence number that's cleared while it's being written and set to the
+ * event's number after, so the writer can skip slots that are being written
+ * (or were written over) while it reads them.  Text is only ever a pointer to
+ * a literal, never copied.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "rtsched.h"
+
+struct trace_event {
+    unsigned long long seq;     // event number + 1 once it's all there, 0 while it's written
+    unsigned long long start;   // ns
+    unsigned long long end;     // same as start for marks
+    const char *text;
+    long arg;
+    int tid;
+    int kind;
+};
+
+struct trace_name {
+    int tid;
+    const char *name;
+};
+
+static const char *kind_names[TR_KINDS] = {
+    "song", "decode", "dsp", "output", "read", "stall", "scan", "tags",
+    "button", "encoder", "skip", "error", "underrun", "recover"
+};
+// Spans (the others are marks)
+static const int kind_span[TR_KINDS] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1 };
+
+static struct trace_event ring[TRACE_EVENTS];
+static unsigned long long head = 0;
+static struct trace_name names[TRACE_THREADS];
+static int num_names = 0;
+static __thread int my_tid = 0;
+static const char *trace_file = NULL;
+
+unsigned long long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int tid()
+{
+    if (my_tid == 0)
+        my_tid = syscall(SYS_gettid);
+    return my_tid;
+}
+
+static void add(int kind, unsigned long long start, unsigned long long end, long arg, const char *text)
+{
+    unsigned long long n = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    struct trace_event *e = &ring[n & (TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->end, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->text, text, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->tid, tid(), __ATOMIC_RELAXED);
+    __atomic_store_n(&e->kind, kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+// The oldest name goes if there are too many (play_song is a new thread every song)
+void trace_thread(const char *name)
+{
+    int i = __atomic_fetch_add(&num_names, 1, __ATOMIC_RELAXED) % TRACE_THREADS;
+
+    __atomic_store_n(&names[i].tid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&names[i].name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&names[i].tid, tid(), __ATOMIC_RELEASE);
+}
+
+void trace_span_at(int kind, unsigned long long start, unsigned long long end, long arg)
+{
+    add(kind, start, end, arg, NULL);
+}
+
+unsigned long long trace_span(int kind, unsigned long long start, long arg)
+{
+    unsigned long long end = trace_now();
+
+    add(kind, start, end, arg, NULL);
+    return end;
+}
+
+void trace_mark(int kind, long arg, const char *text)
+{
+    unsigned long long t = trace_now();
+
+    add(kind, t, t, arg, text);
+}
+
+// A JSON string
+static void write_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        if ((unsigned char)*s >= ' ')
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+int trace_write(const char *file)
+{
+    struct trace_event e;
+    struct trace_event *slot;
+    unsigned long long n, last = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    int i, count, first = 1;
+    FILE *fp;
+
+    fp = fopen(file, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot write %s\n", __FILE__, __LINE__, file);
+        return -1;
+    }
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    count = __atomic_load_n(&num_names, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count && i < TRACE_THREADS; i++)
+    {
+        e.tid = __atomic_load_n(&names[i].tid, __ATOMIC_ACQUIRE);
+        if (e.tid == 0)
+            continue;
+        fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ", (first ? "" : ",\n"), e.tid);
+        write_string(fp, __atomic_load_n(&names[i].name, __ATOMIC_RELAXED));
+        fprintf(fp, "}}");
+        first = 0;
+    }
+    for (n = (last > TRACE_EVENTS ? last - TRACE_EVENTS : 0); n < last; n++)
+    {
+        slot = &ring[n & (TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+            continue;
+        e.start = __atomic_load_n(&slot->start, __ATOMIC_RELAXED);
+        e.end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED);
+        e.text = __atomic_load_n(&slot->text, __ATOMIC_RELAXED);
+        e.arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+        e.tid = __atomic_load_n(&slot->tid, __ATOMIC_RELAXED);
+        e.kind = __atomic_load_n(&slot->kind, __ATOMIC_RELAXED);
+        // Written over while we were reading it
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != n + 1 || e.kind < 0 || e.kind >= TR_KINDS)
+            continue;
+        // Microseconds
+        fprintf(fp, "%s{\"name\": \"%s\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, ", (first ? "" : ",\n"),
+                kind_names[e.kind], e.tid, e.start / 1000.0);
+        if (kind_span[e.kind])
+            fprintf(fp, "\"ph\": \"X\", \"dur\": %.3f, ", (e.end - e.start) / 1000.0);
+        else
+            fprintf(fp, "\"ph\": \"i\", \"s\": \"t\", ");
+        fprintf(fp, "\"args\": {\"arg\": %ld", e.arg);
+        if (e.text != NULL)
+        {
+            fprintf(fp, ", \"text\": ");
+            write_string(fp, e.text);
+        }
+        fprintf(fp, "}}");
+        first = 0;
+    }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp);
+}
+
+static void *trace_loop(void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    while (sigwait(&set, &sig) == 0)
+        trace_write(trace_file);
+    return NULL;
+}
+
+int trace_init(const char *file)
+{
+    trace_file = file;
+    // kill -USR2 is taken by trace_loop alone, whichever thread it lands on
+    if (rt_signal_thread(SIGUSR2, trace_loop) != 0)
+    {
+        fprintf(stderr, "[%s - %d]: Cannot start the trace thread\n", __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
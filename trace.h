@@ -0,0 +1,48 @@
+/*
+ * header file for trace.c
+ *
+ * What every thread was doing lately, kept in memory and written out as a
+ * Chrome trace (chrome://tracing or ui.perfetto.dev)
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+// Events in the ring (a power of two); 40 bytes each
+#define TRACE_EVENTS 16384
+// Threads that can be given names
+#define TRACE_THREADS 32
+
+enum {
+	TR_SONG,        // play_song, start to finish
+	TR_DECODE,      // mpg123_read, a block
+	TR_DSP,         // the DSP chain, a block
+	TR_OUTPUT,      // ao_play, a block
+	TR_READ,        // read-ahead thread reading a chunk
+	TR_STALL,       // decoder waiting on the read-ahead
+	TR_SCAN,        // ReplayGain analysis of a file
+	TR_TAGS,        // id3_tagger
+	TR_BUTTON,      // a button changed (arg is pin * 2 + level)
+	TR_ENCODER,     // encoder interrupt (arg is its value)
+	TR_SKIP,        // next/prev/shuffle
+	TR_ERROR,       // printErr (text is the message, arg the line)
+	TR_UNDERRUN,    // the card ran out (arg is roughly how many ms late)
+	TR_RECOVER,     // opening the card again (arg is 1 if it worked)
+	TR_KINDS
+};
+
+// Start the thread that writes the trace to 'file' on SIGUSR2 (before any other threads start)
+int trace_init(const char *file);
+// Name this thread in the trace
+void trace_thread(const char *name);
+// Monotonic ns, for trace_span
+unsigned long long trace_now(void);
+// Something that started at 'start' and finished now; returns now
+unsigned long long trace_span(int kind, unsigned long long start, long arg);
+// Something that finished at 'end'
+void trace_span_at(int kind, unsigned long long start, unsigned long long end, long arg);
+// Something that happened now; 'text' has to be a string that stays put (a literal), or NULL
+void trace_mark(int kind, long arg, const char *text);
+// Write what's in the ring to 'file'; returns 0 if it could
+int trace_write(const char *file);
+
+#endif
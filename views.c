@@ -0,0 +1,192 @@
+/*
+ * views.c
+ *
+ * The library in order.
+ *
+ * The playlist was in whatever order readdir gave, and the only other
+ * order was a shuffle of it.  A view is an array of the library's song ids
+ * sorted one way (artist/album/disc/track, title, or newest first).  It's
+ * sorted once, with qsort, the first time it's wanted; after that the
+ * library keeps it sorted itself: a song that's added is put in its place
+ * (a binary search and a memmove of what's after it), and one whose tags
+ * change is found by its old fields and moved to its new place with one
+ * memmove of what's in between.  Picking an order to play in is then a
+ * copy of the array, however many songs there are.
+ *
+ * Every order ends with the song's id, so no two songs ever compare equal
+ * and a song's place (and where to look for it) is always exact.  Like the
+ * library itself, views are only used by the thread that owns it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "library.h"
+#include "views.h"
+
+int view_name_compare(const char *a, const char *b)
+{
+    if (a[0] == '\0' || b[0] == '\0')
+        return (b[0] == '\0') - (a[0] == '\0');
+    return strcasecmp(a, b);
+}
+
+int view_compare(int order, const struct library *lib, int a, int b)
+{
+    int c = 0;
+
+    switch (order)
+    {
+        case VIEW_ARTIST:
+            if (lib->artist[a] != lib->artist[b])
+                c = view_name_compare(library_artist(lib, a), library_artist(lib, b));
+            if (c == 0 && lib->album[a] != lib->album[b])
+                c = view_name_compare(library_album(lib, a), library_album(lib, b));
+            if (c == 0)
+                c = (int)lib->disc[a] - (int)lib->disc[b];
+            if (c == 0)
+                c = (int)lib->track[a] - (int)lib->track[b];
+            if (c == 0)
+                c = view_name_compare(library_title(lib, a), library_title(lib, b));
+            break;
+        case VIEW_TITLE:
+            c = view_name_compare(library_title(lib, a), library_title(lib, b));
+            if (c == 0 && lib->artist[a] != lib->artist[b])
+                c = view_name_compare(library_artist(lib, a), library_artist(lib, b));
+            break;
+        case VIEW_ADDED:
+            c = (lib->added[a] > lib->added[b] ? -1 : (lib->added[a] < lib->added[b] ? 1 : 0));
+            break;
+    }
+    return (c != 0 ? c : a - b);
+}
+
+// For qsort, which has no way to pass them
+static const struct library *sort_lib;
+static int sort_order;
+
+static int sort_compare(const void *a, const void *b)
+{
+    return view_compare(sort_order, sort_lib, *(const int *)a, *(const int *)b);
+}
+
+static int view_grow(struct lib_view *v, int need)
+{
+    int n = (v->max > 0 ? v->max : 256);
+    int *more;
+
+    if (need <= v->max)
+        return 0;
+    while (n < need)
+        n *= 2;
+    more = realloc(v->ids, n * sizeof(int));
+    if (more == NULL)
+    {
+        perror("realloc: views");
+        return -1;
+    }
+    v->ids = more;
+    v->max = n;
+    return 0;
+}
+
+void view_sort(int *ids, int count, int order, const struct library *lib)
+{
+    sort_lib = lib;
+    sort_order = order;
+    qsort(ids, count, sizeof(int), sort_compare);
+}
+
+int view_build(struct lib_view *v, int order, const struct library *lib)
+{
+    int i;
+
+    if (view_grow(v, lib->num_tracks) != 0)
+        return -1;
+    v->count = 0;
+    for (i = 0; i < lib->num_tracks; i++)
+    {
+        if (!(lib->flags[i] & LIB_GONE))
+            v->ids[v->count++] = i;
+    }
+    view_sort(v->ids, v->count, order, lib);
+    v->built = 1;
+    return 0;
+}
+
+int view_find(const struct lib_view *v, int order, const struct library *lib, int id)
+{
+    int lo = 0, hi = v->count - 1, mid, c;
+
+    while (lo <= hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        c = view_compare(order, lib, v->ids[mid], id);
+        if (c == 0)
+            return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+/*
+  Where 'id' goes among the view's songs, leaving out the one at 'skip' (-1
+  for none); the position is in the array without it.
+*/
+static int place(const struct lib_view *v, int order, const struct library *lib, int id, int skip)
+{
+    int lo = 0, hi = v->count - (skip >= 0 ? 1 : 0), mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (view_compare(order, lib, v->ids[skip >= 0 && mid >= skip ? mid + 1 : mid], id) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int view_insert(struct lib_view *v, int order, const struct library *lib, int id)
+{
+    int pos;
+
+    if (view_grow(v, v->count + 1) != 0)
+        return -1;
+    pos = place(v, order, lib, id, -1);
+    memmove(v->ids + pos + 1, v->ids + pos, (v->count - pos) * sizeof(int));
+    v->ids[pos] = id;
+    v->count++;
+    return 0;
+}
+
+void view_moved(struct lib_view *v, int order, const struct library *lib, int pos)
+{
+    int id = v->ids[pos];
+    int to = place(v, order, lib, id, pos);
+
+    // Only what's between where it was and where it's going moves
+    if (to > pos)
+        memmove(v->ids + pos, v->ids + pos + 1, (to - pos) * sizeof(int));
+    else if (to < pos)
+        memmove(v->ids + to + 1, v->ids + to, (pos - to) * sizeof(int));
+    v->ids[to] = id;
+}
+
+void view_remove(struct lib_view *v, int pos)
+{
+    memmove(v->ids + pos, v->ids + pos + 1, (v->count - pos - 1) * sizeof(int));
+    v->count--;
+}
+
+void view_free(struct lib_view *v)
+{
+    free(v->ids);
+    memset(v, 0, sizeof(*v));
+}
@@ -0,0 +1,45 @@
+/*
+ * header file for views.c
+ *
+ * The library's songs kept sorted (by artist, title, or when they were
+ * added), and kept that way as songs come, go and change
+ */
+#ifndef VIEWS_H
+#define VIEWS_H
+
+// Orders the library is kept in
+enum {
+	VIEW_ARTIST,        // artist, then album, disc and track
+	VIEW_TITLE,         // title, then artist
+	VIEW_ADDED,         // newest first
+	VIEWS
+};
+
+struct lib_view {
+	int *ids;           // file ids, in order
+	int count;
+	int max;
+	int built;          // sorted once, and kept sorted from then on
+};
+
+struct library;
+
+// strcasecmp, but with "" (not known) after everything else, as the views have names
+int view_name_compare(const char *a, const char *b);
+// How two songs go in 'order' (never 0 for two different songs; the id settles it)
+int view_compare(int order, const struct library *lib, int a, int b);
+// Sort some songs' ids (a few picked out of the library, say) into 'order'
+void view_sort(int *ids, int count, int order, const struct library *lib);
+// Sort the whole library into the view; 0, or -1 if out of memory
+int view_build(struct lib_view *v, int order, const struct library *lib);
+// Where song 'id' is in the view (going by its fields as they are now); -1 if it's not there
+int view_find(const struct lib_view *v, int order, const struct library *lib, int id);
+// Put a song that's not in the view yet in its place; 0, or -1 if out of memory
+int view_insert(struct lib_view *v, int order, const struct library *lib, int id);
+// The song at 'pos' has changed; move it to where it goes now
+void view_moved(struct lib_view *v, int order, const struct library *lib, int pos);
+// Take out the song at 'pos'
+void view_remove(struct lib_view *v, int pos);
+void view_free(struct lib_view *v);
+
+#endif